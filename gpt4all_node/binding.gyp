@@ -58,5 +58,96 @@
             ]
         }]
       ]
+    },
+    {
+      # the inference server behind src/ipc-client.js; it loads the same implementation
+      # libraries as the addon, so only the loader side is compiled here
+      "target_name": "llmodel_server",
+      "type": "executable",
+      "include_dirs": [
+        "gpt4all-backend",
+      ],
+      "sources": [
+        "gpt4all-backend/llmodel.cpp",
+        "gpt4all-backend/llmodel_shared.cpp",
+        "gpt4all-backend/llmodel_server.cpp",
+       ],
+      "conditions": [
+        ['OS=="win"', {
+            # Unix-domain sockets only
+            'type': 'none',
+        }],
+        ['OS=="mac"', {
+            'xcode_settings': {
+                'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+                'OTHER_CPLUSPLUSFLAGS': [ '-std=c++20' ],
+            },
+            'defines': [
+                'LIB_FILE_EXT=".dylib"',
+            ],
+        }],
+        ['OS=="linux"', {
+            'defines': [
+                'LIB_FILE_EXT=".so"',
+            ],
+            'cflags_cc!': [
+                '-fno-rtti',
+            ],
+            'cflags_cc': [
+                '-std=c++2a',
+                '-fexceptions',
+                '-pthread',
+            ],
+            'libraries': [
+                '-ldl',
+                '-pthread',
+            ],
+        }]
+      ]
+    },
+    {
+      # the scene replay benchmark (llama_model/llmodel_bench.cpp)
+      "target_name": "llmodel_bench",
+      "type": "executable",
+      "include_dirs": [
+        "gpt4all-backend",
+      ],
+      "sources": [
+        "gpt4all-backend/llmodel.cpp",
+        "gpt4all-backend/llmodel_shared.cpp",
+        "gpt4all-backend/llmodel_bench.cpp",
+       ],
+      "conditions": [
+        ['OS=="win"', {
+            # getrusage for the peak RSS
+            'type': 'none',
+        }],
+        ['OS=="mac"', {
+            'xcode_settings': {
+                'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+                'OTHER_CPLUSPLUSFLAGS': [ '-std=c++20' ],
+            },
+            'defines': [
+                'LIB_FILE_EXT=".dylib"',
+            ],
+        }],
+        ['OS=="linux"', {
+            'defines': [
+                'LIB_FILE_EXT=".so"',
+            ],
+            'cflags_cc!': [
+                '-fno-rtti',
+            ],
+            'cflags_cc': [
+                '-std=c++2a',
+                '-fexceptions',
+                '-pthread',
+            ],
+            'libraries': [
+                '-ldl',
+                '-pthread',
+            ],
+        }]
+      ]
     }]
 }
@@ -10,6 +10,15 @@ Napi::Function NodeModelWrapper::GetClass(Napi::Env env)
                                        InstanceMethod("stateSize", &NodeModelWrapper::StateSize),
                                        InstanceMethod("infer", &NodeModelWrapper::Infer),
                                        InstanceMethod("setThreadCount", &NodeModelWrapper::SetThreadCount),
+                                       InstanceMethod("setDecodeScheduler", &NodeModelWrapper::SetDecodeScheduler),
+                                       InstanceMethod("loadActors", &NodeModelWrapper::LoadActors),
+                                       InstanceMethod("importMemories", &NodeModelWrapper::ImportMemories),
+                                       InstanceMethod("setIdleWork", &NodeModelWrapper::SetIdleWork),
+                                       InstanceMethod("setTracing", &NodeModelWrapper::SetTracing),
+                                       InstanceMethod("exportTrace", &NodeModelWrapper::ExportTrace),
+                                       InstanceMethod("getMetrics", &NodeModelWrapper::GetMetrics),
+                                       InstanceMethod("resetMetrics", &NodeModelWrapper::ResetMetrics),
+                                       InstanceMethod("setPromptBatch", &NodeModelWrapper::SetPromptBatch),
                                        InstanceMethod("embed", &NodeModelWrapper::GenerateEmbedding),
                                        InstanceMethod("threadCount", &NodeModelWrapper::ThreadCount),
                                        InstanceMethod("getLibraryPath", &NodeModelWrapper::GetLibraryPath),
@@ -17,12 +26,17 @@ Napi::Function NodeModelWrapper::GetClass(Napi::Env env)
                                        InstanceMethod("hasGpuDevice", &NodeModelWrapper::HasGpuDevice),
                                        InstanceMethod("listGpu", &NodeModelWrapper::GetGpuDevices),
                                        InstanceMethod("memoryNeeded", &NodeModelWrapper::GetRequiredMemory),
+                                       InstanceMethod("memoryEstimate", &NodeModelWrapper::GetMemoryEstimate),
                                        InstanceMethod("dispose", &NodeModelWrapper::Dispose),
                                        InstanceMethod("saveState", &NodeModelWrapper::SaveState),
                                        InstanceMethod("restoreState", &NodeModelWrapper::RestoreState),
+                                       InstanceMethod("saveScene", &NodeModelWrapper::SaveScene),
+                                       InstanceMethod("restoreScene", &NodeModelWrapper::RestoreScene),
+                                       InstanceMethod("saveCheckpoint", &NodeModelWrapper::SaveCheckpoint),
                                        InstanceMethod("selectContext", &NodeModelWrapper::SelectContext),
                                        InstanceMethod("viewContext", &NodeModelWrapper::ViewContext),
-                                       InstanceMethod("tokenLookup", &NodeModelWrapper::TokenLookup)
+                                       InstanceMethod("tokenLookup", &NodeModelWrapper::TokenLookup),
+                                       InstanceMethod("openSession", &NodeModelWrapper::OpenSession)
                                    } );
     // Keep a static reference to the constructor
     //
@@ -34,8 +48,26 @@ Napi::Function NodeModelWrapper::GetClass(Napi::Env env)
 Napi::Value NodeModelWrapper::GetRequiredMemory(const Napi::CallbackInfo &info)
 {
     auto env = info.Env();
+    // as a double: most models need more than 4 GiB
     return Napi::Number::New(
-        env, static_cast<uint32_t>(llmodel_required_mem(GetInference(), full_model_path.c_str(), nCtx, nGpuLayers)));
+        env, static_cast<double>(llmodel_required_mem(GetInference(), full_model_path.c_str(), nCtx, nGpuLayers)));
+}
+Napi::Value NodeModelWrapper::GetMemoryEstimate(const Napi::CallbackInfo &info)
+{
+    auto env = info.Env();
+    llmodel_mem_estimate est;
+    if (!llmodel_estimate_mem(GetInference(), full_model_path.c_str(), nCtx, nGpuLayers, &est))
+    {
+        return env.Null();
+    }
+    auto js_estimate = Napi::Object::New(env);
+    js_estimate["weights"] = static_cast<double>(est.weights);
+    js_estimate["weightsGpu"] = static_cast<double>(est.weights_gpu);
+    js_estimate["kvSlots"] = static_cast<double>(est.kv_slots);
+    js_estimate["compute"] = static_cast<double>(est.compute);
+    js_estimate["eidets"] = static_cast<double>(est.eidets);
+    js_estimate["total"] = static_cast<double>(est.total);
+    return js_estimate;
 }
 Napi::Value NodeModelWrapper::GetGpuDevices(const Napi::CallbackInfo &info)
 {
@@ -81,6 +113,32 @@ Napi::Value NodeModelWrapper::TokenLookup(const Napi::CallbackInfo &info)
     return Napi::String::New(info.Env(), llmodel_token_lookup(GetInference(), x));
 }
 
+Napi::Value NodeModelWrapper::OpenSession(const Napi::CallbackInfo &info)
+{
+    auto env = info.Env();
+    const char *e;
+    llmodel_model session = llmodel_session_open(GetInference(), &e);
+    if (!session)
+    {
+        Napi::Error::New(env, e).ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    fs::path model_path(full_model_path);
+    Napi::Object config = Napi::Object::New(env);
+    config.Set("model_name", model_path.filename().string());
+    config.Set("model_path", model_path.parent_path().string());
+    config.Set("nCtx", nCtx);
+    config.Set("ngl", nGpuLayers);
+    config.Set("session", Napi::External<void>::New(env, session));
+    if (!type.empty())
+    {
+        config.Set("model_type", type);
+    }
+    Napi::FunctionReference *constructor = env.GetInstanceData<Napi::FunctionReference>();
+    return constructor->New({config});
+}
+
 Napi::Value NodeModelWrapper::GetType(const Napi::CallbackInfo &info)
 {
     if (type.empty())
@@ -136,6 +194,17 @@ NodeModelWrapper::NodeModelWrapper(const Napi::CallbackInfo &info) : Napi::Objec
     nCtx = config_object.Get("nCtx").As<Napi::Number>().Int32Value();
     nGpuLayers = config_object.Get("ngl").As<Napi::Number>().Int32Value();
 
+    if (config_object.Has("session") && config_object.Get("session").IsExternal())
+    {
+        // opened by OpenSession(): the weights are already loaded
+        inference_ = config_object.Get("session").As<Napi::External<void>>().Data();
+        if (config_object.Has("model_type"))
+        {
+            type = config_object.Get("model_type").As<Napi::String>();
+        }
+        return;
+    }
+
     const char *e;
     inference_ = llmodel_model_create2(full_weight_path.c_str(), "auto", &e);
     if (!inference_)
@@ -251,6 +320,51 @@ Napi::Value NodeModelWrapper::RestoreState(const Napi::CallbackInfo &info)
     uint8_t *data = (uint8_t*)buf.Data();
     return Napi::Number::New(info.Env(), static_cast<int64_t>(llmodel_restore_state_data(i, const_cast<uint8_t*>(data) )));
 }
+Napi::Value NodeModelWrapper::SaveScene(const Napi::CallbackInfo &info)
+{
+    auto e = info.Env();
+    if (!info[0].IsString())
+    {
+        Napi::Error::New(e, "Could not save scene: argument 1 is not a string").ThrowAsJavaScriptException();
+        return e.Undefined();
+    }
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    auto model = GetInference();
+    auto worker = new SessionWorker(e, &inference_mutex, SessionWorker::Boolean,
+                                    [model, path]() { return (double)llmodel_save_scene(model, path.c_str()); });
+    worker->Queue();
+    return worker->GetPromise();
+}
+Napi::Value NodeModelWrapper::RestoreScene(const Napi::CallbackInfo &info)
+{
+    auto e = info.Env();
+    if (!info[0].IsString())
+    {
+        Napi::Error::New(e, "Could not restore scene: argument 1 is not a string").ThrowAsJavaScriptException();
+        return e.Undefined();
+    }
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    auto model = GetInference();
+    auto worker = new SessionWorker(e, &inference_mutex, SessionWorker::Boolean,
+                                    [model, path]() { return (double)llmodel_restore_scene(model, path.c_str()); });
+    worker->Queue();
+    return worker->GetPromise();
+}
+Napi::Value NodeModelWrapper::SaveCheckpoint(const Napi::CallbackInfo &info)
+{
+    auto e = info.Env();
+    if (!info[0].IsString())
+    {
+        Napi::Error::New(e, "Could not save checkpoint: argument 1 is not a string").ThrowAsJavaScriptException();
+        return e.Undefined();
+    }
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    auto model = GetInference();
+    auto worker = new SessionWorker(e, &inference_mutex, SessionWorker::Boolean,
+                                    [model, path]() { return (double)llmodel_save_checkpoint(model, path.c_str()); });
+    worker->Queue();
+    return worker->GetPromise();
+}
 Napi::Value NodeModelWrapper::SelectContext(const Napi::CallbackInfo &info)
 {
     auto i = GetInference();
@@ -393,6 +507,10 @@ Napi::Value NodeModelWrapper::Infer(const Napi::CallbackInfo &info)
     {
         promptContext.per_idle = inputObject.Get("per_idle").As<Napi::Number>().Int32Value();
     }
+    if (inputObject.Has("seed") && inputObject.Get("seed").IsNumber())
+    {
+        promptContext.seed = inputObject.Get("seed").As<Napi::Number>().Int32Value();
+    }
     if (inputObject.Has("topK") && inputObject.Get("topK").IsNumber())
     {
         promptContext.top_k = inputObject.Get("topK").As<Napi::Number>().Int32Value();
@@ -445,6 +563,10 @@ Napi::Value NodeModelWrapper::Infer(const Napi::CallbackInfo &info)
     promptWorkerConfig.result = "";
 
     promptWorkerConfig.promptTemplate = inputObject.Get("promptTemplate").As<Napi::String>();
+    if (inputObject.Has("wantLogits"))
+    {
+        promptWorkerConfig.wantLogits = inputObject.Get("wantLogits").As<Napi::Boolean>();
+    }
     if (inputObject.Has("special"))
     {
         promptWorkerConfig.special = inputObject.Get("special").As<Napi::Boolean>();
@@ -480,6 +602,185 @@ void NodeModelWrapper::SetThreadCount(const Napi::CallbackInfo &info)
     }
 }
 
+Napi::Value NodeModelWrapper::SetDecodeScheduler(const Napi::CallbackInfo &info)
+{
+    if (!info[0].IsNumber())
+    {
+        Napi::Error::New(info.Env(), "Could not set decode scheduler: argument 1 is NaN").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+    return Napi::Boolean::New(info.Env(),
+                              llmodel_set_decode_scheduler(GetInference(), info[0].As<Napi::Number>().Int32Value()));
+}
+
+Napi::Value NodeModelWrapper::SetIdleWork(const Napi::CallbackInfo &info)
+{
+    if (!info[0].IsNumber())
+    {
+        Napi::Error::New(info.Env(), "Could not set idle work: argument 1 is NaN").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+    return Napi::Boolean::New(info.Env(),
+                              llmodel_set_idle_work(GetInference(), info[0].As<Napi::Number>().Int32Value()));
+}
+
+Napi::Value NodeModelWrapper::SetTracing(const Napi::CallbackInfo &info)
+{
+    if (!info[0].IsBoolean())
+    {
+        Napi::Error::New(info.Env(), "Could not set tracing: argument 1 is not a boolean").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+    return Napi::Boolean::New(info.Env(), llmodel_set_tracing(GetInference(), info[0].As<Napi::Boolean>().Value()));
+}
+
+Napi::Value NodeModelWrapper::ExportTrace(const Napi::CallbackInfo &info)
+{
+    auto e = info.Env();
+    if (!info[0].IsString())
+    {
+        Napi::Error::New(e, "Could not export trace: argument 1 is not a string").ThrowAsJavaScriptException();
+        return e.Undefined();
+    }
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    return Napi::Boolean::New(e, llmodel_export_trace(GetInference(), path.c_str()));
+}
+
+Napi::Value NodeModelWrapper::GetMetrics(const Napi::CallbackInfo &info)
+{
+    auto env = info.Env();
+    int n_metrics = 0;
+    // no inference lock: the metrics have their own, so a running prompt can be watched
+    llmodel_stage_metric *metrics = llmodel_get_metrics(GetInference(), &n_metrics);
+    auto js_metrics = Napi::Array::New(env, n_metrics);
+    for (int i = 0; i < n_metrics; i++)
+    {
+        const auto &m = metrics[i];
+        auto js_metric = Napi::Object::New(env);
+        js_metric["stage"] = m.stage;
+        js_metric["actor"] = m.actor;
+        js_metric["turn"] = m.turn;
+        js_metric["count"] = static_cast<double>(m.count);
+        js_metric["totalMs"] = m.total_ms;
+        js_metric["maxMs"] = m.max_ms;
+        js_metric["p50Ms"] = m.p50_ms;
+        js_metric["p99Ms"] = m.p99_ms;
+        auto js_buckets = Napi::Array::New(env, LLMODEL_METRIC_BUCKETS);
+        for (uint32_t b = 0; b < LLMODEL_METRIC_BUCKETS; b++)
+        {
+            js_buckets[b] = static_cast<double>(m.buckets[b]);
+        }
+        js_metric["buckets"] = js_buckets;
+        js_metrics[i] = js_metric;
+    }
+    return js_metrics;
+}
+
+void NodeModelWrapper::ResetMetrics(const Napi::CallbackInfo &info)
+{
+    llmodel_reset_metrics(GetInference());
+}
+
+Napi::Value NodeModelWrapper::SetPromptBatch(const Napi::CallbackInfo &info)
+{
+    if (!info[0].IsNumber())
+    {
+        Napi::Error::New(info.Env(), "Could not set prompt batch: argument 1 is NaN").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+    // recalibrating decodes on the session's context and re-reserves its compute buffers, so it
+    // queues behind a running prompt instead of waiting for it on the event loop
+    auto model = GetInference();
+    int32_t n_batch = info[0].As<Napi::Number>().Int32Value();
+    auto worker = new SessionWorker(info.Env(), &inference_mutex, SessionWorker::Number,
+                                    [model, n_batch]() { return (double)llmodel_set_prompt_batch(model, n_batch); });
+    worker->Queue();
+    return worker->GetPromise();
+}
+
+Napi::Value NodeModelWrapper::LoadActors(const Napi::CallbackInfo &info)
+{
+    if (!info[0].IsArray())
+    {
+        Napi::Error::New(info.Env(), "Could not load actors: argument 1 is not an array").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+    auto array = info[0].As<Napi::Array>();
+    std::vector<std::string> names;
+    for (uint32_t i = 0; i < array.Length(); i++)
+    {
+        names.push_back(array.Get(i).ToString().Utf8Value());
+    }
+    // loading reads actor files and eidets, and waits for a running prompt: not on the event loop
+    auto model = GetInference();
+    auto worker = new SessionWorker(info.Env(), &inference_mutex, SessionWorker::Undefined, [model, names]() {
+        std::vector<const char *> name_ptrs;
+        for (auto &n : names)
+        {
+            name_ptrs.push_back(n.c_str());
+        }
+        llmodel_load_actors(model, name_ptrs.data(), name_ptrs.size());
+        return 0.0;
+    });
+    worker->Queue();
+    return worker->GetPromise();
+}
+
+Napi::Value NodeModelWrapper::ImportMemories(const Napi::CallbackInfo &info)
+{
+    auto env = info.Env();
+    if (!info[0].IsArray())
+    {
+        Napi::Error::New(env, "Could not import memories: argument 1 is not an array").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    auto array = info[0].As<Napi::Array>();
+    uint32_t n = array.Length();
+    // actor, who, when, what for each record; copied, the worker outlives the JS array
+    std::vector<std::string> fields(n * 4);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        Napi::Value item = array.Get(i);
+        if (!item.IsObject())
+        {
+            Napi::Error::New(env, "Could not import memories: record " + std::to_string(i) + " is not an object")
+                .ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        auto record = item.As<Napi::Object>();
+        if (!record.Has("actor") || !record.Has("what"))
+        {
+            Napi::Error::New(env, "Could not import memories: record " + std::to_string(i) + " needs actor and what")
+                .ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        fields[i * 4] = record.Get("actor").ToString().Utf8Value();
+        if (record.Has("who"))
+        {
+            fields[i * 4 + 1] = record.Get("who").ToString().Utf8Value();
+        }
+        if (record.Has("when"))
+        {
+            fields[i * 4 + 2] = record.Get("when").ToString().Utf8Value();
+        }
+        fields[i * 4 + 3] = record.Get("what").ToString().Utf8Value();
+    }
+    // imports sort and file every record, and wait for a running prompt: not on the event loop
+    auto model = GetInference();
+    auto worker = new SessionWorker(env, &inference_mutex, SessionWorker::Number, [model, fields = std::move(fields)]() {
+        size_t n = fields.size() / 4;
+        std::vector<llmodel_memory_record> records(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            records[i] = {fields[i * 4].c_str(), fields[i * 4 + 1].c_str(), fields[i * 4 + 2].c_str(),
+                          fields[i * 4 + 3].c_str()};
+        }
+        return (double)llmodel_import_memories(model, records.data(), records.size());
+    });
+    worker->Queue();
+    return worker->GetPromise();
+}
+
 Napi::Value NodeModelWrapper::GetName(const Napi::CallbackInfo &info)
 {
     return Napi::String::New(info.Env(), name);
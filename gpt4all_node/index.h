@@ -23,10 +23,18 @@ class NodeModelWrapper : public Napi::ObjectWrap<NodeModelWrapper>
     Napi::Value StateSize(const Napi::CallbackInfo &info);
     Napi::Value SaveState(const Napi::CallbackInfo &info);
     Napi::Value RestoreState(const Napi::CallbackInfo &info);
+    Napi::Value SaveScene(const Napi::CallbackInfo &info);
+    Napi::Value RestoreScene(const Napi::CallbackInfo &info);
+    Napi::Value SaveCheckpoint(const Napi::CallbackInfo &info);
     Napi::Value SelectContext(const Napi::CallbackInfo &info);
     Napi::Value ViewContext(const Napi::CallbackInfo &info);
     Napi::Value Recalculate(const Napi::CallbackInfo &info);
     Napi::Value TokenLookup(const Napi::CallbackInfo &info);
+    /**
+     * Open another session on the loaded weights. The new LLModel has its own actors, KV slots
+     * and mutex, so it can infer in parallel with this one.
+     */
+    Napi::Value OpenSession(const Napi::CallbackInfo &info);
     // void Finalize(Napi::Env env) override;
     /**
      * Prompting the model. This entails spawning a new thread and adding the response tokens
@@ -34,6 +42,15 @@ class NodeModelWrapper : public Napi::ObjectWrap<NodeModelWrapper>
      */
     Napi::Value Infer(const Napi::CallbackInfo &info);
     void SetThreadCount(const Napi::CallbackInfo &info);
+    Napi::Value SetDecodeScheduler(const Napi::CallbackInfo &info);
+    Napi::Value LoadActors(const Napi::CallbackInfo &info);
+    Napi::Value ImportMemories(const Napi::CallbackInfo &info);
+    Napi::Value SetIdleWork(const Napi::CallbackInfo &info);
+    Napi::Value SetTracing(const Napi::CallbackInfo &info);
+    Napi::Value ExportTrace(const Napi::CallbackInfo &info);
+    Napi::Value GetMetrics(const Napi::CallbackInfo &info);
+    void ResetMetrics(const Napi::CallbackInfo &info);
+    Napi::Value SetPromptBatch(const Napi::CallbackInfo &info);
     void Dispose(const Napi::CallbackInfo &info);
     Napi::Value GetName(const Napi::CallbackInfo &info);
     Napi::Value ThreadCount(const Napi::CallbackInfo &info);
@@ -42,6 +59,7 @@ class NodeModelWrapper : public Napi::ObjectWrap<NodeModelWrapper>
     Napi::Value ListGpus(const Napi::CallbackInfo &info);
     Napi::Value InitGpuByString(const Napi::CallbackInfo &info);
     Napi::Value GetRequiredMemory(const Napi::CallbackInfo &info);
+    Napi::Value GetMemoryEstimate(const Napi::CallbackInfo &info);
     Napi::Value GetGpuDevices(const Napi::CallbackInfo &info);
     /*
      * The path that is used to search for the dynamic libraries
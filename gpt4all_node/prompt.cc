@@ -1,31 +1,115 @@
 #include "prompt.h"
-#include <future>
+#include <cstring>
 
-PromptWorker::PromptWorker(Napi::Env env, PromptWorkerConfig config)
-    : promise(Napi::Promise::Deferred::New(env)), _config(config), AsyncWorker(env)
+// Wrap a vector produced on the worker thread in a Float32Array; the array's finalizer frees it.
+static Napi::Value ToFloat32Array(Napi::Env env, std::vector<float> *data)
 {
-    if (_config.hasResponseCallback)
+    if (data == nullptr)
     {
-        _responseCallbackFn = Napi::ThreadSafeFunction::New(config.responseCallback.Env(), config.responseCallback,
-                                                            "PromptWorker", 0, 1, this);
+        return env.Undefined();
     }
+    size_t count = data->size();
+#ifdef NODE_API_NO_EXTERNAL_BUFFERS_ALLOWED
+    auto buffer = Napi::ArrayBuffer::New(env, count * sizeof(float));
+    memcpy(buffer.Data(), data->data(), count * sizeof(float));
+    delete data;
+#else
+    auto buffer = Napi::ArrayBuffer::New(
+        env, data->data(), count * sizeof(float),
+        [](Napi::Env, void *, std::vector<float> *owned) { delete owned; }, data);
+#endif
+    return Napi::Float32Array::New(env, count, buffer, 0);
+}
 
-    if (_config.hasPromptCallback)
+static std::vector<float> *CopyFloats(bool wanted, int size, const float *src)
+{
+    if (!wanted || src == nullptr || size <= 0)
     {
-        _promptCallbackFn = Napi::ThreadSafeFunction::New(config.promptCallback.Env(), config.promptCallback,
-                                                          "PromptWorker", 0, 1, this);
+        return nullptr;
     }
+    return new std::vector<float>(src, src + size);
 }
 
-PromptWorker::~PromptWorker()
+void TokenStream::Drain(Napi::Env env)
 {
-    if (_config.hasResponseCallback)
+    flushPending.store(false, std::memory_order_release);
+
+    TokenEvent *value;
+    while (ring.pop(value))
     {
-        _responseCallbackFn.Release();
+        if (cancelled.load(std::memory_order_relaxed))
+        {
+            delete value; // the generation loop stops at its next token, drop what is already queued
+            continue;
+        }
+        Napi::HandleScope scope(env);
+        try
+        {
+            // Transform native data into JS data, passing it to the matching callback.
+            auto token_id = Napi::Number::New(env, value->tokenId);
+            auto mlogits = ToFloat32Array(env, value->logits);
+            auto membd = ToFloat32Array(env, value->embds);
+            value->logits = value->embds = nullptr;
+            bool jsResult;
+            if (value->isResponse)
+            {
+                auto token = Napi::String::New(env, value->token);
+                jsResult = responseCallback.Call({token_id, token, mlogits, membd}).ToBoolean();
+            }
+            else
+            {
+                jsResult = promptCallback.Call({token_id, mlogits, membd}).ToBoolean();
+            }
+            if (!jsResult)
+            {
+                cancelled.store(true, std::memory_order_relaxed);
+            }
+        }
+        catch (const Napi::Error &e)
+        {
+            std::cerr << "Error in " << (value->isResponse ? "onResponseToken" : "onPromptToken")
+                      << " callback: " << e.what() << std::endl;
+            cancelled.store(true, std::memory_order_relaxed);
+        }
+        delete value;
     }
-    if (_config.hasPromptCallback)
+}
+
+TokenStream::~TokenStream()
+{
+    TokenEvent *value;
+    while (ring.pop(value))
     {
-        _promptCallbackFn.Release();
+        delete value;
+    }
+}
+
+PromptWorker::PromptWorker(Napi::Env env, PromptWorkerConfig config)
+    : promise(Napi::Promise::Deferred::New(env)), _config(config), AsyncWorker(env)
+{
+    if (_config.hasResponseCallback || _config.hasPromptCallback)
+    {
+        _stream = new TokenStream();
+        if (_config.hasResponseCallback)
+        {
+            _stream->responseCallback = Napi::Persistent(config.responseCallback);
+        }
+        if (_config.hasPromptCallback)
+        {
+            _stream->promptCallback = Napi::Persistent(config.promptCallback);
+        }
+        // the TSFN only schedules drains; the callbacks themselves are called through the references above
+        _flushFn = Napi::ThreadSafeFunction::New(
+            env, _config.hasResponseCallback ? config.responseCallback : config.promptCallback, "PromptWorker", 0, 1,
+            _stream, [](Napi::Env, TokenStream *stream) { delete stream; });
+    }
+}
+
+PromptWorker::~PromptWorker()
+{
+    if (_stream)
+    {
+        _flushFn.Release();
     }
 }
 
@@ -49,6 +133,7 @@ void PromptWorker::Execute()
     wrapper->promptContext.repeat_last_n = ctx->repeat_last_n;
     wrapper->promptContext.contextErase = ctx->context_erase;
     wrapper->promptContext.continuing = ctx->continuing;
+    wrapper->promptContext.seed = ctx->seed;
 
     // Call the C++ prompt method
 
@@ -83,6 +168,10 @@ void PromptWorker::Execute()
 
 void PromptWorker::OnOK()
 {
+    if (_stream)
+    {
+        _stream->Drain(Env()); // deliver the tail of the stream before resolving
+    }
     Napi::Object returnValue = Napi::Object::New(Env());
     returnValue.Set("text", result);
     returnValue.Set("nPast", _config.context.n_past);
@@ -94,6 +183,10 @@ void PromptWorker::OnOK()
 
 void PromptWorker::OnError(const Napi::Error &e)
 {
+    if (_stream)
+    {
+        _stream->Drain(Env());
+    }
     delete _config.fakeReply;
     promise.Reject(e.Value());
 }
@@ -103,6 +196,38 @@ Napi::Promise PromptWorker::GetPromise()
     return promise.Promise();
 }
 
+// Called on the worker thread. Never waits for JS unless the ring is full; cancellation
+// requested by a callback is picked up on the next token.
+bool PromptWorker::Emit(TokenEvent *event)
+{
+    while (!_stream->ring.push(event))
+    {
+        if (_stream->cancelled.load(std::memory_order_relaxed))
+        {
+            delete event;
+            return false;
+        }
+        RequestFlush();
+        std::this_thread::yield();
+    }
+    RequestFlush();
+    return !_stream->cancelled.load(std::memory_order_relaxed);
+}
+
+void PromptWorker::RequestFlush()
+{
+    if (_stream->flushPending.exchange(true, std::memory_order_acq_rel))
+    {
+        return;
+    }
+    auto status = _flushFn.NonBlockingCall(
+        _stream, [](Napi::Env env, Napi::Function, TokenStream *stream) { stream->Drain(env); });
+    if (status != napi_ok)
+    {
+        Napi::Error::Fatal("PromptWorkerFlush", "Napi::ThreadSafeNapi::Function.NonBlockingCall() failed");
+    }
+}
+
 bool PromptWorker::ResponseCallback(int32_t token_id, const std::string token, int lsz, int esz, float *logits, float *embds)
 {
     if (token_id == -1)
@@ -117,57 +242,14 @@ bool PromptWorker::ResponseCallback(int32_t token_id, const std::string token, i
 
     result += token;
 
-    std::promise<bool> promise;
-
-    auto info = new ResponseCallbackData();
+    auto info = new TokenEvent();
+    info->isResponse = true;
     info->tokenId = token_id;
     info->token = token;
-    info->lsz = lsz;
-    info->esz = esz;
-    info->logits = logits;
-    info->embds = embds;
-
-    auto future = promise.get_future();
-
-    auto status = _responseCallbackFn.BlockingCall(
-        info, [&promise](Napi::Env env, Napi::Function jsCallback, ResponseCallbackData *value) {
-            try
-            {
-                // Transform native data into JS data, passing it to the provided
-                // `jsCallback` -- the TSFN's JavaScript function.
-                auto token_id = Napi::Number::New(env, value->tokenId);
-                auto token = Napi::String::New(env, value->token);
-                //auto mlsz = Napi::Number::New(env, value->lsz);
-                //auto mesz = Napi::Number::New(env, value->esz);
-                //auto mlogits = Napi::Array::New(env, value->lsz==0?1:value->lsz);
-                auto mlogits = Napi::Array::New(env, value->lsz);
-                mlogits.Set((uint32_t)0, Napi::Number::New(env, (double)0));
-                for( int x = 0; x < value->lsz; x++ ) {
-                    mlogits.Set((uint32_t)x, Napi::Number::New(env, value->logits[x]));
-                }
-                //auto membd = Napi::Array::New(env, value->esz==0?1:value->esz);
-                auto membd = Napi::Array::New(env, value->esz);
-                membd.Set((uint32_t)0, Napi::Number::New(env, (double)0));
-                for( int x = 0; x < value->esz; x++ ) {
-                    membd.Set((uint32_t)x, Napi::Number::New(env, value->embds[x]));
-                }
-                auto jsResult = jsCallback.Call({token_id, token, mlogits, membd}).ToBoolean();
-                promise.set_value(jsResult);
-            }
-            catch (const Napi::Error &e)
-            {
-                std::cerr << "Error in onResponseToken callback: " << e.what() << std::endl;
-                promise.set_value(false);
-            }
+    info->logits = CopyFloats(_config.wantLogits, lsz, logits);
+    info->embds = CopyFloats(_config.wantLogits, esz, embds);
 
-            delete value;
-        });
-    if (status != napi_ok)
-    {
-        Napi::Error::Fatal("PromptWorkerResponseCallback", "Napi::ThreadSafeNapi::Function.NonBlockingCall() failed");
-    }
-
-    return future.get();
+    return Emit(info);
 }
 
 bool PromptWorker::RecalculateCallback(bool isRecalculating)
@@ -182,48 +264,57 @@ bool PromptWorker::PromptCallback(int32_t token_id, int lsz, int esz, float *log
         return true;
     }
 
-    std::promise<bool> promise;
-
-    auto info = new PromptCallbackData();
+    auto info = new TokenEvent();
     info->tokenId = token_id;
-    info->lsz = lsz;
-    info->esz = esz;
-    info->logits = logits;
-    info->embds = embds;
+    info->logits = CopyFloats(_config.wantLogits, lsz, logits);
+    info->embds = CopyFloats(_config.wantLogits, esz, embds);
 
-    auto future = promise.get_future();
+    return Emit(info);
+}
 
-    auto status = _promptCallbackFn.BlockingCall(
-        info, [&promise](Napi::Env env, Napi::Function jsCallback, PromptCallbackData *value) {
-            try
-            {
-                // Transform native data into JS data, passing it to the provided
-                // `jsCallback` -- the TSFN's JavaScript function.
-                auto token_id = Napi::Number::New(env, value->tokenId);
-                Napi::Array mlogits = Napi::Array::New(env, value->lsz==0?1:value->lsz);
-                mlogits.Set((uint32_t)0, Napi::Number::New(env, (double)0 ) );
-                for( int x = 0; x < value->lsz; x++ ) {
-                    mlogits.Set((uint32_t)x, Napi::Number::New(env, value->logits[x]) );
-                }
-                Napi::Array membd = Napi::Array::New(env, value->esz==0?1:value->esz);
-                membd.Set((uint32_t)0, Napi::Number::New(env, (double)0 ) );
-                for( int x = 0; x < value->esz; x++ ) {
-                    membd.Set((uint32_t)x, Napi::Number::New(env, value->embds[x]) );
-                }
-                auto jsResult = jsCallback.Call({token_id, mlogits, membd}).ToBoolean();
-                promise.set_value(jsResult);
-            }
-            catch (const Napi::Error &e)
-            {
-                std::cerr << "Error in onPromptToken callback: " << e.what() << std::endl;
-                promise.set_value(false);
-            }
-            delete value;
-        });
-    if (status != napi_ok)
+SessionWorker::SessionWorker(Napi::Env env, std::mutex *mutex, ResultKind kind, std::function<double()> &&task)
+    : AsyncWorker(env), promise(Napi::Promise::Deferred::New(env)), _mutex(mutex), _kind(kind), _task(std::move(task))
+{
+}
+
+void SessionWorker::Execute()
+{
+    std::lock_guard<std::mutex> lock(*_mutex);
+    try
     {
-        Napi::Error::Fatal("PromptWorkerPromptCallback", "Napi::ThreadSafeNapi::Function.NonBlockingCall() failed");
+        _result = _task();
     }
+    catch (const char *e)
+    {
+        SetError(e);
+    }
+    catch (const std::exception &e)
+    {
+        SetError(e.what());
+    }
+}
 
-    return future.get();
+void SessionWorker::OnOK()
+{
+    switch (_kind)
+    {
+    case Boolean:
+        promise.Resolve(Napi::Boolean::New(Env(), _result != 0));
+        break;
+    case Number:
+        promise.Resolve(Napi::Number::New(Env(), _result));
+        break;
+    default:
+        promise.Resolve(Env().Undefined());
+    }
+}
+
+void SessionWorker::OnError(const Napi::Error &e)
+{
+    promise.Reject(e.Value());
+}
+
+Napi::Promise SessionWorker::GetPromise()
+{
+    return promise.Promise();
 }
@@ -5,24 +5,79 @@
 #include "llmodel_c.h"
 #include "napi.h"
 #include <atomic>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
-struct ResponseCallbackData
+#define PROMPT_TOKEN_RING_SIZE 1024
+
+// One prompt or response token on its way to JS.
+// logits/embds are copied off the event loop and handed to JS as Float32Arrays that own them;
+// they stay null unless the caller asked for them with wantLogits.
+struct TokenEvent
 {
-    int32_t tokenId;
+    bool isResponse = false;
+    int32_t tokenId = 0;
     std::string token;
-    int lsz, esz;
-    float *logits, *embds;
+    std::vector<float> *logits = nullptr, *embds = nullptr;
+    ~TokenEvent()
+    {
+        delete logits;
+        delete embds;
+    }
+};
+
+// Lock-free single-producer/single-consumer ring: the worker thread pushes, the JS thread pops.
+template <typename T, size_t N> class SpscRing
+{
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+  public:
+    bool push(T item)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) == N)
+        {
+            return false;
+        }
+        _items[head & (N - 1)] = item;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(T &item)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = _items[tail & (N - 1)];
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    T _items[N];
+    alignas(64) std::atomic<size_t> _head{0};
+    alignas(64) std::atomic<size_t> _tail{0};
 };
 
-struct PromptCallbackData
+// Token events shared between the worker and the JS thread. It is owned by the flush
+// ThreadSafeFunction and freed by its finalizer, so flushes still queued after the worker
+// is gone remain valid.
+struct TokenStream
 {
-    int32_t tokenId;
-    int lsz, esz;
-    float *logits, *embds;
+    SpscRing<TokenEvent *, PROMPT_TOKEN_RING_SIZE> ring;
+    std::atomic<bool> cancelled{false};    // set from JS, polled by the generation loop
+    std::atomic<bool> flushPending{false}; // a NonBlockingCall is already queued
+    Napi::FunctionReference responseCallback;
+    Napi::FunctionReference promptCallback;
+
+    void Drain(Napi::Env env);
+    ~TokenStream();
 };
 
 struct LLModelWrapper
@@ -48,6 +103,7 @@ struct PromptWorkerConfig
     llmodel_prompt_context context;
     std::string result;
     bool special = false;
+    bool wantLogits = false;
     std::string *fakeReply = nullptr;
 };
 
@@ -66,11 +122,40 @@ class PromptWorker : public Napi::AsyncWorker
     bool PromptCallback(int32_t token_id, int lsz, int esz, float *logits, float *embds);
 
   private:
+    bool Emit(TokenEvent *event);
+    void RequestFlush();
+
     Napi::Promise::Deferred promise;
     std::string result;
     PromptWorkerConfig _config;
-    Napi::ThreadSafeFunction _responseCallbackFn;
-    Napi::ThreadSafeFunction _promptCallbackFn;
+    TokenStream *_stream = nullptr;
+    Napi::ThreadSafeFunction _flushFn;
+};
+
+// One call into the session run off the event loop: it waits for a prompt in progress to finish, and
+// a prompt waiting on the event loop to drain its tokens must not be waited for from there.
+// The promise resolves with what the call returns, as the JS type kind names.
+class SessionWorker : public Napi::AsyncWorker
+{
+  public:
+    enum ResultKind
+    {
+        Undefined,
+        Boolean,
+        Number
+    };
+    SessionWorker(Napi::Env env, std::mutex *mutex, ResultKind kind, std::function<double()> &&task);
+    void Execute() override;
+    void OnOK() override;
+    void OnError(const Napi::Error &e) override;
+    Napi::Promise GetPromise();
+
+  private:
+    Napi::Promise::Deferred promise;
+    std::mutex *_mutex;
+    ResultKind _kind;
+    std::function<double()> _task;
+    double _result = 0;
 };
 
 #endif // PREDICT_WORKER_H
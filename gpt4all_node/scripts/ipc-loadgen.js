@@ -0,0 +1,192 @@
+#!/usr/bin/env node
+"use strict";
+
+/// Load generator for llmodel_server: replays recorded scenes over N concurrent connections
+/// and reports time to first token, decode rate and turn latency percentiles.
+///
+///   node scripts/ipc-loadgen.js scenes.jsonl [--socket path] [--clients n] [--repeat n] [--json]
+///                               [--sweep maxThreads]
+///
+/// --sweep replays the scenes at 1, 2, 4, ... maxThreads decode threads (set through the
+/// connection's SET_THREADS) and prints a scaling table instead of a single report.
+///
+/// A scene file holds one JSON scene per line:
+///   {"name": "tavern", "actor": "Rommie", "options": {...},
+///    "keys": [["Rommie", "mood", "tired"]],
+///    "turns": [{"prompt": "...", "options": {...}}, ...]}
+/// `options` are infer() options (nPredict, temp, ...); turn options override the scene's.
+const fs = require("node:fs");
+const { performance } = require("node:perf_hooks");
+const { IpcLLModel, DEFAULT_SOCKET } = require("../src/ipc-client.js");
+const { DEFAULT_MODEL_CONFIG, DEFAULT_PROMPT_CONTEXT } = require("../src/config.js");
+
+function parseArgs(argv) {
+    const args = { socket: DEFAULT_SOCKET, clients: 1, repeat: 1, json: false, sweep: 0, file: null };
+    for (let i = 0; i < argv.length; i++) {
+        switch (argv[i]) {
+            case "--socket":
+                args.socket = argv[++i];
+                break;
+            case "--clients":
+                args.clients = parseInt(argv[++i], 10);
+                break;
+            case "--repeat":
+                args.repeat = parseInt(argv[++i], 10);
+                break;
+            case "--json":
+                args.json = true;
+                break;
+            case "--sweep":
+                args.sweep = parseInt(argv[++i], 10);
+                break;
+            default:
+                args.file = argv[i];
+        }
+    }
+    if (!args.file || !(args.clients > 0) || !(args.repeat > 0)) {
+        console.error(
+            "usage: ipc-loadgen.js scenes.jsonl [--socket path] [--clients n] [--repeat n] [--json] [--sweep maxThreads]"
+        );
+        process.exit(1);
+    }
+    return args;
+}
+
+function loadScenes(file) {
+    return fs
+        .readFileSync(file, "utf8")
+        .split("\n")
+        .filter((line) => line.trim().length > 0)
+        .map((line) => JSON.parse(line));
+}
+
+function percentile(sorted, p) {
+    if (sorted.length === 0) return 0;
+    const idx = Math.min(sorted.length - 1, Math.floor((p / 100) * sorted.length));
+    return sorted[idx];
+}
+
+async function playScene(llm, scene, turns) {
+    if (scene.actor) await llm.pickActor(scene.actor);
+    for (const [keyfor, key, value] of scene.keys ?? []) {
+        await llm.setKey(keyfor, key, value);
+    }
+    let nPast = 0;
+    for (const turn of scene.turns) {
+        const started = performance.now();
+        const result = await llm.infer(turn.prompt, {
+            promptTemplate: DEFAULT_MODEL_CONFIG.promptTemplate,
+            ...DEFAULT_PROMPT_CONTEXT,
+            ...scene.options,
+            ...turn.options,
+            nPast,
+        });
+        nPast = result.nPast;
+        turns.push({
+            scene: scene.name ?? "",
+            wallMs: performance.now() - started,
+            ttftMs: result.promptMs,
+            totalMs: result.totalMs,
+            tokens: result.tokensGenerated,
+            cancelled: result.cancelled,
+        });
+    }
+}
+
+// Each client takes the next scene off the shared queue until it is empty.
+async function runClient(socket, queue, turns, nThreads) {
+    const llm = await IpcLLModel.connect(socket);
+    try {
+        if (nThreads > 0) await llm.setThreadCount(nThreads);
+        for (let scene = queue.shift(); scene; scene = queue.shift()) {
+            await playScene(llm, scene, turns);
+        }
+    } finally {
+        llm.dispose();
+    }
+}
+
+async function runLoad(args, scenes, nThreads) {
+    const queue = [];
+    for (let r = 0; r < args.repeat; r++) queue.push(...scenes);
+
+    const turns = [];
+    const started = performance.now();
+    const clients = [];
+    for (let c = 0; c < args.clients; c++) clients.push(runClient(args.socket, queue, turns, nThreads));
+    await Promise.all(clients);
+    const elapsedS = (performance.now() - started) / 1000;
+
+    const tokens = turns.reduce((n, t) => n + t.tokens, 0);
+    const wall = turns.map((t) => t.wallMs).sort((a, b) => a - b);
+    const ttft = turns.map((t) => t.ttftMs).sort((a, b) => a - b);
+    const decode = turns
+        .filter((t) => t.tokens > 1 && t.totalMs > t.ttftMs)
+        .map((t) => ((t.tokens - 1) * 1000) / (t.totalMs - t.ttftMs))
+        .sort((a, b) => a - b);
+    return {
+        threads: nThreads,
+        clients: args.clients,
+        turns: turns.length,
+        tokens,
+        elapsedS,
+        tokensPerS: tokens / elapsedS,
+        turnMs: { p50: percentile(wall, 50), p99: percentile(wall, 99) },
+        ttftMs: { p50: percentile(ttft, 50), p99: percentile(ttft, 99) },
+        decodeTokensPerS: { p50: percentile(decode, 50), p1: percentile(decode, 1) },
+    };
+}
+
+async function sweep(args, scenes) {
+    const counts = [];
+    for (let n = 1; n < args.sweep; n *= 2) counts.push(n);
+    counts.push(args.sweep);
+    const rows = [];
+    for (const n of counts) rows.push(await runLoad(args, scenes, n));
+    if (args.json) {
+        console.log(JSON.stringify(rows));
+        return;
+    }
+    const base = rows[0].tokensPerS;
+    console.log("threads  tok/s    speedup  efficiency  first token p50");
+    for (const row of rows) {
+        const speedup = row.tokensPerS / base;
+        console.log(
+            `${String(row.threads).padStart(7)}  ${row.tokensPerS.toFixed(1).padStart(7)}  ` +
+                `${speedup.toFixed(2).padStart(7)}  ${((speedup / row.threads) * 100).toFixed(0).padStart(9)}%  ` +
+                `${row.ttftMs.p50.toFixed(0).padStart(12)} ms`
+        );
+    }
+}
+
+async function main() {
+    const args = parseArgs(process.argv.slice(2));
+    const scenes = loadScenes(args.file);
+    if (args.sweep > 0) {
+        await sweep(args, scenes);
+        return;
+    }
+    const report = await runLoad(args, scenes, 0);
+    const elapsedS = report.elapsedS;
+    const tokens = report.tokens;
+
+    if (args.json) {
+        console.log(JSON.stringify(report));
+        return;
+    }
+    console.log(
+        `${report.turns} turns over ${report.clients} clients in ${elapsedS.toFixed(1)}s, ` +
+            `${tokens} tokens (${report.tokensPerS.toFixed(1)} tok/s aggregate)`
+    );
+    console.log(`turn latency  p50 ${report.turnMs.p50.toFixed(0)} ms  p99 ${report.turnMs.p99.toFixed(0)} ms`);
+    console.log(`first token   p50 ${report.ttftMs.p50.toFixed(0)} ms  p99 ${report.ttftMs.p99.toFixed(0)} ms`);
+    console.log(
+        `decode rate   p50 ${report.decodeTokensPerS.p50.toFixed(1)} tok/s  ` +
+            `p1 ${report.decodeTokensPerS.p1.toFixed(1)} tok/s`
+    );
+}
+
+main().catch((err) => {
+    console.error(err);
+    process.exit(1);
+});
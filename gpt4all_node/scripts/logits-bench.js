@@ -0,0 +1,143 @@
+#!/usr/bin/env node
+"use strict";
+
+/// Cost of wantLogits: runs the same seeded prompt through the in-process LLModel with logits and
+/// embeddings passed to the token callbacks and without, alternating, and reports the decode rate
+/// and first-token time of each.
+///
+///   node scripts/logits-bench.js model.gguf [--libs path] [--ctx n] [--ngl n] [--prompt text]
+///                                [--predict n] [--repeat n] [--seed n] [--json]
+///
+/// Every run starts from nPast 0 with the same seed, so both modes generate the same tokens and the
+/// difference is the per-token copy into Float32Arrays plus the event-loop time spent receiving them.
+const path = require("node:path");
+const { performance } = require("node:perf_hooks");
+const { LLModel, DEFAULT_LIBRARIES_DIRECTORY, DEFAULT_MODEL_CONFIG, DEFAULT_PROMPT_CONTEXT } = require("../src/gpt4all.js");
+
+function parseArgs(argv) {
+    const args = {
+        model: null,
+        libs: DEFAULT_LIBRARIES_DIRECTORY,
+        ctx: 2048,
+        ngl: 100,
+        prompt: "Tell me about the lighthouse at the end of the harbour.",
+        predict: 256,
+        repeat: 3,
+        seed: 42,
+        json: false,
+    };
+    for (let i = 0; i < argv.length; i++) {
+        switch (argv[i]) {
+            case "--libs":
+                args.libs = argv[++i];
+                break;
+            case "--ctx":
+                args.ctx = parseInt(argv[++i], 10);
+                break;
+            case "--ngl":
+                args.ngl = parseInt(argv[++i], 10);
+                break;
+            case "--prompt":
+                args.prompt = argv[++i];
+                break;
+            case "--predict":
+                args.predict = parseInt(argv[++i], 10);
+                break;
+            case "--repeat":
+                args.repeat = parseInt(argv[++i], 10);
+                break;
+            case "--seed":
+                args.seed = parseInt(argv[++i], 10);
+                break;
+            case "--json":
+                args.json = true;
+                break;
+            default:
+                args.model = argv[i];
+        }
+    }
+    if (!args.model || !(args.predict > 0) || !(args.repeat > 0)) {
+        console.error(
+            "usage: logits-bench.js model.gguf [--libs path] [--ctx n] [--ngl n] [--prompt text] [--predict n] [--repeat n] [--seed n] [--json]"
+        );
+        process.exit(1);
+    }
+    return args;
+}
+
+async function runOnce(llm, args, wantLogits) {
+    let tokens = 0;
+    let floats = 0;
+    let firstMs = 0;
+    const started = performance.now();
+    await llm.infer(args.prompt, {
+        promptTemplate: DEFAULT_MODEL_CONFIG.promptTemplate,
+        ...DEFAULT_PROMPT_CONTEXT,
+        nPredict: args.predict,
+        nPast: 0,
+        seed: args.seed,
+        wantLogits,
+        onResponseToken: (tokenId, token, logits, embds) => {
+            if (tokens++ === 0) firstMs = performance.now() - started;
+            if (logits) floats += logits.length;
+            if (embds) floats += embds.length;
+        },
+    });
+    const totalMs = performance.now() - started;
+    return { tokens, firstMs, totalMs, bytesPerToken: tokens ? (floats * 4) / tokens : 0 };
+}
+
+function summarize(runs) {
+    const tokens = runs.reduce((n, r) => n + r.tokens, 0);
+    const decodeMs = runs.reduce((n, r) => n + (r.totalMs - r.firstMs), 0);
+    const decodeTokens = runs.reduce((n, r) => n + Math.max(r.tokens - 1, 0), 0);
+    return {
+        runs: runs.length,
+        tokens,
+        decodeTokensPerS: decodeMs > 0 ? (decodeTokens * 1000) / decodeMs : 0,
+        firstTokenMs: runs.reduce((n, r) => n + r.firstMs, 0) / runs.length,
+        bytesPerToken: runs[0].bytesPerToken,
+    };
+}
+
+async function main() {
+    const args = parseArgs(process.argv.slice(2));
+    const llm = new LLModel({
+        model_name: path.basename(args.model),
+        model_path: path.dirname(path.resolve(args.model)),
+        library_path: args.libs,
+        device: "cpu",
+        nCtx: args.ctx,
+        ngl: args.ngl,
+    });
+    try {
+        await runOnce(llm, args, false); // warm-up: loads the actor slot and fills the caches
+        const off = [];
+        const on = [];
+        for (let r = 0; r < args.repeat; r++) {
+            off.push(await runOnce(llm, args, false));
+            on.push(await runOnce(llm, args, true));
+        }
+        const report = { without: summarize(off), with: summarize(on) };
+        report.slowdown = report.with.decodeTokensPerS > 0 ? report.without.decodeTokensPerS / report.with.decodeTokensPerS : 0;
+        if (args.json) {
+            console.log(JSON.stringify(report));
+            return;
+        }
+        for (const [name, s] of [["without logits", report.without], ["with logits", report.with]]) {
+            console.log(
+                `${name.padEnd(15)} ${s.decodeTokensPerS.toFixed(1).padStart(8)} tok/s  ` +
+                    `first token ${s.firstTokenMs.toFixed(0).padStart(5)} ms  ` +
+                    `${(s.bytesPerToken / 1024).toFixed(0).padStart(6)} KiB/token passed  (${s.tokens} tokens)`
+            );
+        }
+        console.log(`wantLogits costs ${((report.slowdown - 1) * 100).toFixed(1)}% of the decode rate`);
+    } finally {
+        llm.dispose();
+    }
+}
+
+main().catch((err) => {
+    console.error(err);
+    process.exit(1);
+});
@@ -109,6 +109,13 @@ declare class InferenceModel implements CompletionProvider {
     /** The name of the model. */
     modelName: string;
 
+    /**
+     * Open another session over the same loaded weights. The session has its own actors and
+     * KV slots and can generate in parallel with this model.
+     * @returns {InferenceModel} The new session.
+     */
+    openSession(): InferenceModel;
+
     /**
      * Create a chat session with the model and set it as the active chat session of this model.
      * A model instance can only have one active chat session at a time.
@@ -264,14 +271,22 @@ interface LLModelInferenceOptions extends Partial<LLModelPromptContext> {
     /** Callback for response tokens, called for each generated token.
      * @param {number} tokenId The token id.
      * @param {string} token The token.
+     * @param {Float32Array} logits The logits for this step, only when wantLogits is set.
+     * @param {Float32Array} embds The output embeddings for this step, only when wantLogits is set.
      * @returns {boolean | undefined} Whether to continue generating tokens.
      * */
-    onResponseToken?: (tokenId: number, token: string) => boolean | void;
+    onResponseToken?: (tokenId: number, token: string, logits?: Float32Array, embds?: Float32Array) => boolean | void;
     /** Callback for prompt tokens, called for each input token in the prompt.
      * @param {number} tokenId The token id.
+     * @param {Float32Array} logits The logits for this step, only when wantLogits is set.
+     * @param {Float32Array} embds The output embeddings for this step, only when wantLogits is set.
      * @returns {boolean | undefined} Whether to continue ingesting the prompt.
      * */
-    onPromptToken?: (tokenId: number) => boolean | void;
+    onPromptToken?: (tokenId: number, logits?: Float32Array, embds?: Float32Array) => boolean | void;
+    /** Pass logits and embeddings to the token callbacks. Off by default since copying them costs time on every token.
+     * @default false
+     * */
+    wantLogits?: boolean;
 }
 
 /**
@@ -397,11 +412,159 @@ declare class LLModel {
      */
     listGpu(nCtx: number): GpuDevice[];
 
+    /**
+     * Open a session sharing this model's weights, with its own actors and KV slots.
+     * @returns {LLModel} The session; dispose it when done.
+     */
+    openSession(): LLModel;
+
+    /**
+     * Share cores between the decode steps of all sessions of this model.
+     * @param {number} nThreads Threads to share, 0 for all cores, negative to turn the scheduler off.
+     * @returns {boolean} Whether the backend supports the scheduler.
+     */
+    setDecodeScheduler(nThreads: number): boolean;
+
+    /**
+     * Load several actors at once across the worker threads, e.g. everyone in a scene.
+     * Runs off the event loop, after any prompt in progress on this model; actors that are already
+     * loaded are skipped.
+     * @param {string[]} names Actor names.
+     * @returns {Promise<void>} Settles once they are loaded.
+     */
+    loadActors(names: string[]): Promise<void>;
+
+    /**
+     * Add many memories to actors' histories at once, e.g. an old chat log. Tokenizing and keyword
+     * indexing run across the worker threads and each actor's history file is appended in one write.
+     * Runs off the event loop, after any prompt in progress on this model.
+     * @param {MemoryRecord[]} records The memories, oldest first.
+     * @returns {Promise<number>} How many were imported; records with a malformed `when` are skipped.
+     */
+    importMemories(records: MemoryRecord[]): Promise<number>;
+
+    /**
+     * Write the scene (the actors in play and every actor KV slot) to a file.
+     * Actor files are not written; use the "/save" prompt first if the scene is restored elsewhere.
+     * Runs off the event loop, after any prompt in progress on this model.
+     * @param {string} path Where to write the snapshot.
+     * @returns {Promise<boolean>} Whether it was written.
+     */
+    saveScene(path: string): Promise<boolean>;
+
+    /**
+     * Resume a scene written by saveScene without decoding it again.
+     * Checkpoints are restored the same way, after the scene and in the order they were saved.
+     * Runs off the event loop, after any prompt in progress on this model.
+     * @param {string} path The snapshot file.
+     * @returns {Promise<boolean>} Whether it was restored.
+     */
+    restoreScene(path: string): Promise<boolean>;
+
+    /**
+     * Write only what changed in the KV slots since the last saved or restored scene or checkpoint.
+     * One per turn gives cheap undo; several off the same parent branch the scene.
+     * Runs off the event loop, after any prompt in progress on this model.
+     * @param {string} path Where to write the checkpoint.
+     * @returns {Promise<boolean>} Whether it was written.
+     */
+    saveCheckpoint(path: string): Promise<boolean>;
+
+    /**
+     * Do deferred maintenance (precomputed memories, journal flushes, index rebuilds) in the background
+     * once the session has been quiet for quietMs. Any call into the session preempts it.
+     * @param {number} quietMs Milliseconds without calls before it starts, negative to turn it off.
+     * @returns {boolean} Whether the backend supports idle maintenance.
+     */
+    setIdleWork(quietMs: number): boolean;
+
+    /**
+     * Record allocator, KV layout, decode and sampling events into per-thread in-memory rings.
+     * Cheap enough to leave on; applies to every session in the process.
+     * @param {boolean} enabled Whether to record. Events recorded so far are kept.
+     * @returns {boolean} Whether the backend supports tracing.
+     */
+    setTracing(enabled: boolean): boolean;
+
+    /**
+     * Write the recorded events as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev.
+     * @param {string} path Where to write the trace.
+     * @returns {boolean} Whether it was written.
+     */
+    exportTrace(path: string): boolean;
+
+    /**
+     * Latency of the multi-actor stages, for the session and per actor, over the whole session and
+     * over the current turn (each infer() call starts one). Safe to call while a prompt is running.
+     * @returns {StageMetric[]} One entry per stage that ran, empty if the backend keeps no metrics.
+     */
+    getMetrics(): StageMetric[];
+
+    /**
+     * Forget the metrics gathered so far.
+     */
+    resetMetrics(): void;
+
+    /**
+     * Tokens of a prompt decoded at once. Loading the model picks one with a short timing sweep.
+     * Runs off the event loop, after any prompt in progress on this model.
+     * @param {number} n Batch size, capped at the context's capacity; 0 repeats the sweep.
+     * @returns {Promise<number>} The batch size now in use.
+     */
+    setPromptBatch(n: number): Promise<number>;
+
+    /**
+     * Bytes the model needs at this context size and GPU layer count: weights, actor KV slots,
+     * compute buffers and resident eidets.
+     * @returns {number} The total, 0 if the model file could not be parsed.
+     */
+    memoryNeeded(): number;
+
+    /**
+     * The parts memoryNeeded() adds up, in bytes.
+     * @returns {MemoryEstimate | null} null if the model file could not be parsed.
+     */
+    memoryEstimate(): MemoryEstimate | null;
+
     /**
      * delete and cleanup the native model
      */
     dispose(): void;
 }
+/**
+ * Client for a model served by llmodel_server over a Unix socket; each instance is one
+ * session on the server. Can be required on its own from "gpt4all/src/ipc-client.js"
+ * without loading the native addon.
+ */
+declare class IpcLLModel {
+    constructor(socketPath?: string, name?: string);
+    /** Connect and wait for the server's handshake. */
+    static connect(socketPath?: string): Promise<IpcLLModel>;
+    socketPath: string;
+    /** Resolves once the server has answered the handshake. */
+    ready: Promise<IpcLLModel>;
+    name(): string;
+    type(): string;
+    /**
+     * Same as LLModel.infer, except prompt tokens are not streamed (onPromptToken is not called)
+     * and the result also carries the server's timings.
+     */
+    infer(
+        prompt: string,
+        options: LLModelInferenceOptions
+    ): Promise<LLModelInferenceResult & { cancelled: boolean; promptMs: number; totalMs: number }>;
+    /** Stop the running prompt; its promise resolves with the text generated so far. */
+    cancel(): void;
+    setKey(keyfor: string, key: string, value: string): Promise<Buffer>;
+    saveActors(): Promise<Buffer>;
+    pickActor(actor: string): Promise<Buffer>;
+    /** Decode threads for this session; also resizes the server's shared worker pool. */
+    setThreadCount(n: number): Promise<Buffer>;
+    /** A new connection, which the server backs with a new session. */
+    openSession(): IpcLLModel;
+    dispose(): void;
+}
+
 /**
  * an object that contains gpu data on this machine.
  */
@@ -416,6 +579,53 @@ interface GpuDevice {
     vendor: string;
 }
 
+/**
+ * What LLModel.memoryNeeded() adds up, in bytes.
+ */
+interface MemoryEstimate {
+    weights: number;
+    /** part of weights offloaded to the GPU */
+    weightsGpu: number;
+    /** K/V of the three actor KV slots at their largest extents */
+    kvSlots: number;
+    compute: number;
+    /** full memories kept in host RAM for the slots they fill */
+    eidets: number;
+    total: number;
+}
+
+/**
+ * Latency of one multi-actor stage, from LLModel.getMetrics(). Stages nest, so their times overlap.
+ */
+interface StageMetric {
+    /** "useactor", "usemap", "prefit_write", "ragsearch", "eidet", "pick_talker", "decode" or "kv_switch" */
+    stage: string;
+    /** "" for the whole session */
+    actor: string;
+    /** counts only the current turn, else the whole session */
+    turn: boolean;
+    count: number;
+    totalMs: number;
+    maxMs: number;
+    p50Ms: number;
+    p99Ms: number;
+    /** buckets[i] counts calls that took under 2^i microseconds; the last one takes the rest */
+    buckets: number[];
+}
+
+/**
+ * One memory for LLModel.importMemories().
+ */
+interface MemoryRecord {
+    /** Actor whose history gets the memory; loaded first if it isn't yet. */
+    actor: string;
+    /** Speaker. */
+    who?: string;
+    /** "time_Y_M_D_h_m_s_" as the history files hold it; now if omitted. */
+    when?: string;
+    what: string;
+}
+
 /**
  * Options that configure a model's behavior.
  */
@@ -530,6 +740,17 @@ type CompletionInput = string | ChatMessage[];
  * @param {CompletionOptions} options - The options for creating the completion.
  * @returns {CompletionResult} The completion result.
  */
+/**
+ * Connect to a model served by llmodel_server instead of loading it in-process.
+ * @param {string} socketPath The server's Unix socket, /tmp/llmodel.sock by default.
+ * @param {Partial<ModelConfig>} config Model config; promptTemplate is used for completions.
+ * @returns {Promise<InferenceModel>}
+ */
+declare function connectModel(
+    socketPath?: string,
+    config?: Partial<ModelConfig>
+): Promise<InferenceModel>;
+
 declare function createCompletion(
     provider: CompletionProvider,
     input: CompletionInput,
@@ -715,6 +936,12 @@ interface LLModelPromptContext {
      * @default 0.75
      * */
     contextErase: number;
+
+    /** Sampling seed. When set, every prompt reseeds its own generator with it, so the same
+     * prompt on the same model and state generates the same tokens. Use -1 for unseeded sampling.
+     * @default -1
+     * */
+    seed?: number;
 }
 
 /**
@@ -825,6 +1052,7 @@ interface DownloadController {
 
 export {
     LLModel,
+    IpcLLModel,
     LLModelPromptContext,
     ModelConfig,
     InferenceModel,
@@ -842,7 +1070,11 @@ export {
     RetrieveModelOptions,
     DownloadModelOptions,
     GpuDevice,
+    MemoryEstimate,
+    StageMetric,
+    MemoryRecord,
     loadModel,
+    connectModel,
     downloadModel,
     retrieveModel,
     listModels,
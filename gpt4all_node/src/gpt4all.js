@@ -21,6 +21,7 @@ const {
 } = require("./config.js");
 const { InferenceModel, EmbeddingModel } = require("./models.js");
 const { ChatSession } = require("./chat-session.js");
+const { IpcLLModel, connectModel } = require("./ipc-client.js");
 
 /**
  * Loads a machine learning model with the specified name. The defacto way to create a model.
@@ -222,6 +223,7 @@ module.exports = {
     DEFAULT_MODEL_CONFIG,
     DEFAULT_MODEL_LIST_URL,
     LLModel,
+    IpcLLModel,
     InferenceModel,
     EmbeddingModel,
     ChatSession,
@@ -232,6 +234,7 @@ module.exports = {
     downloadModel,
     retrieveModel,
     loadModel,
+    connectModel,
     modelContext,
     modelView,
     modelStateSize,
@@ -0,0 +1,263 @@
+"use strict";
+
+/// Client for llmodel_server (llama_model/llmodel_server.cpp).
+/// Speaks the framed protocol from llama_model/llmodel_ipc.h over a Unix domain socket and
+/// offers the same infer() surface as the native LLModel, so InferenceModel and ChatSession
+/// work unchanged. Does not load the addon.
+const net = require("node:net");
+const { DEFAULT_MODEL_CONFIG } = require("./config.js");
+const { InferenceModel } = require("./models.js");
+
+const IPC_VERSION = 2;
+const DEFAULT_SOCKET = "/tmp/llmodel.sock";
+const HEADER_SIZE = 12;
+
+// keep in step with llmodel_ipc_type
+const MSG = {
+    HELLO: 1,
+    PROMPT: 2,
+    CANCEL: 3,
+    SET_KEY: 4,
+    SAVE_ACTORS: 5,
+    PICK_ACTOR: 6,
+    SET_THREADS: 7,
+    TOKEN: 16,
+    DONE: 17,
+    OK: 18,
+    ERROR: 19,
+};
+
+const PROMPT_CONTINUING = 0x1;
+const PROMPT_SPECIAL = 0x2;
+const PROMPT_FAKE_REPLY = 0x4;
+
+function packStrings(strings) {
+    const parts = [];
+    for (const s of strings) {
+        const body = Buffer.from(s ?? "", "utf8");
+        const len = Buffer.alloc(4);
+        len.writeUInt32LE(body.length, 0);
+        parts.push(len, body);
+    }
+    return Buffer.concat(parts);
+}
+
+class IpcLLModel {
+    #socket;
+    #pending = new Map();
+    #nextId = 1;
+    #buffered = Buffer.alloc(0);
+    #closed = false;
+    #name;
+    socketPath;
+    /** Resolves once the server has answered HELLO; requests made before then are queued. */
+    ready;
+
+    constructor(socketPath = DEFAULT_SOCKET, name = "") {
+        this.socketPath = socketPath;
+        this.#name = name;
+        this.#socket = net.createConnection({ path: socketPath });
+        this.#socket.on("data", (chunk) => this.#onData(chunk));
+        this.#socket.on("error", (err) => this.#fail(err));
+        this.#socket.on("close", () => this.#fail(new Error("llmodel_server closed the connection")));
+
+        this.ready = this.#request(MSG.HELLO, Buffer.alloc(0)).then((hello) => {
+            const version = hello.readUInt32LE(0);
+            if (version !== IPC_VERSION) {
+                this.dispose();
+                throw new Error(`llmodel_server speaks protocol ${version}, expected ${IPC_VERSION}`);
+            }
+            this.#name = hello.subarray(4).toString("utf8");
+            return this;
+        });
+        // failures surface on the requests themselves; don't let an unawaited ready reject loudly
+        this.ready.catch(() => {});
+    }
+
+    /**
+     * Connect to a running llmodel_server.
+     * @param {string} socketPath path of the server's Unix socket
+     * @returns {Promise<IpcLLModel>}
+     */
+    static connect(socketPath = DEFAULT_SOCKET) {
+        return new IpcLLModel(socketPath).ready;
+    }
+
+    name() {
+        return this.#name;
+    }
+
+    type() {
+        return "ipc";
+    }
+
+    /**
+     * Same options and result as LLModel.infer. Prompt tokens are not streamed back, so
+     * onPromptToken is never called; returning false from onResponseToken cancels.
+     */
+    infer(prompt, options = {}) {
+        const params = Buffer.alloc(52);
+        let flags = 0;
+        if (options.continuing) flags |= PROMPT_CONTINUING;
+        if (options.special) flags |= PROMPT_SPECIAL;
+        if (options.fakeReply !== undefined) flags |= PROMPT_FAKE_REPLY;
+        // defaults match NodeModelWrapper::Infer
+        params.writeInt32LE(options.nPast ?? 0, 0);
+        params.writeInt32LE(options.nPredict ?? 4096, 4);
+        params.writeInt32LE(options.topK ?? 40, 8);
+        params.writeFloatLE(options.topP ?? 0.9, 12);
+        params.writeFloatLE(options.minP ?? 0.0, 16);
+        params.writeFloatLE(options.temp ?? 0.1, 20);
+        params.writeInt32LE(options.nBatch ?? 8, 24);
+        params.writeFloatLE(options.repeatPenalty ?? 1.2, 28);
+        params.writeInt32LE(options.repeatLastN ?? 10, 32);
+        params.writeFloatLE(options.contextErase ?? 0.75, 36);
+        params.writeInt32LE(options.per_idle ?? 4, 40);
+        params.writeUInt32LE(flags, 44);
+        params.writeInt32LE(options.seed ?? -1, 48);
+        const payload = Buffer.concat([
+            params,
+            packStrings([prompt, options.promptTemplate, options.fakeReply]),
+        ]);
+
+        const id = this.#nextId++;
+        return new Promise((resolve, reject) => {
+            this.#pending.set(id, {
+                resolve,
+                reject,
+                text: "",
+                onToken: options.onResponseToken,
+                options,
+            });
+            this.#send(MSG.PROMPT, id, payload);
+        });
+    }
+
+    /** Stop the running prompt; its promise still resolves with what was generated. */
+    cancel() {
+        this.#send(MSG.CANCEL, 0, Buffer.alloc(0));
+    }
+
+    setKey(keyfor, key, value) {
+        return this.#request(MSG.SET_KEY, packStrings([keyfor, key, value]));
+    }
+
+    saveActors() {
+        return this.#request(MSG.SAVE_ACTORS, Buffer.alloc(0));
+    }
+
+    pickActor(actor) {
+        return this.#request(MSG.PICK_ACTOR, packStrings([actor]));
+    }
+
+    /** Decode threads for this session; also resizes the server's shared worker pool. */
+    setThreadCount(n) {
+        const payload = Buffer.alloc(4);
+        payload.writeInt32LE(n, 0);
+        return this.#request(MSG.SET_THREADS, payload);
+    }
+
+    /** Every connection is its own session on the server. */
+    openSession() {
+        return new IpcLLModel(this.socketPath, this.#name);
+    }
+
+    dispose() {
+        this.#closed = true;
+        this.#socket.end();
+    }
+
+    #request(type, payload) {
+        const id = this.#nextId++;
+        return new Promise((resolve, reject) => {
+            this.#pending.set(id, { resolve, reject });
+            this.#send(type, id, payload);
+        });
+    }
+
+    #send(type, id, payload) {
+        const header = Buffer.alloc(HEADER_SIZE);
+        header.writeUInt32LE(payload.length, 0);
+        header.writeUInt16LE(type, 4);
+        header.writeUInt16LE(0, 6);
+        header.writeUInt32LE(id, 8);
+        this.#socket.write(Buffer.concat([header, payload]));
+    }
+
+    #onData(chunk) {
+        this.#buffered = this.#buffered.length ? Buffer.concat([this.#buffered, chunk]) : chunk;
+        while (this.#buffered.length >= HEADER_SIZE) {
+            const length = this.#buffered.readUInt32LE(0);
+            if (this.#buffered.length < HEADER_SIZE + length) break;
+            const type = this.#buffered.readUInt16LE(4);
+            const id = this.#buffered.readUInt32LE(8);
+            const payload = this.#buffered.subarray(HEADER_SIZE, HEADER_SIZE + length);
+            this.#buffered = this.#buffered.subarray(HEADER_SIZE + length);
+            this.#onFrame(type, id, payload);
+        }
+    }
+
+    #onFrame(type, id, payload) {
+        const req = this.#pending.get(id);
+        if (!req) return;
+        switch (type) {
+            case MSG.TOKEN: {
+                const tokenId = payload.readInt32LE(0);
+                const token = payload.subarray(4).toString("utf8");
+                req.text += token;
+                if (req.onToken && req.onToken(tokenId, token) === false) {
+                    req.onToken = null;
+                    this.#send(MSG.CANCEL, id, Buffer.alloc(0));
+                }
+                break;
+            }
+            case MSG.DONE:
+                this.#pending.delete(id);
+                req.resolve({
+                    text: req.text,
+                    nPast: payload.readInt32LE(0),
+                    continuing: !!req.options.continuing,
+                    nPredict: req.options.nPredict ?? 4096,
+                    tokensIngested: payload.readUInt32LE(4),
+                    tokensGenerated: payload.readUInt32LE(8),
+                    cancelled: payload.readUInt32LE(12) !== 0,
+                    promptMs: payload.readFloatLE(16),
+                    totalMs: payload.readFloatLE(20),
+                });
+                break;
+            case MSG.OK:
+                this.#pending.delete(id);
+                req.resolve(payload);
+                break;
+            case MSG.ERROR:
+                this.#pending.delete(id);
+                req.reject(new Error(payload.toString("utf8")));
+                break;
+        }
+    }
+
+    #fail(err) {
+        const pending = this.#pending;
+        this.#pending = new Map();
+        for (const req of pending.values()) {
+            req.reject(this.#closed ? new Error("disposed") : err);
+        }
+    }
+}
+
+/**
+ * Drop-in for loadModel() when the model runs in llmodel_server.
+ * @param {string} socketPath path of the server's Unix socket
+ * @param {object} config model config; promptTemplate is used by generate()
+ * @returns {Promise<InferenceModel>}
+ */
+async function connectModel(socketPath = DEFAULT_SOCKET, config = {}) {
+    const llm = await IpcLLModel.connect(socketPath);
+    return new InferenceModel(llm, { ...DEFAULT_MODEL_CONFIG, ...config });
+}
+
+module.exports = {
+    IpcLLModel,
+    connectModel,
+    DEFAULT_SOCKET,
+};
@@ -14,6 +14,14 @@ class InferenceModel {
         this.modelName = this.llm.name();
     }
 
+    /**
+     * A second model over the same weights with its own actors and KV slots; it can
+     * generate at the same time as this one.
+     */
+    openSession() {
+        return new InferenceModel(this.llm.openSession(), this.config);
+    }
+
     async createChatSession(options) {
         const chatSession = new ChatSession(this, options);
         await chatSession.initialize();
@@ -58,9 +58,11 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
+#include <charconv>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
@@ -69,12 +71,16 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
+#include <exception>
 #include <forward_list>
 #include <fstream>
 #include <functional>
 //#include <filesystem>
 //#include <initializer_list>
+#include <list>
 #include <locale>
 #include <map>
 #include <memory>
@@ -121,9 +127,31 @@ static void llama_log_callback_default(ggml_log_level level, const char * text,
 #define LLAMA_LOG_WARN(...)  llama_log_internal(GGML_LOG_LEVEL_WARN , __VA_ARGS__)
 #define LLAMA_LOG_ERROR(...) llama_log_internal(GGML_LOG_LEVEL_ERROR, __VA_ARGS__)
 
-void LLAMA_TRACK(std::string tag, size_t value);
-void llama_enable_tracker(std::string tag);
-void llama_disable_tracker(std::string tag);
+//
+// tracing (llama_trace_enable / llama_trace_export)
+//
+
+extern std::atomic<uint64_t> g_trace_mask;
+void llama_trace_emit(int tag, char phase, uint64_t value);
+
+#define LLAMA_TRACE_ON(tag) ((g_trace_mask.load(std::memory_order_relaxed) >> (tag)) & 1)
+#define LLAMA_TRACE(tag, value) \
+    do { if( LLAMA_TRACE_ON(tag) ) llama_trace_emit((tag), 'i', (uint64_t)(value)); } while(0)
+
+// begin/end pair around the enclosing scope; at most one per scope
+struct llama_trace_scope {
+    int tag;
+    bool on;
+    llama_trace_scope( int tag, uint64_t value ) : tag(tag), on(LLAMA_TRACE_ON(tag))
+    {
+        if( on ) llama_trace_emit(tag, 'B', value);
+    }
+    ~llama_trace_scope()
+    {
+        if( on ) llama_trace_emit(tag, 'E', 0);
+    }
+};
+#define LLAMA_TRACE_SCOPE(tag, value) llama_trace_scope trace_scope((tag), (uint64_t)(value))
 
 //
 // helpers
@@ -167,6 +195,42 @@ static size_t utf8_len(char src) {
 }
 
 static const int kv_context = 1;
+
+// actor KV slots are sized from their working set in steps of LLAMA_KV_EXTENT_STEP tokens
+#define LLAMA_KV_EXTENT_STEP 256
+#define LLAMA_KV_EXTENT_MIN  512
+#define LLAMA_KV_EXTENT_MAX  4096
+
+// Kv_mem entries (actor memory lists and KV maps) are carved from chunks of this many
+#define LLAMA_KV_MEM_CHUNK   1024
+
+// llama_import_memories tokenizes this many records per pool work item
+#define LLAMA_IMPORT_BLOCK   512
+
+// prompt tokens per llama_decode when messages and memories go into actor KV slots; calibrated per
+// model between MIN and the context's n_batch (see llama_set_prompt_batch)
+#define LLAMA_PROMPT_BATCH_MIN     32
+#define LLAMA_PROMPT_BATCH_DEFAULT 64      // until calibrated, and for models that aren't
+#define LLAMA_PROMPT_BATCH_MAX     256     // the n_batch llmodel gives a context (LLMODEL_MAX_PROMPT_BATCH)
+#define LLAMA_PROMPT_BATCH_CAL_US  1500000 // calibration tries no larger sizes past this
+
+// idle maintenance (llama_idle_work)
+#define LLAMA_JOURNAL_MAX     32    // history entries addhist holds before writing them itself
+#define LLAMA_IDLE_MAX_TOKENS 64    // longest memory precomputed in one step: one prompt batch
+#define LLAMA_IDLE_MAX_MERGES 256   // pool blocks merged per compaction step
+#define LLAMA_IDLE_SLICE_US   20000 // maintenance time a llama_idle() call may spend
+#define LLAMA_IDLE_NONE    0
+#define LLAMA_IDLE_JOURNAL 1
+#define LLAMA_IDLE_EIDET   2
+#define LLAMA_IDLE_INDEX   3
+#define LLAMA_IDLE_COMPACT 4
+
+// where a scene snapshot's KV map entries are found in their actor
+#define LLAMA_SCENE_MINE    0
+#define LLAMA_SCENE_MEM     1
+#define LLAMA_SCENE_RAGS    2
+#define LLAMA_SCENE_RECENT  3
+#define LLAMA_SCENE_UNKNOWN 0xff
 std::string quick_ts();
 
 static void replace_all(std::string & s, const std::string & search, const std::string & replace) {
@@ -1390,7 +1454,7 @@ public:
         Q *qptr;
         sp_searchable * midref;
 
-        LLAMA_TRACK("sp_search", 0);
+        LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 0);
 
         L=M=0;
         R=count>0?count-1:0;
@@ -1399,11 +1463,11 @@ public:
         while(L<R) {
             M=L+floor((float)(R-L)/2.0);
             mid = data[searchby]->get(M,miditem,listno,searchby);
-            LLAMA_TRACK("sp_search", 1);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 1);
             buf = (void**)mid->data;
             midref = (sp_searchable*)( buf[miditem] );
             Ml=Mr=M;
-            LLAMA_TRACK("sp_search", 2);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 2);
             if( midref == NULL ) {
                 LLAMA_LOG_INFO("%s error: midref==null M=%zu L=%zu R=%zu\n", __func__, M, L, R);
                 throw "error\n";
@@ -1413,7 +1477,7 @@ public:
             else
                 qptr = (Q*)(char**)( (uint8_t*)midref->data + dataptr[1] );
 
-            LLAMA_TRACK("sp_search", 3);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 3);
             if( searchby == 0 ) {
                 //LLAMA_LOG_INFO("%s: compare s %p(%zu) vs %p\n", __func__, (void*)*sptr, M, (void*)*valS);
                 if( *sptr < *valS ) {
@@ -1435,20 +1499,20 @@ public:
                     R = M = M>0?M - 1:0;
                 }
             }
-            LLAMA_TRACK("sp_search", 4);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 4);
         }
         if( M == 0 ) {
             mid = data[searchby]->head;
             miditem=0;
             listno=0;
-            LLAMA_TRACK("sp_search", 5);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 5);
         } else if( M == count ) {
             miditem++;
             if( miditem == units ) {
                 miditem=0;
                 listno++;
             }
-            LLAMA_TRACK("sp_search", 6);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 6);
             return NULL;
         } else {
             mid = data[searchby]->get( M, miditem, listno, searchby );
@@ -1456,7 +1520,7 @@ public:
         buf = (void**)mid->data;
         midref = (sp_searchable*)( buf[miditem] );
         //LLAMA_LOG_INFO("%s: M=%zu, miditem=%u, listno=%u\n", __func__, M, miditem, listno);
-        LLAMA_TRACK("sp_search", 9);
+        LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH, 9);
         return midref;
     }
     /*
@@ -1544,7 +1608,7 @@ public:
         S *sptr;
         Q *qptr;
         sp_searchable * midref;
-        LLAMA_TRACK("sp_search_ub", 0);
+        LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH_UB, 0);
 
         L=M=0;
         R=count>0?count-1:0;
@@ -1592,21 +1656,21 @@ public:
                 miditem=0;
                 listno++;
             }
-            LLAMA_TRACK("sp_search_ub", 6);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH_UB, 6);
             return NULL;
         } else if( M == 0 ) {
             mid = data[searchby]->head;
             miditem=0;
             listno=0;
         } else {
-            LLAMA_TRACK("sp_search_ub", 7);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH_UB, 7);
             mid = data[searchby]->get( M, miditem, listno, searchby );
-            LLAMA_TRACK("sp_search_ub", 8);
+            LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH_UB, 8);
         }
         buf = (void**)mid->data;
         midref = (sp_searchable*)( buf[miditem] );
         //LLAMA_LOG_INFO("%s: M=%zu, miditem=%u, listno=%u\n", __func__, M, miditem, listno);
-        LLAMA_TRACK("sp_search_ub", 9);
+        LLAMA_TRACE(LLAMA_TRACE_SP_SEARCH_UB, 9);
         return midref;
     }
     void insert( T *ptr )
@@ -1618,7 +1682,7 @@ public:
         sp_searchable *sb = new sp_searchable(ptr);
         sp_searchable *res;
 
-        LLAMA_TRACK("sp_insert", 0);
+        LLAMA_TRACE(LLAMA_TRACE_SP_INSERT, 0);
         res = bsub(0, ptr, M, mi, ln);
         sp_linked *arr = data[0]->get(ln);
         if( M != count ) {
@@ -1626,13 +1690,13 @@ public:
         } else {
             arr->count++;
         }
-        LLAMA_TRACK("sp_insert", 10);
+        LLAMA_TRACE(LLAMA_TRACE_SP_INSERT, 10);
         buf = (void**)arr->data;
         buf[mi] = (void*)sb;
         sb->inds[0] = ln;
         sb->refs[0] = mi;
 
-        LLAMA_TRACK("sp_insert", 20);
+        LLAMA_TRACE(LLAMA_TRACE_SP_INSERT, 20);
         res = bsub(1, ptr, M, mi, ln);
         arr = data[1]->get(ln);
         if( M != count ) {
@@ -1640,14 +1704,14 @@ public:
         } else {
             arr->count++;
         }
-        LLAMA_TRACK("sp_insert", 40);
+        LLAMA_TRACE(LLAMA_TRACE_SP_INSERT, 40);
         buf = (void**)arr->data;
         buf[mi] = (void*)sb;
         sb->inds[1] = ln;
         sb->refs[1] = mi;
 
         count++;
-        LLAMA_TRACK("sp_insert", 9);
+        LLAMA_TRACE(LLAMA_TRACE_SP_INSERT, 9);
     }
     void erase( T *ptr )
     { //! todo: reduce gaps after erasure to increase speed
@@ -1657,7 +1721,7 @@ public:
         sp_searchable *sp;
         sp_linked *arr;
 
-        LLAMA_TRACK("sp_erase", 0);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ERASE, 0);
         //LLAMA_LOG_INFO("%s: count=%zu\n", __func__, count);
         sp_searchable *pre = bs(0, ptr, M, mi, ln);
         if( !pre ) {
@@ -1666,11 +1730,11 @@ public:
             throw "not found on erase";
             return;
         }
-        LLAMA_TRACK("sp_erase", 1);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ERASE, 1);
         arr = data[0]->get(ln);
         buf = (void**)arr->data;
         sp = (sp_searchable*)buf[mi];
-        LLAMA_TRACK("sp_erase", 2);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ERASE, 2);
         if( !sp ) {
             LLAMA_LOG_INFO("%s: not found 2 %p (found %p)\n", __func__, ptr, sp->data);
             PrintStackTrace();
@@ -1685,7 +1749,7 @@ public:
         }
         shift_pointers_l(arr, mi, 0);
 
-        LLAMA_TRACK("sp_erase", 3);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ERASE, 3);
         arr = data[1]->get( sp->inds[1] );
         buf = (void**)arr->data;
         if( buf[sp->refs[1]] != (void*)sp ) {
@@ -1694,11 +1758,11 @@ public:
             throw "not found on erase";
             return;
         }
-        LLAMA_TRACK("sp_erase", 4);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ERASE, 4);
         shift_pointers_l(arr, sp->refs[1], 1);
 
         count--;
-        LLAMA_TRACK("sp_erase", 5);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ERASE, 5);
     }
 };
 
@@ -1746,14 +1810,7 @@ struct senmemory_pool {
         uint16_t offset, listno;
         void **buf;
 
-        //llama_enable_tracker("sp_search");
-        //llama_enable_tracker("sp_search_ub");
-        //llama_enable_tracker("sp_free");
-        //llama_enable_tracker("sp_erase");
-        //llama_enable_tracker("sp_alloc");
-        //llama_enable_tracker("sp_insert");
-
-        LLAMA_TRACK("sp_alloc", 0);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 0);
 
         ptr_ref.sz = sz;
         //LLAMA_LOG_INFO("%s: locate size %zu\n", __func__, sz);
@@ -1768,7 +1825,7 @@ struct senmemory_pool {
         } else {
             iter = NULL;
         }
-        LLAMA_TRACK("sp_alloc", 1);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 1);
         /*
         m = std::lower_bound(loose_bysize.begin(), loose_bysize.end(), &ptr_ref, [](Llama_mem *a, Llama_mem *b) {
             return a->sz < b->sz;
@@ -1776,12 +1833,12 @@ struct senmemory_pool {
         if( iter ) { // && (((void*)iter->data)[offset]) ) {
             buf = (void**)iter->data;
             if( buf[offset] != NULL ) {
-                LLAMA_TRACK("sp_alloc", 11);
+                LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 11);
                 //LLAMA_LOG_INFO("%s: iter=%p sz=%zu offset=%u\n", __func__, iter, sz, offset);
                 buf = (void**)iter->data;
                 sp = (sp_searchable*)buf[offset];
                 usable = (Llama_mem*)sp->data;
-                LLAMA_TRACK("sp_alloc", 12);
+                LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 12);
                 //LLAMA_LOG_INFO("%s: usable addr=%p sz=%zu\n", __func__, usable->addr, usable->sz);
                 if( usable->sz == sz || usable->sz >= sz+144 ) {
                 } else {
@@ -1789,27 +1846,27 @@ struct senmemory_pool {
                     ptr_ref.sz = tgtsz;
 
                     //LLAMA_LOG_INFO("%s: locate double %zu\n", __func__, ptr_ref.sz);
-                    LLAMA_TRACK("sp_alloc", 13);
+                    LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 13);
                     sp = loose->bsub(1, &ptr_ref, M, offset, listno);
-                    LLAMA_TRACK("sp_alloc", 14);
+                    LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 14);
                     if( sp ) {
                         iter = loose->data[1]->get( listno );
                         buf = (void**)iter->data;
                         if( buf[offset] != NULL ) {
                             sp = (sp_searchable*)buf[offset];
                             usable = (Llama_mem*)sp->data;
-                            LLAMA_TRACK("sp_alloc", 15);
+                            LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 15);
                             if( usable->sz < tgtsz || usable->sz >= sz*3 ) {
                                 iter = NULL;
                             }
-                            LLAMA_TRACK("sp_alloc", 16);
+                            LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 16);
                         }
                     } else {
                         iter = NULL;
                     }
                     usable=NULL;
                     if( iter ) {
-                        LLAMA_TRACK("sp_alloc", 17);
+                        LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 17);
                         if( buf[offset] != NULL ) {
                             //LLAMA_LOG_INFO("%s: found double iter=%p offset=%u\n", __func__, iter, offset);
                             sp = (sp_searchable*)buf[offset];
@@ -1818,19 +1875,19 @@ struct senmemory_pool {
                         } else {
                             usable = NULL;
                         }
-                        LLAMA_TRACK("sp_alloc", 18);
+                        LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 18);
                     }
                 }
             }
         }
-        LLAMA_TRACK("sp_alloc", 2);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 2);
         if( usable ) {
             if( usable->sz < sz ) {
             } else {
                 //LLAMA_LOG_INFO("%s: erase usable %p (%p: %zu)\n", __func__, usable, usable->addr, usable->sz);
                 loose->erase(usable); // we have to erase because we may change its size
 
-                //LLAMA_TRACK("sp_alloc", 21);
+                //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 21);
                 if( usable->sz != sz ) {
                     size_t addr_ptr, new_sz=usable->sz - sz;
                     addr_ptr = (size_t)( (char*)usable->addr + sz );
@@ -1839,7 +1896,7 @@ struct senmemory_pool {
                         addr_ptr += offset_sz;
                         new_sz = usable->sz - (((char*)addr_ptr) - ((char*)usable->addr));
                     }
-                    //LLAMA_TRACK("sp_alloc", 22);
+                    //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 22);
                     if( new_sz >= 16 ) {
                         //LLAMA_LOG_INFO("%s: create remnant size %zu ptr %p\n", __func__, new_sz, addr_ptr);
                         remnant = new Llama_mem(usable);
@@ -1848,15 +1905,15 @@ struct senmemory_pool {
                         _record(remnant);
                         usable->sz -= new_sz;
                     }
-                    //LLAMA_TRACK("sp_alloc", 23);
+                    //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 23);
                 }
 
                 new_ptr = usable;
-                //LLAMA_TRACK("sp_alloc", 24);
+                //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 24);
             }
         }
         if( !new_ptr ) {
-            //LLAMA_TRACK("sp_alloc", 3);
+            //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 3);
             new_ptr = new Llama_mem(calloc(sz,1));
             if( !new_ptr->addr ) {
                 LLAMA_LOG_INFO("%s: allocation of %zu bytes failed.\n", __func__, sz);
@@ -1865,17 +1922,13 @@ struct senmemory_pool {
             new_ptr->sz = sz;
             memset(new_ptr->addr, 0, sz);
             total_alloced += sz/100;
-            //LLAMA_TRACK("sp_alloc", 4);
+            //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 4);
         }
 
-        //llama_enable_tracker("sp_search_ub");
-        //llama_enable_tracker("sp_search");
 
         used->insert( new_ptr );
 
-        //llama_disable_tracker("sp_search_ub");
-        //llama_disable_tracker("sp_search");
-        //LLAMA_TRACK("sp_alloc", 5);
+        //LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 5);
         /*if( total_alloced > 100000 && (total_alloced/100)%100 == 0 ) {
             LLAMA_LOG_INFO("%s: total_alloced=%zu*100\n", __func__, total_alloced);
         }
@@ -1883,7 +1936,7 @@ struct senmemory_pool {
             LLAMA_LOG_INFO("%s: used count %zu %p (%p) size %zu\n", __func__, used->count, new_ptr, new_ptr->addr, sz);
 
         */
-        LLAMA_TRACK("sp_alloc", 9);
+        LLAMA_TRACE(LLAMA_TRACE_SP_ALLOC, 9);
         return new_ptr->addr;
     }
     void release(void *ptr) {
@@ -1900,16 +1953,16 @@ struct senmemory_pool {
         uint16_t offset, listno;
         void **buf;
 
-        LLAMA_TRACK("sp_free", 0);
+        LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 0);
         //LLAMA_LOG_INFO("%s: %p\n", __func__, ptr);
         ptr_ref.addr = ptr;
         sp = used->bs(0, &ptr_ref, M, offset, listno);
         iter = used->data[0]->get(listno);
         buf = (void**)iter->data;
         if( !iter || !buf[offset] ) {
-            LLAMA_TRACK("sp_free", 2);
+            LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 2);
             free(ptr);
-            LLAMA_TRACK("sp_free", 3);
+            LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 3);
             return;
             /*
             LLAMA_LOG_ERROR("Invalid free of %p, 1 used size %zu\n", ptr, used->count);
@@ -1919,9 +1972,9 @@ struct senmemory_pool {
         }
         Llama_mem *mem = (Llama_mem*)sp->data;
         if( mem->addr != ptr ) {
-            LLAMA_TRACK("sp_free", 5);
+            LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 5);
             free(ptr);
-            LLAMA_TRACK("sp_free", 6);
+            LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 6);
             return;
             /*
             LLAMA_LOG_ERROR("Invalid free of %p, 2 used size %zu (found %p at %zu (%u))\n",
@@ -1932,12 +1985,40 @@ struct senmemory_pool {
             */
         }
         memset( mem->addr, 0, mem->sz );
-        LLAMA_TRACK("sp_free", 7);
+        LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 7);
         used->erase(mem);
         //LLAMA_LOG_INFO("%s: ->record\n", __func__);
-        LLAMA_TRACK("sp_free", 8);
+        LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 8);
         _record(mem);
-        LLAMA_TRACK("sp_free", 9);
+        LLAMA_TRACE(LLAMA_TRACE_SP_FREE, 9);
+    }
+
+    // Merge loose blocks that sit back to back inside the same allocation so larger requests can
+    // reuse them. Stops after max_merges; returns the number of blocks merged away.
+    size_t compact(size_t max_merges)
+    {
+        static std::vector<Llama_mem*> blocks; // filled by the forall callback; pool_mutex is held
+        blocks.clear();
+        loose->data[0]->forall( [](void *sp) { blocks.push_back( (Llama_mem*)((sp_searchable*)sp)->data ); } );
+        std::sort( blocks.begin(), blocks.end(), [](Llama_mem *a, Llama_mem *b) { return a->addr < b->addr; } );
+
+        size_t merged=0;
+        Llama_mem *run=NULL;
+        for( Llama_mem *mem : blocks ) {
+            if( merged >= max_merges ) break;
+            if( run && run->ref == mem->ref && (char*)run->addr + run->sz == (char*)mem->addr ) {
+                loose->erase(run);
+                loose->erase(mem);
+                run->sz += mem->sz;
+                loose->insert(run);
+                delete mem;
+                merged++;
+                continue;
+            }
+            run = mem;
+        }
+        blocks.clear();
+        return merged;
     }
 };
 
@@ -1972,8 +2053,11 @@ void report_pool_contig( void *ptr )
 
 _Pool myPool;
 bool pool_initialized=false;
+static std::mutex pool_mutex; // sessions on different threads share the pool
+
 void *pool_alloc(size_t sz)
 {
+    std::lock_guard<std::mutex> guard(pool_mutex);
     if( !pool_initialized ) {
         pool_initialized=true;
         new (&myPool) _Pool;
@@ -1989,10 +2073,295 @@ void my_pool_free(void *ptr)
     if( !ptr ) {
         LLAMA_LOG_INFO("Invalid pointer 3\n");
     }
+    std::lock_guard<std::mutex> guard(pool_mutex);
     myPool.release(ptr);
 }
 #define pool_free(x) my_pool_free(x); x=NULL
 
+size_t pool_compact(size_t max_merges)
+{
+    std::lock_guard<std::mutex> guard(pool_mutex);
+    if( !pool_initialized ) return 0;
+    return myPool.compact(max_merges);
+}
+
+//
+// worker pool
+//
+
+// Long-lived workers shared by every context. Bulk copies (the KV shuffler) and actor I/O hand them
+// item ranges through llama_parallel_for instead of starting threads per call. A worker spins for
+// LLAMA_POOL_SPIN_US after each job, because work tends to arrive in bursts, and then parks.
+// Graph compute is not among them: the CPU backend of this ggml starts its own n_threads per graph
+// and takes no outside thread pool.
+#define LLAMA_POOL_SPIN_US 50
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
+// Logical CPU ids, one per physical core, grouped by NUMA node (node 0 first).
+static std::vector<int> llama_core_order() {
+    std::vector<int> order;
+#if defined(_WIN32)
+    DWORD len = 0;
+    GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &len);
+    std::vector<uint8_t> buf(len);
+    auto *info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *) buf.data();
+    if (len && GetLogicalProcessorInformationEx(RelationProcessorCore, info, &len)) {
+        for (DWORD off = 0; off < len; ) {
+            auto *rec = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *) (buf.data() + off);
+            KAFFINITY mask = rec->Processor.GroupMask[0].Mask;
+            if (rec->Processor.GroupMask[0].Group == 0 && mask) {
+                int cpu = 0;
+                while (!(mask & 1)) { mask >>= 1; cpu++; }
+                order.push_back(cpu);
+            }
+            off += rec->Size;
+        }
+    }
+#elif defined(__linux__)
+    int n_cpu = (int) std::thread::hardware_concurrency();
+    std::vector<std::pair<int, int>> cores; // (node, cpu)
+    std::set<std::pair<int, int>> seen;     // (package, core id)
+    char path[128];
+    for (int cpu = 0; cpu < n_cpu; cpu++) {
+        int package = 0, core = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        std::ifstream(path) >> package;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        std::ifstream(path) >> core;
+        if (!seen.insert({package, core}).second) continue; // hyperthread sibling
+        int node = 0;
+        for (int n = 0; n < 64; n++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, n);
+            if (access(path, F_OK) == 0) { node = n; break; }
+        }
+        cores.push_back({node, cpu});
+    }
+    std::stable_sort(cores.begin(), cores.end(),
+            [](const std::pair<int, int> &a, const std::pair<int, int> &b) { return a.first < b.first; });
+    for (auto &c : cores) order.push_back(c.second);
+#endif
+    return order;
+}
+
+int32_t llama_physical_cores(void) {
+    static int32_t n_cores = [] {
+        int32_t n = (int32_t) llama_core_order().size();
+        if (n > 0) return n;
+        unsigned hw = std::thread::hardware_concurrency();
+        return (int32_t) std::max(1u, hw > 4 ? hw / 2 : hw);
+    }();
+    return n_cores;
+}
+
+static bool llama_pin_thread(std::thread &t, int cpu) {
+#if defined(_WIN32)
+    return cpu < 64 && SetThreadAffinityMask(t.native_handle(), (DWORD_PTR) 1 << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) t; (void) cpu;
+    return false;
+#endif
+}
+
+static thread_local bool in_pool_worker = false;
+
+struct llama_worker_pool {
+    std::vector<std::thread> workers;
+    std::atomic<int32_t> n_workers{0};
+    bool pinned = false;
+
+    std::mutex call_mutex; // one parallel_for or resize at a time; nested calls run inline
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+    bool stopping = false;
+
+    // current job, published under mutex together with a new generation
+    const std::function<void(int32_t)> *job = nullptr;
+    int32_t n_items = 0;
+    std::atomic<uint64_t> generation{0};
+    std::atomic<int32_t> next{0};
+    std::atomic<int32_t> pending{0}; // items not finished yet
+    int32_t active = 0;              // workers holding the current job (under mutex)
+    std::atomic<bool> failed{false}; // an item threw; the rest are skipped
+    std::exception_ptr error;        // the first throw, rethrown by parallel_for (under mutex)
+
+    void run_items(const std::function<void(int32_t)> *fn, int32_t n) {
+        for (int32_t i = next.fetch_add(1); i < n; i = next.fetch_add(1)) {
+            if (!failed.load(std::memory_order_relaxed)) {
+                try {
+                    (*fn)(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                    failed = true;
+                }
+            }
+            // skipped and failed items count as finished, so the caller always gets to rethrow
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> lock(mutex);
+                cv_done.notify_all();
+            }
+        }
+    }
+
+    void worker_main() {
+        in_pool_worker = true;
+        uint64_t seen = 0;
+        for (;;) {
+            const int64_t t_spin = ggml_time_us() + LLAMA_POOL_SPIN_US;
+            while (generation.load(std::memory_order_acquire) == seen && ggml_time_us() < t_spin) {
+                std::this_thread::yield();
+            }
+            const std::function<void(int32_t)> *fn;
+            int32_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_work.wait(lock, [&] { return stopping || generation.load() != seen; });
+                if (stopping) return;
+                seen = generation.load();
+                fn = job;
+                n = n_items;
+                active++;
+            }
+            run_items(fn, n);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--active == 0) cv_done.notify_all();
+            }
+        }
+    }
+
+    // false if the pool already had that shape
+    bool start(int32_t n_threads, bool pin) {
+        std::lock_guard<std::mutex> call(call_mutex); // no job is running while workers change
+        if ((int32_t) workers.size() + 1 == n_threads && pinned == pin) return false;
+        stop_workers();
+        std::vector<int> cores = llama_core_order();
+        stopping = false;
+        pinned = false;
+        // the calling thread works too, so n_threads - 1 workers
+        for (int32_t i = 0; i + 1 < n_threads; i++) {
+            workers.emplace_back([this] { worker_main(); });
+            if (pin && !cores.empty()) {
+                // core 0 of node 0 is left to the caller
+                pinned = llama_pin_thread(workers.back(), cores[(i + 1) % cores.size()]) || pinned;
+            }
+        }
+        n_workers = (int32_t) workers.size();
+        return true;
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> call(call_mutex);
+        stop_workers();
+    }
+
+    void stop_workers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv_work.notify_all();
+        for (auto &t : workers) t.join();
+        workers.clear();
+        n_workers = 0;
+    }
+
+    void parallel_for(int32_t n, const std::function<void(int32_t)> &fn) {
+        if (n <= 0) return;
+        if (n == 1 || in_pool_worker) {
+            for (int32_t i = 0; i < n; i++) fn(i);
+            return;
+        }
+        std::unique_lock<std::mutex> call(call_mutex);
+        if (workers.empty()) {
+            call.unlock();
+            for (int32_t i = 0; i < n; i++) fn(i);
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_done.wait(lock, [&] { return active == 0; }); // stragglers from the last job
+            job = &fn;
+            n_items = n;
+            next = 0;
+            pending = n;
+            failed = false;
+            error = nullptr;
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        cv_work.notify_all();
+        in_pool_worker = true; // the caller is a worker until the job is done
+        run_items(&fn, n);
+        in_pool_worker = false;
+        std::exception_ptr thrown;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_done.wait(lock, [&] { return pending.load() == 0; });
+            std::swap(thrown, error);
+        }
+        if (thrown) std::rethrow_exception(thrown); // fn is no longer in use by any worker
+    }
+
+    ~llama_worker_pool() { stop(); }
+};
+
+static llama_worker_pool g_pool;
+
+// Run fn(0..n-1) across the worker pool; returns when all items are done.
+static void llama_parallel_for(int32_t n, const std::function<void(int32_t)> &fn) {
+    g_pool.parallel_for(n, fn);
+}
+
+void llama_pool_start(int32_t n_threads, bool pin) {
+    if (n_threads <= 0) n_threads = llama_physical_cores();
+    if (!g_pool.start(n_threads, pin)) return;
+    LLAMA_LOG_INFO("%s: %d threads%s\n", __func__, n_threads, g_pool.pinned ? " (pinned)" : "");
+}
+
+void llama_pool_stop(void) {
+    g_pool.stop();
+}
+
+int32_t llama_pool_size(void) {
+    return g_pool.n_workers.load() + 1;
+}
+
+int32_t llama_bench_pool(size_t n_bytes, struct llama_pool_bench * out, int32_t n_out) {
+    const int32_t n_items = 32; // one per layer, as the KV shuffler splits its copies
+    const size_t item = std::max<size_t>(n_bytes / n_items, 4096);
+    std::vector<uint8_t> src(item * n_items, 1), dst(item * n_items);
+
+    const int32_t size_was = llama_pool_size();
+    const bool pinned_was = g_pool.pinned;
+    const int32_t n_cores = llama_physical_cores();
+    int32_t n_done = 0;
+    for (int32_t n_threads = 1; n_done < n_out; n_threads *= 2) {
+        n_threads = std::min(n_threads, n_cores);
+        g_pool.start(n_threads, pinned_was);
+        auto copy = [&](int32_t i) { memcpy(dst.data() + i * item, src.data() + i * item, item); };
+        llama_parallel_for(n_items, copy); // warm: page in dst, wake the workers
+        const int reps = 8;
+        const int64_t t0 = ggml_time_us();
+        for (int r = 0; r < reps; r++) llama_parallel_for(n_items, copy);
+        const int64_t t_us = std::max<int64_t>(ggml_time_us() - t0, 1);
+        out[n_done++] = { n_threads, t_us / 1000.0 / reps, (double)item * n_items * reps / t_us / 1e3 };
+        LLAMA_LOG_INFO("%s: %2d threads: %8.3f ms per copy, %6.2f GB/s\n", __func__,
+                       n_threads, out[n_done-1].t_ms, out[n_done-1].gb_per_s);
+        if (n_threads == n_cores) break;
+    }
+    g_pool.start(size_was, pinned_was);
+    return n_done;
+}
+
 
 struct llama_file {
     // use FILE * so we don't have to re-open the file to mmap
@@ -2129,22 +2498,149 @@ struct llama_file {
     }
 };
 
-std::set<std::string> trackers;
+std::atomic<uint64_t> g_trace_mask{0};
+
+struct llama_trace_event {
+    int64_t  t_us;
+    uint64_t value;
+    uint16_t tag;
+    char     phase; // 'i' instant, 'B'/'E' span
+};
+
+// written only by the thread that owns it; readers snapshot it without stopping the writer
+struct llama_trace_ring {
+    llama_trace_event ev[LLAMA_TRACE_RING];
+    std::atomic<uint64_t> head{0};      // events ever written
+    std::atomic<uint64_t> cleared{0};   // head at the last llama_trace_clear
+    std::atomic<bool> owned{false};
+    uint32_t tid;
+};
+
+static std::mutex g_trace_mutex; // guards g_trace_rings, not the rings
+static std::vector<llama_trace_ring*> g_trace_rings;
+
+// a ring outlives its thread so the events stay exportable; the next new thread takes it over
+struct llama_trace_owner {
+    llama_trace_ring *ring = NULL;
+    ~llama_trace_owner()
+    {
+        if( ring ) ring->owned.store(false, std::memory_order_release);
+    }
+};
+static thread_local llama_trace_owner t_trace;
+
+static llama_trace_ring *llama_trace_ring_get( void )
+{
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    for( llama_trace_ring *r : g_trace_rings ) {
+        bool expected = false;
+        if( r->owned.compare_exchange_strong(expected, true) ) return r;
+    }
+    llama_trace_ring *r = new llama_trace_ring;
+    r->owned.store(true);
+    r->tid = g_trace_rings.size();
+    g_trace_rings.push_back(r);
+    return r;
+}
+
+void llama_trace_emit(int tag, char phase, uint64_t value)
+{
+    if( !t_trace.ring ) t_trace.ring = llama_trace_ring_get();
+    llama_trace_ring *r = t_trace.ring;
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    llama_trace_event &e = r->ev[h % LLAMA_TRACE_RING];
+    e.t_us = ggml_time_us();
+    e.value = value;
+    e.tag = tag;
+    e.phase = phase;
+    r->head.store(h + 1, std::memory_order_release);
+}
+
+static const char *trace_tag_names[LLAMA_TRACE_COUNT] = {
+    "sp_search", "sp_search_ub", "sp_insert", "sp_erase", "sp_alloc", "sp_free",
+    "usemap", "fit_extent", "process", "decode", "sample",
+};
+
+const char *llama_trace_tag_name( int tag )
+{
+    if( tag < 0 || tag >= LLAMA_TRACE_COUNT ) return "unknown";
+    return trace_tag_names[tag];
+}
 
-void LLAMA_TRACK(std::string tag, size_t value)
+void llama_trace_enable( uint64_t mask )
 {
-    if( trackers.count(tag) == 0 ) return;
-    llama_file *f = new llama_file(tag.c_str(), "w");
-    f->write_text( std::to_string(value) );
-    f->close();
+    g_trace_mask.store(mask & LLAMA_TRACE_ALL, std::memory_order_relaxed);
 }
-void llama_enable_tracker(std::string tag)
+
+void llama_trace_clear( void )
 {
-    trackers.insert(tag);
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    for( llama_trace_ring *r : g_trace_rings ) {
+        r->cleared.store(r->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
 }
-void llama_disable_tracker(std::string tag)
+
+bool llama_trace_export( const char *path )
 {
-    trackers.erase(tag);
+    std::vector<llama_trace_ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_trace_mutex);
+        rings = g_trace_rings;
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    std::vector<llama_trace_event> copy;
+    bool first = true;
+    char line[256];
+    for( llama_trace_ring *r : rings ) {
+        uint64_t h = r->head.load(std::memory_order_acquire);
+        uint64_t from = std::max<uint64_t>(r->cleared.load(std::memory_order_relaxed), h > LLAMA_TRACE_RING ? h - LLAMA_TRACE_RING : 0);
+        copy.resize(h - from);
+        for( uint64_t i = from; i < h; i++ ) {
+            copy[i - from] = r->ev[i % LLAMA_TRACE_RING];
+        }
+        // the writer kept going: whatever it reached while we copied may be torn
+        uint64_t h2 = r->head.load(std::memory_order_acquire);
+        uint64_t skip = 0;
+        if( h2 + 1 > from + LLAMA_TRACE_RING ) {
+            skip = std::min<uint64_t>(copy.size(), h2 + 1 - LLAMA_TRACE_RING - from);
+        }
+
+        for( size_t i = skip; i < copy.size(); i++ ) {
+            const llama_trace_event &e = copy[i];
+            int n;
+            if( e.phase == 'i' ) {
+                n = snprintf(line, sizeof(line),
+                        "%s{\"name\":\"%s\",\"cat\":\"llama\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"value\":%llu}}",
+                        first ? "" : ",\n", llama_trace_tag_name(e.tag), (long long)e.t_us, r->tid, (unsigned long long)e.value);
+            } else if( e.phase == 'B' ) {
+                n = snprintf(line, sizeof(line),
+                        "%s{\"name\":\"%s\",\"cat\":\"llama\",\"ph\":\"B\",\"ts\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"value\":%llu}}",
+                        first ? "" : ",\n", llama_trace_tag_name(e.tag), (long long)e.t_us, r->tid, (unsigned long long)e.value);
+            } else {
+                n = snprintf(line, sizeof(line),
+                        "%s{\"name\":\"%s\",\"cat\":\"llama\",\"ph\":\"E\",\"ts\":%lld,\"pid\":1,\"tid\":%u}",
+                        first ? "" : ",\n", llama_trace_tag_name(e.tag), (long long)e.t_us, r->tid);
+            }
+            out.append(line, std::min<int>(n, sizeof(line) - 1));
+            first = false;
+        }
+    }
+    out += "\n]}\n";
+
+    try {
+        llama_file f(path, "wb");
+        if( f.fp == NULL ) {
+            LLAMA_LOG_ERROR("%s: could not open %s: %s\n", __func__, path, strerror(errno));
+            return false;
+        }
+        f.write_raw(out.data(), out.size());
+        f.close();
+    } catch( const std::exception &err ) {
+        LLAMA_LOG_ERROR("%s: could not write %s: %s\n", __func__, path, err.what());
+        return false;
+    }
+    return true;
 }
 
 
@@ -2841,6 +3337,354 @@ typedef struct llm_org_context Org_context;
 
 ggml_backend_t get_backend(ggml_tensor *);
 
+// Byte-range patches over the 32 K and V layers of a KV cache, used for checkpoint deltas.
+typedef struct Sparse_list sparse_list;
+typedef struct Sparse_patch sparse_patch;
+struct Sparse_list {
+    int offset;
+    int size;
+    void *data;
+    sparse_list *next;
+
+    Sparse_list(int target=0, int sz=0, void *ptr=NULL)
+    {
+        offset = target;
+        size = sz;
+        data = ptr;
+        next = NULL;
+    }
+
+    sparse_list *copy( void )
+    {
+        sparse_list *head=NULL, *i, *b, *last=NULL;
+        void *cpy;
+
+        for( i = this; i; i = i->next ) {
+            cpy = malloc( i->size );
+            memcpy( cpy, i->data, i->size );
+            b = new sparse_list(i->offset, i->size, cpy );
+            if( last ) last->next = b;
+            else if( !head ) head=b;
+            last=b;
+        }
+        return head;
+    }
+
+    sparse_list *merge( sparse_list *b, bool inplace=false )
+    {
+        sparse_list *tgt = inplace ? this : this->copy();
+
+        for( sparse_list *i = b; i; i = i->next ) {
+            tgt->append( i->offset, i->size, i->data );
+        }
+
+        return tgt;
+    }
+
+    void apply( void *target )
+    {
+        uint8_t *tgtbuf=(uint8_t*)target;
+        for( sparse_list *x = this; x; x = x->next ) {
+            if( x->size > 0 )
+                memcpy( tgtbuf+x->offset, x->data, x->size );
+        }
+    }
+
+    uint8_t *save( int *out_sz )
+    {
+        uint8_t *buf;
+        sparse_list *x = this;
+        int sz=0;
+
+        for( x = this; x; x = x->next ) {
+            sz += sizeof(int)*2 + x->size;
+        }
+        *out_sz = sz;
+        buf = (uint8_t*)malloc(sz);
+        uint8_t *ptr=buf;
+        for( x = this; x; x = x->next ) {
+            memcpy( ptr, &x->offset, sizeof(int) );
+            memcpy( ptr+sizeof(int), &x->size, sizeof(int) );
+            memcpy( ptr+2*sizeof(int), x->data, x->size );
+            ptr += 2*sizeof(int) + x->size;
+        }
+
+        return buf;
+    }
+    void load(uint8_t *buf, int bufsz)
+    {
+        int off, offset, size;
+        sparse_list *at = NULL;
+
+        for( off=0; off<bufsz; off += 2*sizeof(int) + size ) {
+            if( bufsz - off < (int)(2*sizeof(int)) ) throw "Sparse patch is truncated.";
+            memcpy(&offset, buf+off, sizeof(int));
+            memcpy(&size, buf+off+sizeof(int), sizeof(int));
+            if( size < 0 || bufsz - off - (int)(2*sizeof(int)) < size ) throw "Sparse patch is truncated.";
+            at = append( offset, size, buf+off+sizeof(int)*2, at ); // saved in ascending order
+        }
+    }
+
+    // Keep the ranges sorted and disjoint: ranges the new one overlaps or touches are folded
+    // into it, and the new bytes win where they overlap. The head is an empty anchor.
+    // Returns the node now holding the bytes; pass it back as `from` when appending in
+    // ascending order so the walk can start there instead of at the head.
+    sparse_list *append( int target, int sz, void *newdata, sparse_list *from=NULL )
+    {
+        if( sz <= 0 ) return from;
+
+        sparse_list *prev = ( from && from->offset + from->size < target ) ? from : this;
+        while( prev->next && prev->next->offset + prev->next->size < target ) {
+            prev = prev->next;
+        }
+
+        int lo = target, hi = target + sz;
+        sparse_list *x = prev->next;
+        while( x && x->offset <= hi ) {
+            lo = std::min(lo, x->offset);
+            hi = std::max(hi, x->offset + x->size);
+            x = x->next;
+        }
+
+        uint8_t *buf = (uint8_t*)malloc( hi - lo );
+        sparse_list *y = prev->next;
+        while( y != x ) {
+            sparse_list *n = y->next;
+            memcpy( buf + (y->offset - lo), y->data, y->size );
+            y->next = NULL;
+            delete y;
+            y = n;
+        }
+        memcpy( buf + (target - lo), newdata, sz );
+
+        sparse_list *node = new sparse_list(lo, hi - lo, buf);
+        node->next = x;
+        prev->next = node;
+        return node;
+    }
+
+    void report(bool kv, int il)
+    {
+        uint32_t sum=0, cnt=0, max=0, min = -1;
+
+        int sectorsz=8;
+        int groupsz=4096;
+        int valsz=128;
+        uint32_t blocksz=valsz*sectorsz;
+
+        int nsector, ntoken, nspot, esector, etoken, espot;
+        int tracker;
+
+
+        for( sparse_list *x = this; x; x = x->next ) {
+            if( x->size == 0 ) continue;
+
+
+            if( cnt < 4 ) {
+                if( kv ) {
+
+                    // each token is 2048 bytes (8*128*2)
+                    // tokens are in order of 4096 context
+
+                    //n_embd_head_k, n_kv, n_head_kv,
+                    // (128, 4096, 8)
+                    nsector = x->offset/blocksz;
+                    ntoken = x->offset/blocksz;
+                    ntoken = (x->offset-nsector*blocksz)/valsz;
+                    nspot = (x->offset-(nsector*blocksz+ntoken*valsz));
+                    esector = (x->offset+x->size)/blocksz;
+                    etoken = ((x->offset+x->size)-esector*blocksz)/valsz;
+                    espot = ((x->offset+x->size)-(esector*blocksz+etoken*valsz));
+
+                } else {
+
+                    // each token is 2 bytes in 1024 places (2048 bytes total)
+                    // from one place to the next is 4096 entries (8192 bytes)
+
+                    nsector = x->offset/(2*groupsz*valsz);
+                    tracker = nsector*2*groupsz*valsz;
+                    nspot = (x->offset-tracker)/(2*valsz);
+                    tracker += nspot*2*valsz;
+                    ntoken = (x->offset-tracker)/2;
+
+                    esector = (x->offset+x->size)/(2*groupsz*valsz);
+                    tracker = esector*2*groupsz*valsz - x->offset;
+                    espot = (x->size-tracker)/(2*valsz);
+                    tracker = espot*2*valsz;
+                    etoken = (x->size-tracker)/2;
+                }
+                std::string v;
+                std::ostringstream vs;
+
+                for( int z=0; z<x->size && z < 8; z+=2 ) {
+                    vs << (float)( ggml_fp16_to_fp32( *(ggml_fp16_t*)((void*)((char*)x->data+z)) ) ) << " ";
+                }
+                vs << "\n";
+                v = vs.str();
+                LLAMA_LOG_INFO("patch_report(%s[%d]) @(%d-%d) s:t+p (%d:%d+%d) - (%d:%d+%d)\n%s\n", kv?"key":"val", il, x->offset, x->size, nsector, ntoken, nspot, esector, etoken, espot, v.c_str());
+            }
+
+
+            if( x->offset < min || min < 0 ) min = x->offset;
+            cnt++;
+            sum += x->size;
+            max = (max > x->offset+x->size) ? max : (x->offset+x->size);
+        }
+
+        if( max == 0 ) return;
+
+        LLAMA_LOG_INFO("patch_report(%s[%d]): %d-%d (%d entries, %d total, %f average)\n", kv?"key":"val", il, min, max, cnt, sum, (float)sum/(float)cnt);
+    }
+
+    ~Sparse_list()
+    {
+        // V patches run to thousands of ranges per layer, so don't recurse down the chain
+        sparse_list *x = next;
+        while( x ) {
+            sparse_list *n = x->next;
+            x->next = NULL;
+            delete x;
+            x = n;
+        }
+        free(data);
+    }
+};
+
+struct Sparse_patch {
+    sparse_list *klayer[32];
+    sparse_list *vlayer[32];
+
+    Sparse_patch(bool prealloc=true)
+    {
+        if( prealloc ) {
+            for( int i=0; i<32; i++ ) {
+                klayer[i] = new sparse_list();
+                vlayer[i] = new sparse_list();
+            }
+        }
+    }
+    void load(uint8_t *buf, int bufsz)
+    {
+        int layer_sz;
+        uint8_t *ptr = buf, *end = buf + bufsz;
+
+        for( int i=0; i<64; i++ ) {
+            if( end - ptr < (int)sizeof(int) ) throw "Sparse patch is truncated.";
+            memcpy( &layer_sz, ptr, sizeof(int) );
+            if( layer_sz < 0 || end - ptr - (int)sizeof(int) < layer_sz ) throw "Sparse patch is truncated.";
+            ( i%2 == 0 ? klayer[i/2] : vlayer[i/2] )->load( ptr+sizeof(int), layer_sz );
+            ptr += layer_sz + sizeof(int);
+        }
+    }
+    uint8_t *save( int *out_sz)
+    {
+        int sz=0, onesz;
+        uint8_t *bufs[64];
+        int sizes[64];
+
+        for( int i=0; i<32; i++ ) {
+            bufs[i] = klayer[i]->save(&sizes[i]);
+            bufs[i+32] = vlayer[i]->save(&sizes[i+32]);
+            sz += sizes[i] + sizes[i+32];
+        }
+
+        sz += 64*sizeof(int);
+
+        uint8_t *tgt = (uint8_t*)malloc(sz);
+        uint8_t *ptr=tgt;
+        for( int i=0; i<32; i++ ) {
+            memcpy( ptr, &sizes[i], sizeof(int) );
+            memcpy( ptr+sizeof(int), bufs[i], sizes[i]);
+            ptr += sizeof(int) + sizes[i];
+            memcpy( ptr, &sizes[i+32], sizeof(int) );
+            memcpy( ptr+sizeof(int), bufs[i+32], sizes[i+32]);
+            ptr += sizeof(int) + sizes[i+32];
+            free(bufs[i]);
+            free(bufs[i+32]);
+        }
+
+        *out_sz = sz;
+        return tgt;
+    }
+
+    sparse_patch *copy(void)
+    {
+        sparse_patch *tgt = new sparse_patch(false);
+        for( int i=0; i<32; i++ ) {
+            tgt->klayer[i] = klayer[i]->copy();
+            tgt->vlayer[i] = vlayer[i]->copy();
+        }
+        return tgt;
+    }
+
+    sparse_patch *merge( sparse_patch *b, bool inplace=false )
+    {
+        sparse_patch *tgt = inplace ? this : this->copy();
+
+        for( int i=0; i<32; i++ ) {
+            tgt->klayer[i]->merge( b->klayer[i], true );
+            tgt->vlayer[i]->merge( b->vlayer[i], true );
+        }
+
+        return tgt;
+    }
+
+    void readchanges( int il, bool kv, void *data, void *newbuf, int sz, bool commit_changes=false )
+    {
+        uint8_t *newdata = (uint8_t*)newbuf;
+        uint8_t *buffer = (uint8_t*)data;
+
+        int modoff=-1;
+        sparse_list *tgt = kv ? klayer[il]:vlayer[il];
+        int changes=0;
+
+        for( int i=0; i<sz; i++ ) {
+            if( buffer[i] != newdata[i] ) {
+                changes++;
+                if( modoff == -1 ) {
+                    modoff = i;
+                    continue;
+                }
+            } else {
+                if( modoff != -1 ) {
+                    tgt->append(modoff, i-modoff, newdata+modoff);
+                    if( commit_changes ) memcpy(buffer+modoff, newdata+modoff, i-modoff);
+                    modoff=-1;
+                }
+            }
+        }
+        if( modoff != -1 ) {
+            tgt->append(modoff, sz-modoff, newdata+modoff);
+            if( commit_changes ) memcpy(buffer+modoff, newdata+modoff, sz-modoff);
+        }
+        if( changes > 0 ) {
+            //LLAMA_LOG_INFO("readchanges(): %d\n", changes);
+        }
+    }
+
+    void apply( int il, bool kv, void *tgtbuf )
+    {
+        sparse_list *layer = kv ? klayer[il] : vlayer[il];
+        layer->apply(tgtbuf);
+    }
+
+    void report()
+    {
+        for( int i=0; i<32; i++ ) {
+            klayer[i]->report(true, i);
+            vlayer[i]->report(false,i);
+        }
+    }
+
+    ~Sparse_patch()
+    {
+        for( int i=0; i<32; i++ ) {
+            delete klayer[i];
+            delete vlayer[i];
+        }
+    }
+};
+
 // ring-buffer of cached KV data
 typedef struct llama_kv_cache {
     uint32_t size = 0;
@@ -2887,7 +3731,7 @@ typedef struct llama_kv_cache {
             pre_v[il].clear();
         }
     }
-    void prefit_set( std::vector<kv_data> *pre, void *data, size_t start, size_t len )
+    void prefit_set( std::vector<kv_data> *pre, void *data, size_t start, size_t len, bool owned=false )
     {
         std::vector<kv_data>::iterator it;
         kv_data z;
@@ -2934,17 +3778,18 @@ typedef struct llama_kv_cache {
                 z.start = start;
                 z.len = len;
                 z.ptr = data;
-                z.alloced = 0;
+                z.alloced = owned ? len : 0;
                 pre->insert(it, z);
             } else if( (*it).start + (*it).len > start ) {
                 LLAMA_LOG_INFO("prefit overflow 2!\n");
+                if( owned ) pool_free(data); // the list would have freed it
                 throw "prefit overthrow!\n";
             }
         } else {
             z.start = start;
             z.len = len;
             z.ptr = data;
-            z.alloced = 0;
+            z.alloced = owned ? len : 0;
             pre->push_back(z);
         }
     }
@@ -3049,36 +3894,83 @@ typedef struct llama_kv_cache {
         void *x = (void*)pool_alloc( 32 * 2048 * len );
         return x;
     }
-    void read( size_t startpt, size_t n_tokens, void *kx, void *vx )
+    // bytes of one token's K row; only K may be quantized since V is stored transposed
+    size_t k_row( void ) const
     {
-        size_t bufptr;
+        return ggml_row_size(type_k, 1024);
+    }
 
-        size_t v = 2 * n_tokens;
-        size_t k = 1024 * v;
+    // eidets always hold fp16 K so they stay portable between cache types
+    void k_to_fp16( const void *src, ggml_fp16_t *dst, size_t n_tokens ) const
+    {
+        ggml_type_traits_t qt = ggml_internal_get_type_traits(type_k);
+        float *tmp = (float*)pool_alloc( 1024 * sizeof(float) );
+
+        for( size_t t=0; t<n_tokens; t++ ) {
+            qt.to_float( (const char*)src + t*k_row(), tmp, 1024 );
+            ggml_fp32_to_fp16_row( tmp, dst + t*1024, 1024 );
+        }
+        pool_free(tmp);
+    }
+    void *k_from_fp16( const ggml_fp16_t *src, size_t n_tokens ) const
+    {
+        ggml_type_traits_t qt = ggml_internal_get_type_traits(type_k);
+        float *tmp = (float*)pool_alloc( 1024 * sizeof(float) );
+        void *dst = pool_alloc( k_row() * n_tokens );
+
+        for( size_t t=0; t<n_tokens; t++ ) {
+            ggml_fp16_to_fp32_row( src + t*1024, tmp, 1024 );
+            qt.from_float( tmp, (char*)dst + t*k_row(), 1024 );
+        }
+        pool_free(tmp);
+        return dst;
+    }
+
+    void read( size_t startpt, size_t n_tokens, void *kx, void *vx )
+    {
+        size_t bufptr;
+
+        size_t v = 2 * n_tokens;
+        size_t k = 1024 * v;
 
         size_t st_v = 2 * startpt;
-        size_t st_k = 1024 * st_v;
+        size_t st_k = k_row() * startpt;
+        size_t k_q = k_row() * n_tokens;
 
         size_t p, p_sz = 2 * size;
 
         LLAMA_LOG_INFO("kv_read(%s): startpt %zu n_tokens %zu\n", quick_ts().c_str(), startpt, n_tokens);
 
         ggml_backend_t backend_res = get_backend(k_l[0]);
+        void *kq = type_k == GGML_TYPE_F16 ? NULL : pool_alloc( 32 * k_q );
 
         for( int il=bufptr=0; il<32; il++ ) {
             //LLAMA_LOG_INFO("kv_read(%s): %d\n", quick_ts().c_str(), il);
-            ggml_backend_tensor_get_async(backend_res, k_l[il], (void*)((char*)kx + bufptr), st_k, k );
+            if( kq ) {
+                ggml_backend_tensor_get_async(backend_res, k_l[il], (void*)((char*)kq + il*k_q), st_k, k_q );
+            } else {
+                ggml_backend_tensor_get_async(backend_res, k_l[il], (void*)((char*)kx + bufptr), st_k, k );
+            }
             for( int i=0, p=st_v; i<1024; i++, p += p_sz, bufptr += v ) {
                 ggml_backend_tensor_get_async(backend_res, v_l[il], (void*)((char*)vx + bufptr), p, v );
             }
         }
 
         ggml_backend_synchronize(backend_res);
+
+        if( kq ) {
+            for( int il=0; il<32; il++ ) {
+                k_to_fp16( (char*)kq + il*k_q, (ggml_fp16_t*)((char*)kx + il*k), n_tokens );
+            }
+            pool_free(kq);
+        }
         LLAMA_LOG_INFO("kv_read(%s): done\n", quick_ts().c_str());
     }
 
     void read2( size_t startpt, size_t offset, size_t n_tokens, std::vector<ggml_fp16_t> kx[32], std::vector<ggml_fp16_t> vx[32] )
     {
+        GGML_ASSERT(type_k == GGML_TYPE_F16); // raw fp16 layout only
+
         size_t bufptr;
 
         size_t v = 2 * n_tokens;
@@ -3124,6 +4016,103 @@ typedef struct llama_kv_cache {
         LLAMA_LOG_INFO("kv_read2(%s): done\n", quick_ts().c_str());
     }
 
+    // scene snapshots: tokens [0,n_tokens) of every layer as K rows then V channels, with one
+    // transfer per tensor instead of one per V channel
+    size_t prefix_size( size_t n_tokens ) const
+    {
+        return prefix_bytes( type_k, n_tokens );
+    }
+    static size_t prefix_bytes( ggml_type type_k, size_t n_tokens )
+    {
+        return 32 * ( ggml_row_size(type_k, 1024) * n_tokens + 2 * 1024 * n_tokens );
+    }
+    void save_prefix( llama_file &file, size_t n_tokens )
+    {
+        size_t v_layer = 2 * 1024 * size;
+        uint8_t *buf = (uint8_t*)pool_alloc( std::max(v_layer, k_row() * n_tokens) );
+
+        for( int il=0; il<32; il++ ) {
+            ggml_backend_tensor_get( k_l[il], buf, 0, k_row() * n_tokens );
+            file.write_raw( buf, k_row() * n_tokens );
+
+            // V is stored transposed: gather each channel's first n_tokens in place
+            ggml_backend_tensor_get( v_l[il], buf, 0, v_layer );
+            for( int i=1; i<1024; i++ ) {
+                memmove( buf + i*2*n_tokens, buf + i*2*size, 2*n_tokens );
+            }
+            file.write_raw( buf, 2 * 1024 * n_tokens );
+        }
+        pool_free(buf);
+    }
+    // src is what save_prefix wrote, usually straight out of a mapped snapshot
+    void load_prefix( const uint8_t *src, size_t n_tokens )
+    {
+        size_t v_layer = 2 * 1024 * size;
+        uint8_t *buf = (uint8_t*)pool_alloc( v_layer );
+
+        for( int il=0; il<32; il++ ) {
+            ggml_backend_tensor_set( k_l[il], src, 0, k_row() * n_tokens );
+            src += k_row() * n_tokens;
+
+            // keep the cells past n_tokens as they are; unused cells still take part in the V product
+            ggml_backend_tensor_get( v_l[il], buf, 0, v_layer );
+            for( int i=0; i<1024; i++ ) {
+                memcpy( buf + i*2*size, src + i*2*n_tokens, 2*n_tokens );
+            }
+            ggml_backend_tensor_set( v_l[il], buf, 0, v_layer );
+            src += 2 * 1024 * n_tokens;
+        }
+        pool_free(buf);
+    }
+
+    // checkpoint deltas: the K rows and V channels of the given token ranges (sorted, disjoint)
+    // as byte ranges of each layer's tensors
+    void read_patch( Sparse_patch &patch, const std::vector<std::pair<uint32_t,uint32_t>> &ranges )
+    {
+        size_t v_layer = 2 * 1024 * size;
+        uint8_t *buf = (uint8_t*)pool_alloc( v_layer );
+
+        for( int il=0; il<32; il++ ) {
+            sparse_list *at = NULL;
+            for( auto &r : ranges ) {
+                size_t n = r.second - r.first;
+                ggml_backend_tensor_get( k_l[il], buf, k_row() * r.first, k_row() * n );
+                at = patch.klayer[il]->append( k_row() * r.first, k_row() * n, buf, at );
+            }
+
+            ggml_backend_tensor_get( v_l[il], buf, 0, v_layer );
+            at = NULL;
+            for( int i=0; i<1024; i++ ) { // channel-major keeps the offsets ascending
+                for( auto &r : ranges ) {
+                    size_t off = i*2*size + 2*r.first;
+                    at = patch.vlayer[il]->append( off, 2 * (r.second - r.first), buf + off, at );
+                }
+            }
+        }
+        pool_free(buf);
+    }
+    void apply_patch( Sparse_patch &patch )
+    {
+        size_t k_layer = k_row() * size;
+        size_t v_layer = 2 * 1024 * size;
+        uint8_t *buf = (uint8_t*)pool_alloc( v_layer );
+
+        for( int il=0; il<32; il++ ) {
+            for( sparse_list *x = patch.klayer[il]; x; x = x->next ) {
+                if( x->size == 0 ) continue;
+                if( x->offset < 0 || (size_t)(x->offset + x->size) > k_layer ) throw "Checkpoint does not fit the KV slot.";
+                ggml_backend_tensor_set( k_l[il], x->data, x->offset, x->size );
+            }
+            for( sparse_list *x = patch.vlayer[il]; x; x = x->next ) {
+                if( x->offset < 0 || (size_t)(x->offset + x->size) > v_layer ) throw "Checkpoint does not fit the KV slot.";
+            }
+            ggml_backend_tensor_get( v_l[il], buf, 0, v_layer );
+            patch.apply( il, false, buf );
+            ggml_backend_tensor_set( v_l[il], buf, 0, v_layer );
+        }
+        pool_free(buf);
+    }
+
     /*
     void writestr( std::string who, std::string what, int n_tokens )
     {
@@ -3155,7 +4144,12 @@ typedef struct llama_kv_cache {
         for( int il=bufptr=0; il<32; il++ ) {
             //LLAMA_LOG_INFO("kv_write(%s): %d step 1\n", quick_ts().c_str(), il);
             //LLAMA_LOG_INFO("pre_k %d: %zu %zu\n", il, st_k, st_k+k);
-            prefit_set( &(pre_k[il]), (void*)((char*)kx + bufptr), st_k, k );
+            if( type_k != GGML_TYPE_F16 ) {
+                void *kq = k_from_fp16( (ggml_fp16_t*)((char*)kx + bufptr), n_tokens );
+                prefit_set( &(pre_k[il]), kq, k_row() * startpt, k_row() * n_tokens, true );
+            } else {
+                prefit_set( &(pre_k[il]), (void*)((char*)kx + bufptr), st_k, k );
+            }
             //ggml_backend_tensor_set( k_l[il], (void*)((char*)kx + bufptr), st_k, k );
             //LLAMA_LOG_INFO("kv_write(%s): %d step 2\n", quick_ts().c_str(), il);
             for( int i=0, p=st_v; i<1024; i++, p += p_sz, bufptr += v ) {
@@ -3170,6 +4164,8 @@ typedef struct llama_kv_cache {
 
     void write2( size_t startpt, size_t offset, size_t n_tokens, std::vector<ggml_fp16_t> kx[32], std::vector<ggml_fp16_t> vx[32] )
     {
+        GGML_ASSERT(type_k == GGML_TYPE_F16); // raw fp16 layout only
+
         size_t bufptr;
 
         size_t v = 2 * n_tokens;
@@ -3254,6 +4250,23 @@ typedef struct llama_kv_cache {
         return size;
     }
 
+    // drop the tensors and backend buffers so the cache can be re-initialized at a new size
+    void free_buffers(void) {
+        prefit_clear();
+        for (struct ggml_context * ctx : ctxs) {
+            ggml_free(ctx);
+        }
+        for (ggml_backend_buffer_t buf : bufs) {
+            ggml_backend_buffer_free(buf);
+        }
+        ctxs.clear();
+        bufs.clear();
+        k_l.clear();
+        v_l.clear();
+        size = 0;
+        seq = 0;
+    }
+
     ~llama_kv_cache() {
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
@@ -3275,14 +4288,18 @@ struct llm_org_context {
     llm_org_context( Kv_cache *kv,
                      std::vector<uint8_t> &compute_meta,
                      ggml_backend_sched *scheduler,
-                     llama_hparams hparams
+                     llama_hparams hparams,
+                     ggml_backend_t cpu,
+                     int threads
                      )
         :
         kv_self          (kv),
         buf_compute_meta (compute_meta),
         sched ( scheduler ),
         n_embd_k_gqa ( hparams.n_embd_head_k * hparams.n_head_kv ),
-        n_embd_v_gqa ( hparams.n_embd_head_v * hparams.n_head_kv )
+        n_embd_v_gqa ( hparams.n_embd_head_v * hparams.n_head_kv ),
+        backend_cpu ( cpu ),
+        n_threads ( threads )
     {
 
     }
@@ -3311,7 +4328,7 @@ struct llm_org_context {
     void *k_buffer_layers[32];
     void *v_buffer_layers[32];
 
-    ggml_backend_t backend_cpu = nullptr;
+    ggml_backend_t backend_cpu; // the context's, not ours to free
     int n_threads;
 
     struct ggml_cgraph *get_shuffler()
@@ -3325,7 +4342,6 @@ struct llm_org_context {
     void run_kv_shuffler(void) {
         LLAMA_LOG_INFO("%s: run shuffler\n", __func__);
 
-        backend_cpu = ggml_backend_cpu_init();
         if (backend_cpu != nullptr) {
             ggml_backend_cpu_set_n_threads(backend_cpu, n_threads);
         }
@@ -3336,18 +4352,24 @@ struct llm_org_context {
         if( buffer_size > 0 ) {
             LLAMA_LOG_INFO("%s: adjust buffer %d\n", __func__, buffer_size);
             size_t size_v = buffer_size * 2;
-            size_t size_k = size_v * 1024;
+            size_t size_k = kv_self->k_row() * buffer_size;
             size_t tgt_v = buffer_target * 2;
-            size_t tgt_k = tgt_v * 1024;
+            size_t tgt_k = kv_self->k_row() * buffer_target;
             size_t p_size = kv_self->size * 2;
             ggml_backend_t backend_res = get_backend(kv_self->k_l[0]);
-            for( int il = 0; il < 32; ++il ) { // it's the same amt of memory, 1024*overlap_v
+            auto restore_layer = [&](int32_t il) { // it's the same amt of memory, 1024*overlap_v
                 ggml_backend_tensor_set_async(backend_res, kv_self->k_l[il], k_buffer_layers[il], tgt_k, size_k );
                 for( int i=0; i<1024; i++ ) {
                     ggml_backend_tensor_set_async(backend_res, kv_self->v_l[il], (void*)((char*)v_buffer_layers[il]+(size_v*i)), tgt_v+(p_size*i), size_v );
                 }
                 pool_free(k_buffer_layers[il]);
                 pool_free(v_buffer_layers[il]);
+            };
+            // host buffers are plain memcpy, so layers can go to the worker pool
+            if( ggml_backend_buffer_is_host(kv_self->k_l[0]->buffer) ) {
+                llama_parallel_for(32, restore_layer);
+            } else {
+                for( int il = 0; il < 32; ++il ) restore_layer(il);
             }
             ggml_backend_synchronize(backend_res);
             buffer_size = 0;
@@ -3384,10 +4406,10 @@ struct llm_org_context {
         size_t remnant = used_en - overlap_end;
 
         size_t overlap_v = 2 * overlap;
-        size_t overlap_k = 1024 * overlap_v;
+        size_t overlap_k = kv_self->k_row() * overlap;
 
         size_t to_st_v = 2 * to_st;
-        size_t to_st_k = 1024 * to_st_v;
+        size_t to_st_k = kv_self->k_row() * to_st;
 
         size_t p_size = kv_self->size * 2;
 
@@ -3402,16 +4424,22 @@ struct llm_org_context {
         ggml_tensor *view_k_src, *view_k_dst, *view_v_src, *view_v_dst;
 
         LLAMA_LOG_INFO("%s: setting up swap_left from %d+%d to %d and from %d+%d to %d\n", from_st, from_sz, to_st, overlap_end, remnant, overlap_tgt );
-        for( int il = 0; il < 32; ++il ) {
-            if( overlap > 0 ) {
+        if( overlap > 0 ) {
+            auto save_layer = [&](int32_t il) {
                 k_buffer_layers[il] = pool_alloc( overlap_k );
-                v_buffer_layers[il] = pool_alloc( overlap_k ); // it's the same amt of memory, 1024*overlap_v
+                v_buffer_layers[il] = pool_alloc( 1024 * overlap_v );
                 ggml_backend_tensor_get(kv_self->k_l[il], k_buffer_layers[il], to_st_k, overlap_k );
                 for( size_t i=0; i<1024; i++ ) {
                     ggml_backend_tensor_get(kv_self->v_l[il], (void*)((char*)v_buffer_layers[il]+(overlap_v*i)), to_st_v+(p_size*i), overlap_v );
                 }
+            };
+            if( ggml_backend_buffer_is_host(kv_self->k_l[0]->buffer) ) {
+                llama_parallel_for(32, save_layer);
+            } else {
+                for( int il = 0; il < 32; ++il ) save_layer(il);
             }
-
+        }
+        for( int il = 0; il < 32; ++il ) {
             view_k_src = ggml_view_2d(ctx0, kv_self->k_l[il],
                     n_embd_k_gqa, from_sz,
                     ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
@@ -3570,6 +4598,9 @@ struct llama_vocab {
 
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
+    // flat merge table keyed by (left id << 32 | right id) -> (rank, merged id), built from bpe_ranks after load
+    std::unordered_map<uint64_t, std::pair<int, id>> bpe_merges;
+
     // default LLaMA special tokens
     id special_bos_id = 1;
     id special_eos_id = 2;
@@ -3601,6 +4632,32 @@ struct llama_vocab {
 
         return it->second;
     }
+
+    int find_bpe_rank(id left, id right, id & merged) const {
+        auto it = bpe_merges.find(((uint64_t)(uint32_t)left << 32) | (uint32_t)right);
+        if (it == bpe_merges.end()) {
+            return -1;
+        }
+
+        merged = it->second.second;
+        return it->second.first;
+    }
+
+    void build_bpe_merges() {
+        bpe_merges.clear();
+        bpe_merges.reserve(bpe_ranks.size());
+
+        for (const auto & it : bpe_ranks) {
+            auto left   = token_to_id.find(it.first.first);
+            auto right  = token_to_id.find(it.first.second);
+            if (left == token_to_id.end() || right == token_to_id.end()) {
+                continue;
+            }
+            auto merged = token_to_id.find(it.first.first + it.first.second);
+            id merged_id = merged != token_to_id.end() ? merged->second : -1;
+            bpe_merges[((uint64_t)(uint32_t)left->second << 32) | (uint32_t)right->second] = std::make_pair(it.second, merged_id);
+        }
+    }
 };
 
 
@@ -3662,9 +4719,11 @@ typedef struct system_eidet System_eidet;
 typedef struct system_kb System_kb;
 typedef struct llama_model Llama_model;
 
+// the model is shared read-only by every session; the context and kb are bound per thread
+// with llama_bind_context() so several sessions can run at once.
 Llama_model *current_model=NULL;
-System_kb *current_kb=NULL;
-_Context *current_context=NULL;
+thread_local System_kb *current_kb=NULL;
+thread_local _Context *current_context=NULL;
 
 typedef struct system_timestamp {
     int year, month, day;
@@ -3726,10 +4785,21 @@ typedef struct system_timestamp {
         return when;
     }
 } System_timestamp;
+// std::localtime shares one static tm between threads; actors are saved and imported on the pool
+static void llama_localtime( std::time_t t, std::tm *out )
+{
+#if defined(_WIN32)
+    localtime_s(out, &t);
+#else
+    localtime_r(&t, out);
+#endif
+}
 System_timestamp *llama_ts_now()
 {
     std::time_t t = std::time(0);   // get time now
-    std::tm* now = std::localtime(&t);
+    std::tm local;
+    llama_localtime(t, &local);
+    std::tm* now = &local;
     System_timestamp *ts = (System_timestamp*)pool_alloc(sizeof(System_timestamp));
 
     ts->year = now->tm_year;
@@ -3802,125 +4872,259 @@ char toLowerCase(char c)
     }
     return c;
 }
-void llama_quick_tokenize( std::string raw_text, std::vector<llama_vocab::id> &output );
+void llama_quick_tokenize( const std::string &raw_text, std::vector<llama_vocab::id> &output );
 
 
 
+// Partial memories (text the actor has heard but not decoded) are rows of the actor's
+// Memory_store; a System_memory is a handle to one row. Columns are read through it.
+typedef struct memory_store Memory_store;
 struct system_memory {
-    std::set<std::string> keywords;
+    Memory_store *store;
+    uint32_t row;
+
+    const std::string &who() const;
+    std::string what() const;
+    uint32_t length() const; // bytes of text
+    int64_t when() const;
+    uint16_t n_tokens() const;
+    const int32_t *tokens() const;
+    const uint32_t *keywords( uint16_t *n ) const;
+
+    void writefile( llama_file &file ) const;
+    // the bytes Kv_mem::writefile puts in a .hst file for this row, appended to out
+    void serialize( std::string &out ) const;
+};
 
-    std::string what;
-    std::string who;
-    System_timestamp *when=NULL;
+// seconds since the epoch <-> the broken-down local time eidets and the memory files use
+int64_t llama_ts_to_epoch( const System_timestamp *ts )
+{
+    std::tm tm = {};
+    tm.tm_year = ts->year;
+    tm.tm_mon = ts->month;
+    tm.tm_mday = ts->day;
+    tm.tm_hour = ts->hour;
+    tm.tm_min = ts->min;
+    tm.tm_sec = ts->second;
+    tm.tm_isdst = -1;
+    return (int64_t)std::mktime(&tm);
+}
+void llama_epoch_to_ts( int64_t epoch, System_timestamp *ts )
+{
+    std::tm local;
+    llama_localtime((std::time_t)epoch, &local);
+    std::tm *tm = &local;
+    ts->year = tm->tm_year;
+    ts->month = tm->tm_mon;
+    ts->day = tm->tm_mday;
+    ts->hour = tm->tm_hour;
+    ts->min = tm->tm_min;
+    ts->second = tm->tm_sec;
+}
+// "time_Y_M_D_h_m_s_" as written by System_timestamp::to_string
+int64_t llama_string_to_epoch( const std::string &str )
+{
+    int fields[6] = {0,0,0,0,0,0};
+    const char *p = str.data(), *end = str.data() + str.size();
+    for( int i=0; i<6; i++ ) {
+        p = (const char*)memchr(p, '_', end - p);
+        if( !p ) throw "Bad memory timestamp.";
+        p++;
+        std::from_chars_result r = std::from_chars(p, end, fields[i]);
+        if( r.ec != std::errc() ) throw "Bad memory timestamp.";
+        p = r.ptr;
+    }
+    System_timestamp ts = { fields[0], fields[1], fields[2], fields[3], fields[4], fields[5] };
+    return llama_ts_to_epoch(&ts);
+}
+std::string llama_epoch_to_string( int64_t epoch )
+{
+    System_timestamp ts;
+    llama_epoch_to_ts(epoch, &ts);
+    return ts.to_string();
+}
 
-    uint16_t n_tokens;
-    std::vector<int> tokens;
+struct memory_store {
+    std::vector<std::string> speakers;
+    std::unordered_map<std::string, uint16_t> speaker_ids;
+    std::vector<std::string> terms; // lowercased words
+    std::unordered_map<std::string, uint32_t> term_ids;
+
+    // one entry per row
+    std::vector<uint16_t> who;
+    std::vector<int64_t> when;
+    std::vector<uint32_t> text_off;
+    std::vector<uint32_t> text_len;
+    std::vector<uint32_t> tok_off;
+    std::vector<uint16_t> n_tok;
+    std::vector<uint32_t> kw_off;
+    std::vector<uint16_t> kw_len;
+
+    // arenas the rows point into
+    std::string text;
+    std::vector<int32_t> tokens;
+    std::vector<uint32_t> keywords; // term ids, sorted within a row
 
-    //std::string where; // add with location
+    std::deque<System_memory> rows; // handles stay put as rows are added
 
-    void prepare()
+    uint16_t speaker( const std::string &name )
     {
-        new (&what) std::string;
-        new (&who) std::string;
-        new (&keywords) std::set<std::string>;
-        new (&tokens) std::vector<int>;
-        when = NULL;
-        n_tokens=0;
+        auto found = speaker_ids.find(name);
+        if( found != speaker_ids.end() ) return found->second;
+        if( speakers.size() >= UINT16_MAX ) throw "Too many speakers in one actor.";
+        uint16_t id = (uint16_t)speakers.size();
+        speakers.push_back(name);
+        speaker_ids[name] = id;
+        return id;
+    }
+    uint32_t term( const std::string &word )
+    {
+        auto found = term_ids.find(word);
+        if( found != term_ids.end() ) return found->second;
+        uint32_t id = (uint32_t)terms.size();
+        terms.push_back(word);
+        term_ids[word] = id;
+        return id;
     }
-    void release()
+
+    // words are split on spaces and newlines and lowercased, as ragunmap splits the query
+    static void split_keywords( const char *str, uint32_t len, std::vector<std::string> &words )
     {
-        keywords.clear();
-        tokens.clear();
+        std::string word;
+        for( uint32_t i=0; i<=len; i++ ) {
+            char c = i < len ? str[i] : '\0';
+            if( c == ' ' || c == '\n' || c == '\0' ) {
+                if( !word.empty() ) {
+                    words.push_back( word );
+                    word.clear();
+                }
+                if( c == '\0' ) break;
+            } else {
+                word.push_back( toLowerCase(c) );
+            }
+        }
     }
-    void readfile( llama_file &file )
+    void index_keywords( const std::vector<std::string> &words )
     {
-        who = file.read_string();
-        what = file.read_string();
-        n_tokens = file.read_u16();
-        std::string strWhen = file.read_string();
-
-        if( tokens.size() != 0 ) tokens.clear();
-        llama_quick_tokenize( what, tokens );
-
-        when = llama_string_to_ts(strWhen);
-
-        buildsearch();
+        std::vector<uint32_t> ids;
+        ids.reserve( words.size() );
+        for( auto &word : words ) {
+            ids.push_back( term(word) );
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase( std::unique(ids.begin(), ids.end()), ids.end() );
+        kw_off.push_back( (uint32_t)keywords.size() );
+        kw_len.push_back( (uint16_t)std::min<size_t>(ids.size(), UINT16_MAX) );
+        keywords.insert( keywords.end(), ids.begin(), ids.begin() + kw_len.back() );
     }
-    void writefile( llama_file &file )
+
+    System_memory *push_row( void )
     {
-        //uint16_t sign = (uint16_t)0x10011;
-        //file.write_u16(sign);
-        file.write_string(who);
-        file.write_string(what);
-        file.write_u16(n_tokens);
-        file.write_string(when->to_string());
+        rows.push_back( System_memory{ this, (uint32_t)rows.size() } );
+        return &rows.back();
     }
 
-    void build( std::string actor, std::string input )
+    // a row from text that is already tokenized and split, so the expensive part can run off the store
+    System_memory *add( std::string_view speaker_name, std::string_view what, int64_t t,
+                        const std::vector<int> &toks, const std::vector<std::string> &words )
     {
-        who = actor;
-        when = llama_ts_now();
-        what = input;
+        who.push_back( speaker(std::string(speaker_name)) );
+        when.push_back( t );
+        text_off.push_back( (uint32_t)text.size() );
+        text_len.push_back( (uint32_t)what.size() );
+        text.append( what );
 
-        if( tokens.size() != 0 ) tokens.clear();
-        llama_quick_tokenize( what, tokens );
-        n_tokens = tokens.size();
+        tok_off.push_back( (uint32_t)tokens.size() );
+        n_tok.push_back( (uint16_t)std::min<size_t>(toks.size(), UINT16_MAX) );
+        tokens.insert( tokens.end(), toks.begin(), toks.begin() + n_tok.back() );
 
-        buildsearch();
+        index_keywords( words );
+        return push_row();
     }
-    void buildsearch( void )
+    System_memory *add( const std::string &speaker_name, const std::string &what, int64_t t )
     {
-        const char *instr; // now index the words for search:
-        char word[128], *wptr;
-        wptr = word;
-        *wptr = '\0';
-
-        //LLAMA_LOG_INFO("%s: memory what=%s\n", __func__, what.c_str());
-
-        int iptr, len = what.length();
-        char c;
-
-        for( iptr=0; iptr<len; iptr++ ) {
-            c = what[iptr]; // = what.c_str() ;; instr++ ) {
-            if( c == ' ' || c == '\n' || c == '\0' ) {
-                if( *word != '\0' ) {
-                    *wptr='\0';
-                    keywords.insert( std::string(word) );
-                    wptr=word;
-                    *wptr='\0';
-                }
-                if( c == '\0' ) break;
-            } else {
-                *wptr = toLowerCase(c);
-                wptr++;
-            }
-        }
-        if( *word != '\0' ) {
-            *wptr='\0';
-            //LLAMA_LOG_INFO("%s: add keyword %s\n", __func__, word);
-            keywords.insert( std::string(word) );
-            wptr=word;
-            *wptr='\0';
-        }
+        std::vector<int> toks;
+        std::vector<std::string> words;
+        llama_quick_tokenize( what, toks );
+        split_keywords( what.data(), (uint32_t)what.size(), words );
+        return add( speaker_name, what, t, toks, words );
+    }
+    System_memory *add( const std::string &speaker_name, const std::string &what )
+    {
+        return add( speaker_name, what, (int64_t)std::time(0) );
     }
 
-    int scan( std::vector<std::string *> search )
+    // src restamped with time t: a row of this store is reused in place, one from elsewhere is copied in
+    System_memory *readd( const System_memory *src, int64_t t )
     {
-        std::vector<std::string *>::iterator it;
-        int results=0;
+        if( src->store != this ) return add( src->who(), src->what(), t );
+        when[src->row] = t;
+        return &rows[src->row];
+    }
 
-        for( it = search.begin(); it != search.end(); it++ ) {
-            std::string *keyword = *it;
+    System_memory *readfile( llama_file &file )
+    {
+        std::string speaker_name = file.read_string();
+        std::string what = file.read_string();
+        file.read_u16(); // n_tokens; the text is tokenized again
+        std::string strWhen = file.read_string();
+        return add( speaker_name, what, llama_string_to_epoch(strWhen) );
+    }
 
-            if( keywords.find(*keyword) != keywords.end() ) {
-                results++;
-            }
-        }
+    size_t size( void ) const { return rows.size(); }
 
-        return results;
+    // heap bytes held by the store, for llama_bench_memories
+    size_t bytes( void ) const
+    {
+        size_t n = 0;
+        for( auto &str : speakers ) n += sizeof(str) + str.capacity();
+        for( auto &str : terms ) n += 2 * ( sizeof(str) + str.capacity() ) + sizeof(uint32_t) + 2*sizeof(void*); // + the map's node
+        n += speaker_ids.size() * ( sizeof(std::string) + sizeof(uint16_t) + 2*sizeof(void*) );
+        n += who.capacity() * sizeof(uint16_t) + when.capacity() * sizeof(int64_t);
+        n += ( text_off.capacity() + text_len.capacity() + tok_off.capacity() + kw_off.capacity() ) * sizeof(uint32_t);
+        n += ( n_tok.capacity() + kw_len.capacity() ) * sizeof(uint16_t);
+        n += text.capacity() + tokens.capacity() * sizeof(int32_t) + keywords.capacity() * sizeof(uint32_t);
+        n += rows.size() * sizeof(System_memory);
+        return n;
+    }
+
+    void clear( void )
+    {
+        *this = memory_store(); // gives the arenas back instead of keeping their capacity
     }
 };
 
+const std::string &system_memory::who() const { return store->speakers[ store->who[row] ]; }
+std::string system_memory::what() const { return store->text.substr( store->text_off[row], store->text_len[row] ); }
+uint32_t system_memory::length() const { return store->text_len[row]; }
+int64_t system_memory::when() const { return store->when[row]; }
+uint16_t system_memory::n_tokens() const { return store->n_tok[row]; }
+const int32_t *system_memory::tokens() const { return store->tokens.data() + store->tok_off[row]; }
+const uint32_t *system_memory::keywords( uint16_t *n ) const
+{
+    *n = store->kw_len[row];
+    return store->keywords.data() + store->kw_off[row];
+}
+void system_memory::writefile( llama_file &file ) const
+{
+    file.write_string(who());
+    file.write_string(what());
+    file.write_u16(n_tokens());
+    file.write_string(llama_epoch_to_string(when()));
+}
+void system_memory::serialize( std::string &out ) const
+{
+    auto put_u32 = [&out]( uint32_t v ) { out.append( (const char*)&v, sizeof(v) ); };
+    auto put_u16 = [&out]( uint16_t v ) { out.append( (const char*)&v, sizeof(v) ); };
+    auto put_string = [&]( const std::string &str ) { put_u32( (uint32_t)str.length() ); out.append( str ); };
+
+    put_u16( 1 ); // Kv_mem type: partial memory
+    put_string( who() );
+    put_string( what() );
+    put_u16( n_tokens() );
+    put_string( llama_epoch_to_string(when()) );
+}
+
 
 struct system_eidet {
     uint16_t n_tokens;
@@ -4047,21 +5251,6 @@ struct system_eidet {
         return n_tokens;
     }
 
-    System_memory *convert()
-    {
-        System_memory *mem = (System_memory*)pool_alloc(sizeof(System_memory));
-
-        new (mem) System_memory;
-
-        mem->prepare();
-        mem->who = who;
-        mem->what = what;
-        mem->when = (System_timestamp*)pool_alloc(sizeof(System_timestamp));
-        memcpy( mem->when, when, sizeof(System_timestamp));
-        mem->buildsearch();
-
-        return mem;
-    }
 };
 typedef struct kv_mem {
     bool is_full = false;
@@ -4071,6 +5260,10 @@ typedef struct kv_mem {
     uint16_t first; // token location
     uint16_t last; // inclusive
 
+    // owned by system_kb's Kv_mem arena
+    struct kv_mem *next_free = NULL;
+    uint32_t generation = 0; // odd while handed out; bumped on every getmem and freemem
+
     void prepare()
     {
         m = NULL;
@@ -4080,9 +5273,9 @@ typedef struct kv_mem {
         first = last = 0;
     }
 
-    System_timestamp *when()
+    int64_t when()
     {
-        return is_full ? e->when : m->when;
+        return is_full ? llama_ts_to_epoch(e->when) : m->when();
     }
 
     void writefile(llama_file &file)
@@ -4090,21 +5283,18 @@ typedef struct kv_mem {
         uint16_t type = !is_full ? 1 : 2;
         file.write_u16( type );
 
-        LLAMA_LOG_INFO("write memory type %u (%s)\n", type, type==1?m->what.c_str():e->what.c_str());
+        LLAMA_LOG_INFO("write memory type %u (%s)\n", type, type==1?m->what().c_str():e->what.c_str());
 
         if( is_full ) e->writefile(file);
         else m->writefile(file);
     }
-    void readfile(llama_file &file)
+    void readfile(llama_file &file, Memory_store *store)
     {
         uint16_t type = file.read_u16();
         first=last=0;
         LLAMA_LOG_INFO("read memory type %u\n", type);
         if( type == 1 ) {
-            m = (System_memory*)pool_alloc(sizeof(System_memory));
-            new (m) System_memory;
-            m->prepare();
-            m->readfile(file);
+            m = store->readfile(file);
             is_full = false;
             is_active = false;
         } else if( type == 2 ) {
@@ -4121,11 +5311,7 @@ typedef struct kv_mem {
 
     void release(bool release_contents=true)
     {
-        if( m != NULL && release_contents ) {
-            m->release();
-            pool_free(m);
-        }
-        m=NULL;
+        m=NULL; // rows belong to the actor's Memory_store
         if( e != NULL && release_contents ) {
             e->release();
             pool_free(e);
@@ -4138,6 +5324,7 @@ typedef struct kv_mem {
 Kv_mem *new_kv_mem( void );
 Kv_mem *new_kv_mem( System_memory *memory );
 Kv_mem *new_kv_mem( System_eidet *memory );
+void free_kv_mem( Kv_mem *m, bool release_contents=true );
 
 void llama_backup_file( const char *filepath )
 {
@@ -4199,7 +5386,7 @@ void llama_backup_file( const char *filepath )
     _unlink(filepath);
     */
 }
-void loadmemories( const char *filepath, std::vector<Kv_mem*> &mems )
+void loadmemories( const char *filepath, std::vector<Kv_mem*> &mems, Memory_store *store )
 {
     llama_file datafile(filepath, "rb");
     Kv_mem *m;
@@ -4216,7 +5403,7 @@ void loadmemories( const char *filepath, std::vector<Kv_mem*> &mems )
     LLAMA_LOG_INFO("%s: load %zu entries.\n", __func__, count);
     while( count > 0 ) {
         m = new_kv_mem();
-        m->readfile(datafile);
+        m->readfile(datafile, store);
         mems.push_back(m);
         count--;
     }
@@ -4251,6 +5438,11 @@ struct system_actor {
     bool rags_changed=false;
     std::vector<Kv_mem *> history; // things you have seen happen long ago (used for pulling RAG)
     std::vector<Kv_mem *> recent; // things you have seen happen recently
+    std::vector<Kv_mem *> journal; // history entries not yet appended to the .hst file
+    Memory_store store; // the partial memories in all of the above
+
+    int64_t t_load_us=0; // last loadfile/savefile, for llama_print_timings
+    int64_t t_save_us=0;
 
     // idioms;
     //
@@ -4263,12 +5455,15 @@ struct system_actor {
         new (&rags) std::vector<Kv_mem *>;
         new (&history) std::vector<Kv_mem *>; // things you have seen happen long ago (used for pulling RAG)
         new (&recent) std::vector<Kv_mem *>;
+        new (&journal) std::vector<Kv_mem *>;
         new (&keys) std::unordered_map<std::string, Kv_mem*>;
         new (&ragged) std::set<std::string>;
+        new (&store) Memory_store;
         new (&name) std::string;
         mine=NULL;
         self=NULL;
         self_changed=rags_changed=mem_changed=false;
+        t_load_us=t_save_us=0;
     }
 
     void release()
@@ -4278,47 +5473,78 @@ struct system_actor {
 
         for( i = mem.begin(); i != mem.end(); i++ ) {
             m = *i;
-            m->release();
+            free_kv_mem(m);
         }
         mem.clear();
 
         for( i = history.begin(); i != history.end(); i++ ) {
             m = *i;
-            m->release();
+            free_kv_mem(m);
         }
         history.clear();
+        journal.clear(); // entries also live in history
 
         for( i = recent.begin(); i != recent.end(); i++ ) {
             m = *i;
-            m->release();
+            free_kv_mem(m);
         }
         recent.clear();
 
         for( i = rags.begin(); i != rags.end(); i++ ) {
             m = *i;
-            m->release();
+            free_kv_mem(m);
         }
         rags.clear();
         ragged.clear();
 
         if( mine != NULL ) {
-            mine->release();
+            free_kv_mem(mine);
             mine = NULL;
         }
+        store.clear();
     }
 
-    void appendhist(Kv_mem *m)
+    // Append n serialized history entries to the .hst file in one write and update the entry
+    // count at its head.
+    void appendhist( const std::string &entries, uint32_t n )
     {
-        char *datapath = (char*) pool_alloc(name.length() + 10);
-        strcpy(datapath, "char\\");
-        strcat(datapath, name.c_str());
-        strcat(datapath, ".hst");
+        if( n == 0 ) return;
 
-        llama_file datafile(datapath, "ab");
-        m->writefile(datafile);
+        std::string datapath = "char\\" + name + ".hst";
+        {
+            llama_file datafile(datapath.c_str(), "r+b");
+            if( datafile.fp != NULL && datafile.size >= sizeof(uint32_t) ) {
+                uint32_t count = datafile.read_u32();
+                datafile.seek(0, SEEK_END);
+                datafile.write_raw(entries.data(), entries.size());
+                datafile.seek(0, SEEK_SET);
+                datafile.write_u32(count + n);
+                datafile.close();
+                return;
+            }
+        }
+        llama_file datafile(datapath.c_str(), "wb");
+        datafile.write_u32(n);
+        datafile.write_raw(entries.data(), entries.size());
         datafile.close();
     }
 
+    // Append the pending history entries to the .hst file.
+    // Runs from idle maintenance, inline once LLAMA_JOURNAL_MAX entries are waiting, and for every
+    // actor when the session closes (System_kb::flushjournals). savefile writes all of history,
+    // so a save or unload takes the journal with it.
+    void flushjournal(void)
+    {
+        if( journal.empty() ) return;
+
+        std::string entries;
+        for( Kv_mem *m : journal ) {
+            m->m->serialize(entries); // addhist only journals partial memories
+        }
+        appendhist(entries, (uint32_t)journal.size());
+        journal.clear();
+    }
+
     Kv_mem *addrecent(System_eidet *m)
     {
         LLAMA_LOG_INFO("Add recent eidet %s (%zu tokens)\n", m->what.c_str(), m->n_tokens);
@@ -4328,7 +5554,7 @@ struct system_actor {
     }
     Kv_mem *addrecent(System_memory *m)
     {
-        LLAMA_LOG_INFO("Add recent memory %s\n", m->what.c_str());
+        LLAMA_LOG_INFO("Add recent memory %s\n", m->what().c_str());
         Kv_mem *mem = new_kv_mem(m);
         recent.push_back(mem);
         return mem;
@@ -4337,7 +5563,10 @@ struct system_actor {
     {
         Kv_mem *m = new_kv_mem(hist);
         history.push_back(m);
-        appendhist(m);
+        journal.push_back(m);
+        if( journal.size() >= LLAMA_JOURNAL_MAX ) {
+            flushjournal();
+        }
 
         return m;
     }
@@ -4345,7 +5574,7 @@ struct system_actor {
     {
         Kv_mem *mem = new_kv_mem(rag);
         rags.push_back(mem);
-        ragged.insert( rag->what );
+        ragged.insert( rag->what() );
         return mem;
     }
     Kv_mem *addmem(System_eidet *m)
@@ -4357,6 +5586,7 @@ struct system_actor {
 
     void loadfile(void)
     {
+        const int64_t t_start_us = ggml_time_us();
         LLAMA_LOG_INFO("%s: start\n", __func__);
         char *rootpath = (char*) pool_alloc(name.length() + 6);
         strcpy(rootpath, "char\\");
@@ -4393,17 +5623,19 @@ struct system_actor {
             playerfile.close();
         }
 
-        loadmemories(ragpath, rags);
-        loadmemories(mempath, mem);
-        loadmemories(hstpath, history);
-        loadmemories(rctpath, recent);
+        loadmemories(ragpath, rags, &store);
+        loadmemories(mempath, mem, &store);
+        loadmemories(hstpath, history, &store);
+        loadmemories(rctpath, recent, &store);
 
+        t_load_us = ggml_time_us() - t_start_us;
         LLAMA_LOG_INFO("%s: load complete.\n", __func__);
 
         self_changed=rags_changed=mem_changed=false; // these refer to the on-disk details
     }
     void savefile()
     {
+        const int64_t t_start_us = ggml_time_us();
         char *rootpath = (char*) pool_alloc(name.length() + 6);
         strcpy(rootpath, "char\\");
         strcat(rootpath, name.c_str());
@@ -4439,6 +5671,7 @@ struct system_actor {
 
         llama_backup_file(datapath);
         savememories(datapath, history);
+        journal.clear(); // its entries were in history
 
         char *recpath = (char*) pool_alloc(name.length() + 10);
         strcpy(recpath, "char\\");
@@ -4447,6 +5680,8 @@ struct system_actor {
 
         llama_backup_file(recpath);
         savememories(recpath, recent);
+
+        t_save_us = ggml_time_us() - t_start_us;
     }
 
 
@@ -4502,7 +5737,7 @@ struct system_actor {
             } else {
                 me = new_kv_mem(src->m);
                 me->first = token;
-                token += src->m->n_tokens;
+                token += src->m->n_tokens();
                 me->last = token - 1;
             }
             if( src->is_active && me->is_full && me->first == src->first ) {
@@ -4543,8 +5778,8 @@ struct system_actor {
                 token += src->e->n_tokens;
                 me = new_kv_mem(src->e);
             } else {
-                if( token+src->m->n_tokens > use_space ) break;
-                token += src->m->n_tokens;
+                if( token+src->m->n_tokens() > use_space ) break;
+                token += src->m->n_tokens();
                 me = new_kv_mem(src->m);
             }
             new_to_old[me] = src;
@@ -4561,13 +5796,10 @@ struct system_actor {
             LLAMA_LOG_INFO("Move %d recent entries to history.\n", (it+1));
         while( it >= 0 ) { // move overflow to history
             src = recent[it];
-            me = new_kv_mem((System_memory*)pool_alloc(sizeof(System_memory)));
-            new (me->m) System_memory;
-            me->m->prepare();
             if( src->is_full ) {
-                me->m->build( src->e->who, src->e->what );
+                me = new_kv_mem( store.add( src->e->who, src->e->what ) );
             } else {
-                me->m->build( src->m->who, src->m->what );
+                me = new_kv_mem( store.readd( src->m, (int64_t)std::time(0) ) );
             }
             me->is_active = false;
             history.insert(history.begin() + itBound2, me);
@@ -4577,7 +5809,6 @@ struct system_actor {
             it--;
         }
 
-        char buf[60];
         token = token_cpy; // final token count & organize results:
         for( it = itBoundary; it < res->size(); it++ ) {
             me = res->at(it);
@@ -4587,12 +5818,9 @@ struct system_actor {
             if( me->is_full )
                 token += src->e->n_tokens;
             else
-                token += src->m->n_tokens;
+                token += src->m->n_tokens();
             me->last = token==0?0:token-1;
-
-            strncpy(buf, me->e->what.c_str(), 50);
-            buf[ me->e->what.length() < 50 ? me->e->what.length() : 50 ] = '\0';
-            //LLAMA_LOG_INFO("%s: set token start %u-end %u for %s message %s\n", __func__, me->first, me->last, me->is_full?"(full)":"(partial)", buf);
+            //LLAMA_LOG_INFO("%s: set token start %u-end %u for %s message\n", __func__, me->first, me->last, me->is_full?"(full)":"(partial)");
 
             if( src->is_full && src->is_active && me->first == src->first ) {
                 me->is_active=true;
@@ -4699,7 +5927,8 @@ struct llama_context {
     llama_context(llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {
         //memset( kv_self->inuse, 0, 512 );
     }
-    struct llama_kv_cache *kv_self;
+    struct llama_kv_cache *kv_self = nullptr;
+    System_kb *kb = nullptr; // this session's actors and KV slots
     ~llama_context() {
         LLAMA_LOG_INFO("%s: eliminate %p\n", __func__, this);
 
@@ -4726,6 +5955,7 @@ struct llama_context {
     int seq_end=0;
 
     std::vector<ggml_backend *> backends;
+    std::vector<ggml_backend_buffer_type_t> backend_buft; // compute buffer type per backend
 #ifdef GGML_USE_METAL
     ggml_backend_t backend_metal = nullptr;
 #endif
@@ -4753,6 +5983,40 @@ struct llama_context {
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
+    int64_t t_graph_us    = 0; // time spent building graphs in llama_decode_internal
+    int32_t n_graph_build = 0;
+    int32_t n_graph_reuse = 0;
+    bool graph_reuse = true; // off only to check the reused graph against fresh builds (llama_bench_decode_graph)
+
+    // n_kv the next graph is built for and its inputs are laid out with (0 = seq_end + n_tokens)
+    int32_t n_kv_graph = 0;
+
+    // single-token decode graph. it lives in buf_compute_meta, so everything that ggml_inits that
+    // buffer (graph builds, the usemap and shift_rev shufflers) must clear gf first;
+    // between builds it is reused by moving the kv store views to the new head.
+    struct {
+        ggml_cgraph * gf = nullptr;
+        llama_kv_cache * kv = nullptr;
+        int record_all = 0;
+        int32_t n_kv = 0;
+        int32_t kv_head = 0;
+        struct ggml_tensor * res = nullptr;
+        struct ggml_tensor * embd = nullptr;
+        struct ggml_tensor * out_embds = nullptr;
+        std::vector<std::pair<struct ggml_tensor *, size_t>> stores; // kv views written at kv_head, bytes per cell
+        std::vector<void *> store_base;   // their view_src data when kept
+        std::vector<size_t> buffer_size;  // compute buffer per backend when kept; a regrown buffer moves every node
+    } tg_graph;
+
+    // idle maintenance: llama_idle_work runs one step at a time under idle_mutex and stops as soon
+    // as a foreground call takes a hold
+    std::mutex idle_mutex;
+    std::atomic<int32_t>  idle_holds{0};
+    std::atomic<int64_t>  idle_last_us{0};    // last llama_idle_release
+    std::atomic<uint64_t> idle_releases{0};
+    uint64_t idle_compacted_at = UINT64_MAX; // idle_releases when the pool last had nothing to merge
+    llama_idle_stats idle_stats = {};        // under idle_mutex
+
     std::vector<float> logits;
 #ifndef NDEBUG
     // guard against access to unset logits
@@ -4792,11 +6056,43 @@ struct llama_context {
 void prepare_kv_cache(struct llama_context *ctx, int n_ctx, int n_batch);
 
 typedef struct system_kb System_kb;
+// times one llama_stage into kb's metrics, on behalf of actor a (may be NULL)
+struct llama_stage_timer {
+    System_kb *kb;
+    int stage;
+    System_actor *a;
+    int64_t t_start_us;
+    llama_stage_timer( System_kb *kb, int stage, System_actor *a ) : kb(kb), stage(stage), a(a), t_start_us(ggml_time_us()) {}
+    ~llama_stage_timer();
+};
+
+static void llama_stage_add( llama_stage_metric &m, int64_t t_us )
+{
+    uint64_t us = std::max<int64_t>(t_us, 0);
+    int b = 0;
+    while( b < LLAMA_STAGE_BUCKETS-1 && (1ull << b) <= us ) b++;
+    m.count++;
+    m.total_us += us;
+    m.max_us = std::max(m.max_us, us);
+    m.buckets[b]++;
+}
+
 struct system_kb {
     std::vector<System_actor*> actors;
     std::unordered_map<std::string, System_actor*> players;
     std::unordered_map<std::string, std::vector<System_memory*> *> ragwordmap;
-    std::vector<Kv_mem*> allmessages;
+    // Kv_mem arena: entries are carved from chunks and go back on an intrusive free list
+    std::vector<Kv_mem*> mem_chunks;
+    Kv_mem *mem_free = NULL;
+    size_t mem_live = 0;
+    size_t mem_peak = 0;
+    std::mutex mem_mutex; // getmem is reached from the pool while actors load in parallel
+    // llama_metrics_*: stage latency for the session and per actor name, total and this turn
+    llama_stage_metrics metrics;
+    llama_stage_metrics metrics_turn;
+    std::unordered_map<std::string, std::pair<llama_stage_metrics, llama_stage_metrics>> metrics_actor;
+    std::mutex metrics_mutex; // decode steps may record from the scheduler thread
+    bool ragwords_dirty = false; // ragwordmap may still point into a released actor's history
     struct llama_kv_cache kv[3];
 
     std::string writinguser;
@@ -4812,6 +6108,19 @@ struct system_kb {
     int16_t gen_prev[3] = {0, 0, 0};
     std::string gen_str_so_far[3];
 
+    ggml_type type_k = GGML_TYPE_F16; // actor caches may quantize K; V is transposed and stays f16
+
+    uint16_t extent_min = LLAMA_KV_EXTENT_MIN;
+    uint16_t extent_max = LLAMA_KV_EXTENT_MAX;
+    uint32_t extent_cap = LLAMA_KV_EXTENT_MAX; // width of the context's KQ mask
+    uint32_t n_reserve_rebuild[3] = {0,0,0}; // processtokens ran out of room and rebuilt the map
+    uint32_t n_kv_resize[3] = {0,0,0};
+
+    // token ranges [first,end) written to each slot since the last scene or checkpoint
+    std::vector<std::pair<uint32_t,uint32_t>> kv_touched[3];
+    uint32_t scene_size[3] = {0,0,0}; // slot sizes as of the last scene or checkpoint
+    uint64_t scene_serial = 0;        // id of that scene or checkpoint, 0 if none
+
     /*
     std::vector<int> gen_tokens_so_far[3];
     std::vector<ggml_fp16_t> gen_k_so_far[3][32];
@@ -4825,7 +6134,16 @@ struct system_kb {
         new (&ragwordmap) std::unordered_map<std::string, std::vector<Kv_mem*>> ;
         new (&active_actor) std::string;
         active_actor = "System";
-        new (&allmessages) std::vector<Kv_mem*>;
+        new (&mem_chunks) std::vector<Kv_mem*>;
+        mem_free = NULL;
+        mem_live = mem_peak = 0;
+        new (&mem_mutex) std::mutex;
+        memset(&metrics, 0, sizeof(metrics));
+        memset(&metrics_turn, 0, sizeof(metrics_turn));
+        new (&metrics_actor) std::unordered_map<std::string, std::pair<llama_stage_metrics, llama_stage_metrics>>;
+        new (&metrics_mutex) std::mutex;
+        current_kv = 0;
+        ragwords_dirty = false;
 
         for( int i=0; i<3; i++ ) {
             new (&(kv[i])) struct llama_kv_cache;
@@ -4835,10 +6153,14 @@ struct system_kb {
             kvmap[i] = NULL;
             kvuser[i] = NULL;
             kv_ready[i] = false;
+            n_reserve_rebuild[i] = n_kv_resize[i] = 0;
             gen_mark[i] = seq_mark[i] = -1;
             gen_prev[i] = 0;
             new (&gen_str_so_far[i]) std::string;
             gen_str_so_far[i] = "";
+            new (&kv_touched[i]) std::vector<std::pair<uint32_t,uint32_t>>;
+            scene_size[i] = 0;
+            slot_batch[i] = llama_batch{};
             /*
             for( int j=0; j<32; j++ ) {
                 new (&gen_k_so_far[i][j]) std::vector<ggml_fp16_t>;
@@ -4848,10 +6170,28 @@ struct system_kb {
             */
         }
         new (&writinguser) std::string;
+        scene_serial = 0;
 
         writinguser = "";
         LLAMA_LOG_INFO("%s: prepared system_kb\n", __func__);
     }
+    void touch( int kvno, uint32_t first, uint32_t n )
+    {
+        if( n == 0 ) return;
+        std::vector<std::pair<uint32_t,uint32_t>> &t = kv_touched[kvno];
+        if( !t.empty() && first <= t.back().second && first + n >= t.back().first ) {
+            t.back().first = std::min(t.back().first, first);
+            t.back().second = std::max(t.back().second, first + n);
+            return;
+        }
+        t.emplace_back(first, first + n);
+    }
+    void touch_kv( const struct llama_kv_cache *cache, uint32_t first, uint32_t n )
+    {
+        for( int i=0; i<3; i++ ) {
+            if( cache == &kv[i] ) touch(i, first, n);
+        }
+    }
     void mark_rewind(void)
     {
         for( int i=0; i<3; i++ ) {
@@ -4930,11 +6270,7 @@ struct system_kb {
                 } else {
                     processtokens(writinguser, message, tokens, false, tokens.size());
                     /*
-                    System_memory *m = (System_memory*)pool_alloc(sizeof(System_memory));
-                    new (m) System_memory;
-                    m->prepare();
-                    m->build(writinguser, message);
-                    mem = kvuser[i]->addrecent(m);
+                    mem = kvuser[i]->addrecent( kvuser[i]->store.add(writinguser, message) );
                     processtokens_inplace(i, mem); //! todo: we may not need this.
                     */
                 }
@@ -4954,12 +6290,8 @@ struct system_kb {
             if( messaged.contains( *it ) ) continue;
 
             System_actor *a = *it;
-            System_memory *m = (System_memory*)pool_alloc(sizeof(System_memory));
-            new (m) System_memory;
-            m->prepare();
-            m->build(writinguser, message);
             LLAMA_LOG_INFO("store message for %s: %s\n", a->name.c_str(), message.c_str());
-            a->addrecent(m);
+            a->addrecent( a->store.add(writinguser, message) );
         }
 
         writinguser = "";
@@ -4981,44 +6313,86 @@ struct system_kb {
 
     Kv_mem *getmem(void)
     {
-        Kv_mem *memitem = (Kv_mem*)pool_alloc(sizeof(Kv_mem));
-        new (memitem) Kv_mem;
+        std::lock_guard<std::mutex> guard(mem_mutex);
+        if( !mem_free ) {
+            Kv_mem *chunk = (Kv_mem*)pool_alloc(sizeof(Kv_mem) * LLAMA_KV_MEM_CHUNK);
+            for( int i=LLAMA_KV_MEM_CHUNK-1; i>=0; i-- ) {
+                new (&chunk[i]) Kv_mem;
+                chunk[i].next_free = mem_free;
+                mem_free = &chunk[i];
+            }
+            mem_chunks.push_back(chunk);
+        }
+        Kv_mem *memitem = mem_free;
+        mem_free = memitem->next_free;
         memitem->prepare();
-        allmessages.push_back(memitem);
+        memitem->next_free = NULL;
+        memitem->generation++;
+        mem_live++;
+        mem_peak = std::max(mem_peak, mem_live);
         return memitem;
     }
     void freemem(Kv_mem *memitem, bool withmem)
     {
-        std::vector<Kv_mem*>::iterator it;
-        for( it = allmessages.begin(); it != allmessages.end(); it++ ) {
-            if( *it == memitem ) {
-                allmessages.erase(it);
-                break;
-            }
+        if( !memitem ) return;
+        if( memitem->generation % 2 == 0 ) {
+            LLAMA_LOG_ERROR("%s: %p was already freed\n", __func__, (void*)memitem);
+            return;
         }
         memitem->release(withmem);
-        pool_free(memitem);
+        std::lock_guard<std::mutex> guard(mem_mutex);
+        memitem->generation++;
+        memitem->next_free = mem_free;
+        mem_free = memitem;
+        mem_live--;
     }
     void freemems(std::set<Kv_mem *>items, bool withmem)
     {
-        size_t it;
-        Kv_mem *memitem;
+        for( Kv_mem *memitem : items ) {
+            freemem(memitem, withmem);
+        }
+    }
+    void record_stage( int stage, const char *actor, int64_t t_us )
+    {
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        llama_stage_add(metrics.stage[stage], t_us);
+        llama_stage_add(metrics_turn.stage[stage], t_us);
+        if( actor ) {
+            auto &am = metrics_actor.try_emplace(actor).first->second;
+            llama_stage_add(am.first.stage[stage], t_us);
+            llama_stage_add(am.second.stage[stage], t_us);
+        }
+    }
+    void record_stage( int stage, System_actor *a, int64_t t_us )
+    {
+        record_stage(stage, a ? a->name.c_str() : NULL, t_us);
+    }
 
-        for( it = 0; it < allmessages.size(); it++ ) {
-            if( items.contains(allmessages[it]) ) {
-                memitem = allmessages[it];
-                allmessages.erase(allmessages.begin() + it);
-                it--;
-                memitem->release(withmem);
-                pool_free(memitem);
-            }
+    // a map built by build_map1/build_map2: its entries are copies, the memories stay with the actor
+    void freemap(std::vector<Kv_mem*> *map)
+    {
+        if( !map ) return;
+        for( Kv_mem *eid : *map ) {
+            freemem(eid, false);
         }
+        map->~vector();
+        pool_free(map);
     }
 
     llama_hparams           hparams;
 
     std::string active_actor;
-    int n_batch = 64;
+    int n_batch = LLAMA_PROMPT_BATCH_DEFAULT;
+    // one per slot so processtokens doesn't allocate per batch; sized to the context's n_batch
+    llama_batch slot_batch[3];
+
+    llama_batch &slotbatch( int kvno )
+    {
+        if( !slot_batch[kvno].token ) {
+            slot_batch[kvno] = llama_batch_init( (int32_t)current_context->cparams.n_batch, 0, 1 );
+        }
+        return slot_batch[kvno];
+    }
 
     // save all actors' current data
     void saveall(void)
@@ -5027,11 +6401,16 @@ struct system_kb {
         System_actor *a;
 
         LLAMA_LOG_INFO("Saving all...\n");
-        for( it = actors.begin(); it != actors.end(); it++ ) {
-            a = *it;
-            a->savefile();
-        }
-        LLAMA_LOG_INFO("Save complete.\n");
+        const int64_t t_start_us = ggml_time_us();
+        System_kb *kb = this;
+        // every actor writes its own files, so they can all be written at once
+        llama_parallel_for( (int32_t)actors.size(), [kb](int32_t i) {
+            System_kb *prev = current_kb;
+            current_kb = kb;
+            kb->actors[i]->savefile();
+            current_kb = prev;
+        });
+        LLAMA_LOG_INFO("Save complete (%zu actors, %.2f ms).\n", actors.size(), (ggml_time_us() - t_start_us) / 1000.0);
     }
     void unload( std::string actor )
     {
@@ -5040,6 +6419,7 @@ struct system_kb {
             System_actor *a = players[actor];
             a->savefile();
             a->release();
+            ragwords_dirty = true;
             players.erase(actor);
             std::vector<System_actor*>::iterator it;
             for( it = actors.begin(); it != actors.end(); it++ ) {
@@ -5052,36 +6432,96 @@ struct system_kb {
         }
     }
 
+    // Write out the history entries still waiting for idle time, before the session lets go of them.
+    void flushjournals()
+    {
+        System_kb *prev = current_kb;
+        current_kb = this;
+        for( System_actor *a : actors ) {
+            a->flushjournal();
+        }
+        current_kb = prev;
+    }
+
     void release()
     {
         int i;
-        Kv_mem *mem;
-        Kv_mem *eid;
-
         System_actor *actor;
+        System_kb *prev = current_kb;
+        current_kb = this; // the actors hand their Kv_mem entries back through current_kb
 
         std::vector<System_actor*>::iterator itActor;
-        std::vector<Kv_mem*>::iterator itMap;
 
         for( i=0; i<3; i++ ) {
             if( kv_ready[i] ) kv_ready[i]=false;
-            if( kvmap[i] != NULL ) {
-                for( itMap = kvmap[i]->begin(); itMap != kvmap[i]->end(); itMap++ ) {
-                    eid = *itMap;
-                    eid->release(false);
-                    pool_free(eid);
-                }
-                delete kvmap[i];
-                kvmap[i] = NULL;
-            }
+            freemap(kvmap[i]);
+            kvmap[i] = NULL;
             if( kvuser[i] != NULL )
                 kvuser[i] = NULL;
+            if( slot_batch[i].token ) {
+                llama_batch_free(slot_batch[i]);
+                slot_batch[i] = llama_batch{};
+            }
         }
         for( itActor = actors.begin(); itActor != actors.end(); itActor++ ) {
             actor = *itActor;
             actor->release();
             pool_free(actor);
         }
+
+        for( Kv_mem *chunk : mem_chunks ) {
+            pool_free(chunk);
+        }
+        mem_chunks.clear();
+        mem_free = NULL;
+        mem_live = 0;
+        current_kb = prev;
+    }
+
+    // allocate slot n at its fitted extent, or the default one (1024 for System, extent_max otherwise)
+    void allocslot( int n )
+    {
+        int n_ctx = kv_extent[n];
+        if( n_ctx == 0 ) n_ctx = n==0?1024:extent_max;
+
+        kv_extent[n] = n_ctx;
+        kv[n].prepare();
+
+        current_context->kv_self = &(kv[n]);
+        current_context->cparams.n_ctx = kv_extent[n];
+
+        if (!llama_kv_cache_init((kv[n]), *current_model,
+                type_k, GGML_TYPE_F16, kv_context*n_ctx,
+                true)) {
+            LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
+            throw "Could not allocate kv cache.";
+        }
+
+        current_context->kv_self = &(kv[n]);
+        prepare_kv_cache(current_context, n_ctx, n_batch);
+        touch(n, 0, kv[n].size);
+        LLAMA_LOG_INFO("%s: prepared kv %d\n", __func__, n);
+
+        seq_start[n] = 0;
+
+        size_t memory_size_k = 0;
+        size_t memory_size_v = 0;
+
+        for (auto & k : kv[n].k_l) {
+            memory_size_k += ggml_nbytes(k);
+        }
+        for (auto & v : kv[n].v_l) {
+            memory_size_v += ggml_nbytes(v);
+        }
+
+        LLAMA_LOG_INFO("%s: KV[%d] self size  = %7.2f MiB, K (%s): %7.2f MiB, V (f16): %7.2f MiB\n", __func__,
+                       n,
+            (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
+            ggml_type_name(type_k),
+            (float)memory_size_k / (1024.0f * 1024.0f),
+            (float)memory_size_v / (1024.0f * 1024.0f));
+
+        kv_ready[n] = true;
     }
 
     struct llama_kv_cache *usekv( int kvno )
@@ -5096,56 +6536,88 @@ struct system_kb {
         //LLAMA_LOG_INFO("%s: use kv %d (actor %s)\n", __func__, kvno, kvuser[kvno]->name.c_str());
 
         if( !kv_ready[kvno] ) {
-            int n = kvno;
-            int n_ctx = n==0?1024:4096;
+            allocslot(kvno);
+        } else {
+            current_context->kv_self = &(kv[kvno]);
+            current_context->cparams.n_ctx = kv_extent[kvno];
+        }
+        current_context->seq_end = seq_start[kvno];
 
-            kv_extent[n] = n_ctx;
-            kv[n].prepare();
+        return &kv[kvno];
+    }
 
-            current_context->kv_self = &(kv[n]);
-            current_context->cparams.n_ctx = kv_extent[n];
+    // tokens the actor's map wants resident: self + mem + rags + recent
+    uint32_t working_set( System_actor *a )
+    {
+        std::vector<Kv_mem*>::iterator it;
+        uint32_t n_tokens = 0;
 
-            if (!llama_kv_cache_init((kv[n]), *current_model,
-                    GGML_TYPE_F16, GGML_TYPE_F16, kv_context*n_ctx,
-                    true)) {
-                LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
-                throw "Could not allocate kv cache.";
-            }
+        if( a->mine ) n_tokens += a->mine->e->n_tokens;
+        for( it = a->mem.begin(); it != a->mem.end(); it++ ) {
+            n_tokens += (*it)->e->n_tokens;
+        }
+        for( it = a->rags.begin(); it != a->rags.end(); it++ ) {
+            n_tokens += (*it)->is_full ? (*it)->e->n_tokens : (*it)->m->n_tokens();
+        }
+        for( it = a->recent.begin(); it != a->recent.end(); it++ ) {
+            n_tokens += (*it)->is_full ? (*it)->e->n_tokens : (*it)->m->n_tokens();
+        }
+        return n_tokens;
+    }
 
-            current_context->kv_self = &(kv[n]);
-            prepare_kv_cache(current_context, n_ctx, n_batch);
-            LLAMA_LOG_INFO("%s: prepared kv %d\n", __func__, n);
+    // space kept free at the end of a slot for the next few batches
+    uint16_t reserve_for( uint16_t extent )
+    {
+        return std::clamp<uint16_t>( extent/16, 32, 256 );
+    }
 
-            seq_start[n] = 0;
+    uint16_t pick_extent( int kvno, System_actor *a )
+    {
+        uint16_t lo = kvno==0 ? std::min<uint16_t>(1024, extent_max) : extent_min; // System answers queries, keep its old floor
+        uint32_t want = working_set(a);
+        want += want/4 + 2*LLAMA_KV_EXTENT_STEP;
+        want = ( (want + LLAMA_KV_EXTENT_STEP-1) / LLAMA_KV_EXTENT_STEP ) * LLAMA_KV_EXTENT_STEP;
+        return (uint16_t)std::clamp<uint32_t>( want, std::max(lo, extent_min), extent_max );
+    }
 
-            size_t memory_size_k = 0;
-            size_t memory_size_v = 0;
+    // grow a slot whenever the working set outgrows it, shrink once it is using less than half.
+    // only the slot's own buffers are reallocated; the map is rebuilt from scratch afterwards.
+    void fit_extent( int kvno, System_actor *a, bool rebuilding )
+    {
+        uint16_t want = pick_extent(kvno, a);
+        LLAMA_TRACE_SCOPE(LLAMA_TRACE_FIT_EXTENT, want);
 
-            for (auto & k : kv[n].k_l) {
-                memory_size_k += ggml_nbytes(k);
-            }
-            for (auto & v : kv[n].v_l) {
-                memory_size_v += ggml_nbytes(v);
-            }
+        if( !kv_ready[kvno] ) {
+            kv_extent[kvno] = want;
+            return;
+        }
+        if( want <= kv_extent[kvno] && want*2 > kv_extent[kvno] ) return;
+        if( !rebuilding && ( gen_mark[kvno] != -1 || seq_mark[kvno] != -1 ) ) return; // don't drop tokens we may rewind into
 
-            LLAMA_LOG_INFO("%s: KV[%d] self size  = %7.2f MiB, K (f16): %7.2f MiB, V (f16): %7.2f MiB\n", __func__,
-                           n,
-                (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                (float)memory_size_k / (1024.0f * 1024.0f),
-                (float)memory_size_v / (1024.0f * 1024.0f));
+        LLAMA_LOG_INFO("%s: kv %d extent %u -> %u (%s, working set %u)\n", __func__, kvno,
+                       kv_extent[kvno], want, a->name.c_str(), working_set(a));
 
-            kv_ready[n] = true;
-        } else {
-            current_context->kv_self = &(kv[kvno]);
-            current_context->cparams.n_ctx = kv_extent[kvno];
-        }
-        current_context->seq_end = seq_start[kvno];
+        kv[kvno].free_buffers();
+        kv_ready[kvno] = false;
+        kv_extent[kvno] = want;
+        n_kv_resize[kvno]++;
 
-        return &kv[kvno];
+        freemap(kvmap[kvno]);
+        kvmap[kvno] = NULL;
+        if( kvuser[kvno] ) {
+            System_actor *u = kvuser[kvno];
+            std::vector<Kv_mem*>::iterator it;
+            if( u->mine ) u->mine->is_active = false;
+            for( it = u->mem.begin(); it != u->mem.end(); it++ ) (*it)->is_active = false;
+            for( it = u->rags.begin(); it != u->rags.end(); it++ ) (*it)->is_active = false;
+            for( it = u->recent.begin(); it != u->recent.end(); it++ ) (*it)->is_active = false;
+        }
     }
 
     void usemap( int kvno, std::vector<Kv_mem*> *map, bool finalize )
     {
+        LLAMA_TRACE_SCOPE(LLAMA_TRACE_USEMAP, kvno);
+        llama_stage_timer stage_timer(this, LLAMA_STAGE_USEMAP, kvuser[kvno]);
         std::vector<Kv_mem*>::iterator it, it1, it2;
         Kv_mem *e1, *e2, *eid;
         uint16_t n_tokens=0;
@@ -5267,7 +6739,8 @@ struct system_kb {
         }
 
         //LLAMA_LOG_INFO("%s: prepare llm for shift\n", __func__);
-        Org_context llm(&kv[kvno], current_context->buf_compute_meta, current_context->sched, hparams);
+        Org_context llm(&kv[kvno], current_context->buf_compute_meta, current_context->sched, hparams,
+                        current_context->backend_cpu, current_context->cparams.n_threads_batch);
         bool initialized=false;
         // shuffle memories that can be moved
         n_tokens=0;
@@ -5278,11 +6751,13 @@ struct system_kb {
                 e1 = new_to_old[eid];
                 if( e1->first != eid->first ) {
                     if( !initialized ) {
+                        current_context->tg_graph.gf = nullptr; // about to overwrite buf_compute_meta
                         llm.init();
                         initialized=true;
                     }
                     int delta = (int)eid->first - (int)e1->first;
                     llm.shuffle_kv( e1->first, e1->last, delta );
+                    touch(kvno, eid->first, eid->last + 1 - eid->first);
                 }
             }
         }
@@ -5315,10 +6790,12 @@ struct system_kb {
                     wrote=true;
                 }
                 eid->e->write(&(kv[kvno]), eid->first);
+                touch(kvno, eid->first, eid->last + 1 - eid->first);
                 entry_count++;
             }
         }
         if( wrote ) {
+            llama_stage_timer stage_timer(this, LLAMA_STAGE_PREFIT_WRITE, kvuser[kvno]);
             kv[kvno].prefit_write();
             LLAMA_LOG_INFO("%s(%s): write complete, %d entries\n", __func__, quick_ts().c_str(), entry_count);
         }
@@ -5342,6 +6819,7 @@ struct system_kb {
 
         if( finalize ) {
             LLAMA_LOG_INFO("%s(%s): finalize (transfer map)\n", __func__, quick_ts().c_str());
+            if( prev != map ) freemap(prev);
             kvmap[kvno] = map;
         }
         if( map->size() == 0 ) { // reset n_tokens... the previous methods skip over counting some entries
@@ -5360,8 +6838,10 @@ struct system_kb {
     uint8_t useactor( std::string actorname, bool quadruple_space=false )
     {
         System_actor *a = getactor(actorname);
+        llama_stage_timer stage_timer(this, LLAMA_STAGE_USEACTOR, a);
         bool is_system_user = ( actorname == "System" );
         uint8_t tgt_kv;
+        System_actor *prev_user[3] = { kvuser[0], kvuser[1], kvuser[2] };
 
         if( is_system_user ) {
             tgt_kv=0;
@@ -5382,13 +6862,15 @@ struct system_kb {
         }
         //if( current_kv == tgt_kv ) return seq_start[tgt_kv];
         LLAMA_LOG_INFO("%s: pick %s for %d\n", __func__, actorname.c_str(), tgt_kv);
+        llama_stage_timer switch_timer(prev_user[tgt_kv] != a ? this : NULL, LLAMA_STAGE_KV_SWITCH, a);
 
-        uint16_t reserve_space=64;
+        fit_extent(tgt_kv, a, quadruple_space);
         usekv(tgt_kv);
 
+        uint16_t reserve_space = reserve_for(kv[tgt_kv].size);
         uint16_t use_space = kv[tgt_kv].size - reserve_space;
         if( quadruple_space ) use_space -= 3*reserve_space;
-        use_space-=64; // extra tokens in case of additions or queries
+        use_space -= reserve_space; // extra tokens in case of additions or queries
         uint16_t pad_space = 0;
         System_eidet *pad_eidet=NULL;
 
@@ -5416,43 +6898,32 @@ struct system_kb {
         }*/
 
         // add to ragwordmap if memories were cycled
-        std::string srch;
-        std::vector<System_memory*>::iterator it;
-        for( it = new_histories->begin(); it != new_histories->end(); it++ ) {
-            System_memory *m = *it;
-            for( auto srch : m->keywords ) {
-                std::vector<System_memory *> *x;
-
-                if( ragwordmap.contains(srch) ) {
-                    x = ragwordmap.at(srch);
-                } else {
-                    x = (std::vector<System_memory *>*)pool_alloc(sizeof(std::vector<System_memory *>));
-                    new (x) std::vector<System_memory *>;
-                    ragwordmap[srch]=x;
-                }
-                x->push_back( m );
+        if( !new_histories->empty() ) {
+            Ragwords words;
+            for( System_memory *m : *new_histories ) {
+                add_ragwords(m, words);
             }
+            merge_ragwords(words);
         }
+        new_histories->~vector();
+        pool_free(new_histories);
 
         return tgt_kv;
     }
 
-    void ragunmap( System_actor *a, std::string what )
+    // score every history memory sharing a word with `what` by matches per byte of its text
+    void ragsearch( const std::string &what, std::unordered_map<System_memory *, float> &counts )
     {
         std::unordered_map< std::string, std::vector<System_memory *> *> results;
-        std::string *pstr;
         char word[128], *wptr;
         wptr = word;
         *wptr = '\0';
 
-        LLAMA_LOG_INFO("%s: unmap what=%s\n", __func__, what.c_str());
-
         int iptr, len = what.length();
         char c;
 
         for( iptr=0; iptr<len; iptr++ ) {
             c = what[iptr];
-            //LLAMA_LOG_INFO("%s: char=%c\n", __func__, c);
             if( c == ' ' || c == '\n' || c == 0 ) {
                 if( *word != '\0' ) {
                     *wptr='\0';
@@ -5463,7 +6934,7 @@ struct system_kb {
                     *wptr='\0';
                 }
                 if( c == '\0' ) break;
-            } else {
+            } else if( wptr - word < (int)sizeof(word) - 1 ) {
                 *wptr = toLowerCase(c);
                 wptr++;
             }
@@ -5473,23 +6944,29 @@ struct system_kb {
             if( ragwordmap.contains(word) && !results.contains(word) ) {
                 results[word] = ragwordmap[word];
             }
-            wptr=word;
-            *wptr='\0';
         }
 
-        std::unordered_map<System_memory *, float> counts;
-        std::vector<System_memory *>::iterator it;
         for( const auto &pair : results ) {
-            for( it = pair.second->begin(); it != pair.second->end(); it++ ) {
-                if( !(counts.contains(*it)) )
-                    counts[*it] = 1.0;
-                else
-                    counts[*it] = counts[*it] + 1.0;
+            for( System_memory *m : *pair.second ) {
+                counts[m] += 1.0f;
             }
         }
         for( auto &pair : counts ) {
-            pair.second /= pair.first->what.length();
+            pair.second /= pair.first->length();
         }
+    }
+
+    void ragunmap( System_actor *a, std::string what )
+    {
+        llama_stage_timer stage_timer(this, LLAMA_STAGE_RAGSEARCH, a);
+        LLAMA_LOG_INFO("%s: unmap what=%s\n", __func__, what.c_str());
+        if( ragwords_dirty ) {
+            rebuild_ragwords(); // idle maintenance didn't get to it first
+        }
+
+        std::unordered_map<System_memory *, float> counts;
+        ragsearch(what, counts);
+
         int desired_adds=1, desired_rags=2;
         float min_match = 0.02;
         System_memory *highest;
@@ -5508,14 +6985,19 @@ struct system_kb {
             desired_adds--;
             // add rag to actor's map
             Kv_mem *memitem = getmem();
-            LLAMA_LOG_INFO("%s: unmap memory=%s\n", __func__, highest->what.c_str());
-            if( a->ragged.contains(highest->what) ) continue;
-            a->ragged.insert(highest->what);
+            std::string highest_what = highest->what();
+            LLAMA_LOG_INFO("%s: unmap memory=%s\n", __func__, highest_what.c_str());
+            if( a->ragged.contains(highest_what) ) continue;
+            a->ragged.insert(highest_what);
             //memitem->e = translate_rag(highest);
-            memitem->m = translate_rag_mem(highest);
+            memitem->m = translate_rag_mem(a, highest);
             memitem->is_active = false;
             memitem->is_full = false;
             if( a->rags.size() >= desired_rags ) {
+                // the eidets may still be laid out in the slot's map, only the entries go
+                for( size_t r=0; r+2 < a->rags.size(); r++ ) {
+                    freemem(a->rags[r], false);
+                }
                 a->rags.erase( a->rags.begin(), a->rags.begin()+a->rags.size()-2 );
             }
             a->rags.push_back( memitem );
@@ -5533,50 +7015,49 @@ struct system_kb {
     {
         std::vector<llama_token> tokens;
         Kv_mem *newmem;
-        if( !(newmem=processtokens(mem->who, mem->what, tokens, false, 0, true)) )
+        if( !(newmem=processtokens(mem->who(), mem->what(), tokens, false, 0, true)) )
         {
-            LLAMA_LOG_INFO("%s: failed to translate %s\n", __func__, mem->what.c_str());
+            LLAMA_LOG_INFO("%s: failed to translate %s\n", __func__, mem->what().c_str());
             throw "Couldn't translate tokens\n";
         }
 
-        return newmem->e;
+        System_eidet *e = newmem->e;
+        freemem(newmem, false);
+        return e;
     }
 
     System_eidet *translate_rag(System_memory *mem)
     {
         std::vector<llama_token> tokens;
         Kv_mem *newmem;
-        std::string newversion = mem->what;
+        std::string newversion = mem->what();
 
         replace_all(newversion, "|im_", "|mem_");
         std::string memlabel = "(memory)\n";
         newversion.replace( newversion.find('\n'), 1, memlabel );
 
-        if( !(newmem=processtokens(mem->who, newversion, tokens, false, 0, true)) )
+        if( !(newmem=processtokens(mem->who(), newversion, tokens, false, 0, true)) )
         {
-            LLAMA_LOG_INFO("%s: failed to translate %s\n", __func__, mem->what.c_str());
+            LLAMA_LOG_INFO("%s: failed to translate %s\n", __func__, newversion.c_str());
             throw "Couldn't translate tokens\n";
         }
 
         return newmem->e;
     }
-    System_memory *translate_rag_mem(System_memory *mem)
+    System_memory *translate_rag_mem(System_actor *a, System_memory *mem)
     {
-        std::string newversion = mem->what;
+        std::string newversion = mem->what();
 
         replace_all(newversion, "|im_", "|mem_");
         newversion.replace( newversion.find('\n'), 1, "(memory)\n" );
 
-        System_memory *newmem = (System_memory*)pool_alloc( sizeof(System_memory) );
-        newmem->prepare();
-        newmem->build(mem->who, newversion);
-
-        return newmem;
+        return a->store.add(mem->who(), newversion);
     }
 
     // send a message to all agents
+    // ts_given >= 0 means the caller already appended that many token ids for message
     int process_tokens( std::string toname, std::string fromname, std::string message,
-                        std::vector<llama_token> &tokens )
+                        std::vector<llama_token> &tokens, int ts_given=-1 )
     {
         std::set<System_actor*> messaged;
         System_actor *a;
@@ -5587,16 +7068,21 @@ struct system_kb {
         }
 
         int ts_prev = tokens.size();
-        llama_quick_tokenize( message, tokens );
-        int ts_addit = tokens.size() - ts_prev;
+        int ts_addit;
         int ts_rewind = 0;
-        if( ts_addit == 0 ) {
-            ts_addit=1;
-            ts_rewind=1;
+        if( ts_given >= 0 ) {
+            ts_addit = ts_given;
+        } else {
+            llama_quick_tokenize( message, tokens );
+            ts_addit = tokens.size() - ts_prev;
+            if( ts_addit == 0 ) {
+                ts_addit=1;
+                ts_rewind=1;
+            }
         }
 
-        int batches = floor(ts_addit/64.0);
-        int n_last_batch = ts_addit - 64 * batches;
+        // processtokens splits the new tokens into n_batch pieces from the front; the logits are the last piece's
+        int n_last_batch = ts_addit > 0 ? (ts_addit - 1) % n_batch + 1 : 0;
         LLAMA_LOG_INFO("%s: tokens=%d, additional=%d, rewind=%d to: %s\n", __func__, tokens.size(), ts_addit, ts_rewind, toname.c_str());
 
         if( toname != "all" ) {
@@ -5643,12 +7129,8 @@ struct system_kb {
             a = *it;
             if( a->name == fromname ) continue;
 
-            System_memory *m = (System_memory*)pool_alloc(sizeof(System_memory));
-            new (m) System_memory;
-            m->prepare();
-            m->build(fromname, message);
             LLAMA_LOG_INFO("store message for %s: %s\n", a->name.c_str(), message.c_str());
-            a->addrecent(m);
+            a->addrecent( a->store.add(fromname, message) );
         }
 
         return n_last_batch;
@@ -5659,8 +7141,8 @@ struct system_kb {
     Kv_mem *processtokens(std::string fromname, std::string message,
                           std::vector<llama_token> &tokens, bool iskey=false, uint16_t ts_addit=0, bool force_encode=false)
     {
+        LLAMA_TRACE_SCOPE(LLAMA_TRACE_PROCESS, message.size());
         size_t i;
-        int n_batch = 64;
         uint16_t startpt;
         uint16_t ts_prev = tokens.size();
         Kv_mem *mem;
@@ -5690,19 +7172,13 @@ struct system_kb {
 
         LLAMA_LOG_INFO("%s(%u): start %u, process %u (bypass %u) of %zu tokens of %s(+%s)\n", __func__, tgt_kv, startpt, ts_addit, ts_prev, tokens.size(), gen_str_so_far[tgt_kv].c_str(), message.c_str());
 
+        llama_batch &batch = slotbatch(tgt_kv);
         for( i=ts_prev; i < tokens.size(); i += n_batch ) {
             size_t batch_end = std::min(i + n_batch, tokens.size());
-            std::vector<int> teabatch(tokens.begin() + i, tokens.begin() + batch_end);
-
-            llama_batch batch = llama_batch_init(teabatch.size(), 0, 1);
-            batch.n_tokens = teabatch.size();
-
-            for (int32_t k = 0; k < batch.n_tokens; k++) {
-                batch.token[k] = teabatch[k];
-            }
 
-            if( seq_start[tgt_kv] + batch.n_tokens >= kv_extent[tgt_kv]-4 ) {
+            if( seq_start[tgt_kv] + (batch_end - i) >= kv_extent[tgt_kv]-4 ) {
                 LLAMA_LOG_INFO("reserve_space from %u (limit %u)\n", seq_start[tgt_kv], kv_extent[tgt_kv]);
+                n_reserve_rebuild[tgt_kv]++;
                 if( gen_mark[tgt_kv] != -1 ) {
                     // add ts_addit tokens to size
                     eid = (System_eidet*)pool_alloc(sizeof(System_eidet));
@@ -5710,14 +7186,17 @@ struct system_kb {
                     eid->prepare();
 
                     // read from current_kv and build eidet
-                    eid->build(&(kv[tgt_kv]), fromname, message, gen_mark[tgt_kv], seq_start[tgt_kv]-gen_mark[tgt_kv]);
+                    {
+                        llama_stage_timer stage_timer(this, LLAMA_STAGE_EIDET, kvuser[tgt_kv]);
+                        eid->build(&(kv[tgt_kv]), fromname, message, gen_mark[tgt_kv], seq_start[tgt_kv]-gen_mark[tgt_kv]);
+                    }
                     // add to source
                     mem = kvuser[tgt_kv]->addrecent(eid);
                     mem->is_active = true;
 
                     LLAMA_LOG_INFO("%s: done reading ts_addit\n", __func__);
                 }
-                useactor( kvuser[tgt_kv]->name, true ); // this 'true' will allocate 256 tokens, enough for 4 batches.
+                useactor( kvuser[tgt_kv]->name, true ); // this 'true' keeps four reserves free, enough for several batches.
                 startpt = seq_start[tgt_kv];
                 if( gen_mark[tgt_kv] != -1 ) { // reset gen mark after rebuilding map
                     gen_mark[tgt_kv] = seq_start[tgt_kv];
@@ -5725,160 +7204,753 @@ struct system_kb {
             } else {
                 //seq_start[tgt_kv] = startpt + tokens.size() - ts_addit;
             }
+            // filled only now: the rebuild above decodes memories into this slot through the same batch
+            batch.n_tokens = batch_end - i;
+            memcpy( batch.token, tokens.data() + i, batch.n_tokens * sizeof(llama_token) );
             current_context->sequential_start = current_context->seq_end = seq_start[tgt_kv];
             int res = llama_decode(current_context, batch);
             seq_start[tgt_kv] += batch.n_tokens;
+        }
 
-            llama_batch_free(batch);
+        if( !force_encode && ( seq_mark[tgt_kv] != -1 || gen_mark[tgt_kv] != -1 ) ) {
+            //LLAMA_LOG_INFO("[skip adding to recent memories for %d]\n", tgt_kv);
+            return NULL; // Don't generate memories if we're going to rewind.
+        }
+
+        eid = (System_eidet*)pool_alloc(sizeof(System_eidet));
+        new (eid) System_eidet;
+        eid->prepare();
+
+        // read from current_kv and build eidet
+        {
+            llama_stage_timer stage_timer(this, LLAMA_STAGE_EIDET, kvuser[tgt_kv]);
+            eid->build(&(kv[tgt_kv]), fromname, message, startpt, tokens.size());
+        }
+        // add to source
+        if( !iskey && !force_encode ) {
+            mem = kvuser[tgt_kv]->addrecent(eid);
+        } else {
+            mem = getmem();
+            mem->is_full = true;
+            mem->is_active = true;
+            mem->m = NULL;
+            mem->e = eid;
+        }
+        mem->first = startpt;
+        mem->last = startpt+tokens.size()-1;
+        mem->is_active = true;
+
+        return mem;
+    }
+
+
+    // processtokens sends a message to one agent
+    bool processtokens_inplace(uint8_t tgt_kv, Kv_mem *mem, bool iskey=false)
+    {
+        size_t i;
+        size_t n_tokens = mem->m->n_tokens();
+        LLAMA_TRACE_SCOPE(LLAMA_TRACE_PROCESS, mem->m->length());
+        std::vector<int> tokens(mem->m->tokens(), mem->m->tokens() + n_tokens); // useactor may grow the store
+        std::string who = mem->m->who(), what = mem->m->what();
+
+        mem->first = seq_start[tgt_kv];
+        mem->last = mem->first + n_tokens - 1;
+
+        LLAMA_LOG_INFO("%s: tgt_kv=%d from=%s first=%d tokens.size()=%zu\nwhat=%s\n", __func__,
+                       tgt_kv, who.c_str(), mem->first, n_tokens, what.c_str());
+
+        llama_batch &batch = slotbatch(tgt_kv);
+        for( i=0; i < n_tokens; i += n_batch ) {
+            size_t batch_end = std::min(i + n_batch, n_tokens);
+
+            if( seq_start[tgt_kv] + (batch_end - i) >= kv_extent[tgt_kv] ) {
+                n_reserve_rebuild[tgt_kv]++;
+                useactor( kvuser[tgt_kv]->name, true );
+            }
+            batch.n_tokens = batch_end - i;
+            memcpy( batch.token, tokens.data() + i, batch.n_tokens * sizeof(llama_token) );
+            current_context->sequential_start = current_context->seq_end = seq_start[tgt_kv];
+            int res = llama_decode(current_context, batch);
+            seq_start[tgt_kv] += batch.n_tokens;
+        }
+
+        System_eidet *eid = (System_eidet*)pool_alloc(sizeof(System_eidet));
+        new (eid) System_eidet;
+        eid->prepare();
+
+        // read from current_kv and build eidet
+        {
+            llama_stage_timer stage_timer(this, LLAMA_STAGE_EIDET, kvuser[tgt_kv]);
+            eid->build(&(kv[tgt_kv]), who, what, mem->first, n_tokens);
+        }
+        // add to source
+        mem->e = eid;
+        mem->is_full = true;
+        mem->m = NULL;
+        mem->is_active = true;
+
+        LLAMA_LOG_INFO("%s(%s): done\n", __func__, quick_ts().c_str());
+        return true;
+    }
+
+    // keyword -> memories, built per actor before it is linked into ragwordmap
+    typedef std::unordered_map<std::string, std::vector<System_memory *>> Ragwords;
+
+    System_actor *getactor( std::string who )
+    {
+        System_actor *a;
+
+        if( players.count(who) <= 0 ) {
+            // initialize actor
+            LLAMA_LOG_INFO("%s: prepare actor1 %s\n", __func__, who.c_str());
+            a = newactor(who);
+            a->loadfile();
+            LLAMA_LOG_INFO("%s: actor prepared3\n", __func__);
+
+            Ragwords words;
+            collect_ragwords(a, words);
+            merge_ragwords(words);
+        } else {
+            a = players[who];
+        }
+
+        return a;
+    }
+
+    // Load every named actor that isn't loaded yet, one per pool worker. Each worker reads its
+    // actor's files and collects the history keywords into its own map; the maps are merged into
+    // ragwordmap afterwards in the order the names were given.
+    void loadactors( const std::vector<std::string> &names )
+    {
+        std::vector<System_actor*> loading;
+        for( auto &who : names ) {
+            if( players.count(who) > 0 ) continue;
+            loading.push_back( newactor(who) );
+        }
+        if( loading.empty() ) return;
+
+        const int64_t t_start_us = ggml_time_us();
+        std::vector<Ragwords> words(loading.size());
+        System_kb *kb = this;
+        llama_parallel_for( (int32_t)loading.size(), [&](int32_t i) {
+            System_kb *prev = current_kb;
+            current_kb = kb;
+            loading[i]->loadfile();
+            collect_ragwords(loading[i], words[i]);
+            current_kb = prev;
+        });
+        for( auto &w : words ) {
+            merge_ragwords(w);
+        }
+        LLAMA_LOG_INFO("%s: loaded %zu actors in %.2f ms\n", __func__, loading.size(), (ggml_time_us() - t_start_us) / 1000.0);
+    }
+
+    // Scene snapshots: the actors in play, every ready KV slot with its map and marks, and the
+    // slots' tokens, written front to back so the restore can map the file and copy straight
+    // out of it. The KV data follows the header in slot order.
+    // A checkpoint has the same header but only carries the token ranges written since the
+    // scene or checkpoint it follows (its parent), as a Sparse_patch per slot. Restoring a
+    // scene and then its checkpoints in order gives undo; two checkpoints off one parent branch.
+    static uint32_t scene_hash( const std::string &what )
+    {
+        uint32_t h = 2166136261u;
+        for( unsigned char c : what ) {
+            h = (h ^ c) * 16777619u;
+        }
+        return h;
+    }
+
+    // where a slot's map entry lives in its actor, so the restore can point at the same eidet
+    bool scene_locate( System_actor *a, System_eidet *e, uint8_t &section, uint32_t &index )
+    {
+        if( a->mine && a->mine->e == e ) {
+            section = LLAMA_SCENE_MINE;
+            index = 0;
+            return true;
+        }
+        std::vector<Kv_mem*> *lists[3] = { &a->mem, &a->rags, &a->recent };
+        for( uint8_t l=0; l<3; l++ ) {
+            for( uint32_t i=0; i<lists[l]->size(); i++ ) {
+                Kv_mem *src = lists[l]->at(i);
+                if( src->is_full && src->e == e ) {
+                    section = LLAMA_SCENE_MEM + l;
+                    index = i;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    System_eidet *scene_resolve( System_actor *a, uint8_t section, uint32_t index )
+    {
+        if( section == LLAMA_SCENE_MINE ) return a->mine ? a->mine->e : NULL;
+        std::vector<Kv_mem*> *list = section == LLAMA_SCENE_MEM ? &a->mem :
+                                     section == LLAMA_SCENE_RAGS ? &a->rags :
+                                     section == LLAMA_SCENE_RECENT ? &a->recent : NULL;
+        if( !list || index >= list->size() || !list->at(index)->is_full ) return NULL;
+        return list->at(index)->e;
+    }
+
+    // a checkpoint needs every ready slot to have the size it had at the parent
+    bool can_checkpoint( void )
+    {
+        if( scene_serial == 0 ) return false;
+        for( int i=0; i<3; i++ ) {
+            if( kv_ready[i] && kvuser[i] && kv[i].size != scene_size[i] ) return false;
+        }
+        return true;
+    }
+
+    void save_scene( const char *path, bool checkpoint=false )
+    {
+        const int64_t t_start_us = ggml_time_us();
+        if( checkpoint && !can_checkpoint() ) {
+            LLAMA_LOG_INFO("%s: no scene to follow or a slot was resized, writing a full scene\n", __func__);
+            checkpoint = false;
+        }
+        llama_file file(path, "wb");
+        if( file.fp == NULL ) throw "Could not open scene file.";
+
+        uint64_t parent = checkpoint ? scene_serial : 0;
+        uint64_t serial = std::max<uint64_t>( (uint64_t)ggml_time_us(), scene_serial + 1 );
+        file.write_u32(checkpoint ? LLAMA_CHECKPOINT_MAGIC : LLAMA_SCENE_MAGIC);
+        file.write_u32(LLAMA_SCENE_VERSION);
+        file.write_raw(&serial, sizeof(serial));
+        file.write_raw(&parent, sizeof(parent));
+        file.write_raw(&current_model->hparams, sizeof(llama_hparams));
+        file.write_u32((uint32_t)type_k);
+        file.write_string(active_actor);
+        file.write_string(writinguser);
+        file.write_raw(&current_kv, sizeof(current_kv));
+
+        file.write_u32((uint32_t)actors.size());
+        for( System_actor *a : actors ) {
+            file.write_string(a->name);
+        }
+
+        const std::vector<float> &logits = current_context->logits;
+        file.write_u32((uint32_t)logits.size());
+        file.write_raw(logits.data(), logits.size() * sizeof(float));
+
+        size_t kv_bytes = 0;
+        for( int i=0; i<3; i++ ) {
+            uint8_t ready = kv_ready[i] && kvuser[i] ? 1 : 0;
+            file.write_raw(&ready, sizeof(ready));
+            if( !ready ) continue;
+
+            file.write_string(kvuser[i]->name);
+            file.write_u32(kv[i].size);
+            file.write_u16(kv_extent[i]);
+            file.write_u16(seq_start[i]);
+            file.write_raw(&seq_mark[i], sizeof(seq_mark[i]));
+            file.write_raw(&gen_mark[i], sizeof(gen_mark[i]));
+            file.write_raw(&gen_prev[i], sizeof(gen_prev[i]));
+            file.write_string(gen_str_so_far[i]);
+
+            // entries that can't be found in the actor (partial rags) are written as unknown;
+            // the restore drops the whole map and the next pick lays the slot out again
+            uint32_t n_map = kvmap[i] ? kvmap[i]->size() : 0;
+            file.write_u32(n_map);
+            for( uint32_t m=0; m<n_map; m++ ) {
+                Kv_mem *eid = kvmap[i]->at(m);
+                uint8_t section = LLAMA_SCENE_UNKNOWN, active = eid->is_active ? 1 : 0;
+                uint32_t index = 0, hash = 0;
+                if( eid->is_full && eid->e && scene_locate(kvuser[i], eid->e, section, index) ) {
+                    hash = scene_hash(eid->e->what);
+                }
+                file.write_raw(&section, sizeof(section));
+                file.write_raw(&active, sizeof(active));
+                file.write_u32(index);
+                file.write_u32(hash);
+                file.write_u16(eid->first);
+                file.write_u16(eid->last);
+            }
+            if( !checkpoint ) kv_bytes += kv[i].prefix_size(seq_start[i]);
+        }
+
+        for( int i=0; i<3; i++ ) {
+            if( !kv_ready[i] || !kvuser[i] ) continue;
+            if( !checkpoint ) {
+                kv[i].save_prefix(file, seq_start[i]);
+                continue;
+            }
+
+            // only what the restored parent doesn't already hold below seq_start
+            std::vector<std::pair<uint32_t,uint32_t>> ranges, &t = kv_touched[i];
+            std::sort(t.begin(), t.end());
+            for( auto r : t ) {
+                r.second = std::min<uint32_t>(r.second, seq_start[i]);
+                if( r.first >= r.second ) continue;
+                if( !ranges.empty() && r.first <= ranges.back().second ) {
+                    ranges.back().second = std::max(ranges.back().second, r.second);
+                } else {
+                    ranges.push_back(r);
+                }
+            }
+            Sparse_patch patch;
+            kv[i].read_patch(patch, ranges);
+            int n_bytes;
+            uint8_t *buf = patch.save(&n_bytes);
+            file.write_u32((uint32_t)n_bytes);
+            file.write_raw(buf, n_bytes);
+            free(buf);
+            kv_bytes += n_bytes;
         }
+        file.close();
 
-        if( !force_encode && ( seq_mark[tgt_kv] != -1 || gen_mark[tgt_kv] != -1 ) ) {
-            //LLAMA_LOG_INFO("[skip adding to recent memories for %d]\n", tgt_kv);
-            return NULL; // Don't generate memories if we're going to rewind.
+        for( int i=0; i<3; i++ ) {
+            kv_touched[i].clear();
+            scene_size[i] = kv_ready[i] && kvuser[i] ? kv[i].size : 0;
         }
+        scene_serial = serial;
 
-        eid = (System_eidet*)pool_alloc(sizeof(System_eidet));
-        new (eid) System_eidet;
-        eid->prepare();
+        LLAMA_LOG_INFO("%s: wrote %s %s (%zu actors, %.2f MiB of KV) in %.2f ms\n", __func__,
+                       checkpoint ? "checkpoint" : "scene", path, actors.size(),
+                       kv_bytes / 1024.0 / 1024.0, (ggml_time_us() - t_start_us) / 1000.0);
+    }
 
-        // read from current_kv and build eidet
-        eid->build(&(kv[tgt_kv]), fromname, message, startpt, tokens.size());
-        // add to source
-        if( !iskey && !force_encode ) {
-            mem = kvuser[tgt_kv]->addrecent(eid);
+    void load_scene( const char *path )
+    {
+        const int64_t t_start_us = ggml_time_us();
+        llama_file file(path, "rb");
+        if( file.fp == NULL ) throw "Could not open scene file.";
+
+        std::unique_ptr<llama_mmap> mapping;
+        std::vector<uint8_t> contents;
+        const uint8_t *base;
+        if( llama_mmap::SUPPORTED ) {
+            mapping.reset(new llama_mmap(&file));
+            base = (const uint8_t*)mapping->addr;
         } else {
-            mem = (Kv_mem*)pool_alloc(sizeof(Kv_mem));
-            mem->prepare();
-            mem->is_full = true;
-            mem->is_active = true;
-            mem->m = NULL;
-            mem->e = eid;
+            contents.resize(file.size);
+            file.read_raw(contents.data(), file.size);
+            base = contents.data();
         }
-        mem->first = startpt;
-        mem->last = startpt+tokens.size()-1;
-        mem->is_active = true;
+        const uint8_t *inp = base, *end = base + file.size;
 
-        return mem;
-    }
+        auto take = [&]( void *dst, size_t len ) {
+            if( (size_t)(end - inp) < len ) throw "Scene file is truncated.";
+            memcpy(dst, inp, len);
+            inp += len;
+        };
+        auto take_string = [&]() {
+            uint32_t len;
+            take(&len, sizeof(len));
+            if( (size_t)(end - inp) < len ) throw "Scene file is truncated.";
+            std::string str((const char*)inp, len);
+            inp += len;
+            return str;
+        };
 
+        uint32_t magic, version, saved_type_k;
+        uint64_t serial, parent;
+        llama_hparams saved_hparams;
+        take(&magic, sizeof(magic));
+        take(&version, sizeof(version));
+        if( ( magic != LLAMA_SCENE_MAGIC && magic != LLAMA_CHECKPOINT_MAGIC ) || version != LLAMA_SCENE_VERSION ) {
+            throw "Not a scene file for this version.";
+        }
+        bool checkpoint = magic == LLAMA_CHECKPOINT_MAGIC;
+        take(&serial, sizeof(serial));
+        take(&parent, sizeof(parent));
+        if( checkpoint && parent != scene_serial ) throw "Checkpoint does not follow the loaded scene.";
+        take(&saved_hparams, sizeof(saved_hparams));
+        if( saved_hparams != current_model->hparams ) throw "Scene was saved with a different model.";
+        take(&saved_type_k, sizeof(saved_type_k));
+        if( (ggml_type)saved_type_k != type_k ) throw "Scene was saved with a different KV cache type.";
+
+        std::string saved_active = take_string();
+        std::string saved_writing = take_string();
+        uint8_t kv_was;
+        take(&kv_was, sizeof(kv_was));
+
+        uint32_t n_actors;
+        take(&n_actors, sizeof(n_actors));
+        std::vector<std::string> names(n_actors);
+        for( auto &name : names ) name = take_string();
+
+        uint32_t n_logits;
+        take(&n_logits, sizeof(n_logits));
+        if( (size_t)(end - inp) < n_logits * sizeof(float) ) throw "Scene file is truncated.";
+        const uint8_t *logits_at = inp;
+        inp += n_logits * sizeof(float);
+
+        // everything is read and checked before the first slot changes, so a bad file leaves the kb as it was
+        struct scene_entry {
+            uint8_t section, active;
+            uint32_t index, hash;
+            uint16_t first, last;
+        };
+        struct scene_slot {
+            bool saved = false; // has KV data in the file
+            bool ready = false; // and it fits the slot as allocated now
+            std::string name;
+            uint32_t size = 0;
+            uint16_t extent = 0, seq_start = 0;
+            int16_t seq_mark = -1, gen_mark = -1, gen_prev = 0;
+            std::string gen_str;
+            std::vector<scene_entry> entries;
+            const uint8_t *data = NULL;
+            size_t n_bytes = 0;
+        } slots[3];
 
-    // processtokens sends a message to one agent
-    bool processtokens_inplace(uint8_t tgt_kv, Kv_mem *mem, bool iskey=false)
-    {
-        size_t i;
-        int n_batch = 64;
+        for( int i=0; i<3; i++ ) {
+            scene_slot &sl = slots[i];
+            uint8_t ready;
+            take(&ready, sizeof(ready));
+            if( !ready ) continue;
+
+            sl.saved = true;
+            sl.name = take_string();
+            take(&sl.size, sizeof(sl.size));
+            take(&sl.extent, sizeof(sl.extent));
+            take(&sl.seq_start, sizeof(sl.seq_start));
+            take(&sl.seq_mark, sizeof(sl.seq_mark));
+            take(&sl.gen_mark, sizeof(sl.gen_mark));
+            take(&sl.gen_prev, sizeof(sl.gen_prev));
+            sl.gen_str = take_string();
+
+            uint32_t n_map;
+            take(&n_map, sizeof(n_map));
+            sl.entries.resize(n_map);
+            for( auto &en : sl.entries ) {
+                take(&en.section, sizeof(en.section));
+                take(&en.active, sizeof(en.active));
+                take(&en.index, sizeof(en.index));
+                take(&en.hash, sizeof(en.hash));
+                take(&en.first, sizeof(en.first));
+                take(&en.last, sizeof(en.last));
+            }
+        }
+        for( int i=0; i<3; i++ ) {
+            scene_slot &sl = slots[i];
+            if( !sl.saved ) continue;
+            if( checkpoint ) {
+                uint32_t n_bytes;
+                take(&n_bytes, sizeof(n_bytes));
+                sl.n_bytes = n_bytes;
+            } else {
+                sl.n_bytes = Kv_cache::prefix_bytes(type_k, sl.seq_start);
+            }
+            if( (size_t)(end - inp) < sl.n_bytes ) throw "Scene file is truncated.";
+            sl.data = inp;
+            inp += sl.n_bytes;
 
-        if( mem->m->tokens.size() == 0 ) {
-            llama_quick_tokenize( mem->m->what, mem->m->tokens );
+            if( checkpoint && ( !kv_ready[i] || kv[i].size != sl.size ) ) throw "Checkpoint does not fit the KV slot.";
+        }
+        if( checkpoint ) {
+            // the delta only holds against the KV as the parent left it
+            for( int i=0; i<3; i++ ) {
+                if( kv_ready[i] && !kv_touched[i].empty() ) throw "KV slots changed since the scene this checkpoint follows; load that scene first.";
+            }
         }
 
-        mem->first = seq_start[tgt_kv];
-        mem->last = mem->first + mem->m->n_tokens - 1;
-        mem->m->n_tokens = mem->m->tokens.size();
+        loadactors(names); // brings actors in, the slots are still untouched
+        active_actor = saved_active;
+        writinguser = saved_writing;
+        current_context->logits.resize(n_logits);
+        memcpy(current_context->logits.data(), logits_at, n_logits * sizeof(float));
 
-        LLAMA_LOG_INFO("%s: tgt_kv=%d from=%s first=%d tokens.size()=%u\nwhat=%s\n", __func__,
-                       tgt_kv, mem->m->who.c_str(), mem->first, mem->m->n_tokens, mem->m->what.c_str());
+        for( int i=0; i<3; i++ ) {
+            scene_slot &sl = slots[i];
 
-        for( i=0; i < mem->m->tokens.size(); i += n_batch ) {
-            size_t batch_end = std::min(i + n_batch, mem->m->tokens.size());
-            std::vector<int> teabatch(mem->m->tokens.begin() + i, mem->m->tokens.begin() + batch_end);
+            // whatever the slot held before is gone either way
+            freemap(kvmap[i]);
+            kvmap[i] = NULL;
+            if( !sl.saved ) {
+                kvuser[i] = NULL;
+                seq_start[i] = 0;
+                seq_mark[i] = gen_mark[i] = -1;
+                continue;
+            }
 
-            llama_batch batch = llama_batch_init(teabatch.size(), 0, 1);
-            batch.n_tokens = teabatch.size();
+            System_actor *a = getactor(sl.name);
+            kvuser[i] = a;
+            kv_extent[i] = sl.extent;
+            seq_mark[i] = sl.seq_mark;
+            gen_mark[i] = sl.gen_mark;
+            gen_prev[i] = sl.gen_prev;
+            gen_str_so_far[i] = sl.gen_str;
 
-            for (int32_t k = 0; k < batch.n_tokens; k++) {
-                batch.token[k] = teabatch[k];
+            if( kv_ready[i] && kv[i].size != sl.size ) {
+                kv[i].free_buffers();
+                kv_ready[i] = false;
             }
-
-            if( seq_start[tgt_kv] + batch.n_tokens >= kv_extent[tgt_kv] ) {
-                useactor( kvuser[tgt_kv]->name, true );
+            usekv(i);
+            if( kv[i].size != sl.size ) {
+                LLAMA_LOG_WARN("%s: kv %d holds %u tokens, scene has %u; slot will be rebuilt\n", __func__, i, kv[i].size, sl.size);
+                seq_start[i] = 0;
+                seq_mark[i] = gen_mark[i] = -1;
+                continue;
             }
-            current_context->sequential_start = current_context->seq_end = seq_start[tgt_kv];
-            int res = llama_decode(current_context, batch);
-            seq_start[tgt_kv] += batch.n_tokens;
-
-            llama_batch_free(batch);
+            sl.ready = true;
+
+            // the actor may have moved on since the snapshot (saved again, memories cycled)
+            std::vector<Kv_mem*> *map = (std::vector<Kv_mem*> *)pool_alloc(sizeof(std::vector<Kv_mem*>));
+            new (map) std::vector<Kv_mem*>;
+            for( const auto &en : sl.entries ) {
+                System_eidet *e = scene_resolve(a, en.section, en.index);
+                if( !e || scene_hash(e->what) != en.hash || e->n_tokens != en.last + 1 - en.first ) {
+                    LLAMA_LOG_WARN("%s: %s changed since the scene was saved; kv %d will be laid out again\n", __func__, sl.name.c_str(), i);
+                    freemap(map);
+                    map = NULL;
+                    break;
+                }
+                Kv_mem *eid = new_kv_mem(e);
+                eid->first = en.first;
+                eid->last = en.last;
+                eid->is_active = en.active != 0;
+                map->push_back(eid);
+            }
+            kvmap[i] = map;
         }
 
-        System_eidet *eid = (System_eidet*)pool_alloc(sizeof(System_eidet));
-        new (eid) System_eidet;
-        eid->prepare();
+        for( int i=0; i<3; i++ ) {
+            scene_slot &sl = slots[i];
+            if( !sl.ready ) continue;
+            if( checkpoint ) {
+                Sparse_patch patch;
+                patch.load((uint8_t*)sl.data, sl.n_bytes);
+                kv[i].apply_patch(patch);
+            } else {
+                kv[i].load_prefix(sl.data, sl.seq_start);
+            }
+            seq_start[i] = kv[i].seq = sl.seq_start;
+        }
+        for( int i=0; i<3; i++ ) {
+            kv_touched[i].clear();
+            scene_size[i] = slots[i].ready ? kv[i].size : 0;
+        }
+        scene_serial = serial;
 
-        // read from current_kv and build eidet
-        eid->build(&(kv[tgt_kv]), mem->m->who, mem->m->what, mem->first, mem->m->n_tokens);
-        // add to source
-        mem->e = eid;
-        mem->is_full = true;
-        mem->m->release();
-        pool_free( mem->m );
-        mem->m = NULL;
-        mem->is_active = true;
+        if( kv_was < 3 && kvuser[kv_was] ) usekv(kv_was);
+        LLAMA_LOG_INFO("%s: restored %s (%u actors) in %.2f ms\n", __func__, path, n_actors,
+                       (ggml_time_us() - t_start_us) / 1000.0);
+    }
 
-        LLAMA_LOG_INFO("%s(%s): done\n", __func__, quick_ts().c_str());
-        return true;
+    System_actor *newactor( std::string who )
+    {
+        System_actor *a = (System_actor*)pool_alloc(sizeof(System_actor));
+        new (a) System_actor;
+        a->prepare();
+        a->name = who;
+        actors.push_back(a);
+        players[who] = a;
+        return a;
     }
 
-    System_actor *getactor( std::string who )
+    void add_ragwords( System_memory *m, Ragwords &words )
     {
-        System_actor *a;
+        uint16_t n;
+        const uint32_t *ids = m->keywords(&n);
+        for( uint16_t k=0; k<n; k++ ) {
+            words[ m->store->terms[ids[k]] ].push_back( m );
+        }
+    }
+    void collect_ragwords( System_actor *a, Ragwords &words )
+    {
+        std::vector<Kv_mem*>::iterator it;
+        for( it = a->history.begin(); it != a->history.end(); it++ ) {
+            if( (*it)->m ) add_ragwords( (*it)->m, words );
+        }
+    }
 
-        if( players.count(who) <= 0 ) {
-            // initialize actor
-            LLAMA_LOG_INFO("%s: prepare actor1 %s\n", __func__, who.c_str());
-            a = (System_actor*)pool_alloc(sizeof(System_actor));
-            new (a) System_actor;
-            a->prepare();
-            a->name = who;
-            a->loadfile();
-            actors.push_back(a);
-            players[who] = a;
-            LLAMA_LOG_INFO("%s: actor prepared3\n", __func__);
+    void merge_ragwords( Ragwords &words )
+    {
+        for( auto &w : words ) {
+            std::vector<System_memory *> *x;
 
-            // link the actor into the ragwordmap
-            // add history to ragwordmap
-            std::string srch;
-            std::vector<Kv_mem*>::iterator it;
-            for( it = a->history.begin(); it != a->history.end(); it++ ) {
-                Kv_mem *memlink = *it;
-                System_memory *m = memlink->m;
-                for( auto srch : m->keywords ) {
-                    std::vector<System_memory *> *x;
-
-                    if( ragwordmap.contains(srch) ) {
-                        x = ragwordmap.at(srch);
-                    } else {
-                        x = (std::vector<System_memory *>*)pool_alloc(sizeof(std::vector<System_memory *>));
-                        new (x) std::vector<System_memory *>;
-                        ragwordmap[srch]=x;
-                    }
-                    x->push_back( m );
-                }
+            if( ragwordmap.contains(w.first) ) {
+                x = ragwordmap.at(w.first);
+            } else {
+                x = (std::vector<System_memory *>*)pool_alloc(sizeof(std::vector<System_memory *>));
+                new (x) std::vector<System_memory *>;
+                ragwordmap[w.first]=x;
             }
-        } else {
-            a = players[who];
+            x->insert( x->end(), w.second.begin(), w.second.end() );
         }
-
-        return a;
     }
     System_memory *remember( std::string actor, std::string who, std::string what, std::string when )
     {
         System_actor *a = current_kb->getactor(actor);
-        System_memory *m = (System_memory*)pool_alloc(sizeof(System_memory));
-        new (m) System_memory;
-        m->prepare();
-
-        m->who = who;
-        m->what = what;
-        if( when.length() == 0 ) {
-            m->when = llama_ts_now();
-        } else {
-            m->when = llama_string_to_ts(when);
-        }
+        int64_t t = when.length() == 0 ? (int64_t)std::time(0) : llama_string_to_epoch(when);
+        System_memory *m = a->store.add(who, what, t);
         a->addhist(m);
 
         return m;
     }
 
+    // Bulk remember(). Timestamps, tokens and keywords are worked out across the pool first; then
+    // each actor's rows go into its store, history and keyword map on a worker of their own, and
+    // onto its .hst file in one write. Returns how many records were imported; ones with a bad
+    // timestamp are skipped.
+    size_t import_memories( const llama_memory_record *records, size_t n_records )
+    {
+        struct prepared {
+            bool ok = false;
+            int64_t t = 0;
+            std::vector<int> toks;
+            std::vector<std::string> words;
+        };
+        const int64_t t_start_us = ggml_time_us();
+        const int64_t now = (int64_t)std::time(0);
+        std::vector<prepared> rows(n_records);
+
+        const int32_t n_blocks = (int32_t)( (n_records + LLAMA_IMPORT_BLOCK - 1) / LLAMA_IMPORT_BLOCK );
+        llama_parallel_for( n_blocks, [&](int32_t b) {
+            size_t end = std::min( n_records, (size_t)(b + 1) * LLAMA_IMPORT_BLOCK );
+            for( size_t i = (size_t)b * LLAMA_IMPORT_BLOCK; i < end; i++ ) {
+                const llama_memory_record &r = records[i];
+                prepared &p = rows[i];
+                try {
+                    p.t = r.when.empty() ? now : llama_string_to_epoch( std::string(r.when) );
+                } catch( const char * ) {
+                    continue;
+                }
+                llama_quick_tokenize( std::string(r.what), p.toks );
+                Memory_store::split_keywords( r.what.data(), (uint32_t)r.what.size(), p.words );
+                p.ok = true;
+            }
+        });
+
+        // records by actor, actors in the order they first appear
+        std::vector<std::string> names;
+        std::vector<std::vector<size_t>> owned;
+        std::unordered_map<std::string_view, size_t> slot;
+        size_t n_imported = 0;
+        for( size_t i=0; i<n_records; i++ ) {
+            if( !rows[i].ok ) continue;
+            auto found = slot.find( records[i].actor );
+            if( found == slot.end() ) {
+                found = slot.emplace( records[i].actor, names.size() ).first;
+                names.emplace_back( records[i].actor );
+                owned.emplace_back();
+            }
+            owned[found->second].push_back(i);
+            n_imported++;
+        }
+        if( n_imported < n_records ) {
+            LLAMA_LOG_INFO("%s: skipped %zu records with a bad timestamp\n", __func__, n_records - n_imported);
+        }
+
+        loadactors(names);
+        std::vector<System_actor*> targets;
+        for( auto &who : names ) {
+            targets.push_back( getactor(who) );
+        }
+
+        std::vector<Ragwords> words(targets.size());
+        System_kb *kb = this;
+        llama_parallel_for( (int32_t)targets.size(), [&](int32_t k) {
+            System_kb *prev = current_kb;
+            current_kb = kb;
+            System_actor *a = targets[k];
+            a->flushjournal(); // what it remembered before goes first in the file
+            std::string entries;
+            for( size_t i : owned[k] ) {
+                const llama_memory_record &r = records[i];
+                System_memory *m = a->store.add( r.who, r.what, rows[i].t, rows[i].toks, rows[i].words );
+                a->history.push_back( new_kv_mem(m) );
+                add_ragwords( m, words[k] );
+                m->serialize( entries );
+                rows[i] = prepared();
+            }
+            a->appendhist( entries, (uint32_t)owned[k].size() );
+            current_kb = prev;
+        });
+        for( auto &w : words ) {
+            merge_ragwords(w);
+        }
+
+        LLAMA_LOG_INFO("%s: %zu memories for %zu actors in %.2f ms\n", __func__, n_imported, targets.size(),
+                       (ggml_time_us() - t_start_us) / 1000.0);
+        return n_imported;
+    }
+
+    void rebuild_ragwords( void )
+    {
+        for( auto &w : ragwordmap ) {
+            w.second->~vector();
+            pool_free(w.second);
+        }
+        ragwordmap.clear();
+
+        Ragwords words;
+        for( System_actor *a : actors ) {
+            collect_ragwords(a, words);
+        }
+        merge_ragwords(words);
+        ragwords_dirty = false;
+        LLAMA_LOG_INFO("%s: %zu keywords\n", __func__, ragwordmap.size());
+    }
+
+    // One piece of deferred work, cheapest first. Returns the LLAMA_IDLE_* kind that ran.
+    int idle_step( void )
+    {
+        for( System_actor *a : actors ) {
+            if( a->journal.empty() ) continue;
+            a->flushjournal();
+            return LLAMA_IDLE_JOURNAL;
+        }
+        if( precompute_one() ) {
+            return LLAMA_IDLE_EIDET;
+        }
+        if( ragwords_dirty ) {
+            rebuild_ragwords();
+            return LLAMA_IDLE_INDEX;
+        }
+        return LLAMA_IDLE_NONE;
+    }
+
+    // Next partial memory of a worth decoding ahead of time: rags first (ragunmap picked them
+    // because the conversation is heading their way), then the newest messages it only heard about.
+    Kv_mem *idle_candidate( System_actor *a, int room )
+    {
+        auto fits = [room](Kv_mem *m) {
+            return !m->is_full && m->m && m->m->n_tokens() > 0 && m->m->n_tokens() <= LLAMA_IDLE_MAX_TOKENS
+                   && m->m->n_tokens() + 4 < room;
+        };
+        std::vector<Kv_mem*>::iterator it;
+        for( it = a->rags.begin(); it != a->rags.end(); it++ ) {
+            if( fits(*it) ) return *it;
+        }
+        std::vector<Kv_mem*>::reverse_iterator rit;
+        for( rit = a->recent.rbegin(); rit != a->recent.rend(); rit++ ) {
+            if( fits(*rit) ) return *rit;
+        }
+        return NULL;
+    }
+
+    // Turn one partial memory of a slot actor into a full eidet so useactor writes it instead of
+    // having to decode it. The memory is decoded past the slot's seq_start and read back, then the
+    // slot is rewound; nothing already in the slot moves. Slots that are generating or hold a
+    // rewind mark are left alone.
+    bool precompute_one( void )
+    {
+        for( int i=0; i<3; i++ ) {
+            if( !kv_ready[i] || !kvuser[i] ) continue;
+            if( gen_mark[i] != -1 || seq_mark[i] != -1 ) continue;
+
+            Kv_mem *target = idle_candidate(kvuser[i], (int)kv_extent[i] - seq_start[i]);
+            if( !target ) continue;
+
+            uint8_t kv_was = current_kv;
+            uint16_t seq_was = seq_start[i];
+            usekv(i);
+            System_eidet *e = translate(target->m);
+            seq_start[i] = seq_was;
+            usekv(kv_was);
+
+            llama_epoch_to_ts(target->m->when(), e->when); // keep when it happened
+            target->e = e;
+            target->is_full = true;
+            target->is_active = false;
+            LLAMA_LOG_INFO("%s: %s: %u tokens\n", __func__, kvuser[i]->name.c_str(), e->n_tokens);
+            return true;
+        }
+        return false;
+    }
+
     bool verify_map( int extent, std::vector<Kv_mem*> *map )
     {
         std::vector<Kv_mem*>::iterator it;
@@ -5887,7 +7959,7 @@ struct system_kb {
             Kv_mem *eid = *it;
             tokens += (eid->last - eid->first)+1;
         }
-        int reserve_space = (extent>1024)?(400):(200);
+        int reserve_space = 5*reserve_for(extent); // the same margins useactor keeps when rebuilding
         return !( tokens > extent-reserve_space );
     }
 
@@ -5958,6 +8030,11 @@ void llama_query_actor_names(std::vector<std::string> &names)
     current_kb->query_actor_names(names);
 }
 
+llama_stage_timer::~llama_stage_timer()
+{
+    if( kb ) kb->record_stage(stage, a, ggml_time_us() - t_start_us);
+}
+
 Kv_mem *new_kv_mem( void )
 {
     Kv_mem *m = current_kb->getmem();
@@ -5987,12 +8064,21 @@ Kv_mem *new_kv_mem( System_eidet *memory )
     m->first = m->last = 0;
     return m;
 }
+void free_kv_mem( Kv_mem *m, bool release_contents )
+{
+    current_kb->freemem(m, release_contents);
+}
 
 void llama_save_actors( void )
 {
     current_kb->saveall();
 }
 
+void llama_load_actors( const std::vector<std::string> &names )
+{
+    current_kb->loadactors(names);
+}
+
 void llama_unload_actor( std::string actor )
 {
     current_kb->unload(actor);
@@ -6004,6 +8090,501 @@ void llama_record_memory( std::string actor, std::string who, std::string when,
     // return m;
 }
 
+size_t llama_import_memories( const struct llama_memory_record *records, size_t n_records )
+{
+    return current_kb->import_memories(records, n_records);
+}
+
+void llama_bench_memories( struct llama_context * ctx, size_t n_memories, struct llama_memory_bench * out )
+{
+    // a scratch kb, so the session's actors and ragwordmap are left alone
+    System_kb *kb = (System_kb*)pool_alloc(sizeof(System_kb));
+    new (kb) System_kb;
+    kb->prepare();
+    System_kb *kb_was = current_kb;
+    _Context *ctx_was = current_context;
+    current_context = ctx;
+    current_kb = kb;
+
+    static const char *common[] = { "the", "a", "and", "to", "of", "you", "i", "it", "in", "was", "that", "we",
+                                    "said", "look", "at", "there", "door", "light", "road", "time", "back", "night" };
+    std::mt19937 rng(42);
+    auto sentence = [&]( int n_words ) {
+        std::string str = "<|im_start|>user\n";
+        for( int w=0; w<n_words; w++ ) {
+            if( w ) str += ' ';
+            if( rng() % 3 == 0 ) str += "word" + std::to_string(rng() % 4096);
+            else str += common[ rng() % (sizeof(common)/sizeof(common[0])) ];
+        }
+        return str + "<|im_end|>";
+    };
+
+    memset(out, 0, sizeof(*out));
+    out->n_memories = n_memories;
+    System_actor *a = kb->newactor("Bench");
+
+    int64_t t0 = ggml_time_us();
+    int64_t now = (int64_t)std::time(0);
+    for( size_t i=0; i<n_memories; i++ ) {
+        System_memory *m = a->store.add( i % 2 ? "Bench" : "Guest", sentence(8 + rng() % 24), now - (int64_t)(n_memories - i) );
+        a->history.push_back( new_kv_mem(m) );
+    }
+    out->t_build_ms = (ggml_time_us() - t0) / 1000.0;
+
+    t0 = ggml_time_us();
+    System_kb::Ragwords words;
+    kb->collect_ragwords(a, words);
+    kb->merge_ragwords(words);
+    out->t_index_ms = (ggml_time_us() - t0) / 1000.0;
+
+    out->store_bytes = a->store.bytes();
+    out->index_bytes = kb->mem_live * sizeof(Kv_mem);
+    for( auto &w : kb->ragwordmap ) {
+        out->index_bytes += sizeof(w) + w.first.capacity() + sizeof(*w.second) + w.second->capacity() * sizeof(System_memory*);
+    }
+    out->bytes_per_memory = n_memories ? (double)(out->store_bytes + out->index_bytes) / n_memories : 0.0;
+
+    const int n_maps = 16, n_queries = 256;
+    int64_t t_map_us = 0;
+    for( int r=0; r<n_maps; r++ ) {
+        while( a->recent.size() < 256 ) {
+            a->recent.push_back( new_kv_mem( a->store.add("Guest", sentence(8 + rng() % 24)) ) );
+        }
+        t0 = ggml_time_us();
+        std::vector<Kv_mem*> *map = a->build_map1();
+        std::vector<System_memory*> *moved = a->build_map2(1024, map);
+        t_map_us += ggml_time_us() - t0;
+        kb->freemap(map);
+        moved->~vector();
+        pool_free(moved);
+    }
+    out->t_map_ms = t_map_us / 1000.0 / n_maps;
+
+    t0 = ggml_time_us();
+    for( int q=0; q<n_queries; q++ ) {
+        std::unordered_map<System_memory *, float> counts;
+        kb->ragsearch(sentence(16), counts);
+    }
+    out->t_search_ms = (ggml_time_us() - t0) / 1000.0 / n_queries;
+
+    LLAMA_LOG_INFO("%s: %zu memories, %.1f bytes each; build %.2f ms, index %.2f ms, map %.3f ms, search %.3f ms\n",
+                   __func__, n_memories, out->bytes_per_memory, out->t_build_ms, out->t_index_ms, out->t_map_ms, out->t_search_ms);
+
+    kb->release();
+    for( auto &w : kb->ragwordmap ) {
+        w.second->~vector();
+        pool_free(w.second);
+    }
+    kb->~System_kb();
+    pool_free(kb);
+    current_kb = kb_was;
+    current_context = ctx_was;
+}
+
+// A slot's compute buffers are reserved for kb->n_batch when it is allocated; after the size changes,
+// reserve again for the widest slot in use (the scheduler only ever grows its buffers).
+static void llama_reserve_prompt_batch( struct llama_context *ctx )
+{
+    System_kb *kb = ctx->kb;
+    int widest = -1;
+    for( int i=0; i<3; i++ ) {
+        if( kb->kv_ready[i] && ( widest < 0 || kb->kv_extent[i] > kb->kv_extent[widest] ) ) widest = i;
+    }
+    if( widest < 0 ) return; // nothing allocated yet: usekv reserves at kb->n_batch
+
+    _Context *ctx_was = current_context;
+    struct llama_kv_cache *kv_was = ctx->kv_self;
+    const uint32_t n_ctx_was = ctx->cparams.n_ctx;
+    current_context = ctx;
+    ctx->kv_self = &kb->kv[widest];
+    ctx->cparams.n_ctx = kb->kv_extent[widest];
+    prepare_kv_cache(ctx, kb->kv_extent[widest], kb->n_batch);
+    ctx->kv_self = kv_was;
+    ctx->cparams.n_ctx = n_ctx_was;
+    current_context = ctx_was;
+}
+
+// Decode max(n_tokens, size) synthetic tokens at each batch size in sizes[] (ascending) on a scratch
+// KV cache, so no actor's slot is touched. Stops once budget_us is spent (0: no limit) or would be by
+// the next size. Returns how many sizes were measured into out; the caller re-reserves the compute
+// buffers for the batch size it settles on.
+static int32_t llama_prompt_sweep( struct llama_context *ctx, const int32_t *sizes, int32_t n_sizes,
+                                   int32_t n_tokens, int64_t budget_us, struct llama_prompt_bench *out )
+{
+    System_kb *kb = ctx->kb;
+    const int32_t cap = (int32_t)ctx->cparams.n_batch;
+    int32_t widest = 0;
+    for( int32_t k=0; k<n_sizes; k++ ) {
+        widest = std::max( widest, std::min(sizes[k], cap) );
+    }
+    if( widest <= 0 ) return 0;
+    const uint32_t n_ctx = std::min<uint32_t>( GGML_PAD(std::max(widest, n_tokens), LLAMA_KV_EXTENT_STEP), kb->extent_cap / kv_context );
+
+    _Context *ctx_was = current_context;
+    struct llama_kv_cache *kv_was = ctx->kv_self;
+    const uint32_t n_ctx_was = ctx->cparams.n_ctx;
+    const int seq_start_was = ctx->sequential_start, seq_end_was = ctx->seq_end;
+    current_context = ctx;
+
+    struct llama_kv_cache scratch;
+    scratch.prepare();
+    ctx->kv_self = &scratch;
+    ctx->cparams.n_ctx = n_ctx;
+    int32_t n_done = 0;
+    if( !llama_kv_cache_init(scratch, ctx->model, kb->type_k, GGML_TYPE_F16, kv_context*n_ctx, true) ) {
+        LLAMA_LOG_ERROR("%s: could not allocate a %u token scratch cache\n", __func__, n_ctx);
+    } else {
+        ctx->kb = NULL; // no actor is decoding: no stage metrics, no touched ranges
+        prepare_kv_cache(ctx, n_ctx, widest);
+
+        const int32_t n_vocab = llama_n_vocab(&ctx->model);
+        std::vector<llama_token> toks(n_ctx);
+        for( uint32_t k=0; k<n_ctx; k++ ) {
+            toks[k] = 1 + (llama_token)( (k * 7919u) % (uint32_t)(n_vocab - 1) );
+        }
+        llama_batch batch = llama_batch_init(widest, 0, 1);
+        auto decode = [&]( int32_t pos, int32_t n ) {
+            batch.n_tokens = n;
+            memcpy( batch.token, toks.data() + pos, n * sizeof(llama_token) );
+            ctx->sequential_start = ctx->seq_end = pos;
+            llama_decode(ctx, batch);
+        };
+
+        decode( 0, std::min(sizes[0], cap) ); // the first decode also lays out the compute buffers
+        const int64_t t_start_us = ggml_time_us();
+        for( int32_t k=0; k<n_sizes; k++ ) {
+            const int32_t size = std::min(sizes[k], cap);
+            const int32_t total = std::min<int32_t>( std::max(n_tokens, size), n_ctx );
+            const int64_t t0 = ggml_time_us();
+            for( int32_t pos=0; pos < total; pos += size ) {
+                decode( pos, std::min(size, total - pos) );
+            }
+            const int64_t t_us = ggml_time_us() - t0;
+            out[n_done++] = { size, total, t_us / 1000.0, t_us > 0 ? total * 1e6 / t_us : 0.0 };
+            // the next size takes about twice as long
+            if( budget_us > 0 && ggml_time_us() - t_start_us + 2*t_us > budget_us ) break;
+        }
+        llama_batch_free(batch);
+        ctx->kb = kb;
+    }
+    scratch.free_buffers();
+
+    ctx->kv_self = kv_was;
+    ctx->cparams.n_ctx = n_ctx_was;
+    ctx->sequential_start = seq_start_was;
+    ctx->seq_end = seq_end_was;
+    current_context = ctx_was;
+    return n_done;
+}
+
+// Past the size where the matmuls are saturated a bigger prompt batch only adds latency and compute
+// buffer, so keep the smallest size within 10% of the best throughput seen.
+static int32_t llama_calibrate_prompt_batch( struct llama_context *ctx )
+{
+    System_kb *kb = ctx->kb;
+    const int32_t cap = (int32_t)ctx->cparams.n_batch;
+    kb->n_batch = std::min(cap, LLAMA_PROMPT_BATCH_DEFAULT);
+    if( cap <= LLAMA_PROMPT_BATCH_MIN || !ctx->model.hparams.causal_attn ) {
+        return kb->n_batch;
+    }
+
+    std::vector<int32_t> sizes;
+    for( int32_t n = LLAMA_PROMPT_BATCH_MIN; n < cap; n *= 2 ) {
+        sizes.push_back(n);
+    }
+    sizes.push_back(cap);
+    std::vector<llama_prompt_bench> res(sizes.size());
+    const int64_t t_start_us = ggml_time_us();
+    int32_t n = llama_prompt_sweep(ctx, sizes.data(), (int32_t)sizes.size(), 0, LLAMA_PROMPT_BATCH_CAL_US, res.data());
+    if( n == 0 ) {
+        llama_reserve_prompt_batch(ctx);
+        return kb->n_batch;
+    }
+
+    double best = 0.0;
+    for( int32_t k=0; k<n; k++ ) {
+        best = std::max(best, res[k].tokens_per_s);
+    }
+    for( int32_t k=0; k<n; k++ ) {
+        if( res[k].tokens_per_s >= 0.9 * best ) {
+            kb->n_batch = res[k].n_batch;
+            break;
+        }
+    }
+    LLAMA_LOG_INFO("%s: prompt batch %d (%d of %zu sizes timed, best %.1f tokens/s, %.2f ms)\n", __func__,
+                   kb->n_batch, n, sizes.size(), best, (ggml_time_us() - t_start_us) / 1000.0);
+    llama_reserve_prompt_batch(ctx);
+    return kb->n_batch;
+}
+
+int32_t llama_set_prompt_batch( struct llama_context *ctx, int32_t n_batch )
+{
+    if( n_batch <= 0 ) {
+        return llama_calibrate_prompt_batch(ctx);
+    }
+    ctx->kb->n_batch = std::min<int32_t>( n_batch, (int32_t)ctx->cparams.n_batch );
+    llama_reserve_prompt_batch(ctx);
+    return ctx->kb->n_batch;
+}
+
+int32_t llama_get_prompt_batch( const struct llama_context *ctx )
+{
+    return ctx->kb->n_batch;
+}
+
+int32_t llama_bench_prompt( struct llama_context *ctx, int32_t n_tokens, struct llama_prompt_bench *out, int32_t n_out )
+{
+    const int32_t cap = (int32_t)ctx->cparams.n_batch;
+    std::vector<int32_t> sizes;
+    for( int32_t n = LLAMA_PROMPT_BATCH_MIN; n < cap && (int32_t)sizes.size() < n_out; n *= 2 ) {
+        sizes.push_back(n);
+    }
+    if( (int32_t)sizes.size() < n_out ) sizes.push_back(cap);
+    if( sizes.empty() ) return 0;
+    int32_t n = llama_prompt_sweep(ctx, sizes.data(), (int32_t)sizes.size(), n_tokens, 0, out);
+    llama_reserve_prompt_batch(ctx);
+    for( int32_t k=0; k<n; k++ ) {
+        LLAMA_LOG_INFO("%s: batch %4d: %5d tokens in %8.2f ms, %8.1f tokens/s\n", __func__,
+                       out[k].n_batch, out[k].n_tokens, out[k].t_ms, out[k].tokens_per_s);
+    }
+    return n;
+}
+
+// Greedy-decode n_tokens from BOS on a scratch KV cache twice: reusing the single-token graph, then
+// building it for every token. The two passes must pick the same tokens; a difference means the
+// patched graph computed something the fresh one did not.
+void llama_bench_decode_graph( struct llama_context *ctx, int32_t n_tokens, struct llama_graph_bench *out )
+{
+    System_kb *kb = ctx->kb;
+    *out = {};
+    out->first_diff = -1;
+    const uint32_t n_ctx = std::min<uint32_t>( GGML_PAD(std::max<int32_t>(n_tokens, 1), LLAMA_KV_EXTENT_STEP), kb->extent_cap / kv_context );
+    n_tokens = std::min<int32_t>( n_tokens, n_ctx );
+    if( n_tokens <= 0 ) return;
+
+    _Context *ctx_was = current_context;
+    struct llama_kv_cache *kv_was = ctx->kv_self;
+    const uint32_t n_ctx_was = ctx->cparams.n_ctx;
+    const int seq_start_was = ctx->sequential_start, seq_end_was = ctx->seq_end;
+    const int record_all_was = ctx->record_all;
+    current_context = ctx;
+
+    struct llama_kv_cache scratch;
+    scratch.prepare();
+    ctx->kv_self = &scratch;
+    ctx->cparams.n_ctx = n_ctx;
+    if( !llama_kv_cache_init(scratch, ctx->model, kb->type_k, GGML_TYPE_F16, kv_context*n_ctx, true) ) {
+        LLAMA_LOG_ERROR("%s: could not allocate a %u token scratch cache\n", __func__, n_ctx);
+    } else {
+        ctx->kb = NULL; // no actor is decoding: no stage metrics, no touched ranges
+        ctx->record_all = 0;
+        prepare_kv_cache(ctx, n_ctx, 1);
+
+        const int32_t n_vocab = llama_n_vocab(&ctx->model);
+        llama_batch batch = llama_batch_init(1, 0, 1);
+        auto pass = [&]( bool reuse, std::vector<llama_token> &toks, int32_t &n_built, int32_t &n_reused ) {
+            ctx->graph_reuse = reuse;
+            ctx->tg_graph.gf = nullptr;
+            const int32_t built_was = ctx->n_graph_build, reused_was = ctx->n_graph_reuse;
+            llama_token tok = llama_token_bos(&ctx->model);
+            const int64_t t0 = ggml_time_us();
+            for( int32_t pos=0; pos < n_tokens; pos++ ) {
+                batch.n_tokens = 1;
+                batch.token[0] = tok;
+                ctx->sequential_start = ctx->seq_end = pos;
+                if( llama_decode(ctx, batch) != 0 ) break;
+                const float *logits = llama_get_logits(ctx);
+                tok = (llama_token)( std::max_element(logits, logits + n_vocab) - logits );
+                toks.push_back(tok);
+            }
+            const int64_t t_us = ggml_time_us() - t0;
+            n_built = ctx->n_graph_build - built_was;
+            n_reused = ctx->n_graph_reuse - reused_was;
+            return t_us;
+        };
+
+        std::vector<llama_token> reused, fresh;
+        const int64_t t_reuse_us = pass( true, reused, out->n_built_reuse, out->n_reused );
+        const int64_t t_fresh_us = pass( false, fresh, out->n_built_fresh, out->n_reused_fresh );
+        ctx->graph_reuse = true;
+        ctx->tg_graph.gf = nullptr; // it points into the scratch cache
+
+        out->n_tokens = (int32_t)std::min(reused.size(), fresh.size());
+        out->t_reuse_ms = t_reuse_us / 1000.0;
+        out->t_fresh_ms = t_fresh_us / 1000.0;
+        out->reuse_tokens_per_s = t_reuse_us > 0 ? reused.size() * 1e6 / t_reuse_us : 0.0;
+        out->fresh_tokens_per_s = t_fresh_us > 0 ? fresh.size() * 1e6 / t_fresh_us : 0.0;
+        for( int32_t k=0; k<out->n_tokens; k++ ) {
+            if( reused[k] != fresh[k] ) {
+                out->first_diff = k;
+                break;
+            }
+        }
+        out->identical = reused.size() == fresh.size() && out->first_diff < 0;
+
+        llama_batch_free(batch);
+        ctx->kb = kb;
+    }
+    scratch.free_buffers();
+
+    ctx->kv_self = kv_was;
+    ctx->cparams.n_ctx = n_ctx_was;
+    ctx->sequential_start = seq_start_was;
+    ctx->seq_end = seq_end_was;
+    ctx->record_all = record_all_was;
+    current_context = ctx_was;
+    llama_reserve_prompt_batch(ctx);
+
+    LLAMA_LOG_INFO("%s: %d tokens: reused %8.2f ms (%.1f tokens/s, %d built), fresh %8.2f ms (%.1f tokens/s), %s\n",
+                   __func__, out->n_tokens, out->t_reuse_ms, out->reuse_tokens_per_s, out->n_built_reuse,
+                   out->t_fresh_ms, out->fresh_tokens_per_s, out->identical ? "identical" : "DIFFERENT");
+    if( !out->identical ) {
+        LLAMA_LOG_ERROR("%s: reused and fresh graphs diverge at token %d\n", __func__, out->first_diff);
+    }
+}
+
+// English prose for llama_bench_kv_types: the perplexity of synthetic word salad says little about
+// what quantizing K costs an actor.
+static const char *llama_kv_bench_text =
+    "The rain had not stopped since the morning, and by evening the road down to the harbour was more "
+    "river than road. Marta stood in the doorway of the inn with her hands wrapped around a cup of tea "
+    "that had long gone cold, watching the lamps come on one by one along the quay. Her brother had "
+    "promised to be back before dark. He always promised that, and he was always late, but tonight the "
+    "boats had come in early and his was not among them.\n"
+    "\"You will catch your death standing there,\" said the innkeeper, a broad man with flour on his "
+    "sleeves. \"Come inside. If he is out there, he will find his way to the fire like everyone else.\"\n"
+    "She thanked him but did not move. Somewhere past the breakwater a bell was ringing, slow and "
+    "uneven, the way it rang only when the sea was rough. She counted the strokes without meaning to. "
+    "When she reached twelve she set the cup down on the windowsill, pulled her coat tighter and "
+    "walked out into the rain towards the lighthouse, where old Tomas kept the logbook of every boat "
+    "that passed the point. If her brother had rounded it, Tomas would know, and if he had not, then "
+    "at least she would know that too.\n";
+
+// Feed the same text through a scratch KV cache with K stored as f16, q8_0 and q4_0 (V is transposed
+// and always f16), then greedy-decode a few tokens after it. Per type: cache bytes, prompt and token
+// times, perplexity of the text and how often its top token agrees with the f16 pass.
+int32_t llama_bench_kv_types( struct llama_context *ctx, int32_t n_tokens, struct llama_kv_type_bench *out, int32_t n_out )
+{
+    static const ggml_type types[] = { GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 };
+    const int32_t n_gen = 32;
+    System_kb *kb = ctx->kb;
+    const int32_t n_vocab = llama_n_vocab(&ctx->model);
+    const uint32_t n_ctx = std::min<uint32_t>( GGML_PAD(std::max<int32_t>(n_tokens, 2) + n_gen, LLAMA_KV_EXTENT_STEP), kb->extent_cap / kv_context );
+    if( (int32_t)n_ctx <= n_gen + 1 ) return 0;
+    n_tokens = std::min<int32_t>( std::max<int32_t>(n_tokens, 2), n_ctx - n_gen );
+
+    // the text, repeated if it is shorter than n_tokens (the repeats are easier to predict, for every type alike)
+    const int32_t text_len = (int32_t)strlen(llama_kv_bench_text);
+    std::vector<llama_token> text(text_len + 1);
+    const int32_t n_text = llama_tokenize(&ctx->model, llama_kv_bench_text, text_len, text.data(), text_len + 1, true, false);
+    if( n_text <= 1 ) return 0;
+    std::vector<llama_token> toks;
+    while( (int32_t)toks.size() < n_tokens ) {
+        toks.insert( toks.end(), text.begin() + ( toks.empty() ? 0 : 1 ), text.begin() + n_text );
+    }
+    toks.resize(n_tokens);
+
+    _Context *ctx_was = current_context;
+    struct llama_kv_cache *kv_was = ctx->kv_self;
+    const uint32_t n_ctx_was = ctx->cparams.n_ctx;
+    const int seq_start_was = ctx->sequential_start, seq_end_was = ctx->seq_end;
+    const int record_all_was = ctx->record_all;
+    current_context = ctx;
+    ctx->kb = NULL; // no actor is decoding: no stage metrics, no touched ranges
+
+    const int32_t n_batch = std::min<int32_t>( kb->n_batch, (int32_t)ctx->cparams.n_batch );
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    std::vector<llama_token> top_f16;
+    int32_t n_done = 0;
+    for( size_t ti=0; ti < sizeof(types)/sizeof(types[0]) && n_done < n_out; ti++ ) {
+        struct llama_kv_cache scratch;
+        scratch.prepare();
+        ctx->kv_self = &scratch;
+        ctx->cparams.n_ctx = n_ctx;
+        ctx->tg_graph.gf = nullptr;
+        if( !llama_kv_cache_init(scratch, ctx->model, types[ti], GGML_TYPE_F16, kv_context*n_ctx, true) ) {
+            LLAMA_LOG_ERROR("%s: could not allocate a %u token %s scratch cache\n", __func__, n_ctx, ggml_type_name(types[ti]));
+            scratch.free_buffers();
+            continue;
+        }
+        prepare_kv_cache(ctx, n_ctx, n_batch);
+
+        struct llama_kv_type_bench &r = out[n_done];
+        r = {};
+        r.type_k = types[ti];
+        r.kv_bytes = scratch.total_size();
+        r.n_tokens = n_tokens;
+
+        // the text, every position's logits kept for the perplexity
+        ctx->record_all = 1;
+        double nll = 0.0;
+        int32_t n_agree = 0, n_scored = 0;
+        std::vector<llama_token> top;
+        int64_t t0 = ggml_time_us();
+        for( int32_t pos=0; pos < n_tokens; pos += n_batch ) {
+            const int32_t n = std::min(n_batch, n_tokens - pos);
+            batch.n_tokens = n;
+            memcpy( batch.token, toks.data() + pos, n * sizeof(llama_token) );
+            ctx->sequential_start = ctx->seq_end = pos;
+            if( llama_decode(ctx, batch) != 0 ) break;
+            for( int32_t i=0; i<n && pos + i + 1 < n_tokens; i++ ) {
+                const float *logits = llama_get_logits_ith(ctx, i);
+                const float max_l = *std::max_element(logits, logits + n_vocab);
+                double sum = 0.0;
+                for( int32_t v=0; v<n_vocab; v++ ) sum += std::exp( (double)(logits[v] - max_l) );
+                nll += std::log(sum) + max_l - logits[ toks[pos + i + 1] ];
+                top.push_back( (llama_token)( std::max_element(logits, logits + n_vocab) - logits ) );
+                n_scored++;
+            }
+        }
+        int64_t t_us = ggml_time_us() - t0;
+        r.t_prompt_ms = t_us / 1000.0;
+        r.prompt_tokens_per_s = t_us > 0 ? n_tokens * 1e6 / t_us : 0.0;
+        r.nll = n_scored ? nll / n_scored : 0.0;
+        r.ppl = std::exp(r.nll);
+        if( ti == 0 ) top_f16 = top;
+        for( size_t k=0; k < top.size() && k < top_f16.size(); k++ ) {
+            n_agree += top[k] == top_f16[k];
+        }
+        r.top1_agree = top.empty() ? 0.0 : (double)n_agree / top.size();
+
+        // then single tokens, as an actor answers
+        ctx->record_all = 0;
+        llama_token tok = top.empty() ? llama_token_bos(&ctx->model) : top.back();
+        int32_t n_gen_done = 0;
+        t0 = ggml_time_us();
+        for( int32_t pos = n_tokens; pos < n_tokens + n_gen; pos++ ) {
+            batch.n_tokens = 1;
+            batch.token[0] = tok;
+            ctx->sequential_start = ctx->seq_end = pos;
+            if( llama_decode(ctx, batch) != 0 ) break;
+            const float *logits = llama_get_logits(ctx);
+            tok = (llama_token)( std::max_element(logits, logits + n_vocab) - logits );
+            n_gen_done++;
+        }
+        t_us = ggml_time_us() - t0;
+        r.t_token_ms = n_gen_done ? t_us / 1000.0 / n_gen_done : 0.0;
+
+        ctx->tg_graph.gf = nullptr; // it points into the scratch cache
+        scratch.free_buffers();
+        LLAMA_LOG_INFO("%s: K %-5s %8.2f MiB, prompt %8.1f tokens/s, %6.2f ms/token, ppl %8.4f, top-1 agrees with f16 %5.1f%%\n",
+                       __func__, ggml_type_name(r.type_k), r.kv_bytes / 1048576.0, r.prompt_tokens_per_s,
+                       r.t_token_ms, r.ppl, 100.0 * r.top1_agree);
+        n_done++;
+    }
+    llama_batch_free(batch);
+
+    ctx->kb = kb;
+    ctx->kv_self = kv_was;
+    ctx->cparams.n_ctx = n_ctx_was;
+    ctx->sequential_start = seq_start_was;
+    ctx->seq_end = seq_end_was;
+    ctx->record_all = record_all_was;
+    current_context = ctx_was;
+    llama_reserve_prompt_batch(ctx);
+    return n_done;
+}
+
 
 const char * llama_context_charname( llama_context *ctx )
 {
@@ -7527,6 +10108,10 @@ static void llm_load_vocab(
     */
     GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
 
+    if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        vocab.build_bpe_merges();
+    }
+
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         try {
@@ -9272,7 +11857,7 @@ struct llm_build_context {
         norm_eps         (hparams.f_norm_eps),
         norm_rms_eps     (hparams.f_norm_rms_eps),
         n_tokens         (batch.n_tokens),
-        n_kv             (worst_case ? lctx.kv_self->size : (lctx.seq_end+n_tokens) ),
+        n_kv             (worst_case ? lctx.kv_self->size : std::max<int32_t>(lctx.n_kv_graph, lctx.seq_end+n_tokens) ),
         kv_head          (worst_case ? (lctx.kv_self->size -n_tokens) : lctx.seq_end),
         n_orig_ctx       (cparams.n_yarn_orig_ctx),
         pooling_type     (cparams.pooling_type),
@@ -11975,6 +14560,8 @@ static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
     llama_batch dummy;
     dummy.n_tokens = 0;
 
+    lctx.tg_graph.gf = nullptr;
+
     llm_build_cb cb = [&](struct ggml_tensor * , const char * , int ) {
 
 
@@ -12019,6 +14606,8 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
+    lctx.tg_graph.gf = nullptr; // about to overwrite buf_compute_meta
+
     struct llm_build_context llm(lctx, batch, cb, worst_case);
 
     llm.init();
@@ -12153,7 +14742,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     ggml_backend_tensor_set(lctx.inp_pos, posn, 0, batch.n_tokens*sizeof(llama_pos) );
 
     const int64_t n_tokens = batch.n_tokens;
-    const int64_t n_kv     = lctx.seq_end + n_tokens;
+    const int64_t n_kv     = std::max<int64_t>(lctx.n_kv_graph, lctx.seq_end + n_tokens);
 
     assert(ggml_backend_buffer_is_host(lctx.inp_KQ_mask->buffer));
 
@@ -12176,12 +14765,93 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             data[j*n_kv+lctx.seq_end+jv] = 0.0;
         }*/
     }
-    pool_free(pattern);
+    pool_free(pattern);
+}
+
+
+void llama_idle_hold(struct llama_context * ctx)
+{
+    ctx->idle_holds++;
+    std::lock_guard<std::mutex> guard(ctx->idle_mutex); // let the step in flight finish
+}
+
+void llama_idle_release(struct llama_context * ctx)
+{
+    ctx->idle_last_us = ggml_time_us();
+    ctx->idle_releases++;
+    ctx->idle_holds--;
+}
+
+int64_t llama_idle_quiet_us(struct llama_context * ctx)
+{
+    if( ctx->idle_holds.load() > 0 ) return -1;
+    return ggml_time_us() - ctx->idle_last_us.load();
+}
+
+int32_t llama_idle_work(struct llama_context * ctx, int64_t budget_us)
+{
+    if( !ctx || !ctx->kb ) return 0;
+
+    llama_context *prev = current_context;
+    llama_bind_context(ctx);
+
+    const int64_t t_start_us = ggml_time_us();
+    int32_t n_steps = 0;
+    while( ggml_time_us() - t_start_us < budget_us ) {
+        std::lock_guard<std::mutex> guard(ctx->idle_mutex);
+        if( ctx->idle_holds.load() > 0 ) {
+            ctx->idle_stats.n_preempted++;
+            break;
+        }
+
+        const int64_t t_step_us = ggml_time_us();
+        int done;
+        try {
+            done = ctx->kb->idle_step();
+        } catch( const char *err ) {
+            LLAMA_LOG_ERROR("%s: %s\n", __func__, err);
+            break;
+        }
+        if( done == LLAMA_IDLE_NONE ) {
+            // the pool is shared by every session, so only go over it once per turn
+            uint64_t releases = ctx->idle_releases.load();
+            if( ctx->idle_compacted_at != releases ) {
+                size_t merged = pool_compact(LLAMA_IDLE_MAX_MERGES);
+                ctx->idle_stats.n_merged += merged;
+                if( merged < LLAMA_IDLE_MAX_MERGES ) {
+                    ctx->idle_compacted_at = releases;
+                }
+                done = merged > 0 ? LLAMA_IDLE_COMPACT : LLAMA_IDLE_NONE;
+            }
+        }
+        if( done == LLAMA_IDLE_NONE ) break;
+
+        switch( done ) {
+            case LLAMA_IDLE_JOURNAL: ctx->idle_stats.n_journals++; break;
+            case LLAMA_IDLE_EIDET:   ctx->idle_stats.n_eidets++;   break;
+            case LLAMA_IDLE_INDEX:   ctx->idle_stats.n_index++;    break;
+        }
+        ctx->idle_stats.n_steps++;
+        ctx->idle_stats.t_idle_ms += (ggml_time_us() - t_step_us) / 1000.0;
+        n_steps++;
+    }
+
+    llama_bind_context(prev);
+    return n_steps;
 }
 
+void llama_idle_get_stats(struct llama_context * ctx, struct llama_idle_stats * stats)
+{
+    std::lock_guard<std::mutex> guard(ctx->idle_mutex);
+    *stats = ctx->idle_stats;
+    stats->n_releases = ctx->idle_releases.load();
+}
 
+// Host idle hook: spends a slice on maintenance. The idle query picker below is still disabled,
+// so no prompt is returned.
 const char *llama_idle( llama_context *ctx, const char **keyptr, const char **fmtptr, int *max_gen )
 {
+    llama_idle_work(ctx, LLAMA_IDLE_SLICE_US);
     /*
     float max_weight=0;
     int i;
@@ -12216,6 +14886,111 @@ ggml_backend_t get_backend(ggml_tensor *x)
     return backend_res;
 }
 
+#define LLAMA_DECODE_GRAPH_BUCKET 128
+
+// remember a freshly built single-token graph along with the kv store views it writes through
+static void llama_keep_decode_graph(llama_context & lctx, ggml_cgraph * gf, struct ggml_tensor * res, struct ggml_tensor * embd, struct ggml_tensor * out_embds)
+{
+    auto & tg = lctx.tg_graph;
+    const auto & hparams = lctx.model.hparams;
+    llama_kv_cache * kv = lctx.kv_self;
+
+    std::unordered_map<const struct ggml_tensor *, size_t> cell_size;
+    for (size_t il = 0; il < kv->k_l.size(); il++) {
+        cell_size[kv->k_l[il]] = ggml_row_size(kv->k_l[il]->type, hparams.n_embd_k_gqa());
+        cell_size[kv->v_l[il]] = ggml_type_size(kv->v_l[il]->type);
+    }
+
+    tg.stores.clear();
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+        if (node->op != GGML_OP_CPY || node->view_src == NULL) {
+            continue;
+        }
+        auto it = cell_size.find(node->view_src);
+        if (it == cell_size.end()) {
+            continue;
+        }
+        tg.stores.push_back(std::make_pair(node, it->second));
+        tg.stores.push_back(std::make_pair(node->src[1], it->second));
+    }
+
+    tg.store_base.clear();
+    tg.buffer_size.clear(); // noted once it has run (llama_note_decode_graph)
+
+    tg.gf = gf;
+    tg.kv = kv;
+    tg.record_all = lctx.record_all;
+    tg.n_kv = lctx.n_kv_graph;
+    tg.kv_head = lctx.seq_end;
+    tg.res = res;
+    tg.embd = embd;
+    tg.out_embds = out_embds;
+}
+
+// the cached graph is patched in place, so it is only reused while nothing it points into has moved:
+// the kv tensors its stores view, and the compute buffers gallocr laid its nodes out in
+static bool llama_decode_graph_valid(llama_context & lctx)
+{
+    auto & tg = lctx.tg_graph;
+    bool valid = tg.buffer_size.size() == lctx.backends.size();
+    for (size_t i = 0; valid && i < lctx.backends.size(); i++) {
+        valid = tg.buffer_size[i] == ggml_backend_sched_get_buffer_size(lctx.sched, lctx.backends[i]);
+    }
+    for (size_t i = 0; valid && i < tg.stores.size(); i++) {
+        valid = tg.stores[i].first->view_src->data == tg.store_base[i];
+    }
+    if (!valid) {
+        LLAMA_LOG_INFO("%s: buffers moved since the decode graph was built, rebuilding it\n", __func__);
+        tg.gf = nullptr;
+    }
+    return valid;
+}
+
+// after the kept graph first ran, so the layout gallocr gave it is the one reuse is checked against
+static void llama_note_decode_graph(llama_context & lctx)
+{
+    auto & tg = lctx.tg_graph;
+    for (auto & st : tg.stores) {
+        tg.store_base.push_back(st.first->view_src->data);
+    }
+    for (auto * backend : lctx.backends) {
+        tg.buffer_size.push_back(ggml_backend_sched_get_buffer_size(lctx.sched, backend));
+    }
+}
+
+// after a reused graph ran: its kv stores must have written where they were moved to
+static void llama_check_decode_graph(llama_context & lctx)
+{
+    auto & tg = lctx.tg_graph;
+    for (auto & st : tg.stores) {
+        struct ggml_tensor * t = st.first;
+        if (t->data != (char *) t->view_src->data + t->view_offs) {
+            LLAMA_LOG_ERROR("%s: %s was allocated away from its kv cell, dropping the decode graph\n", __func__, t->name);
+            tg.gf = nullptr;
+            return;
+        }
+    }
+}
+
+// point the cached graph's kv stores at a new head; everything else only changes through the inputs
+static void llama_move_decode_graph(llama_context & lctx, int32_t kv_head)
+{
+    auto & tg = lctx.tg_graph;
+    const int64_t shift = (int64_t)kv_head - tg.kv_head;
+
+    for (auto & st : tg.stores) {
+        struct ggml_tensor * t = st.first;
+        t->view_offs = (size_t)((int64_t)t->view_offs + shift*(int64_t)st.second);
+        t->data = (char *) t->view_src->data + t->view_offs;
+        if (t->op == GGML_OP_VIEW) {
+            size_t offs = t->view_offs;
+            memcpy(t->op_params, &offs, sizeof(offs));
+        }
+    }
+    tg.kv_head = kv_head;
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -12233,6 +15008,8 @@ static int llama_decode_internal(
     if (n_tokens == 0) {
         return 0;
     }
+    LLAMA_TRACE_SCOPE(LLAMA_TRACE_DECODE, n_tokens);
+    llama_stage_timer stage_timer(lctx.kb, LLAMA_STAGE_DECODE, lctx.kb ? lctx.kb->kvuser[lctx.kb->current_kv] : NULL);
 
     if( lctx.ctx_ready == false ) {
         LLAMA_LOG_ERROR("%s: context not ready!", __func__);
@@ -12277,42 +15054,70 @@ static int llama_decode_internal(
 
     //lctx.kv_self->use_tokens(lctx.seq_end, batch.n_tokens);
 
-    //LLAMA_LOG_INFO("%s: build graph\n", __func__);
-    ggml_cgraph * gf = llama_build_graph(lctx, batch, false);
+    // single-token steps attend over a bucketed n_kv so the same graph serves the whole bucket
+    auto & tg = lctx.tg_graph;
+    bool single = n_tokens == 1 && batch.token && hparams.causal_attn;
+    lctx.n_kv_graph = single ? std::min<int32_t>(GGML_PAD(lctx.seq_end + 1, LLAMA_DECODE_GRAPH_BUCKET), kv_self->size) : 0;
 
-    // the output is always the last tensor in the graph
-    struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
-    struct ggml_tensor * embd = gf->nodes[gf->n_nodes - 2];
+    ggml_cgraph * gf;
+    struct ggml_tensor * res;
+    struct ggml_tensor * embd;
     struct ggml_tensor * out_embds = NULL;
 
-    if( lctx.record_all == 2 ) {
-        out_embds = gf->nodes[gf->n_nodes - 3];
-    }
-
-    //LLAMA_LOG_INFO("%s: do attention\n", __func__);
-    if (!hparams.causal_attn) {
-        res = nullptr; // do not extract logits for embedding models such as BERT
+    bool kept = false;
+    bool reused = single && lctx.graph_reuse && tg.gf && tg.kv == kv_self && tg.n_kv == lctx.n_kv_graph &&
+                  tg.record_all == lctx.record_all && llama_decode_graph_valid(lctx);
+    if (reused) {
+        llama_move_decode_graph(lctx, lctx.seq_end);
+        gf = tg.gf;
+        res = tg.res;
+        embd = tg.embd;
+        out_embds = tg.out_embds;
+        lctx.n_graph_reuse++;
+    } else {
+        //LLAMA_LOG_INFO("%s: build graph\n", __func__);
+        const int64_t t_graph_us = ggml_time_us();
+        gf = llama_build_graph(lctx, batch, false);
 
-        // token or sequence embeddings
-        embd = gf->nodes[gf->n_nodes - 1];
+        // the output is always the last tensor in the graph
+        res  = gf->nodes[gf->n_nodes - 1];
+        embd = gf->nodes[gf->n_nodes - 2];
         if( lctx.record_all == 2 ) {
-            out_embds = gf->nodes[gf->n_nodes - 2];
+            out_embds = gf->nodes[gf->n_nodes - 3];
         }
 
-        GGML_ASSERT(strcmp(embd->name, "result_embd") == 0 || strcmp(embd->name, "result_embd_pooled") == 0);
-    } else {
-        if (strcmp(res->name, "result_output") == 0) {
-            // the token embeddings could be the second to last tensor, or the third to last tensor
-            if (strcmp(embd->name, "result_norm") != 0) {
-                embd = gf->nodes[gf->n_nodes - 3];
-                if( lctx.record_all == 2 ) {
-                    out_embds = gf->nodes[gf->n_nodes - 4];
-                }
-                GGML_ASSERT(strcmp(embd->name, "result_norm") == 0);
+        //LLAMA_LOG_INFO("%s: do attention\n", __func__);
+        if (!hparams.causal_attn) {
+            res = nullptr; // do not extract logits for embedding models such as BERT
+
+            // token or sequence embeddings
+            embd = gf->nodes[gf->n_nodes - 1];
+            if( lctx.record_all == 2 ) {
+                out_embds = gf->nodes[gf->n_nodes - 2];
             }
+
+            GGML_ASSERT(strcmp(embd->name, "result_embd") == 0 || strcmp(embd->name, "result_embd_pooled") == 0);
         } else {
-            GGML_ASSERT(false && "missing result_output tensor");
+            if (strcmp(res->name, "result_output") == 0) {
+                // the token embeddings could be the second to last tensor, or the third to last tensor
+                if (strcmp(embd->name, "result_norm") != 0) {
+                    embd = gf->nodes[gf->n_nodes - 3];
+                    if( lctx.record_all == 2 ) {
+                        out_embds = gf->nodes[gf->n_nodes - 4];
+                    }
+                    GGML_ASSERT(strcmp(embd->name, "result_norm") == 0);
+                }
+            } else {
+                GGML_ASSERT(false && "missing result_output tensor");
+            }
+        }
+
+        if (single && lctx.graph_reuse) {
+            llama_keep_decode_graph(lctx, gf, res, embd, out_embds);
+            kept = true;
         }
+        lctx.t_graph_us += ggml_time_us() - t_graph_us;
+        lctx.n_graph_build++;
     }
 
     //LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
@@ -12333,9 +15138,17 @@ static int llama_decode_internal(
 
     //LLAMA_LOG_INFO("%s: run compute\n", __func__);
     llama_graph_compute(lctx, gf, n_threads);
+    if (reused) {
+        llama_check_decode_graph(lctx);
+    } else if (kept) {
+        llama_note_decode_graph(lctx);
+    }
 
     LLAMA_LOG_INFO("%s: compute done\n", __func__);
 
+    if (lctx.kb) {
+        lctx.kb->touch_kv(lctx.kv_self, lctx.seq_end, batch.n_tokens);
+    }
     lctx.seq_end += batch.n_tokens;
 
 
@@ -12454,7 +15267,6 @@ static int llama_decode_internal(
     return 0;
 }
 
-std::vector<ggml_backend_buffer_type_t> backend_buft;
 
 void prepare_kv_cache(struct llama_context *ctx, int n_ctx, int n_batch)
 {
@@ -12472,7 +15284,7 @@ void prepare_kv_cache(struct llama_context *ctx, int n_ctx, int n_batch)
 
     for (size_t i = 0; i < ctx->backends.size(); i++) {
         ggml_backend *backend = ctx->backends[i];
-        ggml_backend_buffer_type_t buft = backend_buft[i];
+        ggml_backend_buffer_type_t buft = ctx->backend_buft[i];
         size_t size = ggml_backend_sched_get_buffer_size(ctx->sched, backend);
         LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB\n", __func__,
                 ggml_backend_buft_name(buft),
@@ -12805,6 +15617,7 @@ struct llm_bigram_spm {
     llm_symbol::index right;
     float score;
     size_t size;
+    llama_vocab::id id;
 };
 
 struct llm_tokenizer_spm {
@@ -12814,6 +15627,8 @@ struct llm_tokenizer_spm {
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
+        symbols.reserve(text.size());
+        symbol_ids.reserve(text.size());
         while (offs < text.size()) {
             llm_symbol sym;
             size_t len = utf8_len(text[offs]);
@@ -12824,6 +15639,10 @@ struct llm_tokenizer_spm {
             sym.next = offs == text.size() ? -1 : index + 1;
             index++;
             symbols.emplace_back(sym);
+
+            scratch.assign(sym.text, sym.n);
+            auto token = vocab.token_to_id.find(scratch);
+            symbol_ids.push_back(token != vocab.token_to_id.end() ? token->second : -1);
         }
 
         // seed the work queue with all possible 2-character tokens.
@@ -12848,6 +15667,7 @@ struct llm_tokenizer_spm {
             // merge the right sym into the left one
             left_sym.n += right_sym.n;
             right_sym.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
 
             //LLAMA_LOG_INFO("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
 
@@ -12863,36 +15683,25 @@ struct llm_tokenizer_spm {
         }
 
         for (int i = 0; i != -1; i = symbols[i].next) {
-            auto & symbol = symbols[i];
-            resegment(symbol, output);
+            resegment(i, output);
         }
     }
 
 private:
-    void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
-
-        // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+    // every merged symbol was a vocab token when its bigram was queued, so only
+    // unmerged characters that are missing from the vocab fall back to bytes
+    void resegment(int i, std::vector<llama_vocab::id> & output) {
+        if (symbol_ids[i] >= 0) {
+            output.push_back(symbol_ids[i]);
             return;
         }
 
-        const auto p = rev_merge.find(text);
-
-        if (p == rev_merge.end()) {
-            // output any symbols that did not form tokens as bytes.
-            output.reserve(output.size() + symbol.n);
-            for (int j = 0; j < (int)symbol.n; ++j) {
-                llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
-                output.push_back(token_id);
-            }
-            return;
+        const auto & symbol = symbols[i];
+        output.reserve(output.size() + symbol.n);
+        for (int j = 0; j < (int)symbol.n; ++j) {
+            llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
+            output.push_back(token_id);
         }
-
-        resegment(symbols[p->second.first],  output);
-        resegment(symbols[p->second.second], output);
     }
 
     void try_add_bigram(int left, int right) {
@@ -12900,8 +15709,8 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
+        scratch.assign(symbols[left].text, symbols[left].n + symbols[right].n);
+        auto token = vocab.token_to_id.find(scratch);
 
         if (token == vocab.token_to_id.end()) {
             return;
@@ -12917,20 +15726,20 @@ private:
         bigram.left  = left;
         bigram.right = right;
         bigram.score = tok_data.score;
-        bigram.size  = text.size();
+        bigram.size  = scratch.size();
+        bigram.id    = (*token).second;
 
         work_queue.push(bigram);
-
-        // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
     }
 
     const llama_vocab & vocab;
 
     std::vector<llm_symbol> symbols;
+    std::vector<llama_vocab::id> symbol_ids;
     llm_bigram_spm::queue work_queue;
 
-    std::map<std::string, std::pair<int, int>> rev_merge;
+    // reused for vocab lookups so each candidate pair does not allocate
+    std::string scratch;
 };
 
 // BPE tokenizer
@@ -12950,9 +15759,9 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
     size_t size;
+    llama_vocab::id id;
 };
 
 struct llm_tokenizer_bpe {
@@ -12963,10 +15772,12 @@ struct llm_tokenizer_bpe {
         auto word_collection = bpe_gpt2_preprocess(text);
 
         symbols_final.clear();
+        symbol_ids_final.clear();
 
         for (auto & word : word_collection) {
             work_queue = llm_bigram_bpe::queue();
             symbols.clear();
+            symbol_ids.clear();
 
             int index = 0;
             size_t offset = 0;
@@ -12981,6 +15792,10 @@ struct llm_tokenizer_bpe {
                 sym.next = offset == word.size() ? -1 : index + 1;
                 index++;
                 symbols.emplace_back(sym);
+
+                scratch.assign(sym.text, sym.n);
+                auto token = vocab.token_to_id.find(scratch);
+                symbol_ids.push_back(token != vocab.token_to_id.end() ? token->second : -1);
             }
             for (size_t i = 1; i < symbols.size(); ++i) {
                 add_new_bigram(i - 1, i);
@@ -12994,18 +15809,16 @@ struct llm_tokenizer_bpe {
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
+                // symbols only grow to the right, so a changed size means the bigram is outdated
+                if (left_symbol.n == 0 || right_symbol.n == 0 ||
+                    left_symbol.n + right_symbol.n != bigram.size) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
                 right_symbol.n = 0;
+                symbol_ids[bigram.left] = bigram.id;
 
                 // remove the right sym from the chain
                 left_symbol.next = right_symbol.next;
@@ -13018,7 +15831,8 @@ struct llm_tokenizer_bpe {
             }
 
             // add the fnished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
+            for (size_t i = 0; i < symbols.size(); ++i) {
+                auto & sym = symbols[i];
                 if (sym.n > 0) {
                     sym.prev = final_prev_index;
                     sym.next = -1;
@@ -13026,6 +15840,7 @@ struct llm_tokenizer_bpe {
                         symbols_final[final_prev_index].next = symbols_final.size();
                     }
                     symbols_final.emplace_back(sym);
+                    symbol_ids_final.push_back(symbol_ids[i]);
                     final_prev_index = symbols_final.size() - 1;
                 }
             }
@@ -13039,6 +15854,10 @@ struct llm_tokenizer_bpe {
                 if (symbol.n == 0) {
                     continue;
                 }
+                if (symbol_ids_final[i] >= 0) {
+                    output.push_back(symbol_ids_final[i]);
+                    continue;
+                }
 
                 const std::string str = std::string(symbol.text, symbol.n);
                 const auto token = vocab.token_to_id.find(str);
@@ -13065,12 +15884,22 @@ private:
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
         int rank_found = -1;
+        llama_vocab::id merged = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (symbol_ids[left] >= 0 && symbol_ids[right] >= 0) {
+            rank_found = vocab.find_bpe_rank(symbol_ids[left], symbol_ids[right], merged);
+        } else {
+            // pieces that are not vocab tokens themselves still go through the string table
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+            rank_found = vocab.find_bpe_rank(left_token, right_token);
+            if (rank_found >= 0) {
+                auto token = vocab.token_to_id.find(left_token + right_token);
+                merged = token != vocab.token_to_id.end() ? token->second : -1;
+            }
+        }
 
         if (rank_found < 0) {
             return;
@@ -13080,9 +15909,9 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
+        bigram.size  = symbols[left].n + symbols[right].n;
         bigram.rank  = rank_found;
+        bigram.id    = merged;
 
         work_queue.push(bigram);
     }
@@ -13230,6 +16059,11 @@ private:
 
     std::vector<llm_symbol> symbols;
     std::vector<llm_symbol> symbols_final;
+    std::vector<llama_vocab::id> symbol_ids;
+    std::vector<llama_vocab::id> symbol_ids_final;
+
+    // reused for vocab lookups so each character does not allocate
+    std::string scratch;
 
     llm_bigram_bpe::queue work_queue;
 };
@@ -13506,32 +16340,92 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
     }
 }
 
-void llama_quick_tokenize( std::string raw_text, std::vector<llama_vocab::id> &output )
+// short strings (names, chat headers, single pieces) are tokenized over and over by the
+// memory and turn code, so keep their results in a small LRU keyed by string hash
+#define LLAMA_TOKENIZE_CACHE_SIZE 1024
+#define LLAMA_TOKENIZE_CACHE_MAXLEN 64
+
+struct llama_tokenize_cache {
+    struct entry {
+        std::string text;
+        std::vector<llama_vocab::id> tokens;
+    };
+
+    std::list<entry> lru;
+    std::unordered_map<size_t, std::list<entry>::iterator> index;
+    const llama_vocab *vocab = nullptr;
+    std::mutex lock;
+    uint64_t hits = 0, misses = 0;
+
+    bool find( const llama_vocab &v, size_t key, const std::string &text, std::vector<llama_vocab::id> &output )
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if( vocab != &v ) {
+            lru.clear();
+            index.clear();
+            vocab = &v;
+        }
+        auto it = index.find(key);
+        if( it == index.end() || it->second->text != text ) {
+            misses++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        output.insert(output.end(), it->second->tokens.begin(), it->second->tokens.end());
+        hits++;
+        return true;
+    }
+
+    void store( const llama_vocab &v, size_t key, const std::string &text, const llama_vocab::id *tokens, size_t n_tokens )
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if( vocab != &v ) {
+            return;
+        }
+        auto it = index.find(key);
+        if( it != index.end() ) { // hash collision, newest text wins
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        lru.push_front( entry{ text, std::vector<llama_vocab::id>(tokens, tokens + n_tokens) } );
+        index[key] = lru.begin();
+
+        if( lru.size() > LLAMA_TOKENIZE_CACHE_SIZE ) {
+            index.erase( std::hash<std::string>{}(lru.back().text) );
+            lru.pop_back();
+        }
+    }
+};
+
+static llama_tokenize_cache tokenize_cache;
+
+void llama_quick_tokenize( const std::string &raw_text, std::vector<llama_vocab::id> &output )
 {
     if (raw_text.empty()) {
         return;
     }
     const llama_vocab &vocab = current_model->vocab;
+    bool cacheable = raw_text.length() <= LLAMA_TOKENIZE_CACHE_MAXLEN;
+    size_t key = 0;
 
-    std::forward_list<fragment_buffer_variant> fragment_buffer;
-    fragment_buffer.emplace_front(raw_text, 0, raw_text.length());
+    if( cacheable ) {
+        key = std::hash<std::string>{}(raw_text);
+        if( tokenize_cache.find(vocab, key, raw_text, output) ) {
+            return;
+        }
+    }
 
-    for (const auto & fragment : fragment_buffer) {
-        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-            // without adding this leading whitespace, we do not get the same results as the original tokenizer
+    size_t first = output.size();
+    std::string text = raw_text;
 
-            // TODO: It's likely possible to get rid of this string copy entirely
-            //  by modifying llm_tokenizer_x to operate with string offsets like pre-tokenizer
-            //  and passing 'add space prefix' as bool argument
-            //
-            auto raw_text = fragment.raw_text.substr(fragment.offset, fragment.length);
+    llm_tokenizer_spm tokenizer(vocab);
+    llama_escape_whitespace(text);
+    tokenizer.tokenize(text, output);
 
-            llm_tokenizer_spm tokenizer(vocab);
-            llama_escape_whitespace(raw_text);
-            tokenizer.tokenize(raw_text, output);
-        } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-            output.push_back(fragment.token);
-        }
+    if( cacheable ) {
+        tokenize_cache.store(vocab, key, raw_text, output.data() + first, output.size() - first);
     }
 }
 
@@ -13625,6 +16519,75 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
     return output;
 }
 
+void llama_bench_tokenize( struct llama_context * ctx, size_t n_texts, struct llama_tokenize_bench * out )
+{
+    const llama_vocab &vocab = ctx->model.vocab;
+    static const char *common[] = { "the", "a", "and", "to", "of", "you", "i", "it", "in", "was", "that", "we",
+                                    "said", "look", "at", "there", "door", "light", "road", "time", "back", "night" };
+    std::mt19937 rng(42);
+    auto words = [&]( int n_words ) {
+        std::string str;
+        for( int w=0; w<n_words; w++ ) {
+            if( w ) str += ' ';
+            if( rng() % 3 == 0 ) str += "word" + std::to_string(rng() % 4096);
+            else str += common[ rng() % (sizeof(common)/sizeof(common[0])) ];
+        }
+        return str;
+    };
+
+    memset(out, 0, sizeof(*out));
+    out->n_texts = n_texts;
+
+    // merge loop: whole messages, too long for the cache
+    std::vector<std::string> texts(n_texts);
+    for( auto &t : texts ) {
+        t = "<|im_start|>user\n" + words(24 + rng() % 40) + "<|im_end|>";
+    }
+    std::vector<llama_vocab::id> toks;
+    int64_t t0 = ggml_time_us();
+    for( const auto &t : texts ) {
+        toks = llama_tokenize_internal(vocab, t, false, false);
+        out->n_bytes += t.size();
+        out->n_tokens += toks.size();
+    }
+    out->t_merge_ms = (ggml_time_us() - t0) / 1000.0;
+    out->merge_mb_per_s = out->t_merge_ms > 0 ? out->n_bytes / 1048576.0 / (out->t_merge_ms / 1000.0) : 0.0;
+
+    // LRU: as many short strings as it holds, once to fill it and once more out of it
+    std::vector<std::string> names(std::min<size_t>(std::max<size_t>(n_texts, 1), LLAMA_TOKENIZE_CACHE_SIZE));
+    for( size_t i=0; i<names.size(); i++ ) {
+        names[i] = "<|im_start|>" + words(1 + rng() % 3) + std::to_string(i);
+    }
+    llama_model *model_was = current_model;
+    current_model = &ctx->model;
+    {
+        std::lock_guard<std::mutex> guard(tokenize_cache.lock);
+        tokenize_cache.lru.clear();
+        tokenize_cache.index.clear();
+        tokenize_cache.vocab = nullptr;
+    }
+    const uint64_t hits_was = tokenize_cache.hits;
+    t0 = ggml_time_us();
+    for( const auto &n : names ) {
+        toks.clear();
+        llama_quick_tokenize(n, toks);
+    }
+    out->t_cold_ms = (ggml_time_us() - t0) / 1000.0;
+    t0 = ggml_time_us();
+    for( const auto &n : names ) {
+        toks.clear();
+        llama_quick_tokenize(n, toks);
+    }
+    out->t_cached_ms = (ggml_time_us() - t0) / 1000.0;
+    out->n_short = names.size();
+    out->hit_rate = (double)(tokenize_cache.hits - hits_was) / (2 * names.size());
+    current_model = model_was;
+
+    LLAMA_LOG_INFO("%s: %zu texts, %zu bytes -> %zu tokens in %.2f ms (%.2f MB/s); %zu short strings %.3f ms cold, %.3f ms cached (%.0f%% hits)\n",
+                   __func__, n_texts, out->n_bytes, out->n_tokens, out->t_merge_ms, out->merge_mb_per_s,
+                   out->n_short, out->t_cold_ms, out->t_cached_ms, out->hit_rate * 100.0);
+}
+
 //
 // grammar - internal
 //
@@ -14673,6 +17636,12 @@ llama_token llama_sample_token_greedy(struct llama_context * ctx, llama_token_da
 
 llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_array * candidates) {
     GGML_ASSERT(ctx);
+    return llama_sample_token(ctx, candidates, ctx->rng);
+}
+
+llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_array * candidates, std::mt19937 & rng) {
+    GGML_ASSERT(ctx);
+    LLAMA_TRACE_SCOPE(LLAMA_TRACE_SAMPLE, candidates->size);
 
     const int64_t t_start_sample_us = ggml_time_us();
     llama_sample_softmax(nullptr, candidates);
@@ -14684,7 +17653,6 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
     }
 
     std::discrete_distribution<> dist(probs.begin(), probs.end());
-    auto & rng = ctx->rng;
     int idx = dist(rng);
 
     llama_token result = candidates->data[idx].id;
@@ -16207,6 +19175,221 @@ int llama_process_tokens( std::string toname, std::string fromname, std::string
 {
     return current_kb->process_tokens(toname, fromname, input, tokens);
 }
+int llama_process_token_ids( std::string toname, std::string fromname, std::string text, const std::vector<int> &ids, std::vector<int> &tokens )
+{
+    tokens.insert(tokens.end(), ids.begin(), ids.end());
+    return current_kb->process_tokens(toname, fromname, text, tokens, ids.size());
+}
+void llama_kv_extent_limits( uint16_t extent_min, uint16_t extent_max )
+{
+    if( !current_kb ) return;
+    if( extent_max < extent_min ) std::swap(extent_min, extent_max);
+    extent_min = std::max<uint16_t>(extent_min, LLAMA_KV_EXTENT_STEP);
+    extent_max = std::min<uint32_t>(extent_max, current_kb->extent_cap);
+    extent_min = std::min(extent_min, extent_max);
+    current_kb->extent_min = extent_min;
+    current_kb->extent_max = extent_max; // slots are refit the next time their actor is picked
+}
+void llama_kv_slot_stats( int slot, uint32_t *extent, uint32_t *rebuilds, uint32_t *resizes )
+{
+    if( !current_kb || slot < 0 || slot > 2 ) throw "Invalid kv slot.";
+    if( extent ) *extent = current_kb->kv_extent[slot];
+    if( rebuilds ) *rebuilds = current_kb->n_reserve_rebuild[slot];
+    if( resizes ) *resizes = current_kb->n_kv_resize[slot];
+}
+void llama_kv_mem_stats( uint64_t *live, uint64_t *peak, uint64_t *capacity )
+{
+    if( !current_kb ) throw "No kb bound.";
+    std::lock_guard<std::mutex> lock(current_kb->mem_mutex);
+    if( live ) *live = current_kb->mem_live;
+    if( peak ) *peak = current_kb->mem_peak;
+    if( capacity ) *capacity = (uint64_t)current_kb->mem_chunks.size() * LLAMA_KV_MEM_CHUNK;
+}
+
+static const char *stage_names[LLAMA_STAGE_COUNT] = {
+    "useactor", "usemap", "prefit_write", "ragsearch", "eidet", "pick_talker", "decode", "kv_switch",
+};
+
+const char *llama_stage_name( int stage )
+{
+    if( stage < 0 || stage >= LLAMA_STAGE_COUNT ) return "unknown";
+    return stage_names[stage];
+}
+
+double llama_stage_percentile_ms( const struct llama_stage_metric *m, float p )
+{
+    if( m->count == 0 ) return 0;
+    uint64_t want = std::max<uint64_t>(1, (uint64_t)std::ceil(p * m->count));
+    uint64_t seen = 0;
+    for( int b=0; b<LLAMA_STAGE_BUCKETS-1; b++ ) {
+        seen += m->buckets[b];
+        if( seen >= want ) return 1e-3 * std::min<uint64_t>(1ull << b, m->max_us);
+    }
+    return 1e-3 * m->max_us;
+}
+
+void llama_metrics_begin_turn( struct llama_context *ctx )
+{
+    System_kb *kb = ctx->kb;
+    if( !kb ) return;
+    std::lock_guard<std::mutex> guard(kb->metrics_mutex);
+    memset(&kb->metrics_turn, 0, sizeof(kb->metrics_turn));
+    for( auto &am : kb->metrics_actor ) {
+        memset(&am.second.second, 0, sizeof(am.second.second));
+    }
+}
+
+void llama_metrics_add( struct llama_context *ctx, int stage, const char *actor, int64_t t_us )
+{
+    System_kb *kb = ctx->kb;
+    if( !kb || stage < 0 || stage >= LLAMA_STAGE_COUNT ) return;
+    kb->record_stage(stage, actor, t_us);
+}
+
+bool llama_metrics_get( struct llama_context *ctx, struct llama_stage_metrics *total, struct llama_stage_metrics *turn,
+                        std::vector<struct llama_actor_metrics> *actors )
+{
+    System_kb *kb = ctx->kb;
+    if( !kb ) return false;
+    std::lock_guard<std::mutex> guard(kb->metrics_mutex);
+    if( total ) *total = kb->metrics;
+    if( turn ) *turn = kb->metrics_turn;
+    if( actors ) {
+        actors->clear();
+        for( auto &am : kb->metrics_actor ) {
+            actors->push_back({ am.first, am.second.first, am.second.second });
+        }
+    }
+    return true;
+}
+
+void llama_metrics_reset( struct llama_context *ctx )
+{
+    System_kb *kb = ctx->kb;
+    if( !kb ) return;
+    std::lock_guard<std::mutex> guard(kb->metrics_mutex);
+    memset(&kb->metrics, 0, sizeof(kb->metrics));
+    memset(&kb->metrics_turn, 0, sizeof(kb->metrics_turn));
+    kb->metrics_actor.clear();
+}
+
+bool llama_estimate_memory( const char *path_model, int32_t n_ctx, int32_t n_gpu_layers, struct llama_mem_estimate *est )
+{
+    memset(est, 0, sizeof(*est));
+
+    struct ggml_context *ctx_meta = NULL;
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx_meta,
+    };
+    struct gguf_context *ctx = gguf_init_from_file(path_model, params);
+    if( !ctx ) {
+        LLAMA_LOG_ERROR("%s: could not read %s\n", __func__, path_model);
+        return false;
+    }
+
+    std::string arch;
+    int kid = gguf_find_key(ctx, "general.architecture");
+    if( kid >= 0 && gguf_get_kv_type(ctx, kid) == GGUF_TYPE_STRING )
+        arch = gguf_get_val_str(ctx, kid);
+    auto get_u32 = [ctx, &arch]( const char *key, uint32_t def ) -> uint32_t {
+        int k = gguf_find_key(ctx, (arch + "." + key).c_str());
+        return k < 0 ? def : gguf_get_val_u32(ctx, k);
+    };
+    const uint32_t n_layer   = get_u32("block_count", 0);
+    const uint32_t n_embd    = get_u32("embedding_length", 0);
+    const uint32_t n_ff      = get_u32("feed_forward_length", 4*n_embd);
+    const uint32_t n_head    = std::max<uint32_t>(get_u32("attention.head_count", 1), 1);
+    const uint32_t n_head_kv = get_u32("attention.head_count_kv", n_head);
+    const uint32_t n_embd_k  = get_u32("attention.key_length", n_embd / n_head) * n_head_kv;
+    const uint32_t n_embd_v  = get_u32("attention.value_length", n_embd / n_head) * n_head_kv;
+    int tok = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+    const size_t n_vocab = tok < 0 ? 0 : gguf_get_arr_n(ctx, tok);
+
+    // weights, split the way llm_load_tensors offloads them: the last n_gpu_layers repeating
+    // layers plus the output layer once every repeating layer is offloaded
+    const int64_t i_gpu_start = std::max<int64_t>((int64_t)n_layer - n_gpu_layers, 0);
+    for( int i = 0; i < gguf_get_n_tensors(ctx); i++ ) {
+        const char *name = gguf_get_tensor_name(ctx, i);
+        size_t sz = ggml_nbytes(ggml_get_tensor(ctx_meta, name));
+        est->weights += sz;
+
+        int il = -1;
+        if( sscanf(name, "blk.%d.", &il) == 1 ) {
+            if( n_gpu_layers > 0 && il >= i_gpu_start ) est->weights_gpu += sz;
+        } else if( strncmp(name, "output", 6) == 0 && n_gpu_layers > (int32_t)n_layer ) {
+            est->weights_gpu += sz;
+        }
+    }
+    gguf_free(ctx);
+    ggml_free(ctx_meta);
+
+    // the three actor slots at the extents usekv allocates them with
+    uint32_t cap = kv_context * std::max(n_ctx, 8);
+    uint32_t extent_max = std::min<uint32_t>(current_kb ? current_kb->extent_max : LLAMA_KV_EXTENT_MAX, cap);
+    uint32_t extents = std::min<uint32_t>(1024, cap) + 2*extent_max;
+    uint32_t widest = std::max<uint32_t>(std::min<uint32_t>(1024, cap), extent_max);
+
+    const size_t kv_per_token = (size_t)n_layer * (n_embd_k + n_embd_v) * ggml_type_size(GGML_TYPE_F16);
+    est->kv_slots = kv_per_token * extents;
+
+    // worst-case graph reserved by prepare_kv_cache: one kb batch over the widest slot
+    // (activations, feed-forward, KQ scores and logits, all f32); calibration may settle on any
+    // batch up to the context's n_batch, so size for that
+    const size_t n_batch = std::min<uint32_t>(LLAMA_PROMPT_BATCH_MAX, widest);
+    est->compute = n_batch * sizeof(float) * ( 4*(size_t)n_embd + 2*(size_t)n_ff + (size_t)n_head*widest + n_vocab );
+
+    // eidets keep their own copy of the K/V they were mapped from (system_eidet::build),
+    // so a kb with full slots holds that much again in host memory
+    const size_t eidet_per_token = 2 * 32 * 2048;
+    est->eidets = eidet_per_token * extents;
+
+    est->total = est->weights + est->kv_slots + est->compute + est->eidets;
+    return n_layer > 0;
+}
+
+int32_t llama_fill_kv_slots( struct llama_context *ctx )
+{
+    System_kb *kb = ctx->kb;
+    _Context *ctx_was = current_context;
+    llama_model *model_was = current_model;
+    struct llama_kv_cache *kv_was = ctx->kv_self;
+    const uint32_t n_ctx_was = ctx->cparams.n_ctx;
+    current_context = ctx;
+    current_model = &ctx->model;
+
+    int32_t n_new = 0;
+    for( int i=0; i<3; i++ ) {
+        if( kb->kv_ready[i] ) continue;
+        kb->allocslot(i); // no user yet: the first actor picked into it keeps the buffers
+        n_new++;
+    }
+
+    ctx->kv_self = kv_was;
+    ctx->cparams.n_ctx = n_ctx_was;
+    current_model = model_was;
+    current_context = ctx_was;
+    llama_reserve_prompt_batch(ctx);
+    return n_new;
+}
+
+void llama_memory_in_use( struct llama_context *ctx, struct llama_mem_estimate *used )
+{
+    memset(used, 0, sizeof(*used));
+    for( ggml_backend_buffer_t buf : ctx->model.bufs ) {
+        const size_t sz = ggml_backend_buffer_get_size(buf);
+        used->weights += sz;
+        if( !ggml_backend_buffer_is_host(buf) ) used->weights_gpu += sz;
+    }
+    for( int i=0; i<3; i++ ) {
+        if( ctx->kb->kv_ready[i] ) used->kv_slots += ctx->kb->kv[i].total_size();
+    }
+    for( auto *backend : ctx->backends ) {
+        used->compute += ggml_backend_sched_get_buffer_size(ctx->sched, backend);
+    }
+    // eidets come out of the same pool as the rest of the kb and are not counted apart from it
+    used->total = used->weights + used->kv_slots + used->compute;
+}
 
 struct llama_context *llama_select_context(struct llama_model *model, uint8_t ctx_n)
 {
@@ -16539,9 +19722,9 @@ struct llama_context * llama_new_context_with_model(
         for (ggml_backend *backend : ctx->backends) {
             if (ggml_backend_is_cpu(backend)) {
                 // use host buffers for the CPU backend compute buffer
-                backend_buft.push_back(llama_default_buffer_type_cpu(true));
+                ctx->backend_buft.push_back(llama_default_buffer_type_cpu(true));
             } else {
-                backend_buft.push_back(ggml_backend_get_default_buffer_type(backend));
+                ctx->backend_buft.push_back(ggml_backend_get_default_buffer_type(backend));
             }
         }
 
@@ -16550,7 +19733,7 @@ struct llama_context * llama_new_context_with_model(
         ctx->buf_compute_meta.resize(ggml_tensor_overhead()*LLAMA_MAX_NODES+ggml_graph_overhead_custom(LLAMA_MAX_NODES, false));
         LLAMA_LOG_INFO("%s: resize buf_compute_meta to %d\n", __func__, ctx->buf_compute_meta.size());
         if( !copyctx ) {
-            ctx->sched = ggml_backend_sched_new(ctx->backends.data(), backend_buft.data(), ctx->backends.size(), LLAMA_MAX_NODES);
+            ctx->sched = ggml_backend_sched_new(ctx->backends.data(), ctx->backend_buft.data(), ctx->backends.size(), LLAMA_MAX_NODES);
             LLAMA_LOG_INFO("%s: created new scheduler %p for context %p\n", __func__, ctx->sched, ctx);
 
 
@@ -16588,14 +19771,49 @@ struct llama_context * llama_new_context_with_model(
     current_kb = (System_kb*)pool_alloc(sizeof(System_kb));
     new (current_kb)  System_kb;
     current_kb->prepare();
-    LLAMA_LOG_INFO("Initializing KB.\n");
+    ctx->kb = current_kb;
+    current_kb->type_k = type_k;
+    current_kb->extent_cap = kv_context*cparams.n_ctx;
+    if( current_kb->extent_cap < current_kb->extent_max ) {
+        current_kb->extent_max = current_kb->extent_cap;
+        current_kb->extent_min = std::min(current_kb->extent_min, current_kb->extent_max);
+        LLAMA_LOG_WARN("%s: context n_ctx %u limits actor KV slots to %u tokens\n", __func__, cparams.n_ctx, current_kb->extent_max);
+    }
+    if( type_v != GGML_TYPE_F16 ) {
+        LLAMA_LOG_WARN("%s: V cache is stored transposed and cannot be quantized, using f16\n", __func__);
+    }
+    LLAMA_LOG_INFO("Initializing KB (K cache %s).\n", ggml_type_name(type_k));
     memcpy( &current_kb->hparams, &hparams, sizeof(llama_hparams) );
+    if( copyctx && copyctx->kb ) {
+        current_kb->n_batch = std::min<int32_t>( copyctx->kb->n_batch, cparams.n_batch ); // same weights, same answer
+    } else {
+        llama_calibrate_prompt_batch(ctx);
+    }
     current_kb->useactor("System");
     LLAMA_LOG_INFO("current_kb initialized\n");
     return ctx;
 }
 
+void llama_bind_context(struct llama_context * ctx) {
+    current_context = ctx;
+    current_kb = ctx ? ctx->kb : NULL;
+}
+
 void llama_free(struct llama_context * ctx) {
+    if( ctx->kb ) {
+        try {
+            ctx->kb->flushjournals();
+        } catch( const std::exception &e ) {
+            LLAMA_LOG_ERROR("%s: history entries not written: %s\n", __func__, e.what());
+        }
+        ctx->kb->release();
+        for( int i=0; i<3; i++ ) {
+            ctx->kb->kv[i].free_buffers();
+        }
+        if( current_kb == ctx->kb ) current_kb = NULL;
+        pool_free(ctx->kb);
+    }
+    if( current_context == ctx ) current_context = NULL;
 
     delete ctx;
 }
@@ -17273,6 +20491,45 @@ bool llama_save_session_file(struct llama_context * ctx, const char * path_sessi
     return true;
 }
 
+bool llama_save_scene(struct llama_context * ctx, const char * path_scene) {
+    try {
+        ctx->kb->save_scene(path_scene);
+    } catch (const char * err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err);
+        return false;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return false;
+    }
+    return true;
+}
+
+bool llama_save_checkpoint(struct llama_context * ctx, const char * path_checkpoint) {
+    try {
+        ctx->kb->save_scene(path_checkpoint, true);
+    } catch (const char * err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err);
+        return false;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return false;
+    }
+    return true;
+}
+
+bool llama_load_scene(struct llama_context * ctx, const char * path_scene) {
+    try {
+        ctx->kb->load_scene(path_scene);
+    } catch (const char * err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err);
+        return false;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return false;
+    }
+    return true;
+}
+
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
@@ -17357,8 +20614,8 @@ void llama_set_key( struct llama_context * ctx, std::string keyfor, std::string
             return;
         }
         if( a->mine ) {
-            a->mine->release();
-            pool_free( a->mine );
+            kv->freemem(a->mine, true);
+            a->mine = NULL;
             a->self = NULL;
         }
     } else if( a->keys.contains(key) ) {
@@ -17378,8 +20635,7 @@ void llama_set_key( struct llama_context * ctx, std::string keyfor, std::string
             }
         }
 
-        target->release();
-        pool_free(target);
+        kv->freemem(target, true);
     }
 
     // process the tokens
@@ -17421,8 +20677,8 @@ void llama_kv_cache_shift_fwd( struct llama_context *ctx, int fwd)
     LLAMA_LOG_INFO("shift_fwd(fwd=%d, seq_end=%d, moving %d tokens)\n", fwd, ctx->seq_end, moving_tokens);
     if( fwd < 64 )
         fwd=64;
-    if( fwd + ctx->seq_end > 4096 )
-        moving_tokens -= ( (fwd+ctx->seq_end) - 4096 );
+    if( fwd + ctx->seq_end > ctx->kv_self->size )
+        moving_tokens -= ( (fwd+ctx->seq_end) - ctx->kv_self->size );
 
     size_t empty_sz = 2048 * fwd;
     size_t moving_sz = 2048 * moving_tokens, moving_sz2 = 2 * moving_tokens;
@@ -17454,6 +20710,7 @@ void llama_kv_cache_shift_fwd( struct llama_context *ctx, int fwd)
     }
     pool_free(nd2);
     pool_free(nd);
+    if( ctx->kb ) ctx->kb->touch_kv(ctx->kv_self, ctx->sequential_start, fwd + moving_tokens);
 
     //ctx->kv_self->use_tokens(ctx->sequential_start, fwd, false);
     ctx->sequential_start += fwd;
@@ -17477,7 +20734,9 @@ void llama_kv_cache_shift_rev( struct llama_context *ctx, int target, int skip,
     };
 
 
-    Org_context llm(ctx->kv_self, ctx->buf_compute_meta, ctx->sched, ctx->model.hparams);
+    Org_context llm(ctx->kv_self, ctx->buf_compute_meta, ctx->sched, ctx->model.hparams,
+                    ctx->backend_cpu, ctx->cparams.n_threads_batch);
+    ctx->tg_graph.gf = nullptr; // about to overwrite buf_compute_meta
     llm.init();
 
     int readptr = target+skip;
@@ -17490,6 +20749,7 @@ void llama_kv_cache_shift_rev( struct llama_context *ctx, int target, int skip,
     }
 
     llm.shuffle_kv_now( readptr, ctx->seq_end, -skip );
+    if( ctx->kb ) ctx->kb->touch_kv(ctx->kv_self, target, range);
 
 
     //ctx->kv_self->use_tokens(ctx->seq_end-skip, skip, false);
@@ -17515,10 +20775,171 @@ int llama_kv_cache_reserve( struct llama_context *ctx, int tokens )
     return ctx->seq_end;
 }
 
+//
+// decode scheduler
+//
+// Sessions decode on their own threads (their actors and KV slots are bound there), so steps from
+// different sessions cannot share one graph. Instead every llama_decode() asks the scheduler thread
+// for a share of the core budget: pending steps are admitted as soon as threads free up, and the
+// free threads are split evenly between them, so several one-token steps run side by side instead
+// of each owning every core in turn. Packing the sessions' tokens into one multi-sequence batch would
+// need them to share one KV cache, which per-session actor slots rule out.
+//
+
+#define LLAMA_SCHED_LATENCY_SAMPLES 4096
+
+static int32_t llama_decode_step(struct llama_context * ctx, struct llama_batch batch);
+
+struct llama_sched_step {
+    int32_t n_tokens  = 0;
+    int32_t n_threads = 0; // set on admission
+    bool    admitted  = false;
+    int64_t t_queued_us = 0;
+};
+
+struct llama_decode_scheduler {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<llama_sched_step *> pending;
+    std::thread thread;
+    std::atomic<bool> running = false;
+    int32_t n_threads = 0;  // core budget shared by all sessions
+    int32_t n_used    = 0;  // threads handed to steps still decoding
+
+    int64_t  t_start_us = 0;
+    uint64_t n_steps  = 0;
+    uint64_t n_tokens = 0;
+    uint64_t n_shared = 0; // steps admitted alongside another running step
+    std::vector<int32_t> latency_us; // queue wait + decode, ring of the last samples
+    size_t latency_pos = 0;
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return !running || ( !pending.empty() && n_used < n_threads ); });
+            if (!running) break;
+
+            int32_t n_free = n_threads - n_used;
+            int32_t share  = std::max<int32_t>(1, n_free / (int32_t) pending.size());
+            size_t i = 0;
+            for (; i < pending.size() && n_used < n_threads; i++) {
+                llama_sched_step * step = pending[i];
+                step->n_threads = std::min(share, n_threads - n_used);
+                step->admitted  = true;
+                if (n_used > 0 || pending.size() > 1) n_shared++;
+                n_used += step->n_threads;
+            }
+            pending.erase(pending.begin(), pending.begin() + i);
+            cv.notify_all();
+        }
+        // let anything still waiting decode on its own
+        for (llama_sched_step * step : pending) {
+            step->admitted = true;
+        }
+        pending.clear();
+        cv.notify_all();
+    }
+
+    void record(int64_t t_us, int32_t tokens) {
+        if (latency_us.size() < LLAMA_SCHED_LATENCY_SAMPLES) {
+            latency_us.push_back((int32_t) t_us);
+        } else {
+            latency_us[latency_pos] = (int32_t) t_us;
+            latency_pos = (latency_pos + 1) % LLAMA_SCHED_LATENCY_SAMPLES;
+        }
+        n_steps++;
+        n_tokens += tokens;
+    }
+
+    int32_t percentile(float p) const {
+        if (latency_us.empty()) return 0;
+        std::vector<int32_t> sorted(latency_us);
+        size_t k = std::min(sorted.size() - 1, (size_t) (p * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+};
+
+static llama_decode_scheduler g_sched;
+
+void llama_scheduler_start(int32_t n_threads) {
+    llama_scheduler_stop();
+    std::lock_guard<std::mutex> guard(g_sched.mutex);
+    g_sched.n_threads  = n_threads > 0 ? n_threads : llama_pool_size();
+    // n_used carries over: steps admitted before a restart still hold their threads and give them back when done
+    g_sched.t_start_us = ggml_time_us();
+    g_sched.n_steps = g_sched.n_tokens = g_sched.n_shared = 0;
+    g_sched.latency_us.clear();
+    g_sched.latency_pos = 0;
+    g_sched.running = true;
+    g_sched.thread = std::thread([] { g_sched.loop(); });
+    LLAMA_LOG_INFO("%s: decode scheduler sharing %d threads\n", __func__, g_sched.n_threads);
+}
+
+void llama_scheduler_stop(void) {
+    {
+        std::lock_guard<std::mutex> guard(g_sched.mutex);
+        if (!g_sched.running) return;
+        g_sched.running = false;
+    }
+    g_sched.cv.notify_all();
+    g_sched.thread.join();
+}
+
+void llama_scheduler_get_stats(struct llama_scheduler_stats * stats) {
+    std::lock_guard<std::mutex> guard(g_sched.mutex);
+    double t_s = 1e-6 * std::max<int64_t>(1, ggml_time_us() - g_sched.t_start_us);
+    stats->running       = g_sched.running;
+    stats->n_threads     = g_sched.n_threads;
+    stats->n_steps       = g_sched.n_steps;
+    stats->n_tokens      = g_sched.n_tokens;
+    stats->n_shared      = g_sched.n_shared;
+    stats->tokens_per_s  = g_sched.t_start_us ? g_sched.n_tokens / t_s : 0.0;
+    stats->p50_ms        = 1e-3 * g_sched.percentile(0.50f);
+    stats->p99_ms        = 1e-3 * g_sched.percentile(0.99f);
+}
+
 int32_t llama_decode(
         struct llama_context * ctx,
         struct llama_batch   batch
         ) {
+    if (g_sched.running) {
+        llama_sched_step step;
+        step.n_tokens    = batch.n_tokens;
+        step.t_queued_us = ggml_time_us();
+
+        std::unique_lock<std::mutex> lock(g_sched.mutex);
+        if (!g_sched.running) {
+            // stopped since the check above: the loop has drained and nothing would admit this step
+            lock.unlock();
+            return llama_decode_step(ctx, batch);
+        }
+        g_sched.pending.push_back(&step);
+        g_sched.cv.notify_all();
+        g_sched.cv.wait(lock, [&step] { return step.admitted; });
+        lock.unlock();
+
+        uint32_t n_threads = ctx->cparams.n_threads, n_threads_batch = ctx->cparams.n_threads_batch;
+        if (step.n_threads > 0) {
+            ctx->cparams.n_threads = ctx->cparams.n_threads_batch = step.n_threads;
+        }
+        int32_t ret = llama_decode_step(ctx, batch);
+        ctx->cparams.n_threads       = n_threads;
+        ctx->cparams.n_threads_batch = n_threads_batch;
+
+        lock.lock();
+        g_sched.n_used -= step.n_threads;
+        g_sched.record(ggml_time_us() - step.t_queued_us, batch.n_tokens);
+        g_sched.cv.notify_all();
+        return ret;
+    }
+    return llama_decode_step(ctx, batch);
+}
+
+static int32_t llama_decode_step(
+        struct llama_context * ctx,
+        struct llama_batch   batch
+        ) {
 
     if( batch.n_tokens + ctx->seq_end > ctx->kv_self->size ) {
         LLAMA_LOG_INFO("kv_cache_over: %d + %d > %d\n", batch.n_tokens, ctx->seq_end, ctx->kv_self->size);
@@ -17937,6 +21358,46 @@ void llama_print_timings(struct llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (timings.t_end_ms - timings.t_start_ms), (timings.n_p_eval + timings.n_eval));
+    LLAMA_LOG_INFO("%s:  graph build time = %10.2f ms / %5d builds (%5d reused, %5.2f%% of eval time)\n",
+            __func__, 1e-3 * ctx->t_graph_us, ctx->n_graph_build, ctx->n_graph_reuse,
+            100.0 * ctx->t_graph_us / std::max<int64_t>(1, ctx->t_eval_us + ctx->t_p_eval_us));
+    if( g_sched.running ) {
+        llama_scheduler_stats st;
+        llama_scheduler_get_stats(&st);
+        LLAMA_LOG_INFO("%s:  decode scheduler = %8.2f tokens/s over %5llu steps (%5llu shared), p50 %8.2f ms, p99 %8.2f ms\n",
+                __func__, st.tokens_per_s, (unsigned long long) st.n_steps, (unsigned long long) st.n_shared, st.p50_ms, st.p99_ms);
+    }
+    if( current_kb ) {
+        for( int i=0; i<3; i++ ) {
+            if( !current_kb->kv_ready[i] ) continue;
+            LLAMA_LOG_INFO("%s:      kv slot %d = %5u tokens, %5u reserve rebuilds, %5u resizes\n", __func__, i,
+                    current_kb->kv_extent[i], current_kb->n_reserve_rebuild[i], current_kb->n_kv_resize[i]);
+        }
+        LLAMA_LOG_INFO("%s:   kv mem entries = %8zu live, %8zu peak, %8zu allocated\n", __func__,
+                current_kb->mem_live, current_kb->mem_peak, current_kb->mem_chunks.size() * LLAMA_KV_MEM_CHUNK);
+        llama_stage_metrics stages = {};
+        llama_metrics_get(ctx, &stages, NULL, NULL);
+        for( int i=0; i<LLAMA_STAGE_COUNT; i++ ) {
+            const llama_stage_metric &m = stages.stage[i];
+            if( m.count == 0 ) continue;
+            LLAMA_LOG_INFO("%s: %16s = %10.2f ms / %5llu calls, p50 %8.2f ms, p99 %8.2f ms, max %8.2f ms\n", __func__,
+                    llama_stage_name(i), 1e-3 * m.total_us, (unsigned long long) m.count,
+                    llama_stage_percentile_ms(&m, 0.50f), llama_stage_percentile_ms(&m, 0.99f), 1e-3 * m.max_us);
+        }
+        for( auto a : current_kb->actors ) {
+            LLAMA_LOG_INFO("%s: actor %-12s load %8.2f ms, save %8.2f ms, %5zu mem %5zu rag %5zu hist %5zu recent\n", __func__,
+                    a->name.c_str(), a->t_load_us / 1000.0, a->t_save_us / 1000.0,
+                    a->mem.size(), a->rags.size(), a->history.size(), a->recent.size());
+        }
+    }
+    llama_idle_stats idle;
+    llama_idle_get_stats(ctx, &idle);
+    if( idle.n_steps > 0 ) {
+        LLAMA_LOG_INFO("%s:  idle maintenance = %8.2f ms / %5llu steps (%llu eidets, %llu journals, %llu index, %llu merged, %llu preempted)\n",
+                __func__, idle.t_idle_ms, (unsigned long long) idle.n_steps, (unsigned long long) idle.n_eidets,
+                (unsigned long long) idle.n_journals, (unsigned long long) idle.n_index,
+                (unsigned long long) idle.n_merged, (unsigned long long) idle.n_preempted);
+    }
 }
 
 void llama_reset_timings(struct llama_context * ctx) {
@@ -17944,6 +21405,12 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->t_graph_us  = ctx->n_graph_build = ctx->n_graph_reuse = 0;
+    if( current_kb ) {
+        for( int i=0; i<3; i++ ) {
+            current_kb->n_reserve_rebuild[i] = current_kb->n_kv_resize[i] = 0;
+        }
+    }
 }
 
 const char * llama_print_system_info(void) {
@@ -42,6 +42,10 @@
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 4
 
+#define LLAMA_SCENE_MAGIC      0x6c73636eu // 'lscn'
+#define LLAMA_CHECKPOINT_MAGIC 0x6c73646cu // 'lsdl'
+#define LLAMA_SCENE_VERSION    2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -377,6 +381,47 @@ extern "C" {
     // Frees all allocated memory
     LLAMA_API void llama_free(struct llama_context * ctx);
 
+    // Make ctx (and the actors/KV slots it owns) the session used by this thread.
+    // Contexts created from the same model share its weights and may run on different threads.
+    LLAMA_API void llama_bind_context(struct llama_context * ctx);
+
+    struct llama_scheduler_stats {
+        bool     running;
+        int32_t  n_threads;
+        uint64_t n_steps;      // llama_decode calls that went through the scheduler
+        uint64_t n_tokens;
+        uint64_t n_shared;     // steps that ran alongside another session's step
+        double   tokens_per_s; // since llama_scheduler_start
+        double   p50_ms;       // step latency (queue wait + decode) over the last 4096 steps
+        double   p99_ms;
+    };
+
+    // Worker pool shared by all contexts, created once at model load. n_threads <= 0 uses the
+    // physical core count; pin binds each worker to its own physical core, NUMA node by node.
+    LLAMA_API void    llama_pool_start(int32_t n_threads, bool pin);
+    LLAMA_API void    llama_pool_stop(void);
+    LLAMA_API int32_t llama_pool_size(void);
+    LLAMA_API int32_t llama_physical_cores(void);
+
+    struct llama_pool_bench {
+        int32_t n_threads;
+        double  t_ms;          // one n_bytes copy split in 32 items
+        double  gb_per_s;
+    };
+
+    // The pool's scaling on the bulk copies it runs: n_bytes in 32 items at 1, 2, 4, ... threads up to
+    // the physical core count. The pool is resized for each and restored after; graph compute does not
+    // use the pool. Returns the number of sizes written to out.
+    LLAMA_API int32_t llama_bench_pool(size_t n_bytes, struct llama_pool_bench * out, int32_t n_out);
+
+    // Share n_threads cores (0 = the pool size) between the llama_decode calls of every session.
+    // Steps are admitted as threads free up and split the free threads evenly. This is not continuous
+    // batching: each session still decodes its own graph over its own KV slots; only the thread
+    // budget is shared.
+    LLAMA_API void llama_scheduler_start(int32_t n_threads);
+    LLAMA_API void llama_scheduler_stop(void);
+    LLAMA_API void llama_scheduler_get_stats(struct llama_scheduler_stats * stats);
+
     LLAMA_API int64_t llama_time_us(void);
 
     LLAMA_API size_t llama_max_devices(void);
@@ -426,6 +471,32 @@ extern "C" {
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
+    // Memory a model file needs once loaded into a kb, estimated from its GGUF header.
+    // weights_gpu is the part of weights offloaded by n_gpu_layers; total counts all of weights.
+    struct llama_mem_estimate {
+        size_t weights;
+        size_t weights_gpu;
+        size_t kv_slots;    // K/V of the three actor slots at their largest extents
+        size_t compute;     // worst-case graph reserved by prepare_kv_cache
+        size_t eidets;      // host copies of the K/V mapped into full slots
+        size_t total;
+    };
+
+    LLAMA_API bool llama_estimate_memory(
+                             const char * path_model,
+                                int32_t   n_ctx,
+                                int32_t   n_gpu_layers,
+              struct llama_mem_estimate * est);
+
+    // Allocate every actor slot that is not allocated yet, at the extent its next actor would get
+    // (llama_estimate_memory assumes the defaults), so what is in use can be held against the
+    // estimate. Returns the number of slots allocated.
+    LLAMA_API int32_t llama_fill_kv_slots(struct llama_context * ctx);
+
+    // The estimate's figures as allocated now: the model's buffers, the slots allocated so far and the
+    // compute buffers reserved. eidets stays 0; the kb's pool does not count them separately.
+    LLAMA_API void llama_memory_in_use(struct llama_context * ctx, struct llama_mem_estimate * used);
+
     // Get a llama model tensor
     LLAMA_API struct ggml_tensor * llama_get_model_tensor(struct llama_model * model, const char * name);
 
@@ -483,6 +554,27 @@ extern "C" {
                const llama_token * tokens,
                           size_t   n_token_count);
 
+    // Scene snapshot of the context's kb: the loaded actors, every ready actor KV slot with its
+    // map and marks, and the slots' tokens. Load maps the file and copies the KV out of it, so
+    // nothing is decoded again. Actor files are not written; save the actors first if the scene
+    // will be restored in another process, or the affected slots are laid out again on next use.
+    LLAMA_API bool llama_save_scene(
+            struct llama_context * ctx,
+                      const char * path_scene);
+
+    // Checkpoint: the same header as a scene, but only the KV ranges written since the last scene
+    // or checkpoint saved or loaded on this context. Falls back to a full scene when there is
+    // nothing to follow or a slot was resized since.
+    LLAMA_API bool llama_save_checkpoint(
+            struct llama_context * ctx,
+                      const char * path_checkpoint);
+
+    // Loads a scene, or a checkpoint on top of the scene or checkpoint it was saved after;
+    // a checkpoint fails if that is not the last one loaded or saved here.
+    LLAMA_API bool llama_load_scene(
+            struct llama_context * ctx,
+                      const char * path_scene);
+
     //
     // Decoding
     //
@@ -522,11 +614,121 @@ extern "C" {
         );
     LLAMA_API const char *llama_idle( struct llama_context *ctx, const char **keyptr, const char **fmtptr, int *max_gen );
 
+    // Idle maintenance: deferred work for a session between turns. Each step does one thing:
+    // flush an actor's history journal, precompute the eidet of a memory a slot actor is likely
+    // to recall, rebuild the keyword index, or compact the allocation pool.
+    // Up to LLAMA_JOURNAL_MAX (32) new history entries per actor wait in memory for a flush, a save,
+    // an unload or llama_free; a crash before any of those loses them.
+    // Foreground calls bracket themselves with hold/release. A hold waits for the step in flight
+    // (at most one prompt batch) and no step starts while any hold is outstanding.
+    struct llama_idle_stats {
+        uint64_t n_steps;
+        uint64_t n_eidets;     // memories precomputed into eidets
+        uint64_t n_journals;   // history journals flushed
+        uint64_t n_index;      // keyword index rebuilds
+        uint64_t n_merged;     // pool blocks merged
+        uint64_t n_preempted;  // llama_idle_work calls cut short by a hold
+        uint64_t n_releases;   // foreground releases so far; new work can only appear after one
+        double   t_idle_ms;    // time spent in steps
+    };
+
+    LLAMA_API void    llama_idle_hold(struct llama_context * ctx);
+    LLAMA_API void    llama_idle_release(struct llama_context * ctx);
+    // microseconds since the last release, -1 while a hold is outstanding
+    LLAMA_API int64_t llama_idle_quiet_us(struct llama_context * ctx);
+    // run steps on the calling thread until budget_us is spent, a hold arrives or nothing is left;
+    // returns the number of steps run (0 = nothing to do)
+    LLAMA_API int32_t llama_idle_work(struct llama_context * ctx, int64_t budget_us);
+    LLAMA_API void    llama_idle_get_stats(struct llama_context * ctx, struct llama_idle_stats * stats);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
     LLAMA_API void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch);
 
+    // Tokens per decode when a prompt is fed to an actor's KV slot. Picked by a short timing sweep
+    // when the context is created, at most llama_n_batch(ctx).
+    // n_batch <= 0 repeats the sweep; returns the size now in use
+    LLAMA_API int32_t llama_set_prompt_batch(struct llama_context * ctx, int32_t n_batch);
+    LLAMA_API int32_t llama_get_prompt_batch(const struct llama_context * ctx);
+
+    struct llama_prompt_bench {
+        int32_t n_batch;
+        int32_t n_tokens;      // decoded in batches of n_batch
+        double  t_ms;
+        double  tokens_per_s;
+    };
+
+    // Decode n_tokens synthetic tokens at batch sizes 32, 64, ... up to llama_n_batch(ctx) on a
+    // scratch KV cache; the actors' slots are left alone. Returns the number of sizes written to out.
+    LLAMA_API int32_t llama_bench_prompt(struct llama_context * ctx, int32_t n_tokens, struct llama_prompt_bench * out, int32_t n_out);
+
+    struct llama_graph_bench {
+        int32_t n_tokens;
+        double  t_reuse_ms;        // single-token graph built once per n_kv bucket and patched in between
+        double  t_fresh_ms;        // built for every token
+        double  reuse_tokens_per_s;
+        double  fresh_tokens_per_s;
+        int32_t n_built_reuse;
+        int32_t n_reused;
+        int32_t n_built_fresh;
+        int32_t n_reused_fresh;    // 0 unless reuse could not be switched off
+        bool    identical;         // both passes picked the same tokens
+        int32_t first_diff;        // index of the first token they disagree on, -1 if none
+    };
+
+    // Greedy-decode n_tokens from BOS on a scratch KV cache with decode graph reuse on, then off,
+    // and compare the tokens picked. The actors' slots are left alone.
+    LLAMA_API void llama_bench_decode_graph(struct llama_context * ctx, int32_t n_tokens, struct llama_graph_bench * out);
+
+    struct llama_kv_type_bench {
+        int32_t type_k;               // enum ggml_type
+        size_t  kv_bytes;             // of the scratch cache, K and V
+        int32_t n_tokens;
+        double  t_prompt_ms;
+        double  prompt_tokens_per_s;
+        double  t_token_ms;           // per greedy token after the text
+        double  nll;                  // mean negative log-likelihood of the text, nats
+        double  ppl;
+        double  top1_agree;           // share of positions whose top token matches the f16 pass
+    };
+
+    // Compare the K cache types the actor slots can use (f16, q8_0, q4_0; V stays f16) on n_tokens of
+    // built-in English text in a scratch KV cache. Returns the number of types written to out.
+    LLAMA_API int32_t llama_bench_kv_types(struct llama_context * ctx, int32_t n_tokens, struct llama_kv_type_bench * out, int32_t n_out);
+
+    struct llama_tokenize_bench {
+        size_t n_texts;
+        size_t n_bytes;        // of the whole messages
+        size_t n_tokens;       // they tokenized to
+        double t_merge_ms;
+        double merge_mb_per_s;
+        size_t n_short;
+        double t_cold_ms;      // every short string missing the cache
+        double t_cached_ms;    // the same strings again
+        double hit_rate;       // over both passes, 0.5 when every repeat hits
+    };
+
+    // Tokenizer throughput on synthetic chat text: n_texts whole messages through the SPM/BPE merge
+    // loop (too long for the cache), then short strings through the tokenize cache twice, cold and
+    // cached. The tokenize cache is emptied first.
+    LLAMA_API void llama_bench_tokenize(struct llama_context * ctx, size_t n_texts, struct llama_tokenize_bench * out);
+
+    struct llama_memory_bench {
+        size_t n_memories;
+        size_t store_bytes;       // Memory_store columns, arenas and dictionaries
+        size_t index_bytes;       // Kv_mem entries and the ragwordmap lists
+        double bytes_per_memory;  // (store_bytes + index_bytes) / n_memories
+        double t_build_ms;        // adding the memories to the store
+        double t_index_ms;        // collecting and merging their keywords
+        double t_map_ms;          // build_map1 + build_map2 with 256 recent entries, per call
+        double t_search_ms;       // the ragunmap keyword search, per query
+    };
+
+    // Footprint and speed of the actor memory store, measured on a scratch kb holding one actor with
+    // n_memories history entries of synthetic text. Nothing is decoded, but the model's tokenizer is used.
+    LLAMA_API void llama_bench_memories(struct llama_context * ctx, size_t n_memories, struct llama_memory_bench * out);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -859,8 +1061,28 @@ extern "C" {
 
 #include <vector>
 #include <unordered_map>
+#include <random>
+#include <string_view>
 
 LLAMA_API void llama_pick_actor( std::string actorname );
+// llama_sample_token drawing from the caller's generator instead of the context's, so a seeded
+// prompt replays the same tokens whatever else has sampled on the session in between
+LLAMA_API llama_token llama_sample_token(
+        struct llama_context * ctx,
+      llama_token_data_array * candidates,
+                std::mt19937 & rng);
+
+// one history entry for llama_import_memories; when is "time_Y_M_D_h_m_s_" as the .hst files
+// hold it, or empty for now. The views only need to live for the call.
+struct llama_memory_record {
+    std::string_view actor;
+    std::string_view who;
+    std::string_view when;
+    std::string_view what;
+};
+// llama_record_memory for many records at once: tokenized and indexed in parallel, written to each
+// actor's .hst file in one go. Returns how many were imported.
+LLAMA_API size_t llama_import_memories( const struct llama_memory_record *records, size_t n_records );
 uint16_t llama_tokenstr(
     llama_model *model,
     std::string text,
@@ -874,15 +1096,95 @@ static bool llama_kv_cache_init(
     uint32_t   n_ctx,
     bool   offload);
 extern struct llama_model *current_model;
-extern struct llama_context *current_context;
+extern thread_local struct llama_context *current_context;
 
 LLAMA_API void llama_mark_rewind(  );
 LLAMA_API void llama_rewind_to_mark(  );
 LLAMA_API void llama_mark_generation( std::string );
 LLAMA_API void llama_rewind_generation( std::string, std::vector<int> & );
 LLAMA_API void llama_query_actor_names( std::vector<std::string> & );
+// load the named actors (and link their history into the RAG word map) in parallel
+LLAMA_API void llama_load_actors( const std::vector<std::string> &names );
 LLAMA_API int llama_process_tokens( std::string toname, std::string fromname, std::string input, std::vector<llama_token> &tokens );
+LLAMA_API int llama_process_token_ids( std::string toname, std::string fromname, std::string text, const std::vector<llama_token> &ids, std::vector<llama_token> &tokens );
 LLAMA_API std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token);
+// bounds for the adaptive actor KV slots (tokens); each slot is sized from its actor's working set
+LLAMA_API void llama_kv_extent_limits( uint16_t extent_min, uint16_t extent_max );
+// current extent, reserve-space map rebuilds and reallocations of KV slot 0-2
+LLAMA_API void llama_kv_slot_stats( int slot, uint32_t *extent, uint32_t *rebuilds, uint32_t *resizes );
+// Kv_mem entries handed out now, the most ever handed out at once, and entries allocated in chunks
+LLAMA_API void llama_kv_mem_stats( uint64_t *live, uint64_t *peak, uint64_t *capacity );
+
+// In-memory tracing: every thread records (timestamp, tag, value) events into its own ring of the
+// last LLAMA_TRACE_RING events; llama_trace_export writes them as Chrome trace / Perfetto JSON.
+// A disabled tag costs one relaxed load at the call site.
+enum llama_trace_tag {
+    LLAMA_TRACE_SP_SEARCH,      // Sparse_list lookups, value = step reached
+    LLAMA_TRACE_SP_SEARCH_UB,
+    LLAMA_TRACE_SP_INSERT,
+    LLAMA_TRACE_SP_ERASE,
+    LLAMA_TRACE_SP_ALLOC,       // KV slot reserve-space allocator
+    LLAMA_TRACE_SP_FREE,
+    LLAMA_TRACE_USEMAP,         // span: laying an actor's memories out in a KV slot, value = slot
+    LLAMA_TRACE_FIT_EXTENT,     // span: resizing a KV slot, value = new extent
+    LLAMA_TRACE_PROCESS,        // span: writing a message into the KV slot, value = message bytes
+    LLAMA_TRACE_DECODE,         // span: llama_decode_internal, value = batch tokens
+    LLAMA_TRACE_SAMPLE,         // span: llama_sample_token, value = candidates
+    LLAMA_TRACE_COUNT
+};
+#define LLAMA_TRACE_ALL  ((1ull << LLAMA_TRACE_COUNT) - 1)
+#define LLAMA_TRACE_RING 8192
+
+// bit (1 << tag) per llama_trace_tag to record; 0 stops recording, the rings keep their events
+LLAMA_API void llama_trace_enable( uint64_t mask );
+LLAMA_API const char *llama_trace_tag_name( int tag );
+// forget the events recorded so far
+LLAMA_API void llama_trace_clear( void );
+// may run while other threads record; events they overwrite during the copy are dropped
+LLAMA_API bool llama_trace_export( const char *path );
+
+// Latency of the multi-actor stages of a session, kept for the session and per actor, over the
+// whole session and over the current turn. Stages nest: useactor includes the usemap and
+// prefit_write it triggers, ragsearch the useactor it ends with.
+enum llama_stage {
+    LLAMA_STAGE_USEACTOR,       // picking a KV slot for an actor and building its map
+    LLAMA_STAGE_USEMAP,         // laying the map out in the slot
+    LLAMA_STAGE_PREFIT_WRITE,   // uploading the eidets usemap placed
+    LLAMA_STAGE_RAGSEARCH,      // ragunmap: pulling matching old memories into the actor's rags
+    LLAMA_STAGE_EIDET,          // reading an eidet back out of the slot
+    LLAMA_STAGE_PICK_TALKER,    // polling for the next speaker
+    LLAMA_STAGE_DECODE,         // llama_decode batches
+    LLAMA_STAGE_KV_SWITCH,      // useactor calls that lay a different actor out in the slot
+    LLAMA_STAGE_COUNT
+};
+#define LLAMA_STAGE_BUCKETS 24
+
+struct llama_stage_metric {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[LLAMA_STAGE_BUCKETS]; // bucket i: calls under 2^i us; the last takes the rest
+};
+struct llama_stage_metrics {
+    struct llama_stage_metric stage[LLAMA_STAGE_COUNT];
+};
+struct llama_actor_metrics {
+    std::string actor;
+    struct llama_stage_metrics total;
+    struct llama_stage_metrics turn;
+};
+
+LLAMA_API const char *llama_stage_name( int stage );
+// upper bound of the bucket holding percentile p (0-1), capped at max_us, in ms
+LLAMA_API double llama_stage_percentile_ms( const struct llama_stage_metric *m, float p );
+// clear the per-turn metrics of the session and its actors
+LLAMA_API void llama_metrics_begin_turn( struct llama_context *ctx );
+// for stages timed outside llama.cpp; actor may be NULL
+LLAMA_API void llama_metrics_add( struct llama_context *ctx, int stage, const char *actor, int64_t t_us );
+// false if the context has no kb
+LLAMA_API bool llama_metrics_get( struct llama_context *ctx, struct llama_stage_metrics *total, struct llama_stage_metrics *turn,
+                                  std::vector<struct llama_actor_metrics> *actors );
+LLAMA_API void llama_metrics_reset( struct llama_context *ctx );
 LLAMA_API int llama_poll_vocab( std::unordered_map< std::string, int > &searchspace, float *logits );
 
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
@@ -1,7 +1,9 @@
 #define LLAMAMODEL_H_I_KNOW_WHAT_I_AM_DOING_WHEN_INCLUDING_THIS_FILE
 #include "llamamodel_impl.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
@@ -10,15 +12,19 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <numeric>
 //#include <random>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <sys/stat.h>
+
 #include <llama.h>
 #include <ggml.h>
 #ifdef GGML_USE_KOMPUTE
@@ -84,7 +90,8 @@ static int llama_sample_top_p_top_k(
         float min_p,
         float temp,
         float repeat_penalty,
-        int32_t pos) {
+        int32_t pos,
+        std::mt19937 *rng) {
     auto logits = llama_get_logits_ith(ctx, pos);
     auto n_vocab = llama_n_vocab(llama_get_model(ctx));
     // Populate initial list of all candidates
@@ -112,17 +119,7 @@ static int llama_sample_top_p_top_k(
     //std::cerr << "running sample temp\n";
     llama_sample_temp(ctx, &candidates_p, temp);
     //std::cerr << "sampling token\n";
-    return llama_sample_token(ctx, &candidates_p);
-}
-
-std::string get_arch_name(gguf_context *ctx_gguf) {
-    std::string arch_name;
-    const int kid = gguf_find_key(ctx_gguf, "general.architecture");
-    enum gguf_type ktype = gguf_get_kv_type(ctx_gguf, kid);
-    if (ktype != (GGUF_TYPE_STRING)) {
-        throw std::runtime_error("ERROR: Can't get general architecture from gguf file.");
-    }
-    return gguf_get_val_str(ctx_gguf, kid);
+    return rng ? llama_sample_token(ctx, &candidates_p, *rng) : llama_sample_token(ctx, &candidates_p);
 }
 
 static gguf_context *load_gguf(const char *fname) {
@@ -146,25 +143,148 @@ static gguf_context *load_gguf(const char *fname) {
     return ctx;
 }
 
-static int32_t get_arch_key_u32(std::string const &modelPath, std::string const &archKey) {
+// What the model picker asks of a GGUF file, read from its header once and then served from
+// a cache keyed by path, size and mtime. The cache is persisted next to the models in
+// GGUF_INDEX_NAME so a later run can list a directory without opening any model.
+#define GGUF_INDEX_NAME    ".gguf-index"
+#define GGUF_INDEX_VERSION 1
+
+struct GGUFInfo {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool valid = false;         // header parsed and has general.architecture
+    std::string arch;
+    int32_t n_ctx_train = -1;   // <arch>.context_length
+    int32_t n_layer = -1;       // <arch>.block_count
+    int32_t n_vocab = -1;
+    bool has_pooling = false;   // <arch>.pooling_type present
+    bool blacklisted = false;
+};
+
+static std::mutex s_gguf_mutex;
+static std::unordered_map<std::string, GGUFInfo> s_gguf_cache;
+static std::unordered_set<std::string> s_gguf_dirs; // directories whose index has been read
+
+static bool gguf_stat(const std::string &path, uint64_t &size, int64_t &mtime) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    size = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+}
+
+static std::string gguf_dir_of(const std::string &path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+static bool gguf_scan(const std::string &modelPath, GGUFInfo &info) {
     auto * ctx = load_gguf(modelPath.c_str());
     if (!ctx)
-        return -1;
-    std::string arch = get_arch_name(ctx);
-
-    int32_t value = -1;
-    if (ctx) {
-        auto key = arch + "." + archKey;
-        int keyidx = gguf_find_key(ctx, key.c_str());
-        if (keyidx != -1) {
-            value = gguf_get_val_u32(ctx, keyidx);
-        } else {
-            std::cerr << __func__ << ": " << key << "not found in " << modelPath << "\n";
-        }
+        return false;
+
+    int kid = gguf_find_key(ctx, "general.architecture");
+    if (kid < 0 || gguf_get_kv_type(ctx, kid) != GGUF_TYPE_STRING) {
+        std::cerr << __func__ << ": no general architecture in " << modelPath << "\n";
+        gguf_free(ctx);
+        return false;
     }
+    info.arch = gguf_get_val_str(ctx, kid);
+
+    auto get_u32 = [ctx, &info](const char *key) -> int32_t {
+        int keyidx = gguf_find_key(ctx, (info.arch + "." + key).c_str());
+        return keyidx < 0 ? -1 : (int32_t)gguf_get_val_u32(ctx, keyidx);
+    };
+    info.n_ctx_train = get_u32("context_length");
+    info.n_layer = get_u32("block_count");
+    info.has_pooling = gguf_find_key(ctx, (info.arch + ".pooling_type").c_str()) >= 0;
+
+    int token_idx = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+    info.n_vocab = token_idx < 0 ? -1 : gguf_get_arr_n(ctx, token_idx);
+
+    // check for known bad models
+    int name_idx = gguf_find_key(ctx, "general.name");
+    info.blacklisted = name_idx >= 0 && token_idx >= 0
+        && gguf_get_val_str(ctx, name_idx) == "open-orca_mistral-7b-openorca"s
+        && info.n_vocab == 32002
+        && gguf_get_arr_str(ctx, token_idx, 32000) == "<dummy32000>"s; // should be <|im_end|>
 
     gguf_free(ctx);
-    return value;
+    info.valid = true;
+    return true;
+}
+
+// one line per file: name, size, mtime, valid, arch, n_ctx_train, n_layer, n_vocab, has_pooling, blacklisted
+static void gguf_read_index(const std::string &dir) {
+    std::ifstream in(dir + GGUF_INDEX_NAME);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != "gguf-index " + std::to_string(GGUF_INDEX_VERSION))
+        return;
+
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        GGUFInfo info;
+        if (!std::getline(fields, name, '\t'))
+            continue;
+        fields >> info.size >> info.mtime >> info.valid >> info.arch >> info.n_ctx_train >> info.n_layer
+               >> info.n_vocab >> info.has_pooling >> info.blacklisted;
+        if (fields.fail())
+            continue;
+        if (info.arch == "-")
+            info.arch.clear();
+        s_gguf_cache.emplace(dir + name, std::move(info));
+    }
+}
+
+// rewrite the directory's index from the cache, dropping files that are gone or have changed
+static void gguf_write_index(const std::string &dir) {
+    std::string path = dir + GGUF_INDEX_NAME;
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out)
+            return; // read-only model directory: stay cached in memory only
+        out << "gguf-index " << GGUF_INDEX_VERSION << "\n";
+        for (const auto &[file, info] : s_gguf_cache) {
+            if (file.size() <= dir.size() || file.compare(0, dir.size(), dir) != 0
+                || file.find_first_of("/\\", dir.size()) != std::string::npos)
+                continue;
+            uint64_t size;
+            int64_t mtime;
+            if (!gguf_stat(file, size, mtime) || size != info.size || mtime != info.mtime)
+                continue;
+            out << file.substr(dir.size()) << '\t' << info.size << ' ' << info.mtime << ' ' << info.valid << ' '
+                << (info.arch.empty() ? "-" : info.arch) << ' ' << info.n_ctx_train << ' ' << info.n_layer << ' '
+                << info.n_vocab << ' ' << info.has_pooling << ' ' << info.blacklisted << "\n";
+        }
+        if (!out)
+            return;
+    }
+    std::remove(path.c_str());
+    std::rename(tmp.c_str(), path.c_str());
+}
+
+static GGUFInfo gguf_info(const std::string &modelPath) {
+    GGUFInfo info;
+    if (!gguf_stat(modelPath, info.size, info.mtime))
+        return info;
+
+    std::string dir = gguf_dir_of(modelPath);
+    std::lock_guard<std::mutex> lock(s_gguf_mutex);
+    if (s_gguf_dirs.insert(dir).second)
+        gguf_read_index(dir);
+
+    auto it = s_gguf_cache.find(modelPath);
+    if (it != s_gguf_cache.end() && it->second.size == info.size && it->second.mtime == info.mtime)
+        return it->second;
+
+    // unreadable files are cached too, so a broken download is only opened once
+    gguf_scan(modelPath, info);
+    s_gguf_cache[modelPath] = info;
+    gguf_write_index(dir);
+    return info;
 }
 
 struct LLamaPrivate {
@@ -172,12 +292,14 @@ struct LLamaPrivate {
     bool modelLoaded = false;
     int device = -1;
     llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
     llama_model_params model_params;
     llama_context_params ctx_params;
     int64_t n_threads = 0;
     std::vector<LLModel::Token> end_tokens;
     const char *backend_name = nullptr;
+    ggml_type kv_type = GGML_TYPE_F16;
+    bool pin_threads = false;
+    int refs = 0; // sessions sharing these weights
 };
 
 LLamaPrivate *mass_ptr = nullptr;
@@ -185,89 +307,53 @@ LLamaPrivate *mass_ptr = nullptr;
 LLamaModel::LLamaModel() {
     d_ptr = mass_ptr ? mass_ptr : new LLamaPrivate();
     if( !mass_ptr ) mass_ptr = d_ptr;
+    d_ptr->refs++;
 }
 
-// default hparams (LLaMA 7B)
-struct llama_file_hparams {
-    uint32_t n_vocab = 32000;
-    uint32_t n_embd  = 4096;
-    uint32_t n_mult  = 256;
-    uint32_t n_head  = 32;
-    uint32_t n_layer = 32;
-    uint32_t n_rot   = 64;
-    enum llama_ftype ftype = LLAMA_FTYPE_MOSTLY_F16;
-};
-
 size_t LLamaModel::requiredMem(const std::string &modelPath, int n_ctx, int ngl) {
-    // TODO(cebtenzzre): update to GGUF
-    (void)ngl; // FIXME(cetenzzre): use this value
-    auto fin = std::ifstream(modelPath, std::ios::binary);
-    fin.seekg(0, std::ios_base::end);
-    size_t filesize = fin.tellg();
-    fin.seekg(0, std::ios_base::beg);
-    uint32_t magic = 0;
-    fin.read(reinterpret_cast<char*>(&magic), sizeof(magic));
-    if (magic != 0x67676a74) return 0;
-    uint32_t version = 0;
-    fin.read(reinterpret_cast<char*>(&version), sizeof(version));
-    llama_file_hparams hparams;
-    fin.read(reinterpret_cast<char*>(&hparams.n_vocab), sizeof(hparams.n_vocab));
-    fin.read(reinterpret_cast<char*>(&hparams.n_embd), sizeof(hparams.n_embd));
-    fin.read(reinterpret_cast<char*>(&hparams.n_head), sizeof(hparams.n_head));
-    fin.read(reinterpret_cast<char*>(&hparams.n_layer), sizeof(hparams.n_layer));
-    fin.read(reinterpret_cast<char*>(&hparams.n_rot), sizeof(hparams.n_rot));
-    fin.read(reinterpret_cast<char*>(&hparams.ftype), sizeof(hparams.ftype));
-    const size_t kvcache_element_size = 2; // fp16
-    const size_t est_kvcache_size = hparams.n_embd * hparams.n_layer * 2u * 3*n_ctx * kvcache_element_size;
-    return filesize + est_kvcache_size;
+    MemoryEstimate est;
+    return estimateMemory(modelPath, n_ctx, ngl, est) ? est.total : 0;
 }
 
-bool LLamaModel::isModelBlacklisted(const std::string &modelPath) const {
-    auto * ctx = load_gguf(modelPath.c_str());
-    if (!ctx) {
-        std::cerr << __func__ << ": failed to load " << modelPath << "\n";
+bool LLamaModel::estimateMemory(const std::string &modelPath, int n_ctx, int ngl, MemoryEstimate &est) {
+    llama_mem_estimate e;
+    if (!llama_estimate_memory(modelPath.c_str(), n_ctx, ngl, &e))
         return false;
-    }
-
-    auto get_key = [ctx, &modelPath](const char *name) {
-        int keyidx = gguf_find_key(ctx, name);
-        if (keyidx == -1) {
-            throw std::logic_error(name + " not found in "s + modelPath);
-        }
-        return keyidx;
-    };
+    est.weights = e.weights;
+    est.weightsGpu = e.weights_gpu;
+    est.kvSlots = e.kv_slots;
+    est.compute = e.compute;
+    est.eidets = e.eidets;
+    est.total = e.total;
+    return true;
+}
 
-    bool res = false;
-    try {
-        std::string name(gguf_get_val_str(ctx, get_key("general.name")));
-        int token_idx = get_key("tokenizer.ggml.tokens");
-        int n_vocab = gguf_get_arr_n(ctx, token_idx);
-
-        // check for known bad models
-        if (name == "open-orca_mistral-7b-openorca"
-            && n_vocab == 32002
-            && gguf_get_arr_str(ctx, token_idx, 32000) == "<dummy32000>"s // should be <|im_end|>
-        ) {
-            res = true;
-        }
-    } catch (const std::logic_error &e) {
-        std::cerr << __func__ << ": " << e.what() << "\n";
-    }
+bool LLamaModel::memoryInUse(MemoryEstimate &used, bool fillSlots) {
+    if (!m_ctx) return false;
+    auto hold = bindSession();
+    if (fillSlots) llama_fill_kv_slots(m_ctx);
+    llama_mem_estimate e;
+    llama_memory_in_use(m_ctx, &e);
+    used.weights = e.weights;
+    used.weightsGpu = e.weights_gpu;
+    used.kvSlots = e.kv_slots;
+    used.compute = e.compute;
+    used.eidets = e.eidets;
+    used.total = e.total;
+    return true;
+}
 
-    gguf_free(ctx);
-    return res;
+bool LLamaModel::isModelBlacklisted(const std::string &modelPath) const {
+    return gguf_info(modelPath).blacklisted;
 }
 
 bool LLamaModel::isEmbeddingModel(const std::string &modelPath) const {
-    auto *ctx_gguf = load_gguf(modelPath.c_str());
-    if (!ctx_gguf) {
+    GGUFInfo info = gguf_info(modelPath);
+    if (!info.valid) {
         std::cerr << __func__ << ": failed to load GGUF from " <<  modelPath << "\n";
         return false;
     }
-
-    std::string arch = get_arch_name(ctx_gguf);
-    gguf_free(ctx_gguf);
-    return is_embedding_arch(arch);
+    return is_embedding_arch(info.arch);
 }
 
 bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
@@ -287,7 +373,7 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
             llama_free_model(d_ptr->model);
             d_ptr->model = nullptr;
         }
-        d_ptr->ctx = nullptr;
+        m_ctx = nullptr;
 
         // -- load the model --
 
@@ -344,6 +430,8 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
         if (isEmbedding) {
             d_ptr->ctx_params.n_batch = n_ctx;
         } else {
+            // room for the prompt batch calibration to pick from; the logits and KQ mask scale with it
+            d_ptr->ctx_params.n_batch = std::min<uint32_t>(LLMODEL_MAX_PROMPT_BATCH, n_ctx);
             if (n_ctx > n_ctx_train) {
                 std::cerr << "warning: model was trained on only " << n_ctx_train << " context tokens ("
                           << n_ctx << " specified)\n";
@@ -351,16 +439,17 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
         }
 
         d_ptr->ctx_params.n_ctx   = n_ctx;
-        d_ptr->ctx_params.type_k  = params.kv_type;
+        d_ptr->ctx_params.type_k  = d_ptr->kv_type;
         d_ptr->ctx_params.type_v  = params.kv_type;
 
         // The new batch API provides space for n_vocab*n_tokens logits. Tell llama.cpp early
         // that we want this many logits so the state serializes consistently.
         d_ptr->ctx_params.logits_all = true;
 
-        d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+        d_ptr->n_threads = llama_physical_cores();
         d_ptr->ctx_params.n_threads       = d_ptr->n_threads;
         d_ptr->ctx_params.n_threads_batch = d_ptr->n_threads;
+        llama_pool_start(d_ptr->n_threads, d_ptr->pin_threads);
 
         //if (isEmbedding)
             d_ptr->ctx_params.embeddings = true;
@@ -384,9 +473,12 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
     }
 
     d_ptr->ctx_params.seed    = -1;
-    d_ptr->ctx = llama_new_context_with_model(d_ptr->model, d_ptr->ctx_params);
+    if (m_ctx) {
+        llama_free(m_ctx);
+    }
+    m_ctx = llama_new_context_with_model(d_ptr->model, d_ptr->ctx_params);
 
-    if (!d_ptr->ctx) {
+    if (!m_ctx) {
         fflush(stdout);
         std::cerr << "LLAMA ERROR: failed to init context for model " <<  modelPath << std::endl;
         llama_free_model(d_ptr->model);
@@ -402,30 +494,59 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
 
 void LLamaModel::setThreadCount(int32_t n_threads) {
     d_ptr->n_threads = n_threads;
-    llama_set_n_threads(d_ptr->ctx, n_threads, n_threads);
+    llama_set_n_threads(m_ctx, n_threads, n_threads);
+    llama_pool_start(n_threads, d_ptr->pin_threads);
+}
+bool LLamaModel::setThreadAffinity(bool pin)
+{
+    d_ptr->pin_threads = pin;
+    if (d_ptr->modelLoaded) {
+        llama_pool_start(d_ptr->n_threads, pin);
+    }
+    return true;
+}
+bool LLamaModel::setKvCacheType(const std::string &type)
+{
+    if( type == "f16" ) {
+        d_ptr->kv_type = GGML_TYPE_F16;
+    } else if( type == "q8_0" ) {
+        d_ptr->kv_type = GGML_TYPE_Q8_0;
+    } else if( type == "q4_0" ) {
+        d_ptr->kv_type = GGML_TYPE_Q4_0;
+    } else {
+        std::cerr << "setKvCacheType: unsupported type '" << type << "'\n";
+        return false;
+    }
+    return true;
 }
 void LLamaModel::markRewind(void)
 {
+    auto hold = bindSession();
     llama_mark_rewind();
 }
 void LLamaModel::rewindToMark(void)
 {
+    auto hold = bindSession();
     llama_rewind_to_mark();
 }
 void LLamaModel::markGeneration(std::string mark)
 {
+    auto hold = bindSession();
     llama_mark_generation(mark);
 }
 void LLamaModel::rewindGeneration(std::string what, std::vector<int> &tokens)
 {
+    auto hold = bindSession();
     llama_rewind_generation(what, tokens);
 }
 void LLamaModel::queryActorNames(std::vector<std::string> &names)
 {
+    auto hold = bindSession();
     llama_query_actor_names(names);
 }
 int LLamaModel::pollVocab( std::unordered_map< std::string, int > &searchspace, float *logits )
 {
+    auto hold = bindSession();
     return llama_poll_vocab(searchspace, logits);
 }
 
@@ -435,7 +556,264 @@ int32_t LLamaModel::threadCount() const {
 
 LLamaModel::~LLamaModel()
 {
+    setIdleWork(-1);
+    if (m_ctx) {
+        llama_free(m_ctx);
+        m_ctx = nullptr;
+    }
+    if (--d_ptr->refs > 0) {
+        return; // other sessions still use the weights
+    }
     llama_free_model(d_ptr->model);
+    if (mass_ptr == d_ptr) {
+        mass_ptr = nullptr;
+    }
+    delete d_ptr;
+}
+
+LLamaModel::SessionHold::SessionHold(llama_context *ctx) : ctx(ctx)
+{
+    if (ctx) llama_idle_hold(ctx);
+}
+
+LLamaModel::SessionHold::~SessionHold()
+{
+    if (ctx) llama_idle_release(ctx);
+}
+
+LLamaModel::SessionHold LLamaModel::bindSession() const
+{
+    llama_bind_context(m_ctx);
+    return SessionHold(m_ctx);
+}
+
+void LLamaModel::holdIdle(bool hold)
+{
+    if (!m_ctx) return;
+    if (hold) {
+        llama_idle_hold(m_ctx);
+    } else {
+        llama_idle_release(m_ctx);
+    }
+}
+
+bool LLamaModel::setIdleWork(int32_t quiet_ms)
+{
+    if (m_idleThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            m_idleStop = true;
+        }
+        m_idleCv.notify_all();
+        m_idleThread.join();
+    }
+    m_idleQuietMs = quiet_ms;
+    if (quiet_ms < 0) return true;
+    if (!m_ctx) return false;
+    m_idleStop = false;
+    m_idleThread = std::thread([this] { idleLoop(); });
+    return true;
+}
+
+void LLamaModel::idleLoop()
+{
+    uint64_t idle_at = UINT64_MAX; // releases seen when the last pass found nothing to do
+    std::unique_lock<std::mutex> lock(m_idleMutex);
+    while (!m_idleStop) {
+        m_idleCv.wait_for(lock, std::chrono::milliseconds(std::max(m_idleQuietMs, 10)));
+        if (m_idleStop) break;
+
+        const int64_t quiet_us = llama_idle_quiet_us(m_ctx);
+        if (quiet_us < (int64_t)m_idleQuietMs * 1000) continue; // in use, or not quiet for long enough
+        llama_idle_stats stats;
+        llama_idle_get_stats(m_ctx, &stats);
+        if (stats.n_releases == idle_at) continue; // nothing can have changed since the last pass
+
+        lock.unlock();
+        int32_t n_steps = llama_idle_work(m_ctx, 100000);
+        lock.lock();
+        if (n_steps == 0) idle_at = stats.n_releases;
+    }
+}
+
+LLModel *LLamaModel::openSession()
+{
+    if (!d_ptr->modelLoaded || !d_ptr->model) {
+        std::cerr << __func__ << ": no model is loaded\n";
+        return nullptr;
+    }
+    auto *session = new LLamaModel();
+    session->m_implementation = m_implementation;
+    session->m_supportsEmbedding = m_supportsEmbedding;
+    session->m_supportsCompletion = m_supportsCompletion;
+    session->m_ctx = llama_new_context_with_model(d_ptr->model, d_ptr->ctx_params);
+    llama_bind_context(m_ctx); // creating a context binds it; give this thread back its session
+    if (!session->m_ctx) {
+        std::cerr << "LLAMA ERROR: failed to init session context\n";
+        delete session;
+        return nullptr;
+    }
+    return session;
+}
+
+bool LLamaModel::setDecodeScheduler(int32_t n_threads)
+{
+    if (n_threads < 0) {
+        llama_scheduler_stop();
+    } else {
+        llama_scheduler_start(n_threads);
+    }
+    return true;
+}
+
+bool LLamaModel::setTracing(bool enabled)
+{
+    llama_trace_enable(enabled ? LLAMA_TRACE_ALL : 0);
+    return true;
+}
+
+bool LLamaModel::exportTrace(const std::string &path)
+{
+    return llama_trace_export(path.c_str());
+}
+
+static_assert(LLModel::MetricBuckets == LLAMA_STAGE_BUCKETS);
+
+static void addStageMetrics(std::vector<LLModel::StageMetrics> &out, const llama_stage_metrics &stages,
+                            const std::string &actor, bool turn)
+{
+    for (int i = 0; i < LLAMA_STAGE_COUNT; i++) {
+        const llama_stage_metric &m = stages.stage[i];
+        if (m.count == 0) continue;
+        LLModel::StageMetrics sm;
+        sm.stage = llama_stage_name(i);
+        sm.actor = actor;
+        sm.turn = turn;
+        sm.count = m.count;
+        sm.totalMs = 1e-3 * m.total_us;
+        sm.maxMs = 1e-3 * m.max_us;
+        sm.p50Ms = llama_stage_percentile_ms(&m, 0.50f);
+        sm.p99Ms = llama_stage_percentile_ms(&m, 0.99f);
+        std::copy(std::begin(m.buckets), std::end(m.buckets), sm.buckets);
+        out.push_back(std::move(sm));
+    }
+}
+
+bool LLamaModel::getMetrics(std::vector<StageMetrics> &metrics) const
+{
+    if (!m_ctx) return false;
+    llama_stage_metrics total, turn;
+    std::vector<llama_actor_metrics> actors;
+    if (!llama_metrics_get(m_ctx, &total, &turn, &actors)) return false;
+
+    metrics.clear();
+    addStageMetrics(metrics, total, "", false);
+    addStageMetrics(metrics, turn, "", true);
+    for (const auto &am : actors) {
+        addStageMetrics(metrics, am.total, am.actor, false);
+        addStageMetrics(metrics, am.turn, am.actor, true);
+    }
+    return true;
+}
+
+void LLamaModel::resetMetrics()
+{
+    if (m_ctx) llama_metrics_reset(m_ctx);
+}
+
+int32_t LLamaModel::setPromptBatch(int32_t n_batch)
+{
+    if (!m_ctx) return 0;
+    auto hold = bindSession();
+    return llama_set_prompt_batch(m_ctx, n_batch);
+}
+
+int32_t LLamaModel::promptBatch() const
+{
+    return m_ctx ? llama_get_prompt_batch(m_ctx) : 0;
+}
+
+bool LLamaModel::benchPromptBatch(int32_t n_tokens, std::vector<PromptBatchResult> &results)
+{
+    if (!m_ctx) return false;
+    auto hold = bindSession();
+    llama_prompt_bench out[16];
+    int32_t n = llama_bench_prompt(m_ctx, n_tokens, out, 16);
+    results.clear();
+    for (int32_t i = 0; i < n; i++) {
+        results.push_back({ out[i].n_batch, out[i].n_tokens, out[i].t_ms, out[i].tokens_per_s });
+    }
+    return n > 0;
+}
+
+bool LLamaModel::runBench(const std::string &which, int64_t n, std::vector<BenchFigure> &figures)
+{
+    if (!m_ctx) return false;
+    auto hold = bindSession();
+    figures.clear();
+    if (which == "tokenize") {
+        llama_tokenize_bench out;
+        llama_bench_tokenize(m_ctx, n > 0 ? (size_t)n : 10000, &out);
+        figures = { { "texts", (double)out.n_texts }, { "bytes", (double)out.n_bytes }, { "tokens", (double)out.n_tokens },
+                    { "merge_ms", out.t_merge_ms }, { "merge_mb_per_s", out.merge_mb_per_s },
+                    { "short", (double)out.n_short }, { "cold_ms", out.t_cold_ms }, { "cached_ms", out.t_cached_ms },
+                    { "hit_rate", out.hit_rate } };
+        return true;
+    }
+    if (which == "memories") {
+        llama_memory_bench out;
+        llama_bench_memories(m_ctx, n > 0 ? (size_t)n : 100000, &out);
+        figures = { { "memories", (double)out.n_memories }, { "store_bytes", (double)out.store_bytes },
+                    { "index_bytes", (double)out.index_bytes }, { "bytes_per_memory", out.bytes_per_memory },
+                    { "mb_per_100k", out.bytes_per_memory * 100000 / (1024.0 * 1024.0) },
+                    { "build_ms", out.t_build_ms }, { "index_ms", out.t_index_ms }, { "map_ms", out.t_map_ms },
+                    { "search_ms", out.t_search_ms } };
+        return true;
+    }
+    if (which == "pool") {
+        llama_pool_bench out[8];
+        int32_t k = llama_bench_pool(n > 0 ? (size_t)n << 20 : (size_t)256 << 20, out, 8);
+        for (int32_t i = 0; i < k; i++) {
+            std::string t = "threads_" + std::to_string(out[i].n_threads);
+            figures.push_back({ t + "_ms", out[i].t_ms });
+            figures.push_back({ t + "_gb_per_s", out[i].gb_per_s });
+        }
+        return k > 0;
+    }
+    if (which == "decode_graph") {
+        llama_graph_bench out;
+        llama_bench_decode_graph(m_ctx, n > 0 ? (int32_t)n : 256, &out);
+        figures = { { "tokens", (double)out.n_tokens }, { "reuse_ms", out.t_reuse_ms }, { "fresh_ms", out.t_fresh_ms },
+                    { "reuse_tokens_per_s", out.reuse_tokens_per_s }, { "fresh_tokens_per_s", out.fresh_tokens_per_s },
+                    { "built_reuse", (double)out.n_built_reuse }, { "reused", (double)out.n_reused },
+                    { "built_fresh", (double)out.n_built_fresh }, { "identical", out.identical ? 1.0 : 0.0 },
+                    { "first_diff", (double)out.first_diff } };
+        return out.n_tokens > 0;
+    }
+    if (which == "kv_type") {
+        llama_kv_type_bench out[3];
+        int32_t k = llama_bench_kv_types(m_ctx, n > 0 ? (int32_t)n : 512, out, 3);
+        for (int32_t i = 0; i < k; i++) {
+            std::string t = ggml_type_name((ggml_type)out[i].type_k);
+            figures.push_back({ t + "_kv_mb", out[i].kv_bytes / (1024.0 * 1024.0) });
+            figures.push_back({ t + "_prompt_tokens_per_s", out[i].prompt_tokens_per_s });
+            figures.push_back({ t + "_token_ms", out[i].t_token_ms });
+            figures.push_back({ t + "_ppl", out[i].ppl });
+            figures.push_back({ t + "_top1_agree", out[i].top1_agree });
+        }
+        return k > 0;
+    }
+    return false;
+}
+
+void LLamaModel::beginTurn()
+{
+    if (m_ctx) llama_metrics_begin_turn(m_ctx);
+}
+
+void LLamaModel::pickTime(const std::string &actor, int64_t t_us)
+{
+    if (m_ctx) llama_metrics_add(m_ctx, LLAMA_STAGE_PICK_TALKER, actor.empty() ? nullptr : actor.c_str(), t_us);
 }
 
 bool LLamaModel::isModelLoaded() const
@@ -446,8 +824,8 @@ bool LLamaModel::isModelLoaded() const
 void LLamaModel::releaseContext(uint8_t ctx_n)
 {
     llama_context *tgt = llama_release_context(d_ptr->model, ctx_n);
-    if( d_ptr->ctx == tgt ) {
-        d_ptr->ctx = nullptr;
+    if( m_ctx == tgt ) {
+        m_ctx = nullptr;
     }
 }
 
@@ -456,9 +834,9 @@ bool LLamaModel::selectContext(uint8_t ctx_n)
 {
     std::cerr << "SelectContext(" << ctx_n << ")\n";
     llama_context *c = llama_select_context(d_ptr->model, ctx_n);
-    return c ? (d_ptr->ctx = c) : false;
+    return c ? (m_ctx = c) : false;
     /*if( c ) {
-        d_ptr->ctx = c;
+        m_ctx = c;
         return true;
     }
     return false;*/
@@ -474,46 +852,70 @@ uint8_t LLamaModel::viewContext(uint8_t ctx_n)
 
 size_t LLamaModel::stateSize() const
 {
-    return llama_get_state_size(d_ptr->ctx);
+    auto hold = bindSession();
+    return llama_get_state_size(m_ctx);
 }
 
 size_t LLamaModel::saveState(uint8_t *dest) const
 {
-    return llama_copy_state_data(d_ptr->ctx, dest);
+    auto hold = bindSession();
+    return llama_copy_state_data(m_ctx, dest);
 }
 
 size_t LLamaModel::restoreState(const uint8_t *src)
 {
+    auto hold = bindSession();
     // const_cast is required, see: https://github.com/ggerganov/llama.cpp/pull/1540
-    return llama_set_state_data(d_ptr->ctx, const_cast<uint8_t*>(src));
+    return llama_set_state_data(m_ctx, const_cast<uint8_t*>(src));
+}
+
+bool LLamaModel::saveScene(const std::string &path)
+{
+    auto hold = bindSession();
+    return llama_save_scene(m_ctx, path.c_str());
+}
+
+bool LLamaModel::restoreScene(const std::string &path)
+{
+    auto hold = bindSession();
+    return llama_load_scene(m_ctx, path.c_str());
+}
+
+bool LLamaModel::saveCheckpoint(const std::string &path)
+{
+    auto hold = bindSession();
+    return llama_save_checkpoint(m_ctx, path.c_str());
 }
 
 void LLamaModel::pickActor( std::string actorname )
 {
+    auto hold = bindSession();
     llama_pick_actor( actorname );
 }
 
 int LLamaModel::reserveCache( PromptContext &ctx, int tokens )
 {
-    ctx.n_past = llama_kv_cache_reserve(d_ptr->ctx, tokens);
+    auto hold = bindSession();
+    ctx.n_past = llama_kv_cache_reserve(m_ctx, tokens);
     return (int)ctx.n_past;
 }
 
 void LLamaModel::saveImpression( )
 {
-    const char *charname = llama_context_charname(d_ptr->ctx);
+    auto hold = bindSession();
+    const char *charname = llama_context_charname(m_ctx);
     if( !charname || !*charname ) return;
     size_t n_vocab = llama_n_vocab(d_ptr->model);
 
-    //float *logits = llama_get_logits( d_ptr->ctx );
-    float *embd = llama_get_embeddings( d_ptr->ctx );
+    //float *logits = llama_get_logits( m_ctx );
+    float *embd = llama_get_embeddings( m_ctx );
     if( !embd ) {
         std::cerr << __func__ << ": no impression found\n";
         return;
     }
     std::cerr << __func__ << ": save impression\n";
 
-    llama_context_add_vocab( d_ptr->ctx, NULL, embd );
+    llama_context_add_vocab( m_ctx, NULL, embd );
 }
 
 std::vector<LLModel::Token> LLamaModel::tokenize(PromptContext &ctx, const std::string &str, bool special) const
@@ -529,76 +931,110 @@ std::vector<LLModel::Token> LLamaModel::tokenize(PromptContext &ctx, const std::
 
 std::string LLamaModel::tokenToString(Token id) const
 {
-    return llama_token_to_piece(d_ptr->ctx, id);
+    auto hold = bindSession();
+    return llama_token_to_piece(m_ctx, id);
 }
 
 LLModel::Token LLamaModel::sampleToken(PromptContext &promptCtx, int n_last_batch) const
 {
+    auto hold = bindSession();
     const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return llama_sample_top_p_top_k(d_ptr->ctx,
+    return llama_sample_top_p_top_k(m_ctx,
         promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks, n_prev_toks,
         promptCtx.top_k, promptCtx.top_p, promptCtx.min_p, promptCtx.temp,
         promptCtx.repeat_penalty,
-        n_last_batch - 1);
+        n_last_batch - 1,
+        promptCtx.seed >= 0 ? &promptCtx.rng : nullptr);
 }
 
 void LLamaModel::flagTokens(int token0, int token1, int saveflag) const
 {
-//    llama_flag_tokens( d_ptr->ctx, token0, token1, saveflag );
+//    llama_flag_tokens( m_ctx, token0, token1, saveflag );
 }
 
 const char *LLamaModel::llamaIdle(PromptContext &ctx, const char **keyptr, const char **fmtptr, int *max_gen ) const
 {
-    return llama_idle(d_ptr->ctx, keyptr, fmtptr, max_gen);
+    // no SessionHold: llama_idle_work stops at the first hold, and this call is the maintenance slice
+    llama_bind_context(m_ctx);
+    return llama_idle(m_ctx, keyptr, fmtptr, max_gen);
 }
 
 void LLamaModel::toggleFull(int value) const
 {
-    llama_toggle_full(d_ptr->ctx, value);
+    auto hold = bindSession();
+    llama_toggle_full(m_ctx, value);
 }
 std::string LLamaModel::tokenLookup(int n) const
 {
-    return llama_token_to_piece(d_ptr->ctx, (llama_token)n);
+    auto hold = bindSession();
+    return llama_token_to_piece(m_ctx, (llama_token)n);
 }
 void LLamaModel::feedData( std::vector<float> &logits, std::vector<float> &embd ) const
 {
-    int sz = llama_get_logits_size(d_ptr->ctx);
+    auto hold = bindSession();
+    int sz = llama_get_logits_size(m_ctx);
     logits.resize(sz);
-    memcpy( logits.data(), llama_get_logits(d_ptr->ctx), sizeof(float)*sz );
+    memcpy( logits.data(), llama_get_logits(m_ctx), sizeof(float)*sz );
 
-    sz = llama_get_embeddings_size(d_ptr->ctx);
+    sz = llama_get_embeddings_size(m_ctx);
     embd.resize(sz);
-    memcpy( embd.data(), llama_get_embeddings(d_ptr->ctx), sizeof(float)*sz );
+    memcpy( embd.data(), llama_get_embeddings(m_ctx), sizeof(float)*sz );
 }
 int LLamaModel::evalTokens(std::string inputStr, std::vector<int32_t> &tokens, std::string fromname, std::string toname) const
 {
+    auto hold = bindSession();
     std::cerr << "evalTokens(" << fromname << " => " << toname << ": " << tokens.size() << "+'" << inputStr << "')\n";
     return llama_process_tokens(toname, fromname, inputStr, tokens);
 }
+int LLamaModel::evalTokenIds(const std::vector<int32_t> &ids, std::string text, std::vector<int32_t> &tokens, std::string fromname, std::string toname) const
+{
+    auto hold = bindSession();
+    return llama_process_token_ids(toname, fromname, text, ids, tokens);
+}
 void LLamaModel::unloadActor(std::string actor)
 {
+    auto hold = bindSession();
     llama_unload_actor(actor);
 }
 void LLamaModel::recordMemory(std::string actor, std::string who, std::string when, std::string what )
 {
+    auto hold = bindSession();
     llama_record_memory(actor, who, when, what);
 }
+size_t LLamaModel::importMemories(const std::vector<MemoryRecord> &records)
+{
+    auto hold = bindSession();
+    std::vector<llama_memory_record> recs;
+    recs.reserve(records.size());
+    for (const auto &r : records) {
+        recs.push_back({r.actor, r.who, r.when, r.what});
+    }
+    return llama_import_memories(recs.data(), recs.size());
+}
 void LLamaModel::saveActors(void)
 {
+    auto hold = bindSession();
     llama_save_actors();
 }
+void LLamaModel::loadActors(const std::vector<std::string> &actornames)
+{
+    auto hold = bindSession();
+    llama_load_actors(actornames);
+}
 void LLamaModel::setKey(std::string keyfor, std::string key, std::string keyval)
 {
-    llama_set_key(d_ptr->ctx, keyfor, key, keyval);
+    auto hold = bindSession();
+    llama_set_key(m_ctx, keyfor, key, keyval);
 }
 void LLamaModel::printTimings()
 {
-    llama_print_timings(d_ptr->ctx);
+    auto hold = bindSession();
+    llama_print_timings(m_ctx);
 }
 
 int32_t LLamaModel::contextLength() const
 {
-    return llama_n_ctx(d_ptr->ctx);
+    return llama_n_ctx(m_ctx);
 }
 
 const std::vector<LLModel::Token> &LLamaModel::endTokens() const
@@ -616,12 +1052,12 @@ bool LLamaModel::shouldAddBOS() const
 
 int32_t LLamaModel::maxContextLength(std::string const &modelPath) const
 {
-    return get_arch_key_u32(modelPath, "context_length");
+    return gguf_info(modelPath).n_ctx_train;
 }
 
 int32_t LLamaModel::layerCount(std::string const &modelPath) const
 {
-    return get_arch_key_u32(modelPath, "block_count");
+    return gguf_info(modelPath).n_layer;
 }
 
 std::vector<LLModel::GPUDevice> LLamaModel::availableGPUDevices(size_t memoryRequired) const
@@ -921,7 +1357,7 @@ void LLamaModel::embedInternal(
     // n_ctx_train: max sequence length of model (RoPE scaling not implemented)
     const uint32_t n_ctx_train = llama_n_ctx_train(d_ptr->model);
     // n_batch (equals n_ctx): max tokens per call to llama_decode (one more more sequences)
-    const uint32_t n_batch = llama_n_batch(d_ptr->ctx);
+    const uint32_t n_batch = llama_n_batch(m_ctx);
 
     // effective sequence length minus prefix and SEP token
     const uint32_t max_len = std::min(n_ctx_train, n_batch) - (prefixTokens.size() + useEOS);
@@ -979,7 +1415,7 @@ void LLamaModel::embedInternal(
 
     /*
     auto decode = [this, &queued_indices, n_embd, &batch, &embeddingsSum, &embeddingsSumTotal, spec, dimensionality]() {
-        if (llama_decode(d_ptr->ctx, batch) < 0)
+        if (llama_decode(m_ctx, batch) < 0)
             throw std::runtime_error("llama_decode failed");
 
         {
@@ -991,9 +1427,9 @@ void LLamaModel::embedInternal(
             auto *out = &embeddingsSum[i_prompt * n_embd];
 
             // sequence embeddings aren't available when pooling_type is NONE
-            //auto *embd;// = llama_get_embeddings_seq(d_ptr->ctx, batch.seq_id[i][0]);
+            //auto *embd;// = llama_get_embeddings_seq(m_ctx, batch.seq_id[i][0]);
             //if (!embd) {
-            auto *embd = llama_get_embeddings_ith(d_ptr->ctx, i);
+            auto *embd = llama_get_embeddings_ith(m_ctx, i);
             //}
             assert(embd);
 
@@ -1077,8 +1513,10 @@ DLL_EXPORT const char *get_build_variant() {
 }
 
 DLL_EXPORT bool magic_match(const char *fname) {
-    auto * ctx = load_gguf(fname);
-    std::string arch = get_arch_name(ctx);
+    GGUFInfo info = gguf_info(fname);
+    if (!info.valid)
+        return false;
+    const std::string &arch = info.arch;
 
     bool valid = true;
 
@@ -1090,10 +1528,9 @@ DLL_EXPORT bool magic_match(const char *fname) {
         valid = false;
     }
 
-    if (valid && is_embedding_arch(arch) && gguf_find_key(ctx, (arch + ".pooling_type").c_str()) < 0)
+    if (valid && is_embedding_arch(arch) && !info.has_pooling)
         valid = false; // old pre-llama.cpp embedding model, e.g. all-MiniLM-L6-v2-f16.gguf
 
-    gguf_free(ctx);
     return valid;
 }
 
@@ -4,12 +4,16 @@
 #ifndef LLAMAMODEL_H
 #define LLAMAMODEL_H
 
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include "llmodel.h"
 
 struct LLamaPrivate;
 struct EmbModelSpec;
+struct llama_context;
 
 class LLamaModel : public LLModel {
 public:
@@ -23,9 +27,14 @@ public:
     bool isEmbeddingModel(const std::string &modelPath) const override;
     bool isModelLoaded() const override;
     size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) override;
+    bool estimateMemory(const std::string &modelPath, int n_ctx, int ngl, MemoryEstimate &est) override;
+    bool memoryInUse(MemoryEstimate &used, bool fillSlots) override;
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
     size_t restoreState(const uint8_t *src) override;
+    bool saveScene(const std::string &path) override;
+    bool restoreScene(const std::string &path) override;
+    bool saveCheckpoint(const std::string &path) override;
     bool selectContext(uint8_t ctx_n) override;
     uint8_t viewContext(uint8_t ctx_n) override;
     void releaseContext(uint8_t ctx_n) override;
@@ -33,6 +42,19 @@ public:
     void pickActor( std::string actorname ) override;
     //void stampMemory() override; // uses pickActor's id
     void setThreadCount(int32_t n_threads) override;
+    bool setThreadAffinity(bool pin) override;
+    bool setKvCacheType(const std::string &type) override;
+    LLModel *openSession() override;
+    bool setDecodeScheduler(int32_t n_threads) override;
+    bool setIdleWork(int32_t quiet_ms) override;
+    bool setTracing(bool enabled) override;
+    bool exportTrace(const std::string &path) override;
+    bool getMetrics(std::vector<StageMetrics> &metrics) const override;
+    void resetMetrics() override;
+    int32_t setPromptBatch(int32_t n_batch) override;
+    int32_t promptBatch() const override;
+    bool benchPromptBatch(int32_t n_tokens, std::vector<PromptBatchResult> &results) override;
+    bool runBench(const std::string &which, int64_t n, std::vector<BenchFigure> &figures) override;
     void markRewind(void) override;
     void rewindToMark(void) override;
     void markGeneration(std::string) override;
@@ -61,8 +83,11 @@ public:
     void printTimings( void ) override;
     void unloadActor( std::string actor ) override;
     int evalTokens(std::string inputStr, std::vector<int32_t> &tokens, std::string fromname, std::string toname ) const override;
+    int evalTokenIds(const std::vector<int32_t> &ids, std::string text, std::vector<int32_t> &tokens, std::string fromname, std::string toname ) const override;
     void recordMemory(std::string actor, std::string who, std::string when, std::string what ) override;
+    size_t importMemories(const std::vector<MemoryRecord> &records) override;
     void saveActors(void) override;
+    void loadActors(const std::vector<std::string> &actornames) override;
     void flagTokens(int token0, int token1, int saveflag) const override;
     void toggleFull(int value) const override;
     const char *llamaIdle(PromptContext &ctx, const char **keyptr, const char **fmtptr, int *max_gen) const override;
@@ -70,12 +95,36 @@ public:
     void feedData( std::vector<float> &logits, std::vector<float> &embd ) const override;
 
 private:
+    // idle maintenance stays off while one of these is alive
+    struct SessionHold {
+        llama_context *ctx;
+        explicit SessionHold(llama_context *ctx);
+        ~SessionHold();
+        SessionHold(const SessionHold &) = delete;
+        SessionHold &operator=(const SessionHold &) = delete;
+    };
+
+    // point llama.cpp's per-thread context/kb at this session before touching actors or the KV slots;
+    // keep the result for as long as the session is in use
+    [[nodiscard]] SessionHold bindSession() const;
+    void idleLoop();
+
+    std::thread m_idleThread;
+    std::mutex m_idleMutex;
+    std::condition_variable m_idleCv;
+    bool m_idleStop = false;
+    int32_t m_idleQuietMs = -1;
+
     LLamaPrivate *d_ptr;
+    llama_context *m_ctx = nullptr;
     int myctx;
     bool m_supportsEmbedding = false;
     bool m_supportsCompletion = false;
 
 protected:
+    void holdIdle(bool hold) override;
+    void beginTurn() override;
+    void pickTime(const std::string &actor, int64_t t_us) override;
     std::vector<Token> tokenize(PromptContext &ctx, const std::string &str, bool special) const override;
     std::string tokenToString(Token id) const override;
     Token sampleToken(PromptContext &ctx, int n_last_batch) const override;
@@ -6,12 +6,13 @@
 #include <functional>
 //#include <limits>
 #include <optional>
+#include <random>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <vector>
 
-#define LLMODEL_MAX_PROMPT_BATCH 128
+#define LLMODEL_MAX_PROMPT_BATCH 256 // context n_batch: the most the prompt batch calibration may pick
 
 class Dlhandle;
 class LLModel {
@@ -29,6 +30,54 @@ public:
             index(index), type(type), heapSize(heapSize), name(std::move(name)), vendor(std::move(vendor)) {}
     };
 
+    // what requiredMem adds up, in bytes
+    struct MemoryEstimate {
+        size_t weights = 0;
+        size_t weightsGpu = 0;  // part of weights offloaded to the GPU
+        size_t kvSlots = 0;     // actor KV slots
+        size_t compute = 0;     // graph compute buffers
+        size_t eidets = 0;      // resident full memories
+        size_t total = 0;
+    };
+
+    static constexpr int MetricBuckets = 24;
+
+    // latency of one multi-actor stage ("useactor", "usemap", "prefit_write", "ragsearch", "eidet",
+    // "pick_talker", "decode", "kv_switch") for the session or one actor
+    struct StageMetrics {
+        std::string stage;
+        std::string actor;      // empty for the whole session
+        bool turn = false;      // only since the current turn started
+        uint64_t count = 0;
+        double totalMs = 0;
+        double maxMs = 0;
+        double p50Ms = 0;
+        double p99Ms = 0;
+        uint64_t buckets[MetricBuckets] = {}; // bucket i: calls under 2^i us; the last takes the rest
+    };
+
+    // one batch size timed by benchPromptBatch
+    struct PromptBatchResult {
+        int32_t nBatch = 0;
+        int32_t nTokens = 0;
+        double ms = 0;
+        double tokensPerS = 0;
+    };
+
+    // one figure reported by runBench
+    struct BenchFigure {
+        std::string name;
+        double value = 0;
+    };
+
+    // one memory for importMemories; the views only need to outlive the call
+    struct MemoryRecord {
+        std::string_view actor;
+        std::string_view who;
+        std::string_view when;          // "time_Y_M_D_h_m_s_" as the history files hold it, empty for now
+        std::string_view what;
+    };
+
     struct PromptContext {
         std::vector<float> logits;      // logits of current context
         std::vector<float> embds;
@@ -48,6 +97,8 @@ public:
         int32_t n_last_batch_tokens = 0;
         bool continuing = false;
         int32_t per_idle = 4;
+        int32_t seed = -1;              // >= 0: rng is reseeded with this at the start of every prompt
+        std::mt19937 rng;               // sampling draws from here while seed >= 0, else from the session's own
     };
 
     class Implementation {
@@ -95,18 +146,34 @@ public:
     virtual bool isEmbeddingModel(const std::string &modelPath) const { (void)modelPath; return false; }
     virtual bool isModelLoaded() const = 0;
     virtual size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) = 0;
+    virtual bool estimateMemory(const std::string &modelPath, int n_ctx, int ngl, MemoryEstimate &est)
+    { (void)modelPath; (void)n_ctx; (void)ngl; (void)est; return false; }
+    // What the loaded model has allocated, in estimateMemory's terms (eidets are not counted apart);
+    // fillSlots first allocates the actor slots nobody is using yet
+    virtual bool memoryInUse(MemoryEstimate &used, bool fillSlots) { (void)used; (void)fillSlots; return false; }
     virtual size_t stateSize() const { return 0; }
     virtual size_t saveState(uint8_t *dest) const { (void)dest; return 0; }
     virtual size_t restoreState(const uint8_t *src) { (void)src; return 0; }
+    // every actor KV slot and the actors in play, streamed to / mapped from a file
+    virtual bool saveScene(const std::string &path) { (void)path; return false; }
+    virtual bool restoreScene(const std::string &path) { (void)path; return false; }
+    // only the KV written since the last scene or checkpoint; restoreScene loads it on top of that one
+    virtual bool saveCheckpoint(const std::string &path) { (void)path; return false; }
     virtual bool selectContext(uint8_t ctx_n) {return 0;}
     virtual uint8_t viewContext(uint8_t ctx_n) {return 0;}
     virtual void releaseContext(uint8_t ctx_n) {return;}
     virtual void saveImpression() { return; }
     virtual void pickActor( std::string actorname ) { return; }
     virtual void saveActors( void ) { return; }
+    // load several actors at once (scene start) instead of one by one on first use
+    virtual void loadActors( const std::vector<std::string> &actornames ) { (void)actornames; }
     virtual void unloadActor( std::string actorname ) { return; }
     virtual void recordMemory(std::string actor, std::string who, std::string when, std::string what ) { return; }
+    // recordMemory for a whole log at once: built in parallel, one write per actor's history file.
+    // Returns how many records were imported (bad timestamps are skipped).
+    virtual size_t importMemories(const std::vector<MemoryRecord> &records) { (void)records; return 0; }
     virtual int evalTokens(std::string inputStr, std::vector<int32_t> &tokens, std::string fromname, std::string toname) const = 0;
+    virtual int evalTokenIds(const std::vector<int32_t> &ids, std::string text, std::vector<int32_t> &tokens, std::string fromname, std::string toname) const = 0;
     virtual void setKey(std::string keyfor, std::string key, std::string keyval) { return; }
     virtual void printTimings(void) { return; }
     virtual void flagTokens(int token0, int token1, int saveflag) const = 0;
@@ -145,6 +212,36 @@ public:
 
     virtual void setThreadCount(int32_t n_threads) { (void)n_threads; }
     virtual int32_t threadCount() const { return 1; }
+    // Pin the shared worker threads to one physical core each, NUMA node by node
+    virtual bool setThreadAffinity(bool pin) { (void)pin; return false; }
+    // K cache type for the actor slots ("f16", "q8_0", "q4_0"); takes effect on the next loadModel.
+    // f16 unless set: check a model's perplexity and latency with runBench("kv_type") before quantizing
+    virtual bool setKvCacheType(const std::string &type) { (void)type; return false; }
+    // New model object sharing this one's loaded weights, with its own context, actors and KV slots.
+    // Sessions can run on different threads; the caller owns the result.
+    virtual LLModel *openSession() { return nullptr; }
+    // Share n_threads cores (0 = all) between the decode steps of every session; negative turns it off.
+    // Each session still decodes its own batches; only the thread budget is shared.
+    virtual bool setDecodeScheduler(int32_t n_threads) { (void)n_threads; return false; }
+    // Run deferred maintenance on a background thread once the session has been quiet for quiet_ms;
+    // any call into the session preempts it. Negative turns it off.
+    virtual bool setIdleWork(int32_t quiet_ms) { (void)quiet_ms; return false; }
+    // Record allocator, KV layout, decode and sampling events of every thread into in-memory rings
+    virtual bool setTracing(bool enabled) { (void)enabled; return false; }
+    // Write the recorded events as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+    virtual bool exportTrace(const std::string &path) { (void)path; return false; }
+    // Stages that ran at least once, session-wide and per actor, over the session and the current turn
+    virtual bool getMetrics(std::vector<StageMetrics> &metrics) const { (void)metrics; return false; }
+    virtual void resetMetrics() {}
+    // Tokens per decode while feeding a prompt; 0 repeats the timing sweep loadModel ran. Returns the size in use.
+    virtual int32_t setPromptBatch(int32_t n_batch) { (void)n_batch; return 0; }
+    virtual int32_t promptBatch() const { return 0; }
+    // Time n_tokens of prompt at each batch size up to LLMODEL_MAX_PROMPT_BATCH, without touching the actors
+    virtual bool benchPromptBatch(int32_t n_tokens, std::vector<PromptBatchResult> &results) { (void)n_tokens; (void)results; return false; }
+    // Run one of the backend's micro benchmarks by name ("tokenize": n messages, "memories": n history entries, "pool": n MB copied,
+    // "decode_graph": n tokens greedy-decoded with the decode graph reused and rebuilt, compared,
+    // "kv_type": n tokens of text through f16, q8_0 and q4_0 K caches); false if it has none by that name
+    virtual bool runBench(const std::string &which, int64_t n, std::vector<BenchFigure> &figures) { (void)which; (void)n; (void)figures; return false; }
     virtual void markRewind(void) { return; }
     virtual void rewindToMark(void) { return; }
     virtual void markGeneration(std::string) { return; }
@@ -203,6 +300,14 @@ protected:
     }
     const Implementation *m_implementation = nullptr;
 
+    // keeps idle maintenance off for the whole of a prompt, not just each call inside it
+    virtual void holdIdle(bool hold) { (void)hold; }
+    // every prompt is a turn; the per-turn metrics start over
+    virtual void beginTurn() {}
+    // pickNextTalker runs here rather than in the backend, so its time is handed over along with
+    // the actor it polled (empty when the pick needed no poll)
+    virtual void pickTime(const std::string &actor, int64_t t_us) { (void)actor; (void)t_us; }
+
     ProgressCallback m_progressCallback;
     static bool staticProgressCallback(float progress, void* ctx)
     {
@@ -212,8 +317,9 @@ protected:
         return true;
     }
 
+    static PromptContext probeContext( PromptContext &parentCtx );
     int pickNextTalker( PromptContext &parentCtx, std::string username, std::string lastTalker,
-                            std::vector<std::string> actorNames );
+                            std::vector<std::string> actorNames, std::string *polled = nullptr );
     int selectAnswer( std::string actor, std::string query, PromptContext &parentCtx,
                             std::unordered_map<std::string, int> &answers, std::string framing );
     std::string queryActor( std::string actor, std::string query, PromptContext &parentCtx );
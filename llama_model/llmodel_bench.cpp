@@ -0,0 +1,596 @@
+// Scene replay benchmark.
+//
+// Loads one model, replays a recorded scene script through LLModel::prompt and prints a JSON report:
+// tokens/s, per-turn latency, the per-stage metrics of the session and of each actor, KV slot
+// switches and peak RSS. Meant for trend tracking in CI, so sampling is seeded (--seed, 42 unless
+// given) and two runs over the same script and model decode the same tokens.
+//
+//   llmodel_bench <model.gguf> <scene.txt> [--ctx n] [--ngl n] [--threads n] [--predict n]
+//                 [--top-k n] [--temp f] [--seed n] [--libs path] [--out report.json]
+//                 [--record golden.txt | --check golden.txt] [--prompt-bench n] [--bench name[:n]]...
+//                 [--sessions n] [--memory]
+//
+// --record writes the token ids each turn generated, one line per turn. --check replays against
+// such a file and stops at the first token that differs, naming the turn, the position and both
+// ids; the report is still written and the exit code is 3. A golden file only holds for the model,
+// settings and backend it was recorded with.
+//
+// --prompt-bench times n tokens of synthetic prompt at each batch size the context allows before the
+// scene starts, on a scratch KV cache, and adds the table to the report next to the batch size the
+// load-time calibration picked.
+//
+// --sessions replays the scene after the main run on n sessions at once (LLModel::openSession), first
+// with each session's steps using every thread and then with the decode scheduler sharing them, and
+// adds both runs' response tokens/s and p50/p99 token latency under "sessions".
+//
+// --memory checks LLModel::estimateMemory against the process: after the scene it allocates the
+// actor slots the scene left unused (LLModel::memoryInUse) and adds the estimate, what is allocated
+// and the RSS before loading, after loading and with every slot filled under "memory". The RSS is
+// read from /proc/self/statm and is 0 where that does not exist.
+//
+// --bench runs one of the backend's micro benchmarks (LLModel::runBench) before the scene and adds
+// its figures to the report under "benches"; it can be given more than once. n is the bench's size,
+// the backend's default if left out:
+//   tokenize   n synthetic messages (10000) through the merge loop, then short strings cold and cached
+//   memories   footprint and build/map/search times of an actor with n memories (100000)
+//   pool       worker pool scaling on an n MB bulk copy (256) at 1, 2, 4, ... threads
+//   decode_graph  n tokens (256) greedy-decoded reusing the decode graph, then rebuilding it per token;
+//              identical is 1 when both picked the same tokens
+//   kv_type    n tokens (512) of built-in text through f16, q8_0 and q4_0 K caches: cache MB, prompt
+//              tokens/s, ms per token, perplexity and top-1 agreement with f16
+//
+// The script is a list of prompts separated by lines that start with "---"; the rest of such a line
+// names the prompt in the report. Every prompt goes to LLModel::prompt as written, so all of its
+// forms replay: "*key:actor" keys, "&actor" memory imports, "/to", "?", "^" and "#" queries and
+// "<|im_start|>user" turns that the loaded actors answer in turn.
+//
+// Built as the llmodel_bench target of gpt4all_node/binding.gyp (node-gyp build).
+
+#include "llmodel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+struct ScenePrompt {
+    std::string name;
+    std::string text;
+};
+
+struct BenchRun {
+    std::string name;
+    int64_t n = 0;
+    std::vector<LLModel::BenchFigure> figures;
+    std::string error;
+};
+
+struct TurnReport {
+    std::string name;
+    double wall_ms = 0;
+    double first_token_ms = 0;  // 0 if nothing was generated
+    uint32_t n_prompt = 0;
+    uint32_t n_response = 0;
+    std::vector<int32_t> ids;   // generated token ids, for --record/--check
+    std::string error;
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s <model.gguf> <scene.txt> [--ctx n] [--ngl n] [--threads n] [--predict n] [--top-k n] [--temp f] [--seed n] [--libs path] [--out report.json] [--record golden.txt | --check golden.txt] [--prompt-bench n] [--bench name[:n]]... [--sessions n] [--memory]\n",
+            argv0);
+}
+
+static bool load_scene(const std::string &path, std::vector<ScenePrompt> &prompts) {
+    std::ifstream in(path);
+    if (!in) return false;
+    ScenePrompt cur;
+    std::string line;
+    bool started = false;
+    auto flush = [&]() {
+        // the separator's newline is not part of the prompt
+        if (!cur.text.empty() && cur.text.back() == '\n') cur.text.pop_back();
+        if (started || !cur.text.empty()) prompts.push_back(cur);
+        cur = ScenePrompt();
+    };
+    while (std::getline(in, line)) {
+        if (line.compare(0, 3, "---") == 0) {
+            flush();
+            started = true;
+            size_t p = line.find_first_not_of("- \t");
+            cur.name = p == std::string::npos ? "" : line.substr(p);
+            continue;
+        }
+        cur.text += line + "\n";
+    }
+    flush();
+    for (size_t i = 0; i < prompts.size(); i++) {
+        if (prompts[i].name.empty()) prompts[i].name = "prompt " + std::to_string(i + 1);
+    }
+    return true;
+}
+
+// one line of space separated token ids per turn
+static bool load_golden(const std::string &path, std::vector<std::vector<int32_t>> &golden) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream ls(line);
+        std::vector<int32_t> ids;
+        int32_t id;
+        while (ls >> id) ids.push_back(id);
+        golden.push_back(ids);
+    }
+    return true;
+}
+
+static std::string json_str(const std::string &s) {
+    std::string out = "\"";
+    for (unsigned char c : s) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+static std::string json_num(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", v);
+    return buf;
+}
+
+// One replay of the scene on several sessions at once.
+struct SessionsRun {
+    double wall_ms = 0;
+    uint64_t n_response = 0;
+    double p50_ms = 0, p99_ms = 0; // gap between response tokens, over every session
+    int n_errors = 0;
+};
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static SessionsRun replay_sessions(LLModel *model, int n_sessions, const std::vector<ScenePrompt> &prompts,
+                                   const LLModel::PromptContext &base) {
+    SessionsRun run;
+    std::vector<LLModel *> sessions;
+    for (int i = 0; i < n_sessions; i++) {
+        LLModel *s = model->openSession();
+        if (!s) break;
+        sessions.push_back(s);
+    }
+    std::mutex mutex;
+    std::vector<double> gaps;
+    auto t_start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (LLModel *s : sessions) {
+        threads.emplace_back([&, s]() {
+            LLModel::PromptContext ctx = base;
+            std::vector<double> mine;
+            uint64_t n_response = 0;
+            int n_errors = 0;
+            auto t_last = std::chrono::steady_clock::now();
+            bool first = true;
+            auto promptCallback = [&](int32_t, int, int, float *, float *) { return true; };
+            auto responseCallback = [&](int32_t token_id, const std::string &token, int, int, float *, float *) {
+                if (token_id == -1) return token.compare(0, 6, "ERROR:") != 0;
+                auto now = std::chrono::steady_clock::now();
+                if (!first) mine.push_back(std::chrono::duration<double, std::milli>(now - t_last).count());
+                first = false;
+                t_last = now;
+                n_response++;
+                return true;
+            };
+            for (const auto &p : prompts) {
+                first = true;
+                try {
+                    s->prompt(p.text, "%1", promptCallback, responseCallback, ctx);
+                } catch (const char *) {
+                    n_errors++;
+                } catch (const std::exception &) {
+                    n_errors++;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            gaps.insert(gaps.end(), mine.begin(), mine.end());
+            run.n_response += n_response;
+            run.n_errors += n_errors;
+        });
+    }
+    for (auto &t : threads) t.join();
+    run.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    run.p50_ms = percentile(gaps, 0.50);
+    run.p99_ms = percentile(gaps, 0.99);
+    run.n_errors += n_sessions - (int)sessions.size();
+    for (LLModel *s : sessions) delete s;
+    return run;
+}
+
+// resident set of this process now, in bytes
+static size_t current_rss() {
+    size_t pages_total = 0, pages_resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%zu %zu", &pages_total, &pages_resident) != 2) pages_resident = 0;
+    fclose(f);
+    return pages_resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// peak resident set of this process, in bytes
+static size_t peak_rss() {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    return (size_t)ru.ru_maxrss * 1024;
+#endif
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string modelPath = argv[1];
+    std::string scenePath = argv[2];
+    std::string outPath, recordPath, checkPath;
+    int n_ctx = 2048, ngl = 100, n_threads = 0, n_predict = 128, top_k = 40, seed = 42, n_prompt_bench = 0, n_sessions = 0;
+    float temp = 0.1f;
+    bool check_memory = false;
+    std::vector<BenchRun> benches;
+
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--memory") {
+            check_memory = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--ctx") n_ctx = atoi(argv[++i]);
+        else if (arg == "--ngl") ngl = atoi(argv[++i]);
+        else if (arg == "--threads") n_threads = atoi(argv[++i]);
+        else if (arg == "--predict") n_predict = atoi(argv[++i]);
+        else if (arg == "--top-k") top_k = atoi(argv[++i]);
+        else if (arg == "--temp") temp = atof(argv[++i]);
+        else if (arg == "--libs") LLModel::Implementation::setImplementationsSearchPath(argv[++i]);
+        else if (arg == "--seed") seed = atoi(argv[++i]);
+        else if (arg == "--out") outPath = argv[++i];
+        else if (arg == "--record") recordPath = argv[++i];
+        else if (arg == "--check") checkPath = argv[++i];
+        else if (arg == "--prompt-bench") n_prompt_bench = atoi(argv[++i]);
+        else if (arg == "--sessions") n_sessions = atoi(argv[++i]);
+        else if (arg == "--bench") {
+            std::string spec = argv[++i];
+            BenchRun b;
+            size_t colon = spec.find(':');
+            b.name = spec.substr(0, colon);
+            if (colon != std::string::npos) b.n = atoll(spec.c_str() + colon + 1);
+            benches.push_back(b);
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<ScenePrompt> prompts;
+    if (!load_scene(scenePath, prompts) || prompts.empty()) {
+        std::cerr << "Unable to read a scene from " << scenePath << "\n";
+        return 1;
+    }
+    if (!recordPath.empty() && !checkPath.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::vector<std::vector<int32_t>> golden;
+    if (!checkPath.empty() && !load_golden(checkPath, golden)) {
+        std::cerr << "Unable to read golden tokens from " << checkPath << "\n";
+        return 1;
+    }
+
+    const size_t rss_start = current_rss();
+    auto t_load = std::chrono::steady_clock::now();
+    LLModel *model;
+    try {
+        model = LLModel::Implementation::construct(modelPath, "auto", n_ctx);
+    } catch (const std::exception &e) {
+        std::cerr << "Unable to instantiate model: " << e.what() << "\n";
+        return 1;
+    }
+    LLModel::MemoryEstimate mem_estimate, mem_used;
+    std::string mem_error;
+    if (check_memory && (!model || !model->estimateMemory(modelPath, n_ctx, ngl, mem_estimate))) {
+        mem_error = "no estimate for this model";
+    }
+    if (!model || !model->loadModel(modelPath, n_ctx, ngl)) {
+        std::cerr << "Unable to load " << modelPath << "\n";
+        return 1;
+    }
+    const size_t rss_loaded = current_rss();
+    if (n_threads > 0) model->setThreadCount(n_threads);
+    double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_load).count();
+    std::vector<LLModel::PromptBatchResult> prompt_batches;
+    if (n_prompt_bench > 0 && !model->benchPromptBatch(n_prompt_bench, prompt_batches)) {
+        std::cerr << "Prompt batch timing is not supported by this backend\n";
+    }
+    for (auto &b : benches) {
+        try {
+            if (!model->runBench(b.name, b.n, b.figures)) b.error = "not supported by this backend";
+        } catch (const char *e) {
+            b.error = e;
+        } catch (const std::exception &e) {
+            b.error = e.what();
+        }
+        if (!b.error.empty()) std::cerr << "llmodel_bench: " << b.name << ": " << b.error << "\n";
+    }
+    model->resetMetrics(); // loading the System actor is not part of the scene
+
+    LLModel::PromptContext ctx;
+    ctx.n_predict = n_predict;
+    ctx.top_k = top_k;
+    ctx.top_p = 1.0f;
+    ctx.min_p = 0.0f;
+    ctx.temp = temp;
+    ctx.n_batch = 8;
+    ctx.repeat_penalty = 1.2f;
+    ctx.repeat_last_n = 10;
+    ctx.contextErase = 0.75f;
+    ctx.seed = seed;
+
+    std::vector<TurnReport> turns;
+    std::string divergence;
+    auto t_scene = std::chrono::steady_clock::now();
+    for (const auto &p : prompts) {
+        const std::vector<int32_t> *expect = nullptr;
+        if (!checkPath.empty()) {
+            if (turns.size() >= golden.size()) {
+                divergence = "golden file ends before turn \"" + p.name + "\"";
+                break;
+            }
+            expect = &golden[turns.size()];
+        }
+        TurnReport turn;
+        turn.name = p.name;
+        auto t_start = std::chrono::steady_clock::now();
+        auto ms_since_start = [&]() {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+        };
+        auto promptCallback = [&](int32_t, int, int, float *, float *) {
+            turn.n_prompt++;
+            return true;
+        };
+        auto responseCallback = [&](int32_t token_id, const std::string &token, int, int, float *, float *) {
+            if (token_id == -1) {
+                // queries stream their text this way too; only prompt's own failures start with ERROR
+                if (token.compare(0, 6, "ERROR:") != 0) return true;
+                turn.error = token;
+                return false;
+            }
+            if (turn.n_response++ == 0) turn.first_token_ms = ms_since_start();
+            size_t pos = turn.ids.size();
+            turn.ids.push_back(token_id);
+            if (expect && (pos >= expect->size() || (*expect)[pos] != token_id)) {
+                turn.error = "diverged at token " + std::to_string(pos) + ": expected "
+                           + (pos < expect->size() ? std::to_string((*expect)[pos]) : std::string("end of turn"))
+                           + ", got " + std::to_string(token_id);
+                return false;
+            }
+            return true;
+        };
+
+        try {
+            model->prompt(p.text, "%1", promptCallback, responseCallback, ctx);
+        } catch (const char *e) {
+            turn.error = e;
+        } catch (const std::exception &e) {
+            turn.error = e.what();
+        }
+        turn.wall_ms = ms_since_start();
+        if (expect && turn.error.empty() && turn.ids.size() < expect->size()) {
+            turn.error = "diverged at token " + std::to_string(turn.ids.size()) + ": expected "
+                       + std::to_string((*expect)[turn.ids.size()]) + ", got end of turn";
+        }
+        std::cerr << "llmodel_bench: " << turn.name << ": " << turn.n_response << " tokens in " << turn.wall_ms << " ms\n";
+        turns.push_back(turn);
+        if (expect && turn.error.compare(0, 8, "diverged") == 0) {
+            divergence = "turn \"" + turn.name + "\" " + turn.error;
+            break;
+        }
+    }
+    double scene_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_scene).count();
+
+    uint64_t n_prompt = 0, n_response = 0;
+    double t_first = 0, t_generate = 0;
+    int n_errors = 0;
+    for (const auto &t : turns) {
+        n_prompt += t.n_prompt;
+        n_response += t.n_response;
+        if (!t.error.empty()) n_errors++;
+        if (t.n_response > 0) {
+            t_first += t.first_token_ms;
+            t_generate += t.wall_ms - t.first_token_ms;
+        }
+    }
+
+    if (!divergence.empty()) {
+        std::cerr << "llmodel_bench: " << divergence << "\n";
+    } else if (!checkPath.empty() && turns.size() < golden.size()) {
+        divergence = "golden file has " + std::to_string(golden.size()) + " turns, the scene " + std::to_string(turns.size());
+        std::cerr << "llmodel_bench: " << divergence << "\n";
+    }
+    if (!recordPath.empty()) {
+        std::ofstream rec(recordPath);
+        for (const auto &t : turns) {
+            for (size_t i = 0; i < t.ids.size(); i++) rec << (i ? " " : "") << t.ids[i];
+            rec << "\n";
+        }
+        if (!rec) {
+            std::cerr << "Unable to write " << recordPath << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<LLModel::StageMetrics> metrics;
+    model->getMetrics(metrics);
+
+    // before --sessions, whose sessions have slots of their own
+    size_t rss_filled = 0;
+    if (check_memory && mem_error.empty()) {
+        try {
+            if (!model->memoryInUse(mem_used, true)) mem_error = "not supported by this backend";
+        } catch (const char *e) {
+            mem_error = e;
+        } catch (const std::exception &e) {
+            mem_error = e.what();
+        }
+        rss_filled = current_rss();
+    }
+    if (!mem_error.empty()) std::cerr << "llmodel_bench: memory: " << mem_error << "\n";
+
+    // the same sessions' work with every step owning all threads, then with the scheduler splitting them
+    SessionsRun sessions_off, sessions_on;
+    if (n_sessions > 0) {
+        model->setDecodeScheduler(-1);
+        sessions_off = replay_sessions(model, n_sessions, prompts, ctx);
+        model->setDecodeScheduler(0);
+        sessions_on = replay_sessions(model, n_sessions, prompts, ctx);
+        model->setDecodeScheduler(-1);
+    }
+    uint64_t kv_switches = 0;
+    for (const auto &m : metrics) {
+        if (m.stage == "kv_switch" && m.actor.empty() && !m.turn) kv_switches = m.count;
+    }
+
+    std::ostringstream js;
+    js << "{\n";
+    js << "  \"model\": " << json_str(modelPath.substr(modelPath.find_last_of("/\\") + 1)) << ",\n";
+    js << "  \"scene\": " << json_str(scenePath) << ",\n";
+    js << "  \"settings\": {\"ctx\": " << n_ctx << ", \"ngl\": " << ngl << ", \"threads\": " << model->threadCount()
+       << ", \"predict\": " << n_predict << ", \"top_k\": " << top_k << ", \"temp\": " << json_num(temp) << ", \"seed\": " << seed << "},\n";
+    js << "  \"load_ms\": " << json_num(load_ms) << ",\n";
+    js << "  \"prompt_batch\": " << model->promptBatch() << ",\n";
+    if (n_prompt_bench > 0) {
+        js << "  \"prompt_batches\": [";
+        for (size_t i = 0; i < prompt_batches.size(); i++) {
+            const auto &b = prompt_batches[i];
+            js << (i ? ",\n" : "\n") << "    {\"n_batch\": " << b.nBatch << ", \"tokens\": " << b.nTokens
+               << ", \"ms\": " << json_num(b.ms) << ", \"tokens_per_s\": " << json_num(b.tokensPerS) << "}";
+        }
+        js << "\n  ],\n";
+    }
+    if (!benches.empty()) {
+        js << "  \"benches\": [";
+        for (size_t i = 0; i < benches.size(); i++) {
+            const auto &b = benches[i];
+            js << (i ? ",\n" : "\n") << "    {\"bench\": " << json_str(b.name) << ", \"n\": " << b.n;
+            if (!b.error.empty()) js << ", \"error\": " << json_str(b.error);
+            for (const auto &f : b.figures) js << ", " << json_str(f.name) << ": " << json_num(f.value);
+            js << "}";
+        }
+        js << "\n  ],\n";
+    }
+    js << "  \"scene_ms\": " << json_num(scene_ms) << ",\n";
+    js << "  \"prompt_tokens\": " << n_prompt << ",\n";
+    js << "  \"response_tokens\": " << n_response << ",\n";
+    js << "  \"prompt_tokens_per_s\": " << json_num(t_first > 0 ? n_prompt * 1000.0 / t_first : 0) << ",\n";
+    js << "  \"response_tokens_per_s\": " << json_num(t_generate > 0 ? n_response * 1000.0 / t_generate : 0) << ",\n";
+    js << "  \"kv_switches\": " << kv_switches << ",\n";
+    if (n_sessions > 0) {
+        auto run_json = [](const SessionsRun &r) {
+            return "{\"wall_ms\": " + json_num(r.wall_ms) + ", \"response_tokens\": " + std::to_string(r.n_response)
+                 + ", \"tokens_per_s\": " + json_num(r.wall_ms > 0 ? r.n_response * 1000.0 / r.wall_ms : 0)
+                 + ", \"p50_token_ms\": " + json_num(r.p50_ms) + ", \"p99_token_ms\": " + json_num(r.p99_ms)
+                 + ", \"errors\": " + std::to_string(r.n_errors) + "}";
+        };
+        js << "  \"sessions\": {\"n\": " << n_sessions << ",\n";
+        js << "    \"unscheduled\": " << run_json(sessions_off) << ",\n";
+        js << "    \"scheduled\": " << run_json(sessions_on) << "\n  },\n";
+    }
+    if (check_memory) {
+        auto mem_json = [](const LLModel::MemoryEstimate &m) {
+            return "{\"weights\": " + std::to_string(m.weights) + ", \"weights_gpu\": " + std::to_string(m.weightsGpu)
+                 + ", \"kv_slots\": " + std::to_string(m.kvSlots) + ", \"compute\": " + std::to_string(m.compute)
+                 + ", \"eidets\": " + std::to_string(m.eidets) + ", \"total\": " + std::to_string(m.total) + "}";
+        };
+        // the estimate counts offloaded weights too; the process only holds the rest
+        const double host_estimate = (double)mem_estimate.total - mem_estimate.weightsGpu;
+        const double growth = rss_filled > rss_start ? (double)(rss_filled - rss_start) : 0.0;
+        js << "  \"memory\": {";
+        if (!mem_error.empty()) js << "\"error\": " << json_str(mem_error) << ",\n    ";
+        js << "\"estimate\": " << mem_json(mem_estimate) << ",\n";
+        js << "    \"in_use\": " << mem_json(mem_used) << ",\n";
+        js << "    \"rss_start\": " << rss_start << ", \"rss_loaded\": " << rss_loaded << ", \"rss_filled\": " << rss_filled
+           << ", \"host_estimate\": " << json_num(host_estimate) << ", \"rss_growth\": " << json_num(growth)
+           << ", \"estimate_error_pct\": " << json_num(growth > 0 ? (host_estimate - growth) * 100.0 / growth : 0) << "\n  },\n";
+    }
+    js << "  \"peak_rss\": " << peak_rss() << ",\n";
+    js << "  \"errors\": " << n_errors << ",\n";
+    if (!checkPath.empty()) js << "  \"divergence\": " << (divergence.empty() ? "null" : json_str(divergence)) << ",\n";
+    js << "  \"turns\": [";
+    for (size_t i = 0; i < turns.size(); i++) {
+        const auto &t = turns[i];
+        js << (i ? ",\n" : "\n") << "    {\"name\": " << json_str(t.name) << ", \"wall_ms\": " << json_num(t.wall_ms)
+           << ", \"first_token_ms\": " << json_num(t.first_token_ms) << ", \"prompt_tokens\": " << t.n_prompt
+           << ", \"response_tokens\": " << t.n_response;
+        if (!t.error.empty()) js << ", \"error\": " << json_str(t.error);
+        js << "}";
+    }
+    js << "\n  ],\n";
+    // whole-session totals only; the per-turn entries would just repeat the last turn
+    js << "  \"stages\": [";
+    bool first = true;
+    for (const auto &m : metrics) {
+        if (m.turn) continue;
+        js << (first ? "\n" : ",\n") << "    {\"stage\": " << json_str(m.stage) << ", \"actor\": " << json_str(m.actor)
+           << ", \"count\": " << m.count << ", \"total_ms\": " << json_num(m.totalMs)
+           << ", \"p50_ms\": " << json_num(m.p50Ms) << ", \"p99_ms\": " << json_num(m.p99Ms)
+           << ", \"max_ms\": " << json_num(m.maxMs) << "}";
+        first = false;
+    }
+    js << "\n  ]\n}\n";
+
+    if (outPath.empty()) {
+        std::cout << js.str();
+    } else {
+        std::ofstream out(outPath);
+        out << js.str();
+        if (!out) {
+            std::cerr << "Unable to write " << outPath << "\n";
+            return 1;
+        }
+    }
+    delete model;
+    if (!divergence.empty()) return 3;
+    return n_errors ? 2 : 0;
+}
@@ -50,6 +50,27 @@ llmodel_model llmodel_model_create2(const char *model_path, const char *build_va
     return wrapper;
 }
 
+llmodel_model llmodel_session_open(llmodel_model model, const char **error) {
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    LLModel *session;
+    try {
+        session = wrapper->llModel->openSession();
+    } catch (const std::exception& e) {
+        llmodel_set_error(error, e.what());
+        return nullptr;
+    }
+
+    if (!session) {
+        llmodel_set_error(error, "Model does not support sessions or is not loaded");
+        return nullptr;
+    }
+
+    auto fres = new LLModelWrapper;
+    fres->llModel = session;
+    fres->promptContext = wrapper->promptContext;
+    return fres;
+}
+
 void llmodel_model_destroy(llmodel_model model) {
     delete static_cast<LLModelWrapper *>(model);
 }
@@ -60,6 +81,22 @@ size_t llmodel_required_mem(llmodel_model model, const char *model_path, int n_c
     return wrapper->llModel->requiredMem(model_path, n_ctx, ngl);
 }
 
+bool llmodel_estimate_mem(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                          llmodel_mem_estimate *estimate)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    LLModel::MemoryEstimate est;
+    if (!wrapper->llModel->estimateMemory(model_path, n_ctx, ngl, est))
+        return false;
+    estimate->weights = est.weights;
+    estimate->weights_gpu = est.weightsGpu;
+    estimate->kv_slots = est.kvSlots;
+    estimate->compute = est.compute;
+    estimate->eidets = est.eidets;
+    estimate->total = est.total;
+    return true;
+}
+
 bool llmodel_loadModel(llmodel_model model, const char *model_path, int n_ctx, int ngl)
 {
     auto *wrapper = static_cast<LLModelWrapper *>(model);
@@ -106,6 +143,24 @@ uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src)
     return wrapper->llModel->restoreState(src);
 }
 
+bool llmodel_save_scene(llmodel_model model, const char *path)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->saveScene(path);
+}
+
+bool llmodel_restore_scene(llmodel_model model, const char *path)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->restoreScene(path);
+}
+
+bool llmodel_save_checkpoint(llmodel_model model, const char *path)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->saveCheckpoint(path);
+}
+
 bool llmodel_select_context(llmodel_model model, uint8_t ctx_n)
 {
     auto *wrapper = static_cast<LLModelWrapper *>(model);
@@ -149,6 +204,7 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
     wrapper->promptContext.repeat_last_n = ctx->repeat_last_n;
     wrapper->promptContext.contextErase = ctx->context_erase;
     wrapper->promptContext.continuing = ctx->continuing;
+    wrapper->promptContext.seed = ctx->seed;
 
     std::string fake_reply_str;
     if (fake_reply) { fake_reply_str = fake_reply; }
@@ -235,6 +291,104 @@ int32_t llmodel_threadCount(llmodel_model model)
     return wrapper->llModel->threadCount();
 }
 
+bool llmodel_set_kv_cache_type(llmodel_model model, const char *type)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->setKvCacheType(type);
+}
+
+bool llmodel_set_decode_scheduler(llmodel_model model, int32_t n_threads)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->setDecodeScheduler(n_threads);
+}
+
+bool llmodel_set_thread_affinity(llmodel_model model, bool pin)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->setThreadAffinity(pin);
+}
+
+void llmodel_load_actors(llmodel_model model, const char **names, size_t n_names)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    std::vector<std::string> actornames(names, names + n_names);
+    wrapper->llModel->loadActors(actornames);
+}
+
+size_t llmodel_import_memories(llmodel_model model, const llmodel_memory_record *records, size_t n_records)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    std::vector<LLModel::MemoryRecord> recs(n_records);
+    for (size_t i = 0; i < n_records; i++) {
+        recs[i].actor = records[i].actor ? records[i].actor : "";
+        recs[i].who = records[i].who ? records[i].who : "";
+        recs[i].when = records[i].when ? records[i].when : "";
+        recs[i].what = records[i].what ? records[i].what : "";
+    }
+    return wrapper->llModel->importMemories(recs);
+}
+
+bool llmodel_set_idle_work(llmodel_model model, int32_t quiet_ms)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->setIdleWork(quiet_ms);
+}
+
+bool llmodel_set_tracing(llmodel_model model, bool enabled)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->setTracing(enabled);
+}
+
+bool llmodel_export_trace(llmodel_model model, const char *path)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->exportTrace(path);
+}
+
+static_assert(LLMODEL_METRIC_BUCKETS == LLModel::MetricBuckets);
+
+struct llmodel_stage_metric *llmodel_get_metrics(llmodel_model model, int *n_metrics)
+{
+    // the strings live in metrics until the next call
+    static thread_local std::vector<LLModel::StageMetrics> metrics;
+    static thread_local std::vector<llmodel_stage_metric> c_metrics;
+
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    *n_metrics = 0;
+    if (!wrapper->llModel->getMetrics(metrics) || metrics.empty()) { return nullptr; }
+
+    c_metrics.resize(metrics.size());
+    for (size_t i = 0; i < metrics.size(); i++) {
+        const auto &m  = metrics[i];
+              auto &cm = c_metrics[i];
+        cm.stage    = m.stage.c_str();
+        cm.actor    = m.actor.c_str();
+        cm.turn     = m.turn;
+        cm.count    = m.count;
+        cm.total_ms = m.totalMs;
+        cm.max_ms   = m.maxMs;
+        cm.p50_ms   = m.p50Ms;
+        cm.p99_ms   = m.p99Ms;
+        std::memcpy(cm.buckets, m.buckets, sizeof(cm.buckets));
+    }
+    *n_metrics = c_metrics.size();
+    return c_metrics.data();
+}
+
+void llmodel_reset_metrics(llmodel_model model)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    wrapper->llModel->resetMetrics();
+}
+
+int32_t llmodel_set_prompt_batch(llmodel_model model, int32_t n_batch)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->setPromptBatch(n_batch);
+}
+
 void llmodel_set_implementation_search_path(const char *path)
 {
     LLModel::Implementation::setImplementationsSearchPath(path);
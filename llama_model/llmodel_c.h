@@ -47,6 +47,17 @@ struct llmodel_prompt_context {
     float context_erase;    // percent of context to erase if we exceed the context window
     bool continuing = false;
     int32_t per_idle = 4;
+    int32_t seed = -1;      // sampling seed, applied at the start of every prompt; -1 for unseeded
+};
+
+/**
+ * One memory for llmodel_import_memories.
+ */
+struct llmodel_memory_record {
+    const char *actor;      // actor whose history gets the memory
+    const char *who;        // speaker
+    const char *when;       // "time_Y_M_D_h_m_s_" as the history files hold it; NULL or "" for now
+    const char *what;       // the text
 };
 
 struct llmodel_gpu_device {
@@ -57,9 +68,40 @@ struct llmodel_gpu_device {
     const char * vendor;
 };
 
+/**
+ * Breakdown of llmodel_required_mem, in bytes.
+ */
+struct llmodel_mem_estimate {
+    size_t weights;       // tensor data in the model file
+    size_t weights_gpu;   // part of weights offloaded to the GPU by ngl
+    size_t kv_slots;      // K/V of the three actor KV slots at their largest extents
+    size_t compute;       // worst-case compute buffers
+    size_t eidets;        // full memories resident in host RAM for full slots
+    size_t total;         // what llmodel_required_mem returns
+};
+
+#define LLMODEL_METRIC_BUCKETS 24
+
+/**
+ * Latency of one multi-actor stage, for the session or one actor. See llmodel_get_metrics.
+ */
+struct llmodel_stage_metric {
+    const char *stage;    // "useactor", "usemap", "prefit_write", "ragsearch", "eidet", "pick_talker", "decode", "kv_switch"
+    const char *actor;    // "" for the whole session
+    bool turn;            // counts only the current turn, else the whole session
+    uint64_t count;
+    double total_ms;
+    double max_ms;
+    double p50_ms;
+    double p99_ms;
+    uint64_t buckets[LLMODEL_METRIC_BUCKETS]; // bucket i: calls under 2^i us; the last takes the rest
+};
+
 #ifndef __cplusplus
 typedef struct llmodel_prompt_context llmodel_prompt_context;
 typedef struct llmodel_gpu_device llmodel_gpu_device;
+typedef struct llmodel_mem_estimate llmodel_mem_estimate;
+typedef struct llmodel_stage_metric llmodel_stage_metric;
 #endif
 
 /**
@@ -122,6 +164,20 @@ void llmodel_model_destroy(llmodel_model model);
  */
 size_t llmodel_required_mem(llmodel_model model, const char *model_path, int n_ctx, int ngl);
 
+/**
+ * Estimate RAM requirement for a model file, split by what uses it.
+ * Counts the weights, the three actor KV slots, the compute buffers and the eidets that fill
+ * the slots, sized as a kb with default KV extents would allocate them.
+ * @param model A pointer to the llmodel_model instance.
+ * @param model_path A string representing the path to the model file.
+ * @param n_ctx Maximum size of context window
+ * @param ngl Number of GPU layers to use (Vulkan)
+ * @param estimate Filled in on success.
+ * @return True if the model was parsed successfully, false otherwise.
+ */
+bool llmodel_estimate_mem(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                          llmodel_mem_estimate *estimate);
+
 /**
  * Load a model from a file.
  * @param model A pointer to the llmodel_model instance.
@@ -168,6 +224,40 @@ uint64_t llmodel_save_state_data(llmodel_model model, uint8_t *dest);
  */
 uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src);
 
+/**
+ * Writes a scene snapshot to a file: the actors in play and every actor KV slot with its map,
+ * marks and tokens. Unlike llmodel_save_state_data no buffer has to be sized beforehand.
+ * Actor files are not written; save the actors first (the "/save" prompt) if the scene will be
+ * restored in another process.
+ * @param model A pointer to the llmodel_model instance.
+ * @param path Where to write the snapshot.
+ * @return True on success.
+ */
+bool llmodel_save_scene(llmodel_model model, const char *path);
+
+/**
+ * Restores a scene written by llmodel_save_scene. The file is mapped and the KV slots are
+ * filled straight from it, so nothing is decoded again. Slots whose actor changed since the
+ * snapshot are laid out again the next time the actor is picked.
+ * Also takes checkpoints: restore the scene, then each checkpoint saved after it in order.
+ * A checkpoint only loads on top of the scene or checkpoint it was saved after.
+ * @param model A pointer to the llmodel_model instance.
+ * @param path The snapshot file.
+ * @return True on success.
+ */
+bool llmodel_restore_scene(llmodel_model model, const char *path);
+
+/**
+ * Writes a checkpoint: like llmodel_save_scene, but only the KV tokens written since the last
+ * scene or checkpoint saved or restored on this model. Saving a checkpoint per turn allows undo
+ * (restore the scene and fewer checkpoints), and several checkpoints off one parent branch the
+ * scene. Falls back to a full scene if there is nothing to follow or a KV slot was resized.
+ * @param model A pointer to the llmodel_model instance.
+ * @param path Where to write the checkpoint.
+ * @return True on success.
+ */
+bool llmodel_save_checkpoint(llmodel_model model, const char *path);
+
 bool llmodel_select_context(llmodel_model model, uint8_t ctx_n);
 uint8_t llmodel_view_context(llmodel_model model, uint8_t ctx_n);
 void llmodel_release_context(llmodel_model model, uint8_t ctx_n);
@@ -237,6 +327,123 @@ void llmodel_setThreadCount(llmodel_model model, int32_t n_threads);
  */
 int32_t llmodel_threadCount(llmodel_model model);
 
+/**
+ * Set the K cache type used for the actor KV slots. Must be called before llmodel_loadModel.
+ * The V cache is stored transposed and always stays f16.
+ * @param model A pointer to the llmodel_model instance.
+ * @param type One of "f16", "q8_0" or "q4_0".
+ * @return true if the type is supported, false otherwise.
+ */
+bool llmodel_set_kv_cache_type(llmodel_model model, const char *type);
+
+/**
+ * Open a session on an already loaded model. The session shares the model's weights but owns its own
+ * context, actors and KV slots, so several scenes can be driven in parallel from different threads.
+ * The returned handle is used with the same llmodel_* functions as a model and must be destroyed with
+ * llmodel_model_destroy(); the weights are released with the last session.
+ * @param model A pointer to a loaded llmodel_model instance.
+ * @param error A pointer to a string; will only be set on error.
+ * @return A new session handle or NULL on error.
+ */
+llmodel_model llmodel_session_open(llmodel_model model, const char **error);
+
+/**
+ * Route the decode steps of all sessions through one scheduler that shares the cores between them.
+ * Steps are admitted as threads free up; throughput and p50/p99 step latency are printed with the timings.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_threads Threads to share, 0 for all cores, negative to turn the scheduler off.
+ * @return true if the backend supports the scheduler.
+ */
+bool llmodel_set_decode_scheduler(llmodel_model model, int32_t n_threads);
+
+/**
+ * Pin the worker threads shared by all sessions to one physical core each, filling NUMA node 0 first.
+ * The thread count defaults to the number of physical cores; see llmodel_setThreadCount.
+ * @param model A pointer to the llmodel_model instance.
+ * @param pin true to pin, false to let the OS place the threads.
+ * @return true if the backend supports thread affinity.
+ */
+bool llmodel_set_thread_affinity(llmodel_model model, bool pin);
+
+/**
+ * Load several actors in parallel, e.g. everyone in a scene, instead of one at a time on first use.
+ * Actors that are already loaded are skipped. Per-actor load and save times are printed with the timings.
+ * @param model A pointer to the llmodel_model instance.
+ * @param names Actor names.
+ * @param n_names Number of names.
+ */
+void llmodel_load_actors(llmodel_model model, const char **names, size_t n_names);
+
+/**
+ * Add many memories to actors' histories in one call, e.g. to import an old chat log. Tokenizing and
+ * keyword indexing run across the worker threads, and each actor's history file gets a single append.
+ * Actors that are not loaded yet are loaded first.
+ * @param model A pointer to the llmodel_model instance.
+ * @param records The memories, in the order they should be remembered.
+ * @param n_records Number of records.
+ * @return The number of records imported; records with a malformed timestamp are skipped.
+ */
+size_t llmodel_import_memories(llmodel_model model, const struct llmodel_memory_record *records, size_t n_records);
+
+/**
+ * Do deferred maintenance between turns on a background thread: precompute eidets for memories the
+ * loaded actors are likely to recall, flush history journals, rebuild the keyword index, compact the pool.
+ * It starts once the session has been quiet for quiet_ms and stops at the next call into the session,
+ * which waits at most one prompt batch.
+ * @param model A pointer to the llmodel_model instance.
+ * @param quiet_ms Milliseconds without calls before maintenance starts, negative to turn it off.
+ * @return true if the backend supports idle maintenance.
+ */
+bool llmodel_set_idle_work(llmodel_model model, int32_t quiet_ms);
+
+/**
+ * Start or stop recording trace events: reserve-space allocator steps, KV slot layout and resizes,
+ * message processing, decode batches and sampling. Each thread keeps its last 8192 events in memory,
+ * so tracing can stay on in production; a disabled tracer costs one load per call site.
+ * Tracing is process wide, not per session.
+ * @param model A pointer to the llmodel_model instance.
+ * @param enabled true to record, false to stop. Recorded events are kept.
+ * @return true if the backend supports tracing.
+ */
+bool llmodel_set_tracing(llmodel_model model, bool enabled);
+
+/**
+ * Write the recorded trace events as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev.
+ * Safe to call while other threads are recording.
+ * @param model A pointer to the llmodel_model instance.
+ * @param path Where to write the JSON.
+ * @return true if the file was written.
+ */
+bool llmodel_export_trace(llmodel_model model, const char *path);
+
+/**
+ * Latency counters and histograms of the multi-actor stages: slot selection and map builds, KV layout
+ * and uploads, RAG searches, eidet builds, next-speaker polls, decode batches and KV slot switches
+ * (useactor calls that lay a different actor out in a slot). There is an entry per
+ * stage that ran at least once, for the whole session and for each actor, over the session and over
+ * the current turn (each llmodel_prompt call starts one). Stages nest, so their times overlap.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_metrics Where to store the number of entries.
+ * @return The entries, valid until the next call on this thread; NULL if there are none or the
+ * backend does not keep metrics.
+ */
+struct llmodel_stage_metric *llmodel_get_metrics(llmodel_model model, int *n_metrics);
+
+/**
+ * Forget the metrics gathered so far.
+ * @param model A pointer to the llmodel_model instance.
+ */
+void llmodel_reset_metrics(llmodel_model model);
+
+/**
+ * Set how many tokens of a prompt are decoded at once.
+ * The size is picked by a short timing sweep when the model is loaded.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_batch Tokens per decode, capped at the context's batch capacity; 0 repeats the sweep.
+ * @return The batch size now in use, or 0 if the backend has none.
+ */
+int32_t llmodel_set_prompt_batch(llmodel_model model, int32_t n_batch);
+
 /**
  * Set llmodel implementation search path.
  * Default is "."
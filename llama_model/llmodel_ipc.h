@@ -0,0 +1,77 @@
+#ifndef LLMODEL_IPC_H
+#define LLMODEL_IPC_H
+
+#include <stdint.h>
+
+/*
+ * Framed protocol spoken by llmodel_server over a Unix domain socket.
+ *
+ * Every message is a 12 byte header followed by `length` payload bytes. All integers are
+ * little endian. Strings inside payloads are a uint32 byte count followed by UTF-8 bytes
+ * (no terminator). Replies carry the `id` of the request they answer, so a client can have
+ * one prompt streaming while it sends CANCEL for it.
+ *
+ * gpt4all_node/src/ipc-client.js mirrors these values; keep the two in step.
+ */
+
+#define LLMODEL_IPC_VERSION     2
+#define LLMODEL_IPC_MAX_FRAME   (16u << 20)
+#define LLMODEL_IPC_SOCKET      "/tmp/llmodel.sock"
+
+enum llmodel_ipc_type : uint16_t {
+    // client -> server
+    LLMODEL_IPC_HELLO       = 1,  // empty; answered with OK carrying u32 version + model name
+    LLMODEL_IPC_PROMPT      = 2,  // llmodel_ipc_prompt, then strings: prompt, template, fake reply
+    LLMODEL_IPC_CANCEL      = 3,  // empty; id names the prompt to stop
+    LLMODEL_IPC_SET_KEY     = 4,  // strings: keyfor, key, value
+    LLMODEL_IPC_SAVE_ACTORS = 5,  // empty
+    LLMODEL_IPC_PICK_ACTOR  = 6,  // string: actor name
+    LLMODEL_IPC_SET_THREADS = 7,  // i32 thread count for this session's decode and the shared pool
+
+    // server -> client
+    LLMODEL_IPC_TOKEN       = 16, // i32 token id, then the token text (rest of the frame)
+    LLMODEL_IPC_DONE        = 17, // llmodel_ipc_done
+    LLMODEL_IPC_OK          = 18, // request finished; payload depends on the request
+    LLMODEL_IPC_ERROR       = 19, // error text (rest of the frame)
+};
+
+#pragma pack(push, 1)
+struct llmodel_ipc_header {
+    uint32_t length;    // payload bytes following the header
+    uint16_t type;      // llmodel_ipc_type
+    uint16_t flags;     // reserved, 0
+    uint32_t id;        // request id chosen by the client
+};
+
+// PROMPT_CONTEXT fields the Node addon accepted through infer()
+struct llmodel_ipc_prompt {
+    int32_t n_past;
+    int32_t n_predict;
+    int32_t top_k;
+    float   top_p;
+    float   min_p;
+    float   temp;
+    int32_t n_batch;
+    float   repeat_penalty;
+    int32_t repeat_last_n;
+    float   context_erase;
+    int32_t per_idle;
+    uint32_t flags;     // LLMODEL_IPC_PROMPT_*
+    int32_t seed;       // >= 0: sampling reseeded with it at the start of the prompt; -1: unseeded (v2)
+};
+
+struct llmodel_ipc_done {
+    int32_t  n_past;
+    uint32_t n_prompt;      // prompt tokens ingested
+    uint32_t n_response;    // tokens generated
+    uint32_t cancelled;
+    float    prompt_ms;     // time to first response token
+    float    total_ms;
+};
+#pragma pack(pop)
+
+#define LLMODEL_IPC_PROMPT_CONTINUING 0x1
+#define LLMODEL_IPC_PROMPT_SPECIAL    0x2
+#define LLMODEL_IPC_PROMPT_FAKE_REPLY 0x4
+
+#endif // LLMODEL_IPC_H
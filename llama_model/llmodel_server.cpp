@@ -0,0 +1,437 @@
+// Standalone inference server for the Lore frontend.
+//
+// Loads one model, then serves the framed protocol from llmodel_ipc.h on a Unix domain socket.
+// Every connection gets its own session (LLModel::openSession) over the shared weights, so a
+// frontend can keep several scenes generating at once; with --sched the sessions' decode steps
+// share the cores through the llama.cpp decode scheduler.
+//
+//   llmodel_server <model.gguf> [--socket path] [--ctx n] [--ngl n] [--threads n] [--sched n]
+//                  [--pin] [--idle ms] [--libs path]
+//
+// --idle runs each session's deferred maintenance after ms without requests.
+//
+// Built next to the addon as the llmodel_server target of gpt4all_node/binding.gyp (node-gyp build).
+
+#include "llmodel.h"
+#include "llmodel_ipc.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static std::atomic<bool> s_stopping{false};
+static int s_listen_fd = -1;
+static int s_idle_ms = -1; // --idle, applied to every session
+
+// Connection threads, so shutdown can close their sockets and join them before the model goes away.
+// A thread that returns queues its id in s_conn_done; the accept loop joins it.
+static std::mutex s_conn_mutex;
+static std::map<uint64_t, std::thread> s_conn_threads;
+static std::set<int> s_conn_fds;
+static std::vector<uint64_t> s_conn_done;
+
+// before the socket is closed, so shutdown never touches a reused descriptor
+static void untrack_socket(int fd) {
+    std::lock_guard<std::mutex> lock(s_conn_mutex);
+    s_conn_fds.erase(fd);
+}
+
+static void join_connections(bool all) {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(s_conn_mutex);
+        if (all) {
+            for (int fd : s_conn_fds) shutdown(fd, SHUT_RDWR); // read_all fails, the prompt is cancelled
+            for (auto &t : s_conn_threads) threads.push_back(std::move(t.second));
+            s_conn_threads.clear();
+        } else {
+            for (uint64_t id : s_conn_done) {
+                threads.push_back(std::move(s_conn_threads[id]));
+                s_conn_threads.erase(id);
+            }
+        }
+        s_conn_done.clear();
+    }
+    for (auto &t : threads) t.join();
+}
+
+static bool read_all(int fd, void *dest, size_t len) {
+    uint8_t *p = static_cast<uint8_t *>(dest);
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *src, size_t len) {
+    const uint8_t *p = static_cast<const uint8_t *>(src);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Cursor over a received payload; every get fails (and stays failed) past the end.
+struct FrameReader {
+    const uint8_t *p, *end;
+    bool ok = true;
+
+    FrameReader(const std::vector<uint8_t> &buf) : p(buf.data()), end(buf.data() + buf.size()) {}
+
+    bool get(void *dest, size_t len) {
+        if (!ok || (size_t)(end - p) < len) return ok = false;
+        memcpy(dest, p, len);
+        p += len;
+        return true;
+    }
+    std::string str() {
+        uint32_t len = 0;
+        if (!get(&len, sizeof(len)) || (size_t)(end - p) < len) {
+            ok = false;
+            return std::string();
+        }
+        std::string s(reinterpret_cast<const char *>(p), len);
+        p += len;
+        return s;
+    }
+};
+
+struct Connection {
+    int fd;
+    LLModel *session;
+    LLModel::PromptContext promptContext;
+
+    std::mutex write_mutex;
+    std::thread worker;
+    std::atomic<bool> busy{false};
+    std::atomic<bool> cancel{false};
+    std::atomic<uint32_t> active_id{0};
+
+    Connection(int fd, LLModel *session) : fd(fd), session(session) {}
+    ~Connection() {
+        cancel = true;
+        if (worker.joinable()) worker.join();
+        delete session;
+        untrack_socket(fd);
+        close(fd);
+    }
+
+    bool send(uint16_t type, uint32_t id, const void *a, size_t alen, const void *b = nullptr, size_t blen = 0) {
+        llmodel_ipc_header hdr;
+        hdr.length = alen + blen;
+        hdr.type = type;
+        hdr.flags = 0;
+        hdr.id = id;
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return write_all(fd, &hdr, sizeof(hdr)) && (alen == 0 || write_all(fd, a, alen)) &&
+               (blen == 0 || write_all(fd, b, blen));
+    }
+    bool sendError(uint32_t id, const std::string &msg) {
+        return send(LLMODEL_IPC_ERROR, id, msg.data(), msg.size());
+    }
+};
+
+static void run_prompt(Connection *conn, uint32_t id, llmodel_ipc_prompt params, std::string prompt,
+                       std::string promptTemplate, std::string fakeReply) {
+    auto &ctx = conn->promptContext;
+    ctx.n_past = params.n_past;
+    ctx.n_predict = params.n_predict;
+    ctx.top_k = params.top_k;
+    ctx.top_p = params.top_p;
+    ctx.min_p = params.min_p;
+    ctx.temp = params.temp;
+    ctx.n_batch = params.n_batch;
+    ctx.repeat_penalty = params.repeat_penalty;
+    ctx.repeat_last_n = params.repeat_last_n;
+    ctx.contextErase = params.context_erase;
+    ctx.per_idle = params.per_idle;
+    ctx.seed = params.seed;
+    ctx.continuing = (params.flags & LLMODEL_IPC_PROMPT_CONTINUING) != 0;
+
+    llmodel_ipc_done done = {};
+    auto t_start = std::chrono::steady_clock::now();
+    auto ms_since_start = [&]() {
+        return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    };
+    bool writable = true;
+
+    auto promptCallback = [&](int32_t, int, int, float *, float *) {
+        done.n_prompt++;
+        return !conn->cancel.load(std::memory_order_relaxed);
+    };
+    auto responseCallback = [&](int32_t token_id, const std::string &token, int, int, float *, float *) {
+        if (token_id == -1) {
+            writable = conn->sendError(id, token);
+            return false;
+        }
+        if (done.n_response++ == 0) done.prompt_ms = ms_since_start();
+        writable = conn->send(LLMODEL_IPC_TOKEN, id, &token_id, sizeof(token_id), token.data(), token.size());
+        return writable && !conn->cancel.load(std::memory_order_relaxed);
+    };
+
+    try {
+        conn->session->prompt(prompt, promptTemplate, promptCallback, responseCallback, ctx,
+                              (params.flags & LLMODEL_IPC_PROMPT_SPECIAL) != 0,
+                              (params.flags & LLMODEL_IPC_PROMPT_FAKE_REPLY) ? &fakeReply : nullptr);
+    } catch (const char *e) {
+        conn->sendError(id, e);
+    } catch (const std::exception &e) {
+        conn->sendError(id, e.what());
+    }
+
+    done.n_past = ctx.n_past;
+    done.cancelled = conn->cancel.load() ? 1 : 0;
+    done.total_ms = ms_since_start();
+    if (writable) conn->send(LLMODEL_IPC_DONE, id, &done, sizeof(done));
+    conn->active_id = 0;
+    conn->busy = false;
+}
+
+static void serve_session(int fd, LLModel *base, const std::string &modelName) {
+    LLModel *session = nullptr;
+    try {
+        session = base->openSession();
+    } catch (const char *e) {
+        std::cerr << __func__ << ": " << e << "\n";
+    } catch (const std::exception &e) {
+        std::cerr << __func__ << ": " << e.what() << "\n";
+    }
+    if (!session) {
+        std::cerr << __func__ << ": could not open a session\n";
+        untrack_socket(fd);
+        close(fd);
+        return;
+    }
+    if (s_idle_ms >= 0) session->setIdleWork(s_idle_ms);
+    std::unique_ptr<Connection> conn(new Connection(fd, session));
+    std::vector<uint8_t> payload;
+
+    for (;;) {
+        llmodel_ipc_header hdr;
+        if (!read_all(fd, &hdr, sizeof(hdr))) break;
+        if (hdr.length > LLMODEL_IPC_MAX_FRAME) {
+            conn->sendError(hdr.id, "frame too large");
+            break;
+        }
+        payload.resize(hdr.length);
+        if (hdr.length && !read_all(fd, payload.data(), hdr.length)) break;
+        FrameReader in(payload);
+
+        // CANCEL is the only request that may arrive while a prompt is running
+        if (hdr.type == LLMODEL_IPC_CANCEL) {
+            if (conn->busy && (hdr.id == 0 || hdr.id == conn->active_id)) conn->cancel = true;
+            continue;
+        }
+        if (conn->busy) {
+            conn->sendError(hdr.id, "busy");
+            continue;
+        }
+        if (conn->worker.joinable()) conn->worker.join();
+
+        // actor files and memories throw const char*; one bad request must not end the server
+        try {
+            switch (hdr.type) {
+            case LLMODEL_IPC_HELLO: {
+                uint32_t version = LLMODEL_IPC_VERSION;
+                conn->send(LLMODEL_IPC_OK, hdr.id, &version, sizeof(version), modelName.data(), modelName.size());
+                break;
+            }
+            case LLMODEL_IPC_PROMPT: {
+                llmodel_ipc_prompt params;
+                in.get(&params, sizeof(params));
+                std::string prompt = in.str();
+                std::string promptTemplate = in.str();
+                std::string fakeReply = in.str();
+                if (!in.ok) {
+                    conn->sendError(hdr.id, "malformed prompt");
+                    break;
+                }
+                conn->busy = true;
+                conn->cancel = false;
+                conn->active_id = hdr.id;
+                conn->worker = std::thread(run_prompt, conn.get(), hdr.id, params, std::move(prompt),
+                                           std::move(promptTemplate), std::move(fakeReply));
+                break;
+            }
+            case LLMODEL_IPC_SET_KEY: {
+                std::string keyfor = in.str();
+                std::string key = in.str();
+                std::string value = in.str();
+                if (!in.ok) {
+                    conn->sendError(hdr.id, "malformed set key");
+                    break;
+                }
+                conn->session->setKey(keyfor, key, value);
+                conn->send(LLMODEL_IPC_OK, hdr.id, nullptr, 0);
+                break;
+            }
+            case LLMODEL_IPC_SAVE_ACTORS:
+                conn->session->saveActors();
+                conn->send(LLMODEL_IPC_OK, hdr.id, nullptr, 0);
+                break;
+            case LLMODEL_IPC_PICK_ACTOR: {
+                std::string actor = in.str();
+                if (!in.ok) {
+                    conn->sendError(hdr.id, "malformed pick actor");
+                    break;
+                }
+                conn->session->pickActor(actor);
+                conn->send(LLMODEL_IPC_OK, hdr.id, nullptr, 0);
+                break;
+            }
+            case LLMODEL_IPC_SET_THREADS: {
+                int32_t n_threads = 0;
+                if (!in.get(&n_threads, sizeof(n_threads)) || n_threads <= 0) {
+                    conn->sendError(hdr.id, "malformed set threads");
+                    break;
+                }
+                conn->session->setThreadCount(n_threads);
+                conn->send(LLMODEL_IPC_OK, hdr.id, nullptr, 0);
+                break;
+            }
+            default:
+                conn->sendError(hdr.id, "unknown request " + std::to_string(hdr.type));
+                break;
+            }
+        } catch (const char *e) {
+            conn->sendError(hdr.id, e);
+        } catch (const std::exception &e) {
+            conn->sendError(hdr.id, e.what());
+        }
+    }
+    // closing the socket cancels whatever is still generating
+}
+
+static void serve_connection(uint64_t id, int fd, LLModel *base, std::string modelName) {
+    serve_session(fd, base, modelName);
+    std::lock_guard<std::mutex> lock(s_conn_mutex);
+    s_conn_done.push_back(id);
+}
+
+static void on_signal(int) {
+    s_stopping = true;
+    if (s_listen_fd >= 0) shutdown(s_listen_fd, SHUT_RDWR);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s <model.gguf> [--socket path] [--ctx n] [--ngl n] [--threads n] [--sched n] [--pin] [--idle ms] [--libs path]\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string modelPath = argv[1];
+    std::string socketPath = LLMODEL_IPC_SOCKET;
+    int n_ctx = 2048, ngl = 100, n_threads = 0, n_sched = -1;
+    bool pin = false;
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--pin") {
+            pin = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--socket") socketPath = argv[++i];
+        else if (arg == "--ctx") n_ctx = atoi(argv[++i]);
+        else if (arg == "--ngl") ngl = atoi(argv[++i]);
+        else if (arg == "--threads") n_threads = atoi(argv[++i]);
+        else if (arg == "--sched") n_sched = atoi(argv[++i]);
+        else if (arg == "--idle") s_idle_ms = atoi(argv[++i]);
+        else if (arg == "--libs") LLModel::Implementation::setImplementationsSearchPath(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    LLModel *model;
+    try {
+        model = LLModel::Implementation::construct(modelPath, "auto", n_ctx);
+    } catch (const std::exception &e) {
+        std::cerr << "Unable to instantiate model: " << e.what() << "\n";
+        return 1;
+    }
+    if (model && pin) model->setThreadAffinity(true);
+    if (!model || !model->loadModel(modelPath, n_ctx, ngl)) {
+        std::cerr << "Unable to load " << modelPath << "\n";
+        return 1;
+    }
+    if (n_threads > 0) model->setThreadCount(n_threads);
+    if (n_sched >= 0) model->setDecodeScheduler(n_sched);
+    std::string modelName = modelPath.substr(modelPath.find_last_of("/\\") + 1);
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << socketPath << "\n";
+        return 1;
+    }
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socketPath.c_str());
+
+    s_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s_listen_fd < 0 || bind(s_listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(s_listen_fd, 16) < 0) {
+        perror("llmodel_server");
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "llmodel_server: %s on %s\n", modelName.c_str(), socketPath.c_str());
+
+    uint64_t next_id = 0;
+    while (!s_stopping) {
+        int fd = accept(s_listen_fd, nullptr, nullptr);
+        join_connections(false);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        std::lock_guard<std::mutex> lock(s_conn_mutex);
+        s_conn_fds.insert(fd);
+        s_conn_threads.emplace(next_id, std::thread(serve_connection, next_id, fd, model, modelName));
+        next_id++;
+    }
+
+    close(s_listen_fd);
+    unlink(socketPath.c_str());
+    // every session is gone before the model and the statics it uses
+    join_connections(true);
+    delete model;
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "llmodel.h"
 
 //#include <cassert>
+#include <chrono>
 #include <iostream>
 #include <string>
 
@@ -22,7 +23,8 @@ int LLModel::pollAnswer( std::string query, PromptContext &parentCtx, std::vecto
 }
 */
 
-int LLModel::pickNextTalker(  PromptContext &parentCtx, std::string username, std::string lastTalker, std::vector<std::string> actorNames )
+int LLModel::pickNextTalker(  PromptContext &parentCtx, std::string username, std::string lastTalker, std::vector<std::string> actorNames,
+                              std::string *polled )
 {
     std::string query = "Who should talk next? (";
     std::string framing = "It should be ";
@@ -62,13 +64,15 @@ int LLModel::pickNextTalker(  PromptContext &parentCtx, std::string username, st
         }
     }
     //! todo: ask all active actors and compare results
+    if( polled ) *polled = firstActorName;
     return selectAnswer(firstActorName, query, parentCtx, pollData, framing);
 }
 
-int LLModel::selectAnswer( std::string actor, std::string query, PromptContext &parentCtx,
-                          std::unordered_map<std::string, int> &answers, std::string framing )
+// Sampling settings for a short System probe (selectAnswer, queryActor, runQuery) run inside a prompt.
+// A seeded prompt gives the probe its own stream, seeded from the prompt's, so the probe is
+// reproducible too and its draws do not interleave with the prompt's.
+LLModel::PromptContext LLModel::probeContext( PromptContext &parentCtx )
 {
-    std::string formed = "<|im_start|>System\n" + query + "<|im_end|><|im_start|>" + actor + "\n" + framing;
     PromptContext pctx;
     pctx.n_batch = 64;
     pctx.n_last_batch_tokens = 0;
@@ -79,6 +83,17 @@ int LLModel::selectAnswer( std::string actor, std::string query, PromptContext &
     pctx.temp = parentCtx.temp;
     pctx.repeat_penalty = parentCtx.repeat_penalty;
     pctx.contextErase = parentCtx.contextErase;
+    pctx.seed = parentCtx.seed;
+    if (pctx.seed >= 0)
+        pctx.rng.seed(parentCtx.rng());
+    return pctx;
+}
+
+int LLModel::selectAnswer( std::string actor, std::string query, PromptContext &parentCtx,
+                          std::unordered_map<std::string, int> &answers, std::string framing )
+{
+    std::string formed = "<|im_start|>System\n" + query + "<|im_end|><|im_start|>" + actor + "\n" + framing;
+    PromptContext pctx = probeContext(parentCtx);
 
     markRewind();
     int n_last_batch = decodePrompt2("System", actor, formed);
@@ -93,16 +108,7 @@ int LLModel::selectAnswer( std::string actor, std::string query, PromptContext &
 std::string LLModel::queryActor( std::string actor, std::string query, PromptContext &parentCtx )
 {
     std::string formed = "<|im_start|>System\n" + query + "<|im_end|><|im_start|>" + actor + "\n";
-    PromptContext pctx;
-    pctx.n_batch = 64;
-    pctx.n_last_batch_tokens = 0;
-    pctx.min_p = parentCtx.min_p;
-    pctx.repeat_last_n = 64;
-    pctx.top_k = parentCtx.top_k;
-    pctx.top_p = parentCtx.top_p;
-    pctx.temp = parentCtx.temp;
-    pctx.repeat_penalty = parentCtx.repeat_penalty;
-    pctx.contextErase = parentCtx.contextErase;
+    PromptContext pctx = probeContext(parentCtx);
 
     markRewind();
     int n_last_batch = decodePrompt2("System", actor, formed);
@@ -121,16 +127,7 @@ void LLModel::runQuery( std::string who, std::string key, std::string query, std
                        )
 {
     std::string formed = "<|im_start|>System\n" + query + "<|im_end|><|im_start|>" + who + "\n";
-    PromptContext pctx;
-    pctx.n_batch = 64;
-    pctx.n_last_batch_tokens = 0;
-    pctx.min_p = parentCtx.min_p;
-    pctx.repeat_last_n = 64;
-    pctx.top_k = parentCtx.top_k;
-    pctx.top_p = parentCtx.top_p;
-    pctx.temp = parentCtx.temp;
-    pctx.repeat_penalty = parentCtx.repeat_penalty;
-    pctx.contextErase = parentCtx.contextErase;
+    PromptContext pctx = probeContext(parentCtx);
 
     if( forgetAboutIt )
         markRewind();
@@ -176,6 +173,16 @@ void LLModel::prompt(const std::string &oldprompt,
         return;
     }
 
+    holdIdle(true);
+    struct IdleRelease {
+        LLModel *model;
+        ~IdleRelease() { model->holdIdle(false); }
+    } idleRelease{this};
+
+    beginTurn();
+    if (promptCtx.seed >= 0)
+        promptCtx.rng.seed(promptCtx.seed);
+
     if( oldprompt.length() == 0 ) {
         //std::cerr << "Run idle prompt\n";
         //idle_prompt(promptCallback, responseCallback, promptCtx);
@@ -189,31 +196,30 @@ void LLModel::prompt(const std::string &oldprompt,
     std::string firstActorName;
     std::vector<std::string> actorNames;
 
-    if( prompt[0] == '&' ) { // for manual loading of old memories
+    if( prompt[0] == '&' ) { // for manual loading of old memories; importMemories takes them directly
         // loading old memories
-        long ipos, npos, tpos, epos;
-        uint32_t count;
-        std::string actor;
-        std::string name, when, value;
-
-        ipos = 0;
-        count = 0;
-        npos = prompt.find("\n", ipos);
-        actor = prompt.substr(1,npos-1);
-        ipos = prompt.find("\n", npos+1); // &<actor>\n
-        while( ipos != std::string::npos && ipos < prompt.length() ) {
-            npos = prompt.find("\n", ipos); // <name>\n<when>:<message>"<store_end>"...
-            name = prompt.substr(ipos+1, npos-(ipos+1));
-            tpos = prompt.find(":", npos);
-            when = prompt.substr(npos+1, tpos-(npos+1));
-            ipos = prompt.find("<store_end>", npos);
-            value = prompt.substr(tpos+1, ipos-(tpos+1) );
+        std::string_view text = prompt;
+        std::vector<MemoryRecord> records;
+        size_t ipos, npos, tpos;
+
+        npos = text.find("\n");
+        std::string_view actor = text.substr(1, npos-1);
+        ipos = npos; // &<actor>\n
+        while( ipos != std::string::npos && ipos < text.length() ) {
+            npos = text.find("\n", ipos+1); // <name>\n<when>:<message>"<store_end>"...
+            if( npos == std::string::npos ) break;
+            tpos = text.find(":", npos);
+            if( tpos == std::string::npos ) break;
+            MemoryRecord r;
+            r.actor = actor;
+            r.who = text.substr(ipos+1, npos-(ipos+1));
+            r.when = text.substr(npos+1, tpos-(npos+1));
+            ipos = text.find("<store_end>", npos);
+            r.what = text.substr(tpos+1, ipos == std::string::npos ? std::string::npos : ipos-(tpos+1));
             if( ipos != std::string::npos ) ipos += 10;
-            if( count < 10 )
-                std::cerr << "recordMemory(" << actor << "," << name << "," << when << "," << value << ")\n";
-            recordMemory(actor, name, when, value);
-            count++;
+            records.push_back(r);
         }
+        size_t count = importMemories(records);
         std::cerr << "Finished loading " << count << " memories for " << actor << ".\n";
         return;
     }
@@ -419,7 +425,10 @@ void LLModel::prompt(const std::string &oldprompt,
             }
         } else {
             std::cerr << "pick actor...\n";
-            iName = pickNextTalker(promptCtx, fromname, lastActor, actorNames);
+            auto t_pick = std::chrono::steady_clock::now();
+            std::string polled;
+            iName = pickNextTalker(promptCtx, fromname, lastActor, actorNames, &polled);
+            pickTime(polled, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_pick).count());
             std::cerr << "pick actor " << toname << "\n";
         }
         toname = actorNames[iName];
@@ -492,7 +501,7 @@ std::string LLModel::generateResponse(std::function<bool(int32_t, const std::str
         auto id = sampleToken(promptCtx, n_last_batch);
         const std::string str = tokenToString(id);
 
-        if( (n_last_batch=evalTokens(str, tokens, activename, toname)) == 0 ) {
+        if( (n_last_batch=evalTokenIds({id}, str, tokens, activename, toname)) == 0 ) {
             std::cerr << implementation().modelType() << " ERROR: Failed to predict next token\n";
             id = 32000; // end
         }
@@ -564,11 +573,10 @@ std::string LLModel::generateResponse2(PromptContext &promptCtx, std::string fro
         std::cerr << "sampleToken n_last_batch=" << n_last_batch << "\n";
         auto id = sampleToken(promptCtx, n_last_batch);
         newTokens.clear();
-        newTokens.push_back(id);
 
         const std::string str = tokenToString(id);
         std::cerr << "gen: " << str << "(" << id << ")\n";
-        if( (n_last_batch=evalTokens(str, newTokens, toname, fromname)) == 0 ) {
+        if( (n_last_batch=evalTokenIds({id}, str, newTokens, toname, fromname)) == 0 ) {
             std::cerr << implementation().modelType() << " ERROR: Failed to predict next token\n";
             id = 32000; // end
             buf += "<|im_end|>";
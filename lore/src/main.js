@@ -1052,31 +1052,27 @@ async function runQuery(a,b,c)
                 memdata = fs.readFileSync(sd + "_mem.json", "utf8");
                 //keyvals = JSON.parse(memdata);
                 let memitems = ("]," + memdata.substr(1)).split("],\"chat_");
-                let buf = "";
-                let count = 0;
+                let records = [];
                 var searchpos;
                 for( searchpos=1; searchpos<memitems.length; searchpos++ ) {
                     let item = "{\"" + memitems[searchpos] + "}";
                     let parsed = JSON.parse(item);
 
-                    if( buf != "" ) buf += "<store_end>";
-                    else buf = "&" + who + "\n";
-
                     var when = Object.keys(parsed)[0];
                     var value = parsed[when];
 
-                    buf += value[0] + "\n" + when + ":" + value[1];
-
-                    count++;
-                    if( count == 100 ) {
-                        await anon.modelstate.safeComplete("", buf + "<store_end>");
-                        count=0;
-                        buf="";
-                    }
-                }
-                if( count > 0 ) {
-                    await anon.modelstate.safeComplete("", buf + "<store_end>");
+                    records.push({ actor: who, who: value[0], when: when, what: value[1] });
                 }
+                // the import waits for a running prompt, so it queues behind one like safeComplete does
+                let importer = async function(ms) {
+                    ms.update_busy(true);
+                    let count = await ms.model.llm.importMemories(records);
+                    console.log(who + ": imported " + count + " of " + records.length + " memories.");
+                    await ms.ready();
+                };
+                let ms = anon.modelstate;
+                if( ms.context !== null && ms.context.shi.currently_busy ) ms.cbq.push(importer);
+                else await importer(ms);
                 console.log(this.charname + ": older memory loaded (" + Object.keys(keyvals).length + ".)");
             } else {
                 keyvals = {};